@@ -2,24 +2,20 @@
 #include "assembler.h"
 
 // This project's headers
+#include "code_heap.h"
 #include "common.h"
+#include "runtime.h"
+#include "target.h"
 
 // Standard headers
 #include <assert.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 
-void *VirtualAlloc(void *address, size_t size, unsigned allocationType, unsigned protect);
-
-enum {
-    MEM_COMMIT = 0x1000,
-    MEM_RESERVE = 0x2000,
-    PAGE_EXECUTE_READWRITE = 0x40
-};
-
-
 assembler_t g_assembler;
 
 
@@ -28,21 +24,102 @@ static bool fits_in_s8(i64 val) {
 }
 
 static bool fits_in_s32(i64 val) {
-    return (val < INT32_MAX || val >= INT32_MIN);
+    return (val <= INT32_MAX && val >= INT32_MIN);
 }
 
 void asm_init(void) {
-    g_assembler.binary = VirtualAlloc(NULL, 0x1000,
-        MEM_COMMIT | MEM_RESERVE,
-        PAGE_EXECUTE_READWRITE);
+    // The buffer is kept for the next function.
+    g_assembler.binary_size = 0;
+    g_assembler.num_lines = 0;
+    g_assembler.installed = NULL;
+    g_assembler.installed_offset = 0;
+}
+
+void *asm_install(unsigned start_offset, bool hot) {
+    unsigned num_bytes = g_assembler.binary_size - start_offset;
+    u8 *code = code_heap_alloc(num_bytes, hot);
+    if (!code)
+        FATAL_ERROR("Out of memory for generated code. Needed %u bytes", num_bytes);
+
+    memcpy(code, g_assembler.binary + start_offset, num_bytes);
+    code_heap_seal();
+    g_assembler.installed = code;
+    g_assembler.installed_offset = start_offset;
+    return code;
+}
+
+void asm_set_source_pos(unsigned source_offset) {
+    // Only record changes, and let a position replace one that got no code.
+    asm_line_entry_t *last = g_assembler.num_lines ? &g_assembler.lines[g_assembler.num_lines - 1] : NULL;
+    if (last && last->source_offset == source_offset)
+        return;
+    if (!last || last->code_offset != g_assembler.binary_size) {
+        if (g_assembler.num_lines == g_assembler.lines_capacity) {
+            g_assembler.lines_capacity = g_assembler.lines_capacity ? g_assembler.lines_capacity * 2 : 256;
+            g_assembler.lines = realloc(g_assembler.lines, g_assembler.lines_capacity * sizeof(asm_line_entry_t));
+        }
+        last = &g_assembler.lines[g_assembler.num_lines++];
+    }
+
+    last->code_offset = g_assembler.binary_size;
+    last->source_offset = source_offset;
+}
+
+bool asm_find_source_pos(unsigned code_offset, unsigned *source_offset) {
+    // Find the last entry that starts at or before code_offset.
+    unsigned lo = 0, hi = g_assembler.num_lines;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (g_assembler.lines[mid].code_offset <= code_offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || g_assembler.lines[lo - 1].source_offset == ASM_NO_SOURCE_POS)
+        return false;
+
+    *source_offset = g_assembler.lines[lo - 1].source_offset;
+    return true;
 }
 
 static void emit_bytes(void *bytes, unsigned num_bytes) {
+    while (g_assembler.binary_size + num_bytes > g_assembler.capacity) {
+        g_assembler.capacity = g_assembler.capacity ? g_assembler.capacity * 2 : 4096;
+        g_assembler.binary = realloc(g_assembler.binary, g_assembler.capacity);
+    }
+
     u8 *o = g_assembler.binary + g_assembler.binary_size;
     memcpy(o, bytes, num_bytes);
     g_assembler.binary_size += num_bytes;
 }
 
+// Emits the ModR/M byte and displacement for the operand [rbp + relative_addr].
+// 'reg_field' is the register (or opcode extension) in the ModR/M reg field.
+static void emit_rbp_operand(unsigned reg_field, i64 relative_addr) {
+    if (fits_in_s8(relative_addr)) {
+        emit_bytes((u8[]){ 0x45 | (reg_field << 3), (i8)relative_addr }, 2);
+    }
+    else {
+        int32_t disp32 = (int32_t)relative_addr;
+        if (!fits_in_s32(relative_addr))
+            DBG_BREAK();
+        emit_bytes((u8[]){ 0x85 | (reg_field << 3) }, 1);
+        emit_bytes(&disp32, 4);
+    }
+}
+
+// Emits a legacy SSE instruction of the form "prefix 0f opcode" with a
+// register-direct ModR/M.
+static void emit_sse_rr(u8 prefix, u8 opcode, unsigned reg_field, unsigned rm_field) {
+    emit_bytes((u8[]){ prefix, 0x0f, opcode, 0xc0 | (reg_field << 3) | rm_field }, 4);
+}
+
+// As emit_sse_rr() but with the memory operand [rbp + relative_addr].
+static void emit_sse_rbp(u8 prefix, u8 opcode, unsigned reg_field, i64 relative_addr) {
+    emit_bytes((u8[]){ prefix, 0x0f, opcode }, 3);
+    emit_rbp_operand(reg_field, relative_addr);
+}
+
 void asm_emit_func_entry(void) {
     u8 c[] = {
         0x55, // push rbp
@@ -73,6 +150,19 @@ void asm_emit_func_exit(void) {
     emit_bytes(c, 2);
 }
 
+void asm_emit_repl_entry(void) {
+    u8 c[] = {
+        0x55,             // push rbp
+        0x48, 0x89, 0xcd, // mov rbp, rcx
+    };
+    emit_bytes(c, sizeof(c));
+}
+
+void asm_emit_repl_exit(void) {
+    u8 c[] = { 0x5d, 0xc3 }; // pop rbp; ret
+    emit_bytes(c, 2);
+}
+
 void asm_emit_stack_alloc(u8 num_bytes) {
     // Emit sub rsp, num_bytes
     u8 c[] = { 0x48, 0x83, 0xec, num_bytes };
@@ -88,68 +178,148 @@ void asm_emit_stack_dealloc(u8 num_bytes) {
 void asm_emit_mov_reg_to_stack(asm_reg_t src_reg, unsigned stack_offset) {
     i64 num_bytes = (src_reg == REG_AL ? 1 : 8);
     i64 relative_addr = -(i64)stack_offset - num_bytes;
-    if (!fits_in_s8(relative_addr))
-        DBG_BREAK();
 
     switch (src_reg) {
     case REG_RAX:
     case REG_RCX:
+    case REG_RDX:
         // mov qword ptr [rbp + stack_offset], src_reg
-        emit_bytes((u8[]){ 0x48, 0x89, 0x45 + (src_reg << 3), (i8)relative_addr }, 4);
+        emit_bytes((u8[]){ 0x48, 0x89 }, 2);
+        emit_rbp_operand(src_reg, relative_addr);
         break;
     case REG_AL:
         // mov byte ptr [rbp + stack_offset], al
-        emit_bytes((u8[]){ 0x88, 0x45, (i8)relative_addr}, 3);
+        emit_bytes((u8[]){ 0x88 }, 1);
+        emit_rbp_operand(REG_RAX, relative_addr);
     }
 }
 
 void asm_emit_mov_stack_to_reg(asm_reg_t dst_reg, unsigned stack_offset) {
     i64 num_bytes = (dst_reg == REG_AL ? 1 : 8);
     i64 relative_addr = -(i64)stack_offset - num_bytes;
-    if (!fits_in_s8(relative_addr))
-        DBG_BREAK();
 
     switch (dst_reg) {
     case REG_RAX:
-        // mov rax, qword ptr [rbp + relative_addr]
-        emit_bytes((u8[]){ 0x48, 0x8b, 0x45, (i8)relative_addr }, 4);
+    case REG_RCX:
+    case REG_RDX:
+        // mov dst_reg, qword ptr [rbp + relative_addr]
+        emit_bytes((u8[]){ 0x48, 0x8b }, 2);
+        emit_rbp_operand(dst_reg, relative_addr);
         break;
     case REG_AL:
-        // mov al, byte ptr [rbp + relative_addr]
-        emit_bytes((u8[]){ 0xf, 0xb6, 0x45, (i8)relative_addr }, 4);
+        // movzx eax, byte ptr [rbp + relative_addr]
+        emit_bytes((u8[]){ 0xf, 0xb6 }, 2);
+        emit_rbp_operand(REG_RAX, relative_addr);
         break;
     }
 }
 
 void asm_emit_zero_stack_range(unsigned stack_offset, unsigned num_bytes) {
     i64 relative_addr = -(i64)stack_offset - (i64)num_bytes;
-    if (!fits_in_s8(relative_addr))
-        DBG_BREAK();
 
     switch (num_bytes) {
     case 1:
         // xor cl, cl
         emit_bytes((u8[]){ 0x30, 0xc9 }, 2);
         // mov byte ptr [rbp - stack_offset], cl
-        emit_bytes((u8[]){ 0x88, 0x4d, (i8)relative_addr }, 3);
+        emit_bytes((u8[]){ 0x88 }, 1);
+        emit_rbp_operand(REG_RCX, relative_addr);
         break;
     case 8:
         // xor rcx, rcx
         emit_bytes((u8[]){ 0x48, 0x31, 0xc9 }, 3);
         // mov qword ptr [rbp - stack_offset], rcx
-        emit_bytes((u8[]){ 0x48, 0x89, 0x45, (i8)relative_addr }, 4);
-        break;
-    case 16:
-        // pxor xmm0, xmm0
-        emit_bytes((u8[]){ 0x66, 0x0f, 0xef, 0xc0 }, 4);
-        // movdqu [rbp - stack_offset], xmm0
-        emit_bytes((u8[]){ 0xf3, 0x0f, 0x7f, 0x45, (i8)relative_addr }, 5);
+        emit_bytes((u8[]){ 0x48, 0x89 }, 2);
+        emit_rbp_operand(REG_RCX, relative_addr);
         break;
     default:
+        if (num_bytes % 16 != 0)
+            DBG_BREAK();
+
+        // pxor xmm0, xmm0
+        emit_sse_rr(0x66, 0xef, REG_XMM0, REG_XMM0);
+        for (unsigned i = 0; i < num_bytes; i += 16) {
+            // movdqu [rbp - stack_offset + i], xmm0
+            emit_sse_rbp(0xf3, 0x7f, REG_XMM0, relative_addr + i);
+        }
+    }
+}
+
+void asm_emit_lea_stack(asm_reg_t dst_reg, unsigned stack_offset, unsigned num_bytes) {
+    // lea dst_reg, [rbp + relative_addr]
+    emit_bytes((u8[]){ 0x48, 0x8d }, 2);
+    emit_rbp_operand(dst_reg, -(i64)stack_offset - (i64)num_bytes);
+}
+
+unsigned asm_emit_lea_rip(asm_reg_t dst_reg) {
+    // lea dst_reg, [rip + disp32]. The displacement is patched later.
+    unsigned rv = g_assembler.binary_size;
+    emit_bytes((u8[]){ 0x48, 0x8d, 0x05 | (dst_reg << 3), 0, 0, 0, 0 }, 7);
+    return rv;
+}
+
+void asm_patch_lea_rip(unsigned offset_to_patch, unsigned target_offset) {
+    int32_t rel_offset32; // VS2013 needs this to be here.
+    i64 rel_offset = (i64)target_offset - (i64)offset_to_patch - 7;
+    u8 *c = g_assembler.binary + offset_to_patch;
+    if (!fits_in_s32(rel_offset))
         DBG_BREAK();
+
+    rel_offset32 = (int32_t)rel_offset;
+    memcpy(&c[3], &rel_offset32, 4);
+}
+
+void asm_emit_data(void const *data, unsigned num_bytes) {
+    emit_bytes((void *)data, num_bytes);
+}
+
+// Copies between a stack slot and [rcx + rcx_disp], 8 bytes at a time where
+// possible. 'to_stack' gives the direction.
+static void emit_copy_rcx_mem(unsigned stack_offset, unsigned num_bytes, unsigned rcx_disp,
+                              bool to_stack) {
+    i64 relative_addr = -(i64)stack_offset - (i64)num_bytes;
+    for (unsigned i = 0; i < num_bytes; ) {
+        bool qword = num_bytes - i >= 8;
+        int32_t disp32 = (int32_t)(rcx_disp + i);
+        u8 load_opcode = qword ? 0x8b : 0x8a;
+        u8 store_opcode = qword ? 0x89 : 0x88;
+
+        // mov rax/al, [src]
+        if (qword)
+            emit_bytes((u8[]){ 0x48 }, 1);
+        if (to_stack) {
+            emit_bytes((u8[]){ load_opcode, 0x81 }, 2);
+            emit_bytes(&disp32, 4);
+        }
+        else {
+            emit_bytes(&load_opcode, 1);
+            emit_rbp_operand(REG_RAX, relative_addr + i);
+        }
+
+        // mov [dst], rax/al
+        if (qword)
+            emit_bytes((u8[]){ 0x48 }, 1);
+        if (to_stack) {
+            emit_bytes(&store_opcode, 1);
+            emit_rbp_operand(REG_RAX, relative_addr + i);
+        }
+        else {
+            emit_bytes((u8[]){ store_opcode, 0x81 }, 2);
+            emit_bytes(&disp32, 4);
+        }
+
+        i += qword ? 8 : 1;
     }
 }
 
+void asm_emit_load_stack_from_rcx(unsigned stack_offset, unsigned num_bytes, unsigned rcx_disp) {
+    emit_copy_rcx_mem(stack_offset, num_bytes, rcx_disp, true);
+}
+
+void asm_emit_store_stack_to_rcx(unsigned stack_offset, unsigned num_bytes, unsigned rcx_disp) {
+    emit_copy_rcx_mem(stack_offset, num_bytes, rcx_disp, false);
+}
+
 void asm_emit_mov_reg_reg(asm_reg_t dst_reg, asm_reg_t src_reg) {
     u8 c[3] = { 0x48, 0x89 };
     c[2] = 0xc0 | (src_reg << 3) | dst_reg; // 0xc0 = ModR/M byte: register-direct mode
@@ -164,12 +334,24 @@ void asm_emit_mov_imm_64(asm_reg_t dst_reg, u64 val) {
     switch (dst_reg) {
     case REG_RAX: c[1] = 0xb8; break;
     case REG_RCX: c[1] = 0xb9; break;
+    case REG_RDX: c[1] = 0xba; break;
     }
 
     emit_bytes(c, 2);
     emit_bytes(&val, 8);
 }
 
+void asm_emit_load_call_arg(unsigned arg_index, unsigned stack_offset) {
+    // r8 and r9 need REX.R to extend the reg field.
+    static u8 const rex[4] = { 0x48, 0x48, 0x4c, 0x4c };
+    static u8 const reg_field[4] = { 1, 2, 0, 1 };
+    assert(arg_index < 4);
+
+    // mov reg, qword ptr [rbp + relative_addr]
+    emit_bytes((u8[]){ rex[arg_index], 0x8b }, 2);
+    emit_rbp_operand(reg_field[arg_index], -(i64)stack_offset - 8);
+}
+
 void asm_emit_call_rax(void) {
     u8 c[] = { 0xff, 0xd0 };
     emit_bytes(c, 2);
@@ -186,6 +368,30 @@ void asm_emit_cmp_imm(asm_reg_t lhs_reg, asm_reg_t rhs_reg) {
     emit_bytes(c, 3);
 }
 
+void asm_emit_cmp_reg_stack(asm_reg_t lhs_reg, unsigned stack_offset) {
+    // cmp lhs_reg, qword ptr [rbp + relative_addr]
+    emit_bytes((u8[]){ 0x48, 0x3b }, 2);
+    emit_rbp_operand(lhs_reg, -(i64)stack_offset - 8);
+}
+
+void asm_emit_test(asm_reg_t reg) {
+    u8 c[3] = { 0x48, 0x85 };
+    c[2] = 0xc0 | (reg << 3) | reg;
+    emit_bytes(c, 3);
+}
+
+void asm_emit_setcc(asm_cond_t cond) {
+    // setcc al; movzx eax, al
+    u8 c[] = { 0x0f, 0x90 | cond, 0xc0, 0x0f, 0xb6, 0xc0 };
+    emit_bytes(c, sizeof(c));
+}
+
+void asm_emit_cmov(asm_cond_t cond, asm_reg_t dst_reg, asm_reg_t src_reg) {
+    u8 c[4] = { 0x48, 0x0f, 0x40 | cond };
+    c[3] = 0xc0 | (dst_reg << 3) | src_reg;
+    emit_bytes(c, 4);
+}
+
 void asm_emit_jmp_imm(unsigned target_offset) {
     int32_t rel_offset32; // VS2013 needs this to be here.
     i64 rel_offset = (i64)target_offset - (i64)g_assembler.binary_size - 5;
@@ -198,19 +404,85 @@ void asm_emit_jmp_imm(unsigned target_offset) {
     emit_bytes(&rel_offset32, 4);
 }
 
+void asm_patch_jmp(unsigned offset_to_patch, unsigned target_offset) {
+    int32_t rel_offset32; // VS2013 needs this to be here.
+    i64 rel_offset = (i64)target_offset - (i64)offset_to_patch - 5;
+    u8 *c = g_assembler.binary + offset_to_patch;
+    if (!fits_in_s32(rel_offset))
+        DBG_BREAK();
+
+    rel_offset32 = (int32_t)rel_offset;
+    memcpy(&c[1], &rel_offset32, 4);
+}
+
+void asm_emit_inc_counter(u64 *counter) {
+    asm_emit_mov_imm_64(REG_RAX, (u64)counter);
+    emit_bytes((u8[]){ 0x48, 0xff, 0x00 }, 3); // inc qword ptr [rax]
+}
+
+void asm_emit_safepoint_poll(void const volatile *poll_word) {
+    // mov eax, dword ptr [poll_word]. The code heap may put the code anywhere,
+    // so the address is absolute rather than rip-relative.
+    u64 addr = (u64)(uintptr_t)poll_word;
+    emit_bytes((u8[]){ 0xa1 }, 1);
+    emit_bytes(&addr, 8);
+}
+
+void asm_emit_nops(unsigned num_bytes) {
+    // The recommended multi-byte NOPs, from the Intel optimization manual.
+    // Each is decoded as one instruction.
+    static u8 const nops[9][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0f, 0x1f, 0x00 },
+        { 0x0f, 0x1f, 0x40, 0x00 },
+        { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+
+    while (num_bytes > 0) {
+        unsigned n = num_bytes < 9 ? num_bytes : 9;
+        emit_bytes((void *)nops[n - 1], n);
+        num_bytes -= n;
+    }
+}
+
+void asm_emit_align(unsigned alignment, unsigned max_padding) {
+    assert((alignment & (alignment - 1)) == 0);
+    if (alignment <= 1)
+        return;
+
+    // The code buffer is page aligned, so offsets can be used instead of
+    // addresses.
+    unsigned padding = (alignment - g_assembler.binary_size % alignment) % alignment;
+    if (padding <= max_padding)
+        asm_emit_nops(padding);
+}
+
 void asm_emit_je(unsigned target_offset) {
+    asm_emit_jcc(COND_E, target_offset);
+}
+
+void asm_patch_je(unsigned offset_to_patch, unsigned target_offset) {
+    asm_patch_jcc(offset_to_patch, target_offset);
+}
+
+void asm_emit_jcc(asm_cond_t cond, unsigned target_offset) {
     int32_t rel_offset32; // VS2013 needs this to be here.
     i64 rel_offset = (i64)target_offset - (i64)g_assembler.binary_size - 6;
     if (!fits_in_s32(rel_offset))
         DBG_BREAK();
         
     rel_offset32 = (int32_t)rel_offset;
-    u8 c[] = { 0x0f, 0x84 };
+    u8 c[] = { 0x0f, 0x80 | cond };
     emit_bytes(c, 2);
     emit_bytes(&rel_offset32, 4);
 }
 
-void asm_patch_je(unsigned offset_to_patch, unsigned target_offset) {
+void asm_patch_jcc(unsigned offset_to_patch, unsigned target_offset) {
     int32_t rel_offset32; // VS2013 needs this to be here.
     i64 rel_offset = (i64)target_offset - (i64)offset_to_patch - 6;
     u8 *c = g_assembler.binary + offset_to_patch;
@@ -221,20 +493,713 @@ void asm_patch_je(unsigned offset_to_patch, unsigned target_offset) {
     memcpy(&c[2], &rel_offset32, 4);
 }
 
+// ***************************************************************************
+// Arithmetic
+// ***************************************************************************
+
+static bool is_power_of_2(u64 val) {
+    return val && (val & (val - 1)) == 0;
+}
+
+static unsigned log2_u64(u64 val) {
+    unsigned n = 0;
+    while (val >>= 1)
+        n++;
+    return n;
+}
+
+// The ModR/M reg field extension of the "op r/m64, imm" forms (opcodes 81 and
+// 83), or -1 if the operation has none.
+static int get_alu_imm_ext(TokenType operation) {
+    switch (operation) {
+    case TOKEN_PLUS: return 0;
+    case TOKEN_OR: return 1;
+    case TOKEN_AND: return 4;
+    case TOKEN_MINUS: return 5;
+    case TOKEN_XOR: return 6;
+    default: return -1;
+    }
+}
+
 void asm_emit_arithmetic(asm_reg_t dst_reg, asm_reg_t src_reg, TokenType operation) {
-    u8 c[3] = { 0x48 };
-    
+    assert(dst_reg <= REG_RDX && src_reg <= REG_RDX);
+    u8 modrm_rr = 0xc0 | (src_reg << 3) | dst_reg; // Mod = 11
+
     switch (operation) {
     case TOKEN_PLUS:
-        c[1] = 0x01; // ADD r/m64, r64
+        emit_bytes((u8[]){ 0x48, 0x01, modrm_rr }, 3); // add dst, src
+        break;
+    case TOKEN_MINUS:
+        emit_bytes((u8[]){ 0x48, 0x29, modrm_rr }, 3); // sub dst, src
+        break;
+    case TOKEN_AND:
+        emit_bytes((u8[]){ 0x48, 0x21, modrm_rr }, 3); // and dst, src
+        break;
+    case TOKEN_OR:
+        emit_bytes((u8[]){ 0x48, 0x09, modrm_rr }, 3); // or dst, src
+        break;
+    case TOKEN_XOR:
+        emit_bytes((u8[]){ 0x48, 0x31, modrm_rr }, 3); // xor dst, src
+        break;
+    case TOKEN_MULTIPLY:
+        // imul has the destination in the reg field.
+        emit_bytes((u8[]){ 0x48, 0x0f, 0xaf, 0xc0 | (dst_reg << 3) | src_reg }, 4); // imul dst, src
         break;
     default:
         printf("Unknown arithmetic operation\n");
         DBG_BREAK();
     }
-    
-    c[2] = 0xc0 | // Mod = 11
-        (REG_RCX << 3) |
-        REG_RAX;
-    emit_bytes(c, 3);
+}
+
+void asm_emit_neg(asm_reg_t reg) {
+    // neg reg
+    emit_bytes((u8[]){ 0x48, 0xf7, 0xd8 | reg }, 3);
+}
+
+void asm_emit_shift(TokenType operation) {
+    assert(operation == TOKEN_SHIFT_LEFT || operation == TOKEN_SHIFT_RIGHT);
+    bool left = operation == TOKEN_SHIFT_LEFT;
+
+    if (g_target.has_bmi2) {
+        // The count can be in any register, and flags are untouched.
+        if (left)
+            emit_bytes((u8[]){ 0xc4, 0xe2, 0xf9, 0xf7, 0xc1 }, 5); // shlx rax, rcx, rax
+        else
+            emit_bytes((u8[]){ 0xc4, 0xe2, 0xfb, 0xf7, 0xc1 }, 5); // shrx rax, rcx, rax
+        return;
+    }
+
+    // The legacy shifts need the count in cl.
+    emit_bytes((u8[]){ 0x48, 0x91 }, 2); // xchg rax, rcx
+    if (left)
+        emit_bytes((u8[]){ 0x48, 0xd3, 0xe0 }, 3); // shl rax, cl
+    else
+        emit_bytes((u8[]){ 0x48, 0xd3, 0xe8 }, 3); // shr rax, cl
+}
+
+unsigned asm_emit_divide(TokenType operation) {
+    assert(operation == TOKEN_DIVIDE || operation == TOKEN_MODULO);
+
+    emit_bytes((u8[]){ 0x48, 0x85, 0xc0 }, 3); // test rax, rax
+    unsigned jz_offset = g_assembler.binary_size;
+    asm_emit_jcc(COND_E, jz_offset);
+
+    emit_bytes((u8[]){ 0x48, 0x91 }, 2); // xchg rax, rcx
+    emit_bytes((u8[]){ 0x31, 0xd2 }, 2); // xor edx, edx
+    emit_bytes((u8[]){ 0x48, 0xf7, 0xf1 }, 3); // div rcx
+    if (operation == TOKEN_MODULO)
+        emit_bytes((u8[]){ 0x48, 0x89, 0xd0 }, 3); // mov rax, rdx
+    return jz_offset;
+}
+
+// Emits "op rax, imm" for one of the operations that get_alu_imm_ext() knows.
+// Clobbers rcx if imm doesn't fit in 32 bits.
+static void emit_alu_imm(TokenType operation, u64 imm) {
+    int ext = get_alu_imm_ext(operation);
+    assert(ext >= 0);
+
+    if (fits_in_s8((i64)imm)) {
+        emit_bytes((u8[]){ 0x48, 0x83, 0xc0 | (ext << 3), (u8)imm }, 4);
+    }
+    else if (fits_in_s32((i64)imm)) {
+        int32_t imm32 = (int32_t)imm;
+        emit_bytes((u8[]){ 0x48, 0x81, 0xc0 | (ext << 3) }, 3);
+        emit_bytes(&imm32, 4);
+    }
+    else {
+        asm_emit_mov_imm_64(REG_RCX, imm);
+        asm_emit_arithmetic(REG_RAX, REG_RCX, operation);
+    }
+}
+
+static void emit_shift_imm(bool left, unsigned count) {
+    count &= 63;
+    if (count == 0)
+        return;
+    if (left)
+        emit_bytes((u8[]){ 0x48, 0xc1, 0xe0, (u8)count }, 4); // shl rax, count
+    else
+        emit_bytes((u8[]){ 0x48, 0xc1, 0xe8, (u8)count }, 4); // shr rax, count
+}
+
+// rdx = rdx * imm. Clobbers rax if imm doesn't fit in 32 bits.
+static void emit_mul_rdx_imm(u64 imm) {
+    if (fits_in_s32((i64)imm)) {
+        int32_t imm32 = (int32_t)imm;
+        emit_bytes((u8[]){ 0x48, 0x69, 0xd2 }, 3); // imul rdx, rdx, imm32
+        emit_bytes(&imm32, 4);
+    }
+    else {
+        asm_emit_mov_imm_64(REG_RAX, imm);
+        asm_emit_arithmetic(REG_RDX, REG_RAX, TOKEN_MULTIPLY);
+    }
+}
+
+static void emit_mul_imm(u64 imm) {
+    if (imm == 0) {
+        emit_bytes((u8[]){ 0x31, 0xc0 }, 2); // xor eax, eax
+        return;
+    }
+
+    // Multiplies by 3, 5 and 9 are an lea, and then powers of 2 a shift.
+    unsigned shift = 0;
+    while (!(imm & 1)) {
+        imm >>= 1;
+        shift++;
+    }
+    if (imm == 1 || imm == 3 || imm == 5 || imm == 9) {
+        if (imm == 3)
+            emit_bytes((u8[]){ 0x48, 0x8d, 0x04, 0x40 }, 4); // lea rax, [rax + rax * 2]
+        else if (imm == 5)
+            emit_bytes((u8[]){ 0x48, 0x8d, 0x04, 0x80 }, 4); // lea rax, [rax + rax * 4]
+        else if (imm == 9)
+            emit_bytes((u8[]){ 0x48, 0x8d, 0x04, 0xc0 }, 4); // lea rax, [rax + rax * 8]
+        emit_shift_imm(true, shift);
+        return;
+    }
+
+    imm <<= shift;
+    if (fits_in_s8((i64)imm)) {
+        emit_bytes((u8[]){ 0x48, 0x6b, 0xc0, (u8)imm }, 4); // imul rax, rax, imm8
+    }
+    else if (fits_in_s32((i64)imm)) {
+        int32_t imm32 = (int32_t)imm;
+        emit_bytes((u8[]){ 0x48, 0x69, 0xc0 }, 3); // imul rax, rax, imm32
+        emit_bytes(&imm32, 4);
+    }
+    else {
+        asm_emit_mov_imm_64(REG_RCX, imm);
+        asm_emit_arithmetic(REG_RAX, REG_RCX, TOKEN_MULTIPLY);
+    }
+}
+
+// Finds the magic number for an unsigned 64 bit division by 'divisor', so
+// that n / divisor is the high half of n * magic, shifted right by 'shift'.
+// Some divisors need a 65 bit magic number. For those, 'needs_add' is set and
+// the quotient is ((n - hi) / 2 + hi) >> (shift - 1), where hi is the high
+// half of n * magic. See Hacker's Delight, chapter 10.
+static void find_magic(u64 divisor, u64 *magic, unsigned *shift, bool *needs_add) {
+    u64 const max_s64 = 0x7fffffffffffffffull;
+    unsigned p = 63;
+    u64 q = max_s64 / divisor;          // (2^p - 1) / divisor
+    u64 r = max_s64 - q * divisor;      // (2^p - 1) % divisor
+    u64 p64 = 0;                        // 2^(p - 64)
+    u64 delta;
+
+    *needs_add = false;
+    do {
+        p++;
+        p64 = p == 64 ? 1 : p64 * 2;
+        if (r + 1 >= divisor - r) {
+            if (q >= max_s64)
+                *needs_add = true;
+            q = 2 * q + 1;
+            r = 2 * r + 1 - divisor;
+        }
+        else {
+            if (q > max_s64)
+                *needs_add = true;
+            q = 2 * q;
+            r = 2 * r + 1;
+        }
+        delta = divisor - 1 - r;
+    } while (p < 128 && p64 < delta);
+
+    *magic = q + 1;
+    *shift = p - 64;
+}
+
+// rax = rax / divisor, or rax % divisor. Clobbers rcx and rdx.
+static void emit_divide_imm(bool remainder, u64 divisor) {
+    assert(divisor != 0);
+
+    if (is_power_of_2(divisor)) {
+        if (remainder)
+            emit_alu_imm(TOKEN_AND, divisor - 1);
+        else
+            emit_shift_imm(false, log2_u64(divisor));
+        return;
+    }
+
+    u64 magic;
+    unsigned shift;
+    bool needs_add;
+    find_magic(divisor, &magic, &shift, &needs_add);
+
+    // Keep n in rcx, and leave the quotient in rdx.
+    emit_bytes((u8[]){ 0x48, 0x89, 0xc1 }, 3); // mov rcx, rax
+    asm_emit_mov_imm_64(REG_RDX, magic);
+    emit_bytes((u8[]){ 0x48, 0xf7, 0xe2 }, 3); // mul rdx
+    if (needs_add) {
+        emit_bytes((u8[]){ 0x48, 0x89, 0xc8 }, 3); // mov rax, rcx
+        emit_bytes((u8[]){ 0x48, 0x29, 0xd0 }, 3); // sub rax, rdx
+        emit_bytes((u8[]){ 0x48, 0xd1, 0xe8 }, 3); // shr rax, 1
+        emit_bytes((u8[]){ 0x48, 0x01, 0xc2 }, 3); // add rdx, rax
+        shift--;
+    }
+    if (shift)
+        emit_bytes((u8[]){ 0x48, 0xc1, 0xea, (u8)shift }, 4); // shr rdx, shift
+
+    if (remainder) {
+        // n - q * divisor
+        emit_mul_rdx_imm(divisor);
+        emit_bytes((u8[]){ 0x48, 0x89, 0xc8 }, 3); // mov rax, rcx
+        emit_bytes((u8[]){ 0x48, 0x29, 0xd0 }, 3); // sub rax, rdx
+    }
+    else {
+        emit_bytes((u8[]){ 0x48, 0x89, 0xd0 }, 3); // mov rax, rdx
+    }
+}
+
+void asm_emit_arithmetic_imm(TokenType operation, u64 imm) {
+    switch (operation) {
+    case TOKEN_PLUS:
+    case TOKEN_MINUS:
+    case TOKEN_OR:
+    case TOKEN_XOR:
+        if (imm != 0)
+            emit_alu_imm(operation, imm);
+        break;
+    case TOKEN_AND:
+        emit_alu_imm(operation, imm);
+        break;
+    case TOKEN_MULTIPLY:
+        emit_mul_imm(imm);
+        break;
+    case TOKEN_DIVIDE:
+    case TOKEN_MODULO:
+        emit_divide_imm(operation == TOKEN_MODULO, imm);
+        break;
+    case TOKEN_SHIFT_LEFT:
+    case TOKEN_SHIFT_RIGHT:
+        emit_shift_imm(operation == TOKEN_SHIFT_LEFT, (unsigned)(imm & 63));
+        break;
+    default:
+        printf("Unknown arithmetic operation\n");
+        DBG_BREAK();
+    }
+}
+
+
+// ***************************************************************************
+// Dynamic arrays
+// ***************************************************************************
+
+// Returns the address, relative to rbp, of a field of a runtime_array_t.
+static i64 array_field_addr(unsigned arr_offset, size_t field_offset) {
+    return -(i64)arr_offset - (i64)sizeof(runtime_array_t) + (i64)field_offset;
+}
+
+void asm_emit_array_clear(unsigned arr_offset) {
+    // mov dword ptr [size], 0
+    emit_bytes((u8[]){ 0xc7 }, 1);
+    emit_rbp_operand(0, array_field_addr(arr_offset, offsetof(runtime_array_t, size)));
+    emit_bytes((u8[]){ 0, 0, 0, 0 }, 4);
+}
+
+void asm_emit_array_len(unsigned arr_offset) {
+    // mov eax, dword ptr [size]
+    emit_bytes((u8[]){ 0x8b }, 1);
+    emit_rbp_operand(REG_RAX, array_field_addr(arr_offset, offsetof(runtime_array_t, size)));
+}
+
+unsigned asm_emit_array_bounds_check(unsigned arr_offset) {
+    // mov ecx, dword ptr [size]
+    emit_bytes((u8[]){ 0x8b }, 1);
+    emit_rbp_operand(REG_RCX, array_field_addr(arr_offset, offsetof(runtime_array_t, size)));
+
+    // cmp rax, rcx
+    emit_bytes((u8[]){ 0x48, 0x39, 0xc8 }, 3);
+
+    unsigned jae_offset = g_assembler.binary_size;
+    asm_emit_jcc(COND_AE, jae_offset);
+    return jae_offset;
+}
+
+void asm_emit_array_load(unsigned arr_offset, unsigned elem_num_bytes) {
+    // mov rcx, qword ptr [data]
+    emit_bytes((u8[]){ 0x48, 0x8b }, 2);
+    emit_rbp_operand(REG_RCX, array_field_addr(arr_offset, offsetof(runtime_array_t, data)));
+
+    if (elem_num_bytes == 1)
+        emit_bytes((u8[]){ 0x0f, 0xb6, 0x04, 0x01 }, 4); // movzx eax, byte ptr [rcx + rax]
+    else
+        emit_bytes((u8[]){ 0x48, 0x8b, 0x04, 0xc1 }, 4); // mov rax, qword ptr [rcx + rax * 8]
+}
+
+void asm_emit_array_store(unsigned arr_offset, unsigned elem_num_bytes) {
+    // mov rcx, qword ptr [data]
+    emit_bytes((u8[]){ 0x48, 0x8b }, 2);
+    emit_rbp_operand(REG_RCX, array_field_addr(arr_offset, offsetof(runtime_array_t, data)));
+
+    if (elem_num_bytes == 1)
+        emit_bytes((u8[]){ 0x88, 0x14, 0x01 }, 3); // mov byte ptr [rcx + rax], dl
+    else
+        emit_bytes((u8[]){ 0x48, 0x89, 0x14, 0xc1 }, 4); // mov qword ptr [rcx + rax * 8], rdx
+}
+
+unsigned asm_emit_array_has_space(unsigned arr_offset) {
+    // mov ecx, dword ptr [size]
+    emit_bytes((u8[]){ 0x8b }, 1);
+    emit_rbp_operand(REG_RCX, array_field_addr(arr_offset, offsetof(runtime_array_t, size)));
+
+    // cmp ecx, dword ptr [capacity]
+    emit_bytes((u8[]){ 0x3b }, 1);
+    emit_rbp_operand(REG_RCX, array_field_addr(arr_offset, offsetof(runtime_array_t, capacity)));
+
+    unsigned jae_offset = g_assembler.binary_size;
+    asm_emit_jcc(COND_AE, jae_offset);
+    return jae_offset;
+}
+
+void asm_emit_array_push(unsigned arr_offset, unsigned elem_num_bytes) {
+    // mov rax, qword ptr [data]
+    emit_bytes((u8[]){ 0x48, 0x8b }, 2);
+    emit_rbp_operand(REG_RAX, array_field_addr(arr_offset, offsetof(runtime_array_t, data)));
+
+    if (elem_num_bytes == 1)
+        emit_bytes((u8[]){ 0x88, 0x14, 0x08 }, 3); // mov byte ptr [rax + rcx], dl
+    else
+        emit_bytes((u8[]){ 0x48, 0x89, 0x14, 0xc8 }, 4); // mov qword ptr [rax + rcx * 8], rdx
+
+    // inc dword ptr [size]
+    emit_bytes((u8[]){ 0xff }, 1);
+    emit_rbp_operand(0, array_field_addr(arr_offset, offsetof(runtime_array_t, size)));
+}
+
+
+// ***************************************************************************
+// Bit counting
+// ***************************************************************************
+
+void asm_emit_popcount(void) {
+    if (g_target.has_popcnt) {
+        emit_bytes((u8[]){ 0xf3, 0x48, 0x0f, 0xb8, 0xc0 }, 5); // popcnt rax, rax
+        return;
+    }
+
+    // Sum the bits in pairs, then nibbles, then bytes, then multiply to add
+    // all the bytes into the top one.
+    emit_bytes((u8[]){ 0x48, 0x89, 0xc1 }, 3); // mov rcx, rax
+    emit_bytes((u8[]){ 0x48, 0xd1, 0xe9 }, 3); // shr rcx, 1
+    asm_emit_mov_imm_64(REG_RDX, 0x5555555555555555ull);
+    emit_bytes((u8[]){ 0x48, 0x21, 0xd1 }, 3); // and rcx, rdx
+    emit_bytes((u8[]){ 0x48, 0x29, 0xc8 }, 3); // sub rax, rcx
+
+    asm_emit_mov_imm_64(REG_RDX, 0x3333333333333333ull);
+    emit_bytes((u8[]){ 0x48, 0x89, 0xc1 }, 3); // mov rcx, rax
+    emit_bytes((u8[]){ 0x48, 0x21, 0xd0 }, 3); // and rax, rdx
+    emit_bytes((u8[]){ 0x48, 0xc1, 0xe9, 2 }, 4); // shr rcx, 2
+    emit_bytes((u8[]){ 0x48, 0x21, 0xd1 }, 3); // and rcx, rdx
+    emit_bytes((u8[]){ 0x48, 0x01, 0xc8 }, 3); // add rax, rcx
+
+    emit_bytes((u8[]){ 0x48, 0x89, 0xc1 }, 3); // mov rcx, rax
+    emit_bytes((u8[]){ 0x48, 0xc1, 0xe9, 4 }, 4); // shr rcx, 4
+    emit_bytes((u8[]){ 0x48, 0x01, 0xc8 }, 3); // add rax, rcx
+    asm_emit_mov_imm_64(REG_RDX, 0x0f0f0f0f0f0f0f0full);
+    emit_bytes((u8[]){ 0x48, 0x21, 0xd0 }, 3); // and rax, rdx
+
+    asm_emit_mov_imm_64(REG_RDX, 0x0101010101010101ull);
+    emit_bytes((u8[]){ 0x48, 0x0f, 0xaf, 0xc2 }, 4); // imul rax, rdx
+    emit_bytes((u8[]){ 0x48, 0xc1, 0xe8, 56 }, 4); // shr rax, 56
+}
+
+void asm_emit_clz(void) {
+    if (g_target.has_lzcnt) {
+        emit_bytes((u8[]){ 0xf3, 0x48, 0x0f, 0xbd, 0xc0 }, 5); // lzcnt rax, rax
+        return;
+    }
+
+    // clz = 63 - bsr = bsr ^ 63. bsr leaves the destination undefined and
+    // sets ZF if the input is 0, in which case 127 ^ 63 gives 64.
+    emit_bytes((u8[]){ 0xb9, 127, 0, 0, 0 }, 5); // mov ecx, 127
+    emit_bytes((u8[]){ 0x48, 0x0f, 0xbd, 0xc0 }, 4); // bsr rax, rax
+    emit_bytes((u8[]){ 0x0f, 0x44, 0xc1 }, 3); // cmovz eax, ecx
+    emit_bytes((u8[]){ 0x83, 0xf0, 63 }, 3); // xor eax, 63
+}
+
+void asm_emit_ctz(void) {
+    if (g_target.has_bmi1) {
+        emit_bytes((u8[]){ 0xf3, 0x48, 0x0f, 0xbc, 0xc0 }, 5); // tzcnt rax, rax
+        return;
+    }
+
+    emit_bytes((u8[]){ 0xb9, 64, 0, 0, 0 }, 5); // mov ecx, 64
+    emit_bytes((u8[]){ 0x48, 0x0f, 0xbc, 0xc0 }, 4); // bsf rax, rax
+    emit_bytes((u8[]){ 0x0f, 0x44, 0xc1 }, 3); // cmovz eax, ecx
+}
+
+
+// ***************************************************************************
+// Vector instructions
+// ***************************************************************************
+
+enum { VEX_MAP_0F = 1, VEX_MAP_0F38 = 2 };
+enum { VEX_PP_NONE, VEX_PP_66, VEX_PP_F3, VEX_PP_F2 };
+
+// Returns the address, relative to rbp, of the lowest byte of a stack slot.
+static i64 slot_addr(unsigned stack_offset, unsigned num_bytes) {
+    return -(i64)stack_offset - (i64)num_bytes;
+}
+
+static bool use_avx2(unsigned num_bytes) {
+    return num_bytes == 32 && g_target.has_avx2;
+}
+
+// Emits a VEX prefix for a 256 bit instruction. 'vvvv' is the extra source
+// register operand.
+static void emit_vex256(unsigned map, unsigned pp, unsigned vvvv) {
+    u8 inv_vvvv = (~vvvv & 0xf) << 3;
+    if (map == VEX_MAP_0F)
+        emit_bytes((u8[]){ 0xc5, 0x80 | inv_vvvv | 4 | pp }, 2);
+    else
+        emit_bytes((u8[]){ 0xc4, 0xe0 | map, inv_vvvv | 4 | pp }, 3);
+}
+
+static void emit_vzeroupper(void) {
+    emit_bytes((u8[]){ 0xc5, 0xf8, 0x77 }, 3);
+}
+
+// movdqu / vmovdqu between a vector register and [rbp + relative_addr].
+static void emit_vec_load(asm_vreg_t dst, i64 relative_addr, bool avx) {
+    if (avx) {
+        emit_vex256(VEX_MAP_0F, VEX_PP_F3, 0);
+        emit_bytes((u8[]){ 0x6f }, 1);
+        emit_rbp_operand(dst, relative_addr);
+    }
+    else {
+        emit_sse_rbp(0xf3, 0x6f, dst, relative_addr);
+    }
+}
+
+static void emit_vec_store(asm_vreg_t src, i64 relative_addr, bool avx) {
+    if (avx) {
+        emit_vex256(VEX_MAP_0F, VEX_PP_F3, 0);
+        emit_bytes((u8[]){ 0x7f }, 1);
+        emit_rbp_operand(src, relative_addr);
+    }
+    else {
+        emit_sse_rbp(0xf3, 0x7f, src, relative_addr);
+    }
+}
+
+// Emits "op dst, src" (SSE2) or "vop dst, dst, src" (AVX2) for an instruction
+// in the 66 0f opcode space.
+static void emit_vec_rr(u8 opcode, asm_vreg_t dst, asm_vreg_t src, bool avx) {
+    if (avx) {
+        emit_vex256(VEX_MAP_0F, VEX_PP_66, dst);
+        emit_bytes((u8[]){ opcode, 0xc0 | (dst << 3) | src }, 2);
+    }
+    else {
+        emit_sse_rr(0x66, opcode, dst, src);
+    }
+}
+
+// Computes xmm0/ymm0 = xmm0/ymm0 op xmm1/ymm1. Clobbers xmm1/ymm1.
+static void emit_vec_lanewise_op(TokenType operation, unsigned lane_num_bytes, bool avx) {
+    switch (operation) {
+    case TOKEN_PLUS:
+        emit_vec_rr(lane_num_bytes == 1 ? 0xfc : 0xd4, REG_XMM0, REG_XMM1, avx); // paddb/paddq
+        break;
+    case TOKEN_MINUS:
+        emit_vec_rr(lane_num_bytes == 1 ? 0xf8 : 0xfb, REG_XMM0, REG_XMM1, avx); // psubb/psubq
+        break;
+    case TOKEN_AND:
+        emit_vec_rr(0xdb, REG_XMM0, REG_XMM1, avx); // pand
+        break;
+    case TOKEN_OR:
+        emit_vec_rr(0xeb, REG_XMM0, REG_XMM1, avx); // por
+        break;
+    case TOKEN_XOR:
+        emit_vec_rr(0xef, REG_XMM0, REG_XMM1, avx); // pxor
+        break;
+    case TOKEN_EQUALS:
+    case TOKEN_NOT_EQUALS:
+        if (lane_num_bytes == 1) {
+            emit_vec_rr(0x74, REG_XMM0, REG_XMM1, avx); // pcmpeqb
+        }
+        else if (avx) {
+            // vpcmpeqq ymm0, ymm0, ymm1
+            emit_vex256(VEX_MAP_0F38, VEX_PP_66, REG_XMM0);
+            emit_bytes((u8[]){ 0x29, 0xc1 }, 2);
+        }
+        else if (g_target.has_sse41) {
+            emit_bytes((u8[]){ 0x66, 0x0f, 0x38, 0x29, 0xc1 }, 5); // pcmpeqq xmm0, xmm1
+        }
+        else {
+            // SSE2 has no pcmpeqq. Compare the dwords, then a qword is equal if
+            // both of its dwords are.
+            emit_sse_rr(0x66, 0x76, REG_XMM0, REG_XMM1); // pcmpeqd xmm0, xmm1
+            emit_sse_rr(0x66, 0x70, REG_XMM1, REG_XMM0); // pshufd xmm1, xmm0, 0xb1
+            emit_bytes((u8[]){ 0xb1 }, 1);
+            emit_sse_rr(0x66, 0xdb, REG_XMM0, REG_XMM1); // pand xmm0, xmm1
+        }
+
+        if (operation == TOKEN_NOT_EQUALS) {
+            emit_vec_rr(0x76, REG_XMM1, REG_XMM1, avx); // pcmpeqd xmm1, xmm1 (all ones)
+            emit_vec_rr(0xef, REG_XMM0, REG_XMM1, avx); // pxor xmm0, xmm1
+        }
+        break;
+    default:
+        printf("Unknown vector operation\n");
+        DBG_BREAK();
+    }
+}
+
+void asm_emit_vec_copy(unsigned dst_offset, unsigned src_offset, unsigned num_bytes) {
+    if (dst_offset == src_offset)
+        return;
+
+    bool avx = use_avx2(num_bytes);
+    unsigned chunk_size = avx ? 32 : 16;
+    for (unsigned i = 0; i < num_bytes; i += chunk_size) {
+        emit_vec_load(REG_XMM0, slot_addr(src_offset, num_bytes) + i, avx);
+        emit_vec_store(REG_XMM0, slot_addr(dst_offset, num_bytes) + i, avx);
+    }
+
+    if (avx)
+        emit_vzeroupper();
+}
+
+void asm_emit_zero_stack_block(unsigned stack_offset, unsigned num_bytes) {
+    if (num_bytes % 16 != 0)
+        DBG_BREAK();
+
+    // Clear 32 bytes per store if the target has AVX2, and finish with a 16
+    // byte store if there is an odd one left. vzeroupper leaves xmm0 zeroed.
+    bool avx = g_target.has_avx2 && num_bytes >= 32;
+    emit_vec_rr(0xef, REG_XMM0, REG_XMM0, avx); // pxor xmm0, xmm0
+    unsigned i = 0;
+    if (avx) {
+        for (; i + 32 <= num_bytes; i += 32)
+            emit_vec_store(REG_XMM0, slot_addr(stack_offset, num_bytes) + i, true);
+        emit_vzeroupper();
+    }
+    for (; i < num_bytes; i += 16)
+        emit_vec_store(REG_XMM0, slot_addr(stack_offset, num_bytes) + i, false);
+}
+
+void asm_emit_vec_splat(unsigned dst_offset, unsigned num_bytes, unsigned lane_num_bytes) {
+    if (lane_num_bytes == 1) {
+        emit_bytes((u8[]){ 0x0f, 0xb6, 0xc0 }, 3); // movzx eax, al
+        emit_bytes((u8[]){ 0x69, 0xc0, 1, 1, 1, 1 }, 6); // imul eax, eax, 0x01010101
+        emit_sse_rr(0x66, 0x6e, REG_XMM0, REG_RAX); // movd xmm0, eax
+        emit_sse_rr(0x66, 0x70, REG_XMM0, REG_XMM0); // pshufd xmm0, xmm0, 0
+        emit_bytes((u8[]){ 0 }, 1);
+    }
+    else {
+        emit_bytes((u8[]){ 0x66, 0x48, 0x0f, 0x6e, 0xc0 }, 5); // movq xmm0, rax
+        emit_sse_rr(0x66, 0x6c, REG_XMM0, REG_XMM0); // punpcklqdq xmm0, xmm0
+    }
+
+    for (unsigned i = 0; i < num_bytes; i += 16)
+        emit_vec_store(REG_XMM0, slot_addr(dst_offset, num_bytes) + i, false);
+}
+
+void asm_emit_vec_binary_op(TokenType operation, unsigned dst_offset, unsigned lhs_offset,
+                            unsigned rhs_offset, unsigned num_bytes, unsigned lane_num_bytes) {
+    bool avx = use_avx2(num_bytes);
+    unsigned chunk_size = avx ? 32 : 16;
+    for (unsigned i = 0; i < num_bytes; i += chunk_size) {
+        emit_vec_load(REG_XMM0, slot_addr(lhs_offset, num_bytes) + i, avx);
+        emit_vec_load(REG_XMM1, slot_addr(rhs_offset, num_bytes) + i, avx);
+        emit_vec_lanewise_op(operation, lane_num_bytes, avx);
+        emit_vec_store(REG_XMM0, slot_addr(dst_offset, num_bytes) + i, avx);
+    }
+
+    if (avx)
+        emit_vzeroupper();
+}
+
+void asm_emit_vec_cmp(unsigned lhs_offset, unsigned rhs_offset, unsigned num_bytes) {
+    bool avx = use_avx2(num_bytes);
+    if (avx) {
+        emit_vec_load(REG_XMM0, slot_addr(lhs_offset, num_bytes), true);
+        emit_vec_load(REG_XMM1, slot_addr(rhs_offset, num_bytes), true);
+        emit_vec_rr(0x74, REG_XMM0, REG_XMM1, true); // vpcmpeqb ymm0, ymm0, ymm1
+        emit_vex256(VEX_MAP_0F, VEX_PP_66, 0); // vpmovmskb eax, ymm0
+        emit_bytes((u8[]){ 0xd7, 0xc0 }, 2);
+        emit_vzeroupper();
+        emit_bytes((u8[]){ 0x83, 0xf8, 0xff }, 3); // cmp eax, -1
+        return;
+    }
+
+    if (g_target.has_sse41) {
+        // OR together the differences of each half, in xmm2, then ptest sets
+        // ZF if they are all zero.
+        for (unsigned i = 0; i < num_bytes; i += 16) {
+            emit_vec_load(REG_XMM0, slot_addr(lhs_offset, num_bytes) + i, false);
+            emit_vec_load(REG_XMM1, slot_addr(rhs_offset, num_bytes) + i, false);
+            emit_sse_rr(0x66, 0xef, REG_XMM0, REG_XMM1); // pxor xmm0, xmm1
+            if (i == 0)
+                emit_sse_rr(0x66, 0x6f, REG_XMM2, REG_XMM0); // movdqa xmm2, xmm0
+            else
+                emit_sse_rr(0x66, 0xeb, REG_XMM2, REG_XMM0); // por xmm2, xmm0
+        }
+        emit_bytes((u8[]){ 0x66, 0x0f, 0x38, 0x17, 0xd2 }, 5); // ptest xmm2, xmm2
+        return;
+    }
+
+    // AND together the byte equality masks of each half, in xmm2.
+    for (unsigned i = 0; i < num_bytes; i += 16) {
+        emit_vec_load(REG_XMM0, slot_addr(lhs_offset, num_bytes) + i, false);
+        emit_vec_load(REG_XMM1, slot_addr(rhs_offset, num_bytes) + i, false);
+        emit_sse_rr(0x66, 0x74, REG_XMM0, REG_XMM1); // pcmpeqb xmm0, xmm1
+        if (i == 0)
+            emit_sse_rr(0x66, 0x6f, REG_XMM2, REG_XMM0); // movdqa xmm2, xmm0
+        else
+            emit_sse_rr(0x66, 0xdb, REG_XMM2, REG_XMM0); // pand xmm2, xmm0
+    }
+
+    emit_sse_rr(0x66, 0xd7, REG_RAX, REG_XMM2); // pmovmskb eax, xmm2
+    emit_bytes((u8[]){ 0x3d, 0xff, 0xff, 0, 0 }, 5); // cmp eax, 0xffff
+}
+
+void asm_emit_vec_hsum(unsigned src_offset, unsigned num_bytes, unsigned lane_num_bytes) {
+    i64 base = slot_addr(src_offset, num_bytes);
+
+    if (lane_num_bytes == 8) {
+        // mov rax, [lane 0], then add rax, [lane n] for the rest.
+        emit_bytes((u8[]){ 0x48, 0x8b }, 2);
+        emit_rbp_operand(REG_RAX, base);
+        for (unsigned i = 8; i < num_bytes; i += 8) {
+            emit_bytes((u8[]){ 0x48, 0x03 }, 2);
+            emit_rbp_operand(REG_RAX, base + i);
+        }
+        return;
+    }
+
+    // psadbw against zero sums each group of 8 bytes into a qword. Accumulate
+    // those in xmm2 and then add its two halves.
+    emit_sse_rr(0x66, 0xef, REG_XMM1, REG_XMM1); // pxor xmm1, xmm1
+    for (unsigned i = 0; i < num_bytes; i += 16) {
+        emit_vec_load(REG_XMM0, base + i, false);
+        emit_sse_rr(0x66, 0xf6, REG_XMM0, REG_XMM1); // psadbw xmm0, xmm1
+        if (i == 0)
+            emit_sse_rr(0x66, 0x6f, REG_XMM2, REG_XMM0); // movdqa xmm2, xmm0
+        else
+            emit_sse_rr(0x66, 0xd4, REG_XMM2, REG_XMM0); // paddq xmm2, xmm0
+    }
+    emit_sse_rr(0x66, 0x70, REG_XMM0, REG_XMM2); // pshufd xmm0, xmm2, 0x4e
+    emit_bytes((u8[]){ 0x4e }, 1);
+    emit_sse_rr(0x66, 0xd4, REG_XMM0, REG_XMM2); // paddq xmm0, xmm2
+    emit_bytes((u8[]){ 0x66, 0x48, 0x0f, 0x7e, 0xc0 }, 5); // movq rax, xmm0
+}
+
+void asm_emit_vec_movemask(unsigned src_offset, unsigned num_bytes, unsigned lane_num_bytes) {
+    i64 base = slot_addr(src_offset, num_bytes);
+    unsigned bits_per_chunk = 16 / lane_num_bytes;
+
+    emit_bytes((u8[]){ 0x31, 0xc0 }, 2); // xor eax, eax
+    for (unsigned i = 0; i < num_bytes; i += 16) {
+        unsigned shift = (i / 16) * bits_per_chunk;
+        emit_vec_load(REG_XMM0, base + i, false);
+        if (lane_num_bytes == 1)
+            emit_sse_rr(0x66, 0xd7, REG_RCX, REG_XMM0); // pmovmskb ecx, xmm0
+        else
+            emit_sse_rr(0x66, 0x50, REG_RCX, REG_XMM0); // movmskpd ecx, xmm0
+        if (shift)
+            emit_bytes((u8[]){ 0xc1, 0xe1, (u8)shift }, 3); // shl ecx, shift
+        emit_bytes((u8[]){ 0x09, 0xc8 }, 2); // or eax, ecx
+    }
 }
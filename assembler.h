@@ -4,17 +4,60 @@
 #include "common.h"
 #include "tokenizer.h"
 
+// Standard headers
+#include <limits.h>
+#include <stdbool.h>
+
 
 typedef enum {
     REG_RAX,
     REG_RCX,
+    REG_RDX,
     REG_AL,
 } asm_reg_t;
 
+// Condition codes, as encoded in the jcc instructions.
+typedef enum {
+    COND_B = 0x2,  // Unsigned <
+    COND_AE = 0x3, // Unsigned >=
+    COND_E = 0x4,
+    COND_NE = 0x5,
+    COND_BE = 0x6, // Unsigned <=
+    COND_A = 0x7,  // Unsigned >
+} asm_cond_t;
+
+typedef enum {
+    REG_XMM0,
+    REG_XMM1,
+    REG_XMM2,
+} asm_vreg_t;
+
+
+// An entry in the line table. It covers the code from 'code_offset' up to the
+// next entry's offset. The source offsets are turned into lines by
+// source_pos_get() when they're reported.
+typedef struct {
+    unsigned code_offset;
+    unsigned source_offset; // ASM_NO_SOURCE_POS if the code doesn't belong to any statement
+} asm_line_entry_t;
+
+#define ASM_NO_SOURCE_POS UINT_MAX
 
+// The code is assembled in 'binary', with offsets relative to its start, and
+// then copied to the code heap by asm_install(). So it mustn't refer to its
+// own address, only to offsets within it.
 typedef struct {
     u8 *binary;
     unsigned binary_size;
+    unsigned capacity;
+
+    // Where the code from 'installed_offset' on was last copied to.
+    u8 *installed;
+    unsigned installed_offset;
+
+    asm_line_entry_t *lines; // Sorted by code_offset
+    unsigned num_lines;
+    unsigned lines_capacity;
 } assembler_t;
 
 
@@ -23,34 +66,106 @@ extern assembler_t g_assembler;
 
 void asm_init(void);
 
+// Copies the code from 'start_offset' to the end into the code heap, and
+// returns where it went. 'hot' is passed on to code_heap_alloc().
+void *asm_install(unsigned start_offset, bool hot);
+
+// Source positions. The code emitted after a call to asm_set_source_pos()
+// belongs to that position.
+void asm_set_source_pos(unsigned source_offset);
+bool asm_find_source_pos(unsigned code_offset, unsigned *source_offset);
+
 // Function entry/exit
 void asm_emit_func_entry(void);
 void asm_patch_func_entry(unsigned func_entry_offset, unsigned stack_frame_num_bytes);
 void asm_emit_func_exit(void);
 
+// Entry/exit for a function that uses the frame that rcx points to the top of,
+// rather than allocating one on the stack.
+void asm_emit_repl_entry(void);
+void asm_emit_repl_exit(void);
+
 // Stack instructions
 void asm_emit_stack_alloc(u8 num_bytes);
 void asm_emit_stack_dealloc(u8 num_bytes);
 void asm_emit_mov_reg_to_stack(asm_reg_t src_reg, unsigned stack_offset);
 void asm_emit_mov_stack_to_reg(asm_reg_t dst_reg, unsigned stack_offset);
 void asm_emit_zero_stack_range(unsigned stack_offset, unsigned num_bytes);
+void asm_emit_lea_stack(asm_reg_t dst_reg, unsigned stack_offset, unsigned num_bytes);
+void asm_emit_load_stack_from_rcx(unsigned stack_offset, unsigned num_bytes, unsigned rcx_disp); // Clobbers rax
+void asm_emit_store_stack_to_rcx(unsigned stack_offset, unsigned num_bytes, unsigned rcx_disp); // Clobbers rax
 
 // Non stack moves
 void asm_emit_mov_reg_reg(asm_reg_t dst_reg, asm_reg_t src_reg);
 void asm_emit_mov_imm_64(asm_reg_t dst_reg, u64 val);
+unsigned asm_emit_lea_rip(asm_reg_t dst_reg); // lea dst_reg, [rip + disp32]. Returns the offset to pass to asm_patch_lea_rip()
+void asm_patch_lea_rip(unsigned offset_to_patch, unsigned target_offset);
+
+// Data, eg a literal pool. It must not be reached by the code around it.
+void asm_emit_data(void const *data, unsigned num_bytes);
 
 // Function calls
+void asm_emit_load_call_arg(unsigned arg_index, unsigned stack_offset); // rcx, rdx, r8 or r9 = qword [stack slot]
 void asm_emit_call_rax(void);
 void asm_emit_ret(void);
 
 // Comparisons
 void asm_emit_cmp_imm(asm_reg_t lhs_reg, asm_reg_t rhs_reg);
+void asm_emit_cmp_reg_stack(asm_reg_t lhs_reg, unsigned stack_offset); // cmp lhs_reg, qword [stack slot]
+void asm_emit_test(asm_reg_t reg); // Sets ZF if reg is 0
+void asm_emit_setcc(asm_cond_t cond); // rax = 1 if cond holds, else 0
+void asm_emit_cmov(asm_cond_t cond, asm_reg_t dst_reg, asm_reg_t src_reg); // dst_reg = src_reg if cond holds
 void asm_patch_cmp_imm(unsigned offset, i64 imm);
 
 // Jumps
 void asm_emit_jmp_imm(unsigned target_offset);
+void asm_patch_jmp(unsigned offset_to_patch, unsigned target_offset);
 void asm_emit_je(unsigned target_offset);
 void asm_patch_je(unsigned offset_to_patch, unsigned target_offset);
-
-// Arithmetic/logic
-void asm_emit_arithmetic(asm_reg_t dst_reg, asm_reg_t src_reg, TokenType operation);
+void asm_emit_jcc(asm_cond_t cond, unsigned target_offset);
+void asm_patch_jcc(unsigned offset_to_patch, unsigned target_offset);
+
+// Profiling
+void asm_emit_inc_counter(u64 *counter); // Clobbers rax
+
+// Safepoints
+void asm_emit_safepoint_poll(void const volatile *poll_word); // Clobbers rax
+
+// Padding
+void asm_emit_nops(unsigned num_bytes); // Uses as few instructions as possible
+void asm_emit_align(unsigned alignment, unsigned max_padding); // Pads with nops, unless that needs more than max_padding bytes
+
+// Arithmetic/logic. All values are unsigned 64 bit, and shift counts are
+// taken mod 64.
+void asm_emit_arithmetic(asm_reg_t dst_reg, asm_reg_t src_reg, TokenType operation); // + - * & | ^
+void asm_emit_shift(TokenType operation); // rax = rcx << rax or rcx >> rax. Clobbers rcx
+void asm_emit_neg(asm_reg_t reg); // reg = 0 - reg
+unsigned asm_emit_divide(TokenType operation); // rax = rcx / rax or rcx % rax. Clobbers rcx, rdx. Returns offset of a jz to patch, taken if rax is 0
+void asm_emit_arithmetic_imm(TokenType operation, u64 imm); // rax = rax op imm, for any binary op. imm must not be 0 for / and %. Clobbers rcx, rdx
+
+// Dynamic arrays. arr_offset is the stack offset of a runtime_array_t.
+void asm_emit_array_clear(unsigned arr_offset); // Sets the size to 0
+void asm_emit_array_len(unsigned arr_offset); // rax = size
+unsigned asm_emit_array_bounds_check(unsigned arr_offset); // Checks rax. Returns offset of a jae to patch
+void asm_emit_array_load(unsigned arr_offset, unsigned elem_num_bytes); // rax = arr[rax]
+void asm_emit_array_store(unsigned arr_offset, unsigned elem_num_bytes); // arr[rax] = rdx
+unsigned asm_emit_array_has_space(unsigned arr_offset); // ecx = size. Returns offset of a jae, taken if full
+void asm_emit_array_push(unsigned arr_offset, unsigned elem_num_bytes); // arr[ecx] = rdx, size++
+
+// Bit counting. These operate on rax and clobber rcx and rdx.
+void asm_emit_popcount(void); // Number of set bits
+void asm_emit_clz(void); // Number of leading zero bits. 64 if rax is 0
+void asm_emit_ctz(void); // Number of trailing zero bits. 64 if rax is 0
+
+// Vector instructions. These operate on vectors held in the stack frame.
+// num_bytes is the size of the vector (16 or 32) and lane_num_bytes the size
+// of each element (1 or 8). 32 byte vectors use AVX2 if the target has it and
+// are otherwise processed as two 16 byte halves with SSE2.
+void asm_emit_vec_copy(unsigned dst_offset, unsigned src_offset, unsigned num_bytes);
+void asm_emit_zero_stack_block(unsigned stack_offset, unsigned num_bytes); // Any size that is a multiple of 16
+void asm_emit_vec_splat(unsigned dst_offset, unsigned num_bytes, unsigned lane_num_bytes); // Broadcasts rax
+void asm_emit_vec_binary_op(TokenType operation, unsigned dst_offset, unsigned lhs_offset,
+                            unsigned rhs_offset, unsigned num_bytes, unsigned lane_num_bytes);
+void asm_emit_vec_cmp(unsigned lhs_offset, unsigned rhs_offset, unsigned num_bytes); // Sets ZF if all lanes are equal
+void asm_emit_vec_hsum(unsigned src_offset, unsigned num_bytes, unsigned lane_num_bytes); // Result in rax
+void asm_emit_vec_movemask(unsigned src_offset, unsigned num_bytes, unsigned lane_num_bytes); // Result in rax
@@ -0,0 +1,500 @@
+// Own header
+#include "bc_gen.h"
+
+// This project's headers
+#include "bytecode.h"
+#include "const_eval.h"
+#include "dead_store.h"
+#include "hash_table.h"
+#include "host_funcs.h"
+#include "lexical_scope.h"
+#include "parser.h"
+#include "strview.h"
+
+// Standard headers
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Each scalar variable gets its own register for the whole program, so most
+// expressions read their operands straight from the variables' registers.
+// Temporaries are allocated above them, in stack order, and are all released
+// at the end of each statement.
+
+enum { NO_DST = -1 };
+
+static struct {
+    bc_module_t *m;
+    unsigned instrs_capacity;
+    unsigned consts_capacity;
+    unsigned strings_capacity;
+
+    hashtab_t slots; // Maps variable name to register or array index + 1.
+    unsigned num_var_regs;
+    unsigned next_temp;
+} g_bcg;
+
+
+static unsigned gen_expr(ast_node_t *node, int dst);
+
+static bc_instr_t *emit(bc_op_t op, unsigned a, unsigned b, unsigned c) {
+    bc_module_t *m = g_bcg.m;
+    if (m->num_instrs == g_bcg.instrs_capacity) {
+        g_bcg.instrs_capacity = g_bcg.instrs_capacity ? g_bcg.instrs_capacity * 2 : 64;
+        m->instrs = realloc(m->instrs, g_bcg.instrs_capacity * sizeof(bc_instr_t));
+    }
+
+    if (a > 0xffff || b > 0xffff || c > 0xffff)
+        FATAL_ERROR("Program too large for the bytecode backend");
+
+    bc_instr_t *in = &m->instrs[m->num_instrs++];
+    in->op = (u8)op;
+    in->n = 0;
+    in->a = (u16)a;
+    in->b = (u16)b;
+    in->c = (u16)c;
+    return in;
+}
+
+static unsigned alloc_temp(void) {
+    unsigned reg = g_bcg.next_temp++;
+    if (g_bcg.next_temp > g_bcg.m->num_regs)
+        g_bcg.m->num_regs = g_bcg.next_temp;
+    return reg;
+}
+
+static unsigned add_const(u64 val) {
+    bc_module_t *m = g_bcg.m;
+    for (unsigned i = 0; i < m->num_consts; i++) {
+        if (m->consts[i] == val)
+            return i;
+    }
+
+    if (m->num_consts == g_bcg.consts_capacity) {
+        g_bcg.consts_capacity = g_bcg.consts_capacity ? g_bcg.consts_capacity * 2 : 16;
+        m->consts = realloc(m->consts, g_bcg.consts_capacity * sizeof(u64));
+    }
+    m->consts[m->num_consts] = val;
+    return m->num_consts++;
+}
+
+static unsigned add_string(strview_t const *str) {
+    bc_module_t *m = g_bcg.m;
+    for (unsigned i = 0; i < m->num_strings; i++) {
+        if (strview_cmp_cstr(str, m->strings[i]))
+            return i;
+    }
+
+    if (m->num_strings == g_bcg.strings_capacity) {
+        g_bcg.strings_capacity = g_bcg.strings_capacity ? g_bcg.strings_capacity * 2 : 8;
+        m->strings = realloc(m->strings, g_bcg.strings_capacity * sizeof(char *));
+    }
+    char *copy = malloc(str->len + 1);
+    memcpy(copy, str->data, str->len);
+    copy[str->len] = '\0';
+    m->strings[m->num_strings] = copy;
+    return m->num_strings++;
+}
+
+// Returns the register of a scalar, or the index of an array.
+static unsigned get_slot(strview_t *name, derived_type_t **type) {
+    *type = lscope_get(name);
+    void *slot = hashtab_get(&g_bcg.slots, name);
+    if (!*type || !slot)
+        FATAL_ERROR("Couldn't find storage for variable '%.*s'", (int)name->len, name->data);
+    return (unsigned)((uintptr_t)slot - 1);
+}
+
+static unsigned get_array(ast_node_t *ident) {
+    derived_type_t *type;
+    assert(ident->type == NODE_IDENTIFIER);
+    unsigned idx = get_slot(&ident->identifier.name, &type);
+    if (!type->is_array)
+        FATAL_ERROR("'%.*s' is not an array",
+                    (int)ident->identifier.name.len, ident->identifier.name.data);
+    return idx;
+}
+
+static void find_vars(ast_node_t *node) {
+    switch (node->type) {
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_vars(node->block.statements.data[i]);
+        break;
+    case NODE_WHILE:
+        find_vars(node->while_loop.block);
+        break;
+    case NODE_IF:
+        find_vars(node->if_stmt.then_block);
+        if (node->if_stmt.else_block)
+            find_vars(node->if_stmt.else_block);
+        break;
+    case NODE_VARIABLE_DECLARATION: {
+            bc_module_t *m = g_bcg.m;
+            derived_type_t const *type = &node->var_decl.type_info;
+            unsigned slot;
+            if (type->object_type.num_lanes > 1)
+                FATAL_ERROR("The bytecode backend does not support SIMD vectors");
+
+            if (type->is_array) {
+                unsigned elem_num_bytes = type->object_type.num_bytes;
+                if (elem_num_bytes != 1 && elem_num_bytes != 8)
+                    FATAL_ERROR("Arrays of %u byte elements are not supported", elem_num_bytes);
+                slot = m->num_arrays++;
+                m->array_elem_num_bytes = realloc(m->array_elem_num_bytes, m->num_arrays);
+                m->array_elem_num_bytes[slot] = (u8)elem_num_bytes;
+            }
+            else {
+                slot = g_bcg.num_var_regs++;
+            }
+            hashtab_put(&g_bcg.slots, &node->var_decl.identifier_name, (void *)(uintptr_t)(slot + 1));
+            break;
+        }
+    default:
+        break;
+    }
+}
+
+// True if evaluating 'node' can change the value of a scalar variable.
+static bool contains_assignment(ast_node_t *node) {
+    switch (node->type) {
+    case NODE_ASSIGNMENT:
+        return true;
+    case NODE_BINARY_OP:
+    case NODE_COMPARE:
+        return contains_assignment(node->binary_op.left) || contains_assignment(node->binary_op.right);
+    case NODE_UNARY_OP:
+        return contains_assignment(node->unary_op.operand);
+    case NODE_INDEX:
+        return contains_assignment(node->index.index);
+    case NODE_FUNCTION_CALL:
+        for (unsigned i = 0; i < node->func_call.parameters.size; i++) {
+            if (contains_assignment(node->func_call.parameters.data[i]))
+                return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+static unsigned dst_or_temp(int dst) {
+    return dst == NO_DST ? alloc_temp() : (unsigned)dst;
+}
+
+// Evaluates 'left' then 'right'. A left operand that lives in a variable's
+// register is copied if 'right' might assign to it.
+static void gen_operands(ast_node_t *left, ast_node_t *right, unsigned *lhs, unsigned *rhs) {
+    *lhs = gen_expr(left, NO_DST);
+    if (*lhs < g_bcg.num_var_regs && contains_assignment(right)) {
+        unsigned copy = alloc_temp();
+        emit(BC_MOV, copy, *lhs, 0);
+        *lhs = copy;
+    }
+    *rhs = gen_expr(right, NO_DST);
+}
+
+static unsigned gen_assignment(ast_node_t *node) {
+    ast_node_t *left = node->assignment.left;
+
+    if (left->type == NODE_INDEX) {
+        unsigned arr = get_array(left->index.array);
+        unsigned val = gen_expr(node->assignment.right, NO_DST);
+        if (val < g_bcg.num_var_regs && contains_assignment(left->index.index)) {
+            unsigned copy = alloc_temp();
+            emit(BC_MOV, copy, val, 0);
+            val = copy;
+        }
+        unsigned idx = gen_expr(left->index.index, NO_DST);
+        emit(BC_ARR_STORE, arr, idx, val);
+        return val;
+    }
+
+    derived_type_t *type;
+    assert(left->type == NODE_IDENTIFIER);
+    unsigned reg = get_slot(&left->identifier.name, &type);
+    if (type->is_array)
+        FATAL_ERROR("Cannot assign to the whole of array '%.*s'",
+                    (int)left->identifier.name.len, left->identifier.name.data);
+
+    // The value of the assignment is the value before truncation, so a u8
+    // can't be the destination of the calculation.
+    if (type->object_type.num_bytes == 1) {
+        unsigned val = gen_expr(node->assignment.right, NO_DST);
+        emit(BC_TRUNC8, reg, val, 0);
+        return val;
+    }
+
+    unsigned val = gen_expr(node->assignment.right, reg);
+    if (val != reg)
+        emit(BC_MOV, reg, val, 0);
+    return reg;
+}
+
+static unsigned gen_function_call(ast_node_t *node, int dst) {
+    strview_t *name = &node->func_call.func_name;
+    darray_t const *params = &node->func_call.parameters;
+    host_func_t const *func = host_funcs_get(name);
+    assert(func);
+
+    switch (func->intrinsic) {
+    case INTRINSIC_NONE: {
+            // The parameters must be in consecutive registers.
+            if (params->size > 4)
+                FATAL_ERROR("%.*s() has too many parameters", (int)name->len, name->data);
+            unsigned first_param = g_bcg.next_temp;
+            for (unsigned i = 0; i < params->size; i++)
+                alloc_temp();
+            for (unsigned i = 0; i < params->size; i++) {
+                unsigned val = gen_expr(params->data[i], first_param + i);
+                if (val != first_param + i)
+                    emit(BC_MOV, first_param + i, val, 0);
+            }
+
+            unsigned rv = dst_or_temp(dst);
+            bc_instr_t *in = emit(BC_CALL, rv, add_string(name), first_param);
+            in->n = (u8)params->size;
+            return rv;
+        }
+    case INTRINSIC_LEN:
+    case INTRINSIC_APPEND:
+    case INTRINSIC_POPCOUNT:
+    case INTRINSIC_CLZ:
+    case INTRINSIC_CTZ:
+        break;
+    default:
+        FATAL_ERROR("%.*s() is not supported by the bytecode backend", (int)name->len, name->data);
+    }
+
+    unsigned expected_num_params = func->intrinsic == INTRINSIC_APPEND ? 2 : 1;
+    if (params->size != expected_num_params)
+        FATAL_ERROR("%.*s() expects %u parameters", (int)name->len, name->data, expected_num_params);
+
+    if (func->intrinsic == INTRINSIC_LEN) {
+        unsigned rv = dst_or_temp(dst);
+        emit(BC_ARR_LEN, rv, get_array(params->data[0]), 0);
+        return rv;
+    }
+
+    if (func->intrinsic == INTRINSIC_APPEND) {
+        unsigned arr = get_array(params->data[0]);
+        unsigned val = gen_expr(params->data[1], NO_DST);
+        emit(BC_ARR_APPEND, arr, val, 0);
+        unsigned rv = dst_or_temp(dst);
+        emit(BC_LOADK, rv, add_const(0), 0);
+        return rv;
+    }
+
+    bc_op_t op = func->intrinsic == INTRINSIC_POPCOUNT ? BC_POPCOUNT :
+                 func->intrinsic == INTRINSIC_CLZ ? BC_CLZ : BC_CTZ;
+    unsigned x = gen_expr(params->data[0], NO_DST);
+    unsigned rv = dst_or_temp(dst);
+    emit(op, rv, x, 0);
+    return rv;
+}
+
+static bc_op_t get_binary_opcode(TokenType op) {
+    switch (op) {
+    case TOKEN_PLUS: return BC_ADD;
+    case TOKEN_MINUS: return BC_SUB;
+    case TOKEN_MULTIPLY: return BC_MUL;
+    case TOKEN_DIVIDE: return BC_DIV;
+    case TOKEN_MODULO: return BC_MOD;
+    case TOKEN_AND: return BC_AND;
+    case TOKEN_OR: return BC_OR;
+    case TOKEN_XOR: return BC_XOR;
+    case TOKEN_SHIFT_LEFT: return BC_SHL;
+    case TOKEN_SHIFT_RIGHT: return BC_SHR;
+    default: FATAL_ERROR("Unknown binary op");
+    }
+}
+
+static void gen_while(ast_node_t *node) {
+    unsigned start_of_condition = g_bcg.m->num_instrs;
+    unsigned temps_outside = g_bcg.next_temp;
+
+    unsigned cond = gen_expr(node->while_loop.condition_expr, NO_DST);
+    unsigned jz_end = g_bcg.m->num_instrs;
+    emit(BC_JZ, cond, 0, 0);
+    g_bcg.next_temp = temps_outside;
+
+    gen_expr(node->while_loop.block, NO_DST);
+
+    bc_set_target(emit(BC_JMP, 0, 0, 0), start_of_condition);
+    bc_set_target(&g_bcg.m->instrs[jz_end], g_bcg.m->num_instrs);
+}
+
+static void gen_if(ast_node_t *node) {
+    unsigned temps_outside = g_bcg.next_temp;
+
+    unsigned cond = gen_expr(node->if_stmt.condition_expr, NO_DST);
+    unsigned jz_else = g_bcg.m->num_instrs;
+    emit(BC_JZ, cond, 0, 0);
+    g_bcg.next_temp = temps_outside;
+
+    gen_expr(node->if_stmt.then_block, NO_DST);
+    if (!node->if_stmt.else_block) {
+        bc_set_target(&g_bcg.m->instrs[jz_else], g_bcg.m->num_instrs);
+        return;
+    }
+
+    unsigned jmp_end = g_bcg.m->num_instrs;
+    emit(BC_JMP, 0, 0, 0);
+    bc_set_target(&g_bcg.m->instrs[jz_else], g_bcg.m->num_instrs);
+    g_bcg.next_temp = temps_outside;
+    gen_expr(node->if_stmt.else_block, NO_DST);
+    bc_set_target(&g_bcg.m->instrs[jmp_end], g_bcg.m->num_instrs);
+}
+
+// && and || only evaluate the right operand if the left one doesn't decide
+// the result. The result is 0 or 1.
+static unsigned gen_logical_op(ast_node_t *node) {
+    bool is_and = node->compare_op.op == TOKEN_LOGICAL_AND;
+    bc_op_t jump_op = is_and ? BC_JZ : BC_JNZ;
+
+    // A fresh register, because 'dst' might be read by the right operand.
+    unsigned rv = alloc_temp();
+    emit(BC_LOADK, rv, add_const(is_and ? 0 : 1), 0);
+    unsigned lhs = gen_expr(node->compare_op.left, NO_DST);
+    unsigned jump_left = g_bcg.m->num_instrs;
+    emit(jump_op, lhs, 0, 0);
+    unsigned rhs = gen_expr(node->compare_op.right, NO_DST);
+    unsigned jump_right = g_bcg.m->num_instrs;
+    emit(jump_op, rhs, 0, 0);
+    emit(BC_LOADK, rv, add_const(is_and ? 1 : 0), 0);
+
+    bc_set_target(&g_bcg.m->instrs[jump_left], g_bcg.m->num_instrs);
+    bc_set_target(&g_bcg.m->instrs[jump_right], g_bcg.m->num_instrs);
+    return rv;
+}
+
+static unsigned gen_compare(ast_node_t *node, int dst) {
+    unsigned lhs, rhs;
+    TokenType op = node->compare_op.op;
+    if (op == TOKEN_LOGICAL_AND || op == TOKEN_LOGICAL_OR)
+        return gen_logical_op(node);
+
+    gen_operands(node->compare_op.left, node->compare_op.right, &lhs, &rhs);
+    unsigned rv = dst_or_temp(dst);
+    switch (op) {
+    case TOKEN_EQUALS: emit(BC_EQ, rv, lhs, rhs); break;
+    case TOKEN_NOT_EQUALS: emit(BC_NE, rv, lhs, rhs); break;
+    case TOKEN_LESS_THAN: emit(BC_LT, rv, lhs, rhs); break;
+    case TOKEN_LESS_EQUAL: emit(BC_LE, rv, lhs, rhs); break;
+    // a > b is b < a, and a >= b is b <= a.
+    case TOKEN_GREATER_THAN: emit(BC_LT, rv, rhs, lhs); break;
+    case TOKEN_GREATER_EQUAL: emit(BC_LE, rv, rhs, lhs); break;
+    default: FATAL_ERROR("Unknown compare op");
+    }
+    return rv;
+}
+
+// Returns the register that holds the value of the expression. If 'dst' is
+// not NO_DST, the result is computed into it when that avoids a move.
+static unsigned gen_expr(ast_node_t *node, int dst) {
+    unsigned lhs, rhs, rv;
+    derived_type_t *type;
+
+    switch (node->type) {
+    case NODE_NUMBER:
+        rv = dst_or_temp(dst);
+        emit(BC_LOADK, rv, add_const((u64)node->number.int_value), 0);
+        return rv;
+    case NODE_IDENTIFIER:
+        rv = get_slot(&node->identifier.name, &type);
+        if (type->is_array)
+            FATAL_ERROR("Array '%.*s' used where a scalar is expected",
+                        (int)node->identifier.name.len, node->identifier.name.data);
+        return rv;
+    case NODE_ASSIGNMENT:
+        return gen_assignment(node);
+    case NODE_BINARY_OP:
+        gen_operands(node->binary_op.left, node->binary_op.right, &lhs, &rhs);
+        rv = dst_or_temp(dst);
+        emit(get_binary_opcode(node->binary_op.op), rv, lhs, rhs);
+        return rv;
+    case NODE_UNARY_OP: {
+            // -x is 0 - x, and !x is x == 0.
+            unsigned operand = gen_expr(node->unary_op.operand, NO_DST);
+            unsigned zero = alloc_temp();
+            emit(BC_LOADK, zero, add_const(0), 0);
+            rv = dst_or_temp(dst);
+            if (node->unary_op.operator == TOKEN_MINUS)
+                emit(BC_SUB, rv, zero, operand);
+            else
+                emit(BC_EQ, rv, operand, zero);
+            return rv;
+        }
+    case NODE_COMPARE:
+        return gen_compare(node, dst);
+    case NODE_BLOCK:
+        rv = 0;
+        for (unsigned i = 0; i < node->block.statements.size; i++) {
+            g_bcg.next_temp = g_bcg.num_var_regs;
+            rv = gen_expr(node->block.statements.data[i], NO_DST);
+        }
+        return rv;
+    case NODE_STRING_LITERAL: {
+        strview_t const *val = &node->string_literal.val;
+        char *decoded = malloc(val->len + 1);
+        strview_t decoded_sv = { decoded, strview_unescape(val, decoded) };
+        rv = dst_or_temp(dst);
+        emit(BC_LOADS, rv, add_string(&decoded_sv), 0);
+        free(decoded);
+        return rv;
+    }
+    case NODE_FUNCTION_CALL:
+        return gen_function_call(node, dst);
+    case NODE_VARIABLE_DECLARATION:
+        rv = get_slot(&node->var_decl.identifier_name, &type);
+        if (type->is_array) {
+            emit(BC_ARR_CLEAR, rv, 0, 0);
+            rv = alloc_temp();
+            emit(BC_LOADK, rv, add_const(0), 0);
+        }
+        else if (!node->var_decl.skip_zero_init) {
+            emit(BC_LOADK, rv, add_const(0), 0);
+        }
+        return rv;
+    case NODE_WHILE:
+        gen_while(node);
+        rv = alloc_temp();
+        emit(BC_LOADK, rv, add_const(0), 0);
+        return rv;
+    case NODE_IF:
+        gen_if(node);
+        rv = alloc_temp();
+        emit(BC_LOADK, rv, add_const(0), 0);
+        return rv;
+    case NODE_INDEX:
+        lhs = get_array(node->index.array);
+        rhs = gen_expr(node->index.index, NO_DST);
+        rv = dst_or_temp(dst);
+        emit(BC_ARR_LOAD, rv, lhs, rhs);
+        return rv;
+    default:
+        FATAL_ERROR("The bytecode backend does not support node type %d", node->type);
+    }
+}
+
+void bc_gen(ast_node_t *ast, bc_module_t *module) {
+    ceval_run(ast);
+    dse_run(ast);
+
+    memset(&g_bcg, 0, sizeof(g_bcg));
+    memset(module, 0, sizeof(*module));
+    g_bcg.m = module;
+    g_bcg.slots = hashtab_create();
+
+    find_vars(ast);
+    module->num_regs = g_bcg.num_var_regs;
+    g_bcg.next_temp = g_bcg.num_var_regs;
+
+    unsigned rv = gen_expr(ast, NO_DST);
+    if (module->num_regs == 0)
+        alloc_temp(); // An empty program returns r0, which starts as 0.
+    emit(BC_RET, rv, 0, 0);
+
+    hashtab_free(&g_bcg.slots);
+}
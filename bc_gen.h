@@ -0,0 +1,10 @@
+// Lowers the AST to the register based bytecode, for the vm backend.
+
+#pragma once
+
+
+typedef struct _ast_node_t ast_node_t;
+typedef struct _bc_module_t bc_module_t;
+
+
+void bc_gen(ast_node_t *ast, bc_module_t *module);
@@ -0,0 +1,138 @@
+# Measures how the compiler's time and memory scale with the size of its
+# input. Programs from gen_stress.py, from 1K to 10M tokens by default, are
+# compiled with "mortar -compile-only", and the tokenize, parse and codegen
+# times are charted per token against the input size. If the compiler is
+# linear, the time per token stays flat. The script fails if the time per
+# token at the largest size is more than --max-growth times what it is at the
+# reference size, so that superlinear regressions get caught.
+#
+# Usage: python3 bench_scaling.py [--mortar path] [--sizes 1000,10000,...]
+#            [--repeat N] [--max-growth X] [gen_stress.py options]
+
+import argparse
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import gen_stress
+
+PHASES = ['tokenize', 'parse', 'codegen']
+CHART_WIDTH = 40
+
+
+def generate(path, num_tokens, args):
+    gen = gen_stress.Generator(args.vars, args.depth, args.loop_depth, random.Random(args.seed))
+    with open(path, 'w') as out:
+        gen.program(out, num_tokens, None)
+
+
+# Returns { 'tokens': n, 'bytes': n, phase: (ms, peak KB), ... }, keeping the
+# fastest of 'repeat' runs for each phase. Memory doesn't vary between runs.
+# Compile-time evaluation stops when its fuel runs out, which would fold small
+# programs away entirely but only the start of big ones, so it's turned off to
+# keep the work per token the same at every size.
+def measure(mortar, path, repeat):
+    best = {}
+    for _ in range(repeat):
+        p = subprocess.run([mortar, '-compile-only', '-const-eval', '0', '-file', path],
+                           capture_output=True, text=True)
+        if p.returncode != 0:
+            sys.exit('mortar failed on %s:\n%s%s' % (path, p.stdout[-2000:], p.stderr[-2000:]))
+        m = re.search(r'--- Compile times: (\d+) tokens, (\d+) bytes ---', p.stdout)
+        if not m:
+            sys.exit('Unexpected output from mortar:\n' + p.stdout[-2000:])
+        best['tokens'] = int(m.group(1))
+        best['bytes'] = int(m.group(2))
+        for phase in PHASES:
+            m = re.search(r'^\s+%s\s+([\d.]+)\s+(\d+)$' % phase, p.stdout, re.M)
+            ms, peak_kb = float(m.group(1)), int(m.group(2))
+            if phase not in best or ms < best[phase][0]:
+                best[phase] = (ms, peak_kb)
+    return best
+
+
+def ns_per_token(result, phase):
+    return result[phase][0] * 1e6 / max(result['tokens'], 1)
+
+
+def print_table(results):
+    print('%10s %12s' % ('tokens', 'bytes'), end='')
+    for phase in PHASES:
+        print(' %12s %9s' % (phase + ' ms', 'ns/tok'), end='')
+    print(' %10s' % 'peak MB')
+    for r in results:
+        print('%10d %12d' % (r['tokens'], r['bytes']), end='')
+        for phase in PHASES:
+            print(' %12.3f %9.1f' % (r[phase][0], ns_per_token(r, phase)), end='')
+        print(' %10.1f' % (r['codegen'][1] / 1024))
+
+
+# One bar per size, scaled to the biggest value of the phase, so a flat column
+# of bars means linear scaling.
+def print_chart(results):
+    for phase in PHASES:
+        values = [ns_per_token(r, phase) for r in results]
+        top = max(values) or 1.0
+        print('\n%s, ns per token' % phase)
+        for r, v in zip(results, values):
+            print('%10d |%-*s %.1f' % (r['tokens'], CHART_WIDTH, '#' * max(1, round(v / top * CHART_WIDTH)), v))
+
+    print('\npeak memory, bytes per token')
+    values = [r['codegen'][1] * 1024 / max(r['tokens'], 1) for r in results]
+    top = max(values) or 1.0
+    for r, v in zip(results, values):
+        print('%10d |%-*s %.1f' % (r['tokens'], CHART_WIDTH, '#' * max(1, round(v / top * CHART_WIDTH)), v))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Chart how compile time scales with input size.')
+    parser.add_argument('--mortar', default='./mortar', help='path of the mortar binary (default ./mortar)')
+    parser.add_argument('--sizes', default='1000,10000,100000,1000000,10000000',
+                        help='comma separated token counts')
+    parser.add_argument('--reference', type=int, default=10000,
+                        help='size that the largest is compared with (default 10000)')
+    parser.add_argument('--repeat', type=int, default=3, help='runs per size, keeping the fastest (default 3)')
+    parser.add_argument('--max-growth', type=float, default=3.0,
+                        help='fail if the time per token grows by more than this (default 3)')
+    parser.add_argument('--vars', type=int, default=16)
+    parser.add_argument('--depth', type=int, default=3)
+    parser.add_argument('--loop-depth', type=int, default=2)
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+    sizes = sorted(int(s) for s in args.sizes.split(','))
+
+    results = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for size in sizes:
+            path = os.path.join(tmp, 'stress_%d.mtr' % size)
+            generate(path, size, args)
+            print('Compiling %d tokens...' % size, file=sys.stderr)
+            results.append(measure(args.mortar, path, args.repeat))
+            os.remove(path)
+
+    print_table(results)
+    print_chart(results)
+
+    # Small inputs are dominated by fixed costs, so compare with the reference
+    # size rather than the smallest.
+    reference = next((r for r, s in zip(results, sizes) if s >= args.reference), results[0])
+    largest = results[-1]
+    failed = False
+    print()
+    for phase in PHASES:
+        growth = ns_per_token(largest, phase) / max(ns_per_token(reference, phase), 1e-9)
+        verdict = 'ok'
+        if growth > args.max_growth:
+            verdict = 'SUPERLINEAR'
+            failed = True
+        print('%-10s %6.2fx from %d to %d tokens  %s' %
+              (phase, growth, reference['tokens'], largest['tokens'], verdict))
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
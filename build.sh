@@ -4,17 +4,40 @@ set -e
 
 srcs="
     assembler.c
+    bc_gen.c
+    bytecode.c
     code_gen.c
+    code_heap.c
+    const_eval.c
     darray.c
+    dead_store.c
+    disasm.c
+    frame_layout.c
+    gvn.c
     hash_table.c
+    host_funcs.c
+    interp.c
     lexical_scope.c
+    licm.c
+    listing.c
+    loop_info.c
     main.c
+    mem_usage.c
     parser.c
+    profile.c
+    repl.c
+    runtime.c
+    safepoint.c
+    sampler.c
+    source_file.c
+    source_pos.c
     stack_frame.c
     strview.c
+    target.c
     time.c
     tokenizer.c
     types.c
+    vm.c
 "
 
 if [ ! -d obj ]; then
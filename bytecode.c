@@ -0,0 +1,209 @@
+// Own header
+#include "bytecode.h"
+
+// Standard headers
+#include <stdlib.h>
+#include <string.h>
+
+
+// The on-disk form is a header followed by each of the module's tables, in
+// the order they are declared in bc_module_t. Integers are little endian.
+//
+//     u32 magic, u32 version
+//     u32 num_instrs, bc_instr_t instrs[num_instrs]
+//     u32 num_regs
+//     u32 num_arrays, u8 array_elem_num_bytes[num_arrays]
+//     u32 num_consts, u64 consts[num_consts]
+//     u32 num_strings, { u32 len, char data[len] } strings[num_strings]
+
+enum {
+    BC_MAGIC = 0x3143424d, // "MBC1"
+    BC_VERSION = 3,
+    BC_MAX_TABLE_SIZE = 1 << 24 // Stops a corrupt file from asking for a huge allocation.
+};
+
+
+static char const *const g_op_names[BC_NUM_OPS] = {
+    "loadk", "loads", "mov", "trunc8", "add", "sub", "mul", "div", "mod", "and", "or",
+    "xor", "shl", "shr", "eq", "ne", "lt", "le", "popcount", "clz", "ctz",
+    "jmp", "jz", "jnz", "arr_clear", "arr_len", "arr_load", "arr_store", "arr_append", "call", "ret"
+};
+
+
+void bc_set_target(bc_instr_t *instr, unsigned target) {
+    instr->b = (u16)target;
+    instr->c = (u16)(target >> 16);
+}
+
+void bc_free(bc_module_t *module) {
+    for (unsigned i = 0; i < module->num_strings; i++)
+        free(module->strings[i]);
+    free(module->strings);
+    free(module->instrs);
+    free(module->array_elem_num_bytes);
+    free(module->consts);
+    memset(module, 0, sizeof(*module));
+}
+
+bool bc_validate(bc_module_t const *m) {
+    for (unsigned i = 0; i < m->num_arrays; i++) {
+        if (m->array_elem_num_bytes[i] != 1 && m->array_elem_num_bytes[i] != 8)
+            return false;
+    }
+
+    for (unsigned i = 0; i < m->num_instrs; i++) {
+        bc_instr_t const *in = &m->instrs[i];
+        bool ok;
+        switch (in->op) {
+        case BC_LOADK:
+            ok = in->a < m->num_regs && in->b < m->num_consts;
+            break;
+        case BC_LOADS:
+            ok = in->a < m->num_regs && in->b < m->num_strings;
+            break;
+        case BC_MOV: case BC_TRUNC8: case BC_POPCOUNT: case BC_CLZ: case BC_CTZ:
+            ok = in->a < m->num_regs && in->b < m->num_regs;
+            break;
+        case BC_ADD: case BC_SUB: case BC_MUL: case BC_DIV: case BC_MOD:
+        case BC_AND: case BC_OR: case BC_XOR: case BC_SHL: case BC_SHR:
+        case BC_EQ: case BC_NE: case BC_LT: case BC_LE:
+            ok = in->a < m->num_regs && in->b < m->num_regs && in->c < m->num_regs;
+            break;
+        case BC_JMP:
+            ok = BC_GET_TARGET(in) < m->num_instrs;
+            break;
+        case BC_JZ: case BC_JNZ:
+            ok = in->a < m->num_regs && BC_GET_TARGET(in) < m->num_instrs;
+            break;
+        case BC_ARR_CLEAR:
+            ok = in->a < m->num_arrays;
+            break;
+        case BC_ARR_LEN:
+            ok = in->a < m->num_regs && in->b < m->num_arrays;
+            break;
+        case BC_ARR_LOAD:
+            ok = in->a < m->num_regs && in->b < m->num_arrays && in->c < m->num_regs;
+            break;
+        case BC_ARR_STORE:
+            ok = in->a < m->num_arrays && in->b < m->num_regs && in->c < m->num_regs;
+            break;
+        case BC_ARR_APPEND:
+            ok = in->a < m->num_arrays && in->b < m->num_regs;
+            break;
+        case BC_CALL:
+            ok = in->a < m->num_regs && in->b < m->num_strings && in->n <= 4 &&
+                 (unsigned)in->c + in->n <= m->num_regs;
+            break;
+        case BC_RET:
+            ok = in->a < m->num_regs;
+            break;
+        default:
+            ok = false;
+        }
+
+        if (!ok)
+            return false;
+    }
+
+    // The vm doesn't check for running off the end.
+    return m->num_instrs > 0 && m->instrs[m->num_instrs - 1].op == BC_RET;
+}
+
+static bool write_u32(u32 val, FILE *f) {
+    return fwrite(&val, 4, 1, f) == 1;
+}
+
+bool bc_write(bc_module_t const *m, FILE *f) {
+    bool ok = write_u32(BC_MAGIC, f) && write_u32(BC_VERSION, f);
+
+    ok = ok && write_u32(m->num_instrs, f);
+    ok = ok && fwrite(m->instrs, sizeof(bc_instr_t), m->num_instrs, f) == m->num_instrs;
+    ok = ok && write_u32(m->num_regs, f);
+    ok = ok && write_u32(m->num_arrays, f);
+    ok = ok && fwrite(m->array_elem_num_bytes, 1, m->num_arrays, f) == m->num_arrays;
+    ok = ok && write_u32(m->num_consts, f);
+    ok = ok && fwrite(m->consts, 8, m->num_consts, f) == m->num_consts;
+
+    ok = ok && write_u32(m->num_strings, f);
+    for (unsigned i = 0; ok && i < m->num_strings; i++) {
+        u32 len = (u32)strlen(m->strings[i]);
+        ok = write_u32(len, f) && fwrite(m->strings[i], 1, len, f) == len;
+    }
+
+    return ok;
+}
+
+static bool read_u32(u32 *val, FILE *f) {
+    return fread(val, 4, 1, f) == 1;
+}
+
+// Reads a table size and allocates a table of that many elements.
+static bool read_table(void **table, unsigned *num_elements, size_t element_size, FILE *f) {
+    u32 num;
+    if (!read_u32(&num, f) || num > BC_MAX_TABLE_SIZE)
+        return false;
+
+    *num_elements = num;
+    *table = calloc(num ? num : 1, element_size);
+    return fread(*table, element_size, num, f) == num;
+}
+
+bool bc_read(bc_module_t *m, FILE *f) {
+    u32 magic, version, num_regs;
+    memset(m, 0, sizeof(*m));
+
+    bool ok = read_u32(&magic, f) && magic == BC_MAGIC &&
+              read_u32(&version, f) && version == BC_VERSION;
+
+    ok = ok && read_table((void **)&m->instrs, &m->num_instrs, sizeof(bc_instr_t), f);
+    ok = ok && read_u32(&num_regs, f) && num_regs <= 0x10000;
+    m->num_regs = num_regs;
+    ok = ok && read_table((void **)&m->array_elem_num_bytes, &m->num_arrays, 1, f);
+    ok = ok && read_table((void **)&m->consts, &m->num_consts, 8, f);
+
+    u32 num_strings = 0;
+    ok = ok && read_u32(&num_strings, f) && num_strings <= BC_MAX_TABLE_SIZE;
+    if (ok) {
+        m->strings = calloc(num_strings ? num_strings : 1, sizeof(char *));
+        for (; ok && m->num_strings < num_strings; m->num_strings++) {
+            u32 len;
+            ok = read_u32(&len, f) && len <= BC_MAX_TABLE_SIZE;
+            if (!ok)
+                break;
+            char *str = calloc(len + 1, 1);
+            m->strings[m->num_strings] = str;
+            ok = fread(str, 1, len, f) == len;
+        }
+    }
+
+    ok = ok && bc_validate(m);
+    if (!ok)
+        bc_free(m);
+    return ok;
+}
+
+void bc_print(bc_module_t const *m) {
+    for (unsigned i = 0; i < m->num_instrs; i++) {
+        bc_instr_t const *in = &m->instrs[i];
+        char const *name = in->op < BC_NUM_OPS ? g_op_names[in->op] : "???";
+        printf("%4u: %-10s", i, name);
+        switch (in->op) {
+        case BC_LOADK:
+            printf(" r%u, %llu\n", in->a, (unsigned long long)m->consts[in->b]);
+            break;
+        case BC_LOADS:
+        case BC_CALL:
+            printf(" r%u, \"%s\", r%u, %u\n", in->a, m->strings[in->b], in->c, in->n);
+            break;
+        case BC_JMP:
+            printf(" %u\n", BC_GET_TARGET(in));
+            break;
+        case BC_JZ:
+        case BC_JNZ:
+            printf(" r%u, %u\n", in->a, BC_GET_TARGET(in));
+            break;
+        default:
+            printf(" %u, %u, %u\n", in->a, in->b, in->c);
+        }
+    }
+}
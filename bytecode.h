@@ -0,0 +1,90 @@
+// A register based bytecode, and its on-disk form. Programs in this form are
+// produced by bc_gen and run by the vm module. Unlike the machine code backend,
+// nothing needs to be mapped executable.
+//
+// Each variable and temporary value is a u64 register. Arrays are held apart
+// from the registers and are named by their index in the module's array list.
+
+#pragma once
+
+// This project's headers
+#include "common.h"
+
+// Standard headers
+#include <stdbool.h>
+#include <stdio.h>
+
+
+typedef enum {
+    BC_LOADK,      // r[a] = consts[b]
+    BC_LOADS,      // r[a] = address of strings[b]
+    BC_MOV,        // r[a] = r[b]
+    BC_TRUNC8,     // r[a] = r[b] & 0xff
+    BC_ADD,        // r[a] = r[b] + r[c]
+    BC_SUB,        // r[a] = r[b] - r[c]
+    BC_MUL,        // r[a] = r[b] * r[c]
+    BC_DIV,        // r[a] = r[b] / r[c]
+    BC_MOD,        // r[a] = r[b] % r[c]
+    BC_AND,        // r[a] = r[b] & r[c]
+    BC_OR,         // r[a] = r[b] | r[c]
+    BC_XOR,        // r[a] = r[b] ^ r[c]
+    BC_SHL,        // r[a] = r[b] << (r[c] & 63)
+    BC_SHR,        // r[a] = r[b] >> (r[c] & 63)
+    BC_EQ,         // r[a] = r[b] == r[c]
+    BC_NE,         // r[a] = r[b] != r[c]
+    BC_LT,         // r[a] = r[b] < r[c]
+    BC_LE,         // r[a] = r[b] <= r[c]
+    BC_POPCOUNT,   // r[a] = popcount(r[b])
+    BC_CLZ,        // r[a] = clz(r[b])
+    BC_CTZ,        // r[a] = ctz(r[b])
+    BC_JMP,        // Jump to target
+    BC_JZ,         // If r[a] == 0, jump to target
+    BC_JNZ,        // If r[a] != 0, jump to target
+    BC_ARR_CLEAR,  // arrays[a].size = 0
+    BC_ARR_LEN,    // r[a] = arrays[b].size
+    BC_ARR_LOAD,   // r[a] = arrays[b][r[c]]
+    BC_ARR_STORE,  // arrays[a][r[b]] = r[c]
+    BC_ARR_APPEND, // Append r[b] to arrays[a]
+    BC_CALL,       // r[a] = strings[b](r[c], ... r[c + n - 1]), a host function
+    BC_RET,        // Stop, returning r[a]
+    BC_NUM_OPS
+} bc_op_t;
+
+typedef struct {
+    u8 op;
+    u8 n;  // Number of parameters of a BC_CALL
+    u16 a;
+    u16 b;
+    u16 c;
+} bc_instr_t;
+
+typedef struct _bc_module_t {
+    bc_instr_t *instrs;
+    unsigned num_instrs;
+
+    unsigned num_regs;
+
+    u8 *array_elem_num_bytes; // 1 or 8 for each array
+    unsigned num_arrays;
+
+    u64 *consts;
+    unsigned num_consts;
+
+    char **strings; // Nul terminated string literals and host function names
+    unsigned num_strings;
+} bc_module_t;
+
+
+// Jump targets are instruction indices, split across b and c.
+#define BC_GET_TARGET(instr) ((instr)->b | ((unsigned)(instr)->c << 16))
+void bc_set_target(bc_instr_t *instr, unsigned target);
+
+void bc_free(bc_module_t *module);
+
+// Checks that every operand is in range, so that the vm doesn't need to.
+bool bc_validate(bc_module_t const *module);
+
+bool bc_write(bc_module_t const *module, FILE *f);
+bool bc_read(bc_module_t *module, FILE *f); // Returns false if the file is truncated or invalid.
+
+void bc_print(bc_module_t const *module);
@@ -4,14 +4,28 @@
 // This project's headers
 #include "assembler.h"
 #include "common.h"
+#include "const_eval.h"
+#include "dead_store.h"
+#include "frame_layout.h"
+#include "gvn.h"
+#include "host_funcs.h"
 #include "lexical_scope.h"
+#include "licm.h"
+#include "listing.h"
+#include "loop_info.h"
 #include "parser.h"
+#include "profile.h"
+#include "runtime.h"
+#include "safepoint.h"
 #include "stack_frame.h"
 #include "types.h"
 
 // Standard headers
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 
@@ -20,11 +34,301 @@
 // Everything is promoted to u64 before use in the expression evaluation.
 
 
+// Loop invariant expressions are evaluated once, before the loop, and their
+// results saved in stack temporaries. While generating the loop, each hoisted
+// node is replaced with a load from its temporary.
+
+enum { MAX_HOISTED = 64 };
+
+typedef struct {
+    ast_node_t *node;
+    unsigned offset;
+} hoisted_t;
+
+static hoisted_t g_hoisted[MAX_HOISTED];
+static unsigned g_num_hoisted;
+
+static hoisted_t *find_hoisted(ast_node_t *node) {
+    for (unsigned i = 0; i < g_num_hoisted; i++) {
+        if (g_hoisted[i].node == node)
+            return &g_hoisted[i];
+    }
+    return NULL;
+}
+
+
+// Expressions that value numbering found to be redundant load the result of
+// the first equivalent expression, which saves it in a stack temporary. While
+// generating a loop preheader, redundant expressions are evaluated in full,
+// because the first one might be inside the loop.
+static gvn_result_t g_gvn;
+static unsigned *g_gvn_offsets; // Temporary of each value, or UINT_MAX before it is needed
+static bool g_in_preheader;
+
+static void begin_value_numbering(ast_node_t *root) {
+    gvn_free(&g_gvn);
+    gvn_run(root, &g_gvn);
+    free(g_gvn_offsets);
+    g_gvn_offsets = malloc((g_gvn.num_values ? g_gvn.num_values : 1) * sizeof(unsigned));
+    for (unsigned i = 0; i < g_gvn.num_values; i++)
+        g_gvn_offsets[i] = UINT_MAX;
+}
+
+// Returns the entry if 'node' can load its value from a temporary.
+static gvn_entry_t const *find_reuse(ast_node_t *node) {
+    if (g_in_preheader)
+        return NULL;
+    gvn_entry_t const *entry = gvn_find(&g_gvn, node);
+    return entry && entry->is_reuse ? entry : NULL;
+}
+
+
+// Array headers are allocated and zeroed on function entry and freed on exit,
+// so that an array declared inside a loop reuses its buffer on each iteration.
+static darray_t g_array_decls;
+
+// Run time checks branch to a shared handler for each kind of error, which is
+// emitted after the function body.
+typedef enum {
+    ERROR_INDEX,
+    ERROR_DIVIDE_BY_ZERO,
+    NUM_ERROR_KINDS
+} error_kind_t;
+
+typedef struct {
+    unsigned jcc_offset; // Taken when the check fails
+    error_kind_t kind;
+} error_jump_t;
+
+static error_jump_t *g_error_jumps;
+static unsigned g_num_error_jumps;
+static unsigned g_error_jumps_capacity;
+
+static void add_error_jump(unsigned jcc_offset, error_kind_t kind) {
+    if (g_num_error_jumps == g_error_jumps_capacity) {
+        g_error_jumps_capacity = g_error_jumps_capacity ? g_error_jumps_capacity * 2 : 16;
+        g_error_jumps = realloc(g_error_jumps, g_error_jumps_capacity * sizeof(error_jump_t));
+    }
+    g_error_jumps[g_num_error_jumps].jcc_offset = jcc_offset;
+    g_error_jumps[g_num_error_jumps].kind = kind;
+    g_num_error_jumps++;
+}
+
+// Cold paths are emitted after the function body, so that the hot code is
+// contiguous and the common case of each branch falls through. These are the
+// calls to grow an array in APPEND, which then jump back to redo the check.
+typedef struct {
+    unsigned jae_offset;    // Jump to the grow path, taken when the array is full
+    unsigned resume_offset; // Start of the check
+    unsigned arr_offset;
+    unsigned elem_num_bytes;
+} grow_path_t;
+
+static grow_path_t *g_grow_paths;
+static unsigned g_num_grow_paths;
+static unsigned g_grow_paths_capacity;
+
+static void add_grow_path(grow_path_t const *path) {
+    if (g_num_grow_paths == g_grow_paths_capacity) {
+        g_grow_paths_capacity = g_grow_paths_capacity ? g_grow_paths_capacity * 2 : 16;
+        g_grow_paths = realloc(g_grow_paths, g_grow_paths_capacity * sizeof(grow_path_t));
+    }
+    g_grow_paths[g_num_grow_paths++] = *path;
+}
+
+// String literals are placed in a pool after the function's code, with
+// duplicates merged, and are addressed relative to rip. That keeps the code
+// independent of where it is loaded.
+typedef struct {
+    char *data;           // Decoded and nul terminated
+    unsigned num_bytes;   // Including the nul
+    unsigned code_offset; // Where it is in the pool, once emitted
+} literal_t;
+
+typedef struct {
+    unsigned lea_offset;
+    unsigned literal;
+} literal_ref_t;
+
+static literal_t *g_literals;
+static unsigned g_num_literals;
+static unsigned g_literals_capacity;
+
+static literal_ref_t *g_literal_refs;
+static unsigned g_num_literal_refs;
+static unsigned g_literal_refs_capacity;
+
+// Returns the index of the literal.
+static unsigned add_literal(strview_t const *val) {
+    char *data = malloc(val->len + 1);
+    unsigned num_bytes = (unsigned)strview_unescape(val, data);
+    data[num_bytes++] = '\0';
+    for (unsigned i = 0; i < g_num_literals; i++) {
+        if (g_literals[i].num_bytes == num_bytes && memcmp(g_literals[i].data, data, num_bytes) == 0) {
+            free(data);
+            return i;
+        }
+    }
+
+    if (g_num_literals == g_literals_capacity) {
+        g_literals_capacity = g_literals_capacity ? g_literals_capacity * 2 : 16;
+        g_literals = realloc(g_literals, g_literals_capacity * sizeof(literal_t));
+    }
+    g_literals[g_num_literals].data = data;
+    g_literals[g_num_literals].num_bytes = num_bytes;
+    return g_num_literals++;
+}
+
+static void add_literal_ref(unsigned lea_offset, unsigned literal) {
+    if (g_num_literal_refs == g_literal_refs_capacity) {
+        g_literal_refs_capacity = g_literal_refs_capacity ? g_literal_refs_capacity * 2 : 16;
+        g_literal_refs = realloc(g_literal_refs, g_literal_refs_capacity * sizeof(literal_ref_t));
+    }
+    g_literal_refs[g_num_literal_refs].lea_offset = lea_offset;
+    g_literal_refs[g_num_literal_refs].literal = literal;
+    g_num_literal_refs++;
+}
+
+// Forward jumps to a label that hasn't been emitted yet, eg the exits of a
+// condition made of && and ||.
+typedef struct {
+    unsigned *jcc_offsets;
+    unsigned num, capacity;
+} jump_list_t;
+
+static void jump_list_add(jump_list_t *list, unsigned jcc_offset) {
+    if (list->num == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->jcc_offsets = realloc(list->jcc_offsets, list->capacity * sizeof(unsigned));
+    }
+    list->jcc_offsets[list->num++] = jcc_offset;
+}
+
+// Points every jump in the list at 'target_offset', and frees the list.
+static void jump_list_patch(jump_list_t *list, unsigned target_offset) {
+    for (unsigned i = 0; i < list->num; i++)
+        asm_patch_jcc(list->jcc_offsets[i], target_offset);
+    free(list->jcc_offsets);
+    memset(list, 0, sizeof(*list));
+}
+
+// Loop heads are padded with nops to start on an 'alignment' byte boundary,
+// unless that takes more than 'max_padding' bytes.
+static unsigned g_loop_alignment = 16;
+static unsigned g_loop_max_padding = 15;
+
+// Counted loops are unrolled by 'g_unroll_factor', with a remainder loop for
+// the last few iterations. Loops with a constant trip count are unrolled
+// completely. Either way, the unrolled body may have at most
+// 'g_unroll_max_nodes' AST nodes.
+static unsigned g_unroll_factor = 4;
+static unsigned g_unroll_max_nodes = 128;
+
+// Index nodes that are known to be in bounds in the loop being generated.
+static darray_t const *g_unchecked_indexes;
+
+static bool is_unchecked_index(ast_node_t *node) {
+    if (!g_unchecked_indexes)
+        return false;
+    for (unsigned i = 0; i < g_unchecked_indexes->size; i++) {
+        if (g_unchecked_indexes->data[i] == node)
+            return true;
+    }
+    return false;
+}
+
+
 static void gen_node(ast_node_t *node);
+static void gen_vector_expr(ast_node_t *node, object_type_t const *vtype, unsigned dst_offset);
+
+static bool is_logical_op(ast_node_t *node) {
+    return node->type == NODE_COMPARE && (node->compare_op.op == TOKEN_LOGICAL_AND ||
+                                          node->compare_op.op == TOKEN_LOGICAL_OR);
+}
+
+// Returns the type of a vector valued expression, or NULL if it is a scalar.
+static object_type_t const *get_vector_type(ast_node_t *node) {
+    switch (node->type) {
+    case NODE_IDENTIFIER: {
+            derived_type_t *type = lscope_get(&node->identifier.name);
+            if (type && !type->is_array && type->object_type.num_lanes > 1)
+                return &type->object_type;
+            return NULL;
+        }
+    case NODE_ASSIGNMENT:
+        return get_vector_type(node->assignment.left);
+    case NODE_COMPARE:
+        if (is_logical_op(node))
+            return NULL;
+        // Fall through
+    case NODE_BINARY_OP: {
+            // A scalar operand is broadcast to every lane of the other.
+            object_type_t const *left = get_vector_type(node->binary_op.left);
+            object_type_t const *right = get_vector_type(node->binary_op.right);
+            if (left && right && (left->num_bytes != right->num_bytes ||
+                                  left->num_lanes != right->num_lanes))
+                FATAL_ERROR("Mismatched vector types in expression");
+            return left ? left : right;
+        }
+    default:
+        return NULL;
+    }
+}
+
+// Returns the stack offset of the array's runtime_array_t.
+static unsigned get_array_offset(ast_node_t *ident, unsigned *elem_num_bytes) {
+    assert(ident->type == NODE_IDENTIFIER);
+    derived_type_t *type = lscope_get(&ident->identifier.name);
+    assert(type);
+    if (!type->is_array)
+        FATAL_ERROR("'%.*s' is not an array",
+                    (int)ident->identifier.name.len, ident->identifier.name.data);
+    *elem_num_bytes = type->object_type.num_bytes;
+    return sframe_get_variable_offset(&ident->identifier.name);
+}
+
+// Emits the code to put the index of 'node' in rax and check it.
+static void gen_index_value(ast_node_t *node, unsigned arr_offset) {
+    gen_node(node->index.index);
+    if (is_unchecked_index(node))
+        return;
+
+    unsigned jae_offset = asm_emit_array_bounds_check(arr_offset);
+    add_error_jump(jae_offset, ERROR_INDEX);
+}
+
+// This function is only used to read from an array element.
+static void gen_index(ast_node_t *node) {
+    unsigned elem_num_bytes;
+    unsigned arr_offset = get_array_offset(node->index.array, &elem_num_bytes);
+    gen_index_value(node, arr_offset);
+    asm_emit_array_load(arr_offset, elem_num_bytes);
+}
+
+static void gen_index_assignment(ast_node_t *node) {
+    ast_node_t *left = node->assignment.left;
+    unsigned elem_num_bytes;
+    unsigned arr_offset = get_array_offset(left->index.array, &elem_num_bytes);
+
+    gen_node(node->assignment.right);
+    unsigned value_offset = sframe_add_temp(8);
+    asm_emit_mov_reg_to_stack(REG_RAX, value_offset);
+
+    gen_index_value(left, arr_offset);
+    asm_emit_mov_stack_to_reg(REG_RDX, value_offset);
+    asm_emit_array_store(arr_offset, elem_num_bytes);
+
+    // The value of the assignment expression is the value stored.
+    asm_emit_mov_reg_reg(REG_RAX, REG_RDX);
+}
 
 static void gen_assignment(ast_node_t *node) {
     ast_node_t *right = node->assignment.right;
-    gen_node(right);
+
+    if (node->assignment.left->type == NODE_INDEX) {
+        gen_index_assignment(node);
+        return;
+    }
 
     // Get address of LHS
     ast_node_t *left = node->assignment.left;
@@ -34,6 +338,16 @@ static void gen_assignment(ast_node_t *node) {
     // Get type of LHS
     derived_type_t *type = lscope_get(&left->identifier.name);
     assert(type);
+    if (type->is_array)
+        FATAL_ERROR("Cannot assign to the whole of array '%.*s'",
+                    (int)left->identifier.name.len, left->identifier.name.data);
+
+    if (type->object_type.num_lanes > 1) {
+        gen_vector_expr(right, &type->object_type, offset);
+        return;
+    }
+
+    gen_node(right);
 
     // Copy RAX or AL to that address on the stack.
     if (type->object_type.num_bytes == 1) {
@@ -44,14 +358,78 @@ static void gen_assignment(ast_node_t *node) {
     }
 }
 
+// Evaluating a leaf only writes rax.
+static bool is_leaf(ast_node_t *node) {
+    return node->type == NODE_NUMBER || node->type == NODE_IDENTIFIER || find_hoisted(node) ||
+           find_reuse(node);
+}
+
+// Leaves the value of 'left' in rcx and the value of 'right' in rax.
+static void gen_operands(ast_node_t *left, ast_node_t *right) {
+    gen_node(left);
+    if (is_leaf(right)) {
+        asm_emit_mov_reg_reg(REG_RCX, REG_RAX);
+        gen_node(right);
+        return;
+    }
+
+    // Evaluating 'right' may use rcx, so keep 'left' on the stack.
+    unsigned left_offset = sframe_add_temp(8);
+    asm_emit_mov_reg_to_stack(REG_RAX, left_offset);
+    gen_node(right);
+    asm_emit_mov_stack_to_reg(REG_RCX, left_offset);
+}
+
+static bool is_commutative(TokenType op) {
+    return op == TOKEN_PLUS || op == TOKEN_MULTIPLY ||
+           op == TOKEN_AND || op == TOKEN_OR || op == TOKEN_XOR;
+}
+
 static void gen_binary_op(ast_node_t *node) {
-    gen_node(node->binary_op.left);
-    asm_emit_mov_reg_reg(REG_RCX, REG_RAX);
-    gen_node(node->binary_op.right);
+    if (get_vector_type(node))
+        FATAL_ERROR("Vector value used where a scalar is expected");
+
+    TokenType op = node->binary_op.op;
+    ast_node_t *left = node->binary_op.left;
+    ast_node_t *right = node->binary_op.right;
+
+    // With a constant operand, the assembler can use an immediate form, or
+    // replace a multiply or divide with cheaper instructions. A constant
+    // divisor of 0 is left to the run time check.
+    if (left->type == NODE_NUMBER && is_commutative(op)) {
+        left = node->binary_op.right;
+        right = node->binary_op.left;
+    }
+    if (right->type == NODE_NUMBER) {
+        u64 imm = (u64)right->number.int_value;
+        if (imm != 0 || (op != TOKEN_DIVIDE && op != TOKEN_MODULO)) {
+            gen_node(left);
+            asm_emit_arithmetic_imm(op, imm);
+            return;
+        }
+    }
+
+    gen_operands(left, right);
 
-    switch (node->binary_op.op) {
+    switch (op) {
     case TOKEN_PLUS:
-        asm_emit_arithmetic(REG_RAX, REG_RCX, node->binary_op.op);
+    case TOKEN_MULTIPLY:
+    case TOKEN_AND:
+    case TOKEN_OR:
+    case TOKEN_XOR:
+        asm_emit_arithmetic(REG_RAX, REG_RCX, op);
+        break;
+    case TOKEN_MINUS:
+        asm_emit_arithmetic(REG_RCX, REG_RAX, op);
+        asm_emit_mov_reg_reg(REG_RAX, REG_RCX);
+        break;
+    case TOKEN_SHIFT_LEFT:
+    case TOKEN_SHIFT_RIGHT:
+        asm_emit_shift(op);
+        break;
+    case TOKEN_DIVIDE:
+    case TOKEN_MODULO:
+        add_error_jump(asm_emit_divide(op), ERROR_DIVIDE_BY_ZERO);
         break;
     default:
         printf("Unknown binary op\n");
@@ -59,10 +437,28 @@ static void gen_binary_op(ast_node_t *node) {
     }
 }
 
+// -x is 0 - x, and !x is 1 if x is 0, else 0.
+static void gen_unary_op(ast_node_t *node) {
+    gen_node(node->unary_op.operand);
+    if (node->unary_op.operator == TOKEN_MINUS) {
+        asm_emit_neg(REG_RAX);
+    }
+    else {
+        asm_emit_test(REG_RAX);
+        asm_emit_setcc(COND_E);
+    }
+}
+
 // This function is only used to read from an identifier.
 static void gen_identifier(ast_node_t *node) {
     derived_type_t *type = lscope_get(&node->identifier.name);
     assert(type);
+    if (type->is_array)
+        FATAL_ERROR("Array '%.*s' used where a scalar is expected",
+                    (int)node->identifier.name.len, node->identifier.name.data);
+    if (type->object_type.num_lanes > 1)
+        FATAL_ERROR("Vector '%.*s' used where a scalar is expected",
+                    (int)node->identifier.name.len, node->identifier.name.data);
     unsigned offset = sframe_get_variable_offset(&node->identifier.name);
     if (type->object_type.num_bytes == 1)
         asm_emit_mov_stack_to_reg(REG_AL, offset);
@@ -70,43 +466,190 @@ static void gen_identifier(ast_node_t *node) {
         asm_emit_mov_stack_to_reg(REG_RAX, offset);
 }
 
+// Returns the stack offset of a slot holding the value of a vector expression.
+static unsigned gen_vector_operand(ast_node_t *node, object_type_t const *vtype) {
+    object_type_t const *node_vtype = get_vector_type(node);
+    if (node->type == NODE_IDENTIFIER && node_vtype)
+        return sframe_get_variable_offset(&node->identifier.name);
+
+    unsigned offset = sframe_add_temp(vtype->num_bytes);
+    gen_vector_expr(node, vtype, offset);
+    return offset;
+}
+
+// Evaluates a vector expression into the stack slot at dst_offset.
+static void gen_vector_expr(ast_node_t *node, object_type_t const *vtype, unsigned dst_offset) {
+    unsigned lane_num_bytes = vtype->num_bytes / vtype->num_lanes;
+    object_type_t const *node_vtype = get_vector_type(node);
+
+    if (!node_vtype) {
+        // A scalar. Broadcast it to every lane.
+        gen_node(node);
+        asm_emit_vec_splat(dst_offset, vtype->num_bytes, lane_num_bytes);
+        return;
+    }
+
+    if (node_vtype->num_bytes != vtype->num_bytes || node_vtype->num_lanes != vtype->num_lanes)
+        FATAL_ERROR("Mismatched vector types in assignment");
+
+    switch (node->type) {
+    case NODE_IDENTIFIER:
+        asm_emit_vec_copy(dst_offset, sframe_get_variable_offset(&node->identifier.name),
+                          vtype->num_bytes);
+        break;
+    case NODE_ASSIGNMENT:
+        gen_assignment(node);
+        gen_vector_expr(node->assignment.left, vtype, dst_offset);
+        break;
+    case NODE_BINARY_OP:
+    case NODE_COMPARE: {
+            TokenType op = node->binary_op.op;
+            if (op != TOKEN_PLUS && op != TOKEN_MINUS && op != TOKEN_AND && op != TOKEN_OR &&
+                op != TOKEN_XOR && op != TOKEN_EQUALS && op != TOKEN_NOT_EQUALS)
+                FATAL_ERROR("Operator %s is not supported on vectors", tokenizer_get_name_from_type(op));
+
+            // Comparisons produce a mask with all bits of each matching lane set.
+            unsigned lhs_offset = gen_vector_operand(node->binary_op.left, vtype);
+            unsigned rhs_offset = gen_vector_operand(node->binary_op.right, vtype);
+            asm_emit_vec_binary_op(node->binary_op.op, dst_offset, lhs_offset, rhs_offset,
+                                   vtype->num_bytes, lane_num_bytes);
+            break;
+        }
+    default:
+        printf("gen_vector_expr() unknown type\n");
+        DBG_BREAK();
+    }
+}
+
+// All values are unsigned.
+static asm_cond_t get_compare_cond(TokenType op) {
+    switch (op) {
+    case TOKEN_EQUALS: return COND_E;
+    case TOKEN_NOT_EQUALS: return COND_NE;
+    case TOKEN_LESS_THAN: return COND_B;
+    case TOKEN_LESS_EQUAL: return COND_BE;
+    case TOKEN_GREATER_THAN: return COND_A;
+    case TOKEN_GREATER_EQUAL: return COND_AE;
+    default: FATAL_ERROR("Unknown compare op");
+    }
+}
+
+// The conditions come in pairs that differ only in the bottom bit.
+static asm_cond_t invert_cond(asm_cond_t cond) {
+    return (asm_cond_t)(cond ^ 1);
+}
+
+// Compares the operands of a relational operator, and returns the condition
+// code that is set in the flags when the comparison is true.
+static asm_cond_t gen_compare_flags(ast_node_t *node) {
+    TokenType op = node->compare_op.op;
+    object_type_t const *vtype = get_vector_type(node);
+    if (!vtype) {
+        gen_operands(node->compare_op.left, node->compare_op.right);
+        asm_emit_cmp_imm(REG_RAX, REG_RCX);
+        return get_compare_cond(op);
+    }
+
+    // Sets the flags as if the whole vectors were compared.
+    if (op != TOKEN_EQUALS && op != TOKEN_NOT_EQUALS)
+        FATAL_ERROR("Operator %s is not supported on vectors", tokenizer_get_name_from_type(op));
+    unsigned lhs_offset = gen_vector_operand(node->compare_op.left, vtype);
+    unsigned rhs_offset = gen_vector_operand(node->compare_op.right, vtype);
+    asm_emit_vec_cmp(lhs_offset, rhs_offset, vtype->num_bytes);
+    return op == TOKEN_EQUALS ? COND_E : COND_NE;
+}
+
+// Emits the code to evaluate 'node' as a condition, and returns the condition
+// code that is set in the flags when it is true. A comparison only needs the
+// flags, not a 0 or 1 in rax.
+static asm_cond_t gen_flags(ast_node_t *node) {
+    if (node->type != NODE_COMPARE || is_logical_op(node) || find_hoisted(node)) {
+        gen_node(node);
+        asm_emit_test(REG_RAX);
+        return COND_NE;
+    }
+
+    listing_pos_t outer = listing_enter(node, false);
+    asm_cond_t cond = gen_compare_flags(node);
+    listing_leave(outer);
+    return cond;
+}
+
+// Emits a jump, added to 'jumps', that is taken if the condition is
+// 'jump_if', and falls through otherwise. && and || only evaluate their right
+// operand if the left one doesn't decide the result.
+static void gen_cond_jump(ast_node_t *node, bool jump_if, jump_list_t *jumps) {
+    if (!is_logical_op(node) || find_hoisted(node)) {
+        asm_cond_t cond = gen_flags(node);
+        jump_list_add(jumps, g_assembler.binary_size);
+        asm_emit_jcc(jump_if ? cond : invert_cond(cond), 0);
+        return;
+    }
+
+    listing_pos_t outer = listing_enter(node, false);
+    bool is_and = node->compare_op.op == TOKEN_LOGICAL_AND;
+    if (is_and != jump_if) {
+        // (a && b) is false if either is false, (a || b) is true if either is.
+        gen_cond_jump(node->compare_op.left, jump_if, jumps);
+        gen_cond_jump(node->compare_op.right, jump_if, jumps);
+    }
+    else {
+        // The left operand decides the result only if it goes the other way.
+        jump_list_t skip = { 0 };
+        gen_cond_jump(node->compare_op.left, !jump_if, &skip);
+        gen_cond_jump(node->compare_op.right, jump_if, jumps);
+        jump_list_patch(&skip, g_assembler.binary_size);
+    }
+    listing_leave(outer);
+}
+
 static void gen_compare(ast_node_t *node) {
-    gen_node(node->compare_op.left);
-    asm_emit_mov_reg_reg(REG_RCX, REG_RAX);
-    gen_node(node->compare_op.right);
-    asm_emit_cmp_imm(REG_RAX, REG_RCX);
+    if (!is_logical_op(node)) {
+        asm_emit_setcc(gen_compare_flags(node));
+        return;
+    }
+
+    // The right operand decides the result when it's evaluated at all.
+    bool is_and = node->compare_op.op == TOKEN_LOGICAL_AND;
+    jump_list_t decided = { 0 };
+    gen_cond_jump(node->compare_op.left, !is_and, &decided);
+    asm_emit_setcc(gen_flags(node->compare_op.right));
+    unsigned jmp_end_offset = g_assembler.binary_size;
+    asm_emit_jmp_imm(0);
+    jump_list_patch(&decided, g_assembler.binary_size);
+    asm_emit_mov_imm_64(REG_RAX, is_and ? 0 : 1);
+    asm_patch_jmp(jmp_end_offset, g_assembler.binary_size);
 }
 
+static void gen_while_loop(ast_node_t *node, ast_node_t *prev_statement);
+
 static void gen_block(ast_node_t *node) {
     for (unsigned i = 0; i < node->block.statements.size; i++) {
-        gen_node(node->block.statements.data[i]);
+        ast_node_t *statement = node->block.statements.data[i];
+        asm_set_source_pos(statement->source_offset);
+        listing_pos_t outer = listing_enter(statement, true);
+        // Loops look at the statement before them to find their start value.
+        if (statement->type == NODE_WHILE)
+            gen_while_loop(statement, i > 0 ? node->block.statements.data[i - 1] : NULL);
+        else
+            gen_node(statement);
+        listing_leave(outer);
     }
 }
 
 static void gen_string_literal(ast_node_t *node) {
     // Put string_addr in rax
-    asm_emit_mov_imm_64(REG_RAX, (u64)"Hello");// node->string_literal.val.data);
+    unsigned literal = add_literal(&node->string_literal.val);
+    add_literal_ref(asm_emit_lea_rip(REG_RAX), literal);
 }
 
-static void gen_function_call(ast_node_t *node) {
-    assert(node->type == NODE_FUNCTION_CALL);
-
-    // Visit each child node. Each visit will result in an integer/pointer on the stack.
-    assert(node->func_call.parameters.size <= 4);
-    asm_reg_t dst_reg = REG_RCX;
-    for (unsigned i = 0; i < node->func_call.parameters.size; i++) {
-        gen_node(node->func_call.parameters.data[i]);
-        // todo
-        // Get parameters from the stack and into registers RCX, RDX, R8, R9.
-//         asm_emit_mov_reg_reg(dst_reg, REG_RAX);
-        dst_reg++;
-    }
-
+// Calls a host function. Its parameters must already be in registers.
+static void gen_host_call(void *addr) {
     // Allocate 32-byte stack shadow space
     asm_emit_stack_alloc(32);
 
     // Put address of func to call in rax
-    asm_emit_mov_imm_64(REG_RAX, (u64)puts);
+    asm_emit_mov_imm_64(REG_RAX, (u64)addr);
 
     // call rax
     asm_emit_call_rax();
@@ -115,33 +658,657 @@ static void gen_function_call(ast_node_t *node) {
     asm_emit_stack_dealloc(32);
 }
 
+static void gen_append(ast_node_t *arr, ast_node_t *value) {
+    unsigned elem_num_bytes;
+    unsigned arr_offset = get_array_offset(arr, &elem_num_bytes);
+
+    gen_node(value);
+    unsigned value_offset = sframe_add_temp(8);
+    asm_emit_mov_reg_to_stack(REG_RAX, value_offset);
+
+    // Only call into the runtime if the array is full. After it grows the
+    // array, the grow path comes back and redoes the check to get the size
+    // into ecx.
+    grow_path_t path;
+    path.resume_offset = g_assembler.binary_size;
+    path.jae_offset = asm_emit_array_has_space(arr_offset);
+    path.arr_offset = arr_offset;
+    path.elem_num_bytes = elem_num_bytes;
+    add_grow_path(&path);
+
+    asm_emit_mov_stack_to_reg(REG_RDX, value_offset);
+    asm_emit_array_push(arr_offset, elem_num_bytes);
+    asm_emit_mov_imm_64(REG_RAX, 0);
+}
+
+static void gen_array_intrinsic(ast_node_t *node, intrinsic_t intrinsic) {
+    strview_t const *name = &node->func_call.func_name;
+    darray_t const *params = &node->func_call.parameters;
+    unsigned expected_num_params = intrinsic == INTRINSIC_APPEND ? 2 : 1;
+    if (params->size != expected_num_params)
+        FATAL_ERROR("%.*s() expects %u parameters", (int)name->len, name->data, expected_num_params);
+
+    ast_node_t *arr = params->data[0];
+    if (arr->type != NODE_IDENTIFIER)
+        FATAL_ERROR("%.*s() expects an array variable", (int)name->len, name->data);
+
+    if (intrinsic == INTRINSIC_APPEND) {
+        gen_append(arr, params->data[1]);
+    }
+    else {
+        unsigned elem_num_bytes;
+        asm_emit_array_len(get_array_offset(arr, &elem_num_bytes));
+    }
+}
+
+static void gen_bit_count_intrinsic(ast_node_t *node, intrinsic_t intrinsic) {
+    strview_t const *name = &node->func_call.func_name;
+    darray_t const *params = &node->func_call.parameters;
+    if (params->size != 1)
+        FATAL_ERROR("%.*s() expects 1 parameter", (int)name->len, name->data);
+
+    gen_node(params->data[0]);
+    switch (intrinsic) {
+    case INTRINSIC_POPCOUNT: asm_emit_popcount(); break;
+    case INTRINSIC_CLZ: asm_emit_clz(); break;
+    case INTRINSIC_CTZ: asm_emit_ctz(); break;
+    default: DBG_BREAK();
+    }
+}
+
+static void gen_intrinsic(ast_node_t *node, intrinsic_t intrinsic) {
+    strview_t const *name = &node->func_call.func_name;
+    darray_t const *params = &node->func_call.parameters;
+    switch (intrinsic) {
+    case INTRINSIC_LEN:
+    case INTRINSIC_APPEND:
+        gen_array_intrinsic(node, intrinsic);
+        return;
+    case INTRINSIC_POPCOUNT:
+    case INTRINSIC_CLZ:
+    case INTRINSIC_CTZ:
+        gen_bit_count_intrinsic(node, intrinsic);
+        return;
+    default:
+        break;
+    }
+
+    unsigned expected_num_params = intrinsic == INTRINSIC_LANE ? 2 : 1;
+    if (params->size != expected_num_params)
+        FATAL_ERROR("%.*s() expects %u parameters", (int)name->len, name->data, expected_num_params);
+
+    ast_node_t *vec = params->data[0];
+    object_type_t const *vtype = get_vector_type(vec);
+    if (!vtype)
+        FATAL_ERROR("%.*s() expects a vector", (int)name->len, name->data);
+
+    unsigned offset = gen_vector_operand(vec, vtype);
+    unsigned lane_num_bytes = vtype->num_bytes / vtype->num_lanes;
+
+    switch (intrinsic) {
+    case INTRINSIC_LANE: {
+            ast_node_t *idx = params->data[1];
+            if (idx->type != NODE_NUMBER || idx->number.int_value < 0 ||
+                (unsigned)idx->number.int_value >= vtype->num_lanes)
+                FATAL_ERROR("lane() index must be a constant from 0 to %u", vtype->num_lanes - 1);
+
+            // Lane i is i elements from the lowest address of the vector.
+            unsigned lane = idx->number.int_value;
+            unsigned lane_offset = offset + vtype->num_bytes - (lane + 1) * lane_num_bytes;
+            asm_emit_mov_stack_to_reg(lane_num_bytes == 1 ? REG_AL : REG_RAX, lane_offset);
+            break;
+        }
+    case INTRINSIC_HSUM:
+        asm_emit_vec_hsum(offset, vtype->num_bytes, lane_num_bytes);
+        break;
+    case INTRINSIC_MOVEMASK:
+        asm_emit_vec_movemask(offset, vtype->num_bytes, lane_num_bytes);
+        break;
+    default:
+        DBG_BREAK();
+    }
+}
+
+static void gen_function_call(ast_node_t *node) {
+    assert(node->type == NODE_FUNCTION_CALL);
+
+    host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+    assert(func);
+    if (func->intrinsic != INTRINSIC_NONE) {
+        gen_intrinsic(node, func->intrinsic);
+        return;
+    }
+
+    // Evaluating an argument can clobber rcx and rdx, so each one is saved in
+    // a temporary, and they are all loaded into rcx, rdx, r8 and r9 at the end.
+    unsigned num_args = node->func_call.parameters.size;
+    unsigned arg_offsets[4];
+    assert(num_args <= 4);
+    for (unsigned i = 0; i < num_args; i++) {
+        gen_node(node->func_call.parameters.data[i]);
+        arg_offsets[i] = sframe_add_temp(8);
+        asm_emit_mov_reg_to_stack(REG_RAX, arg_offsets[i]);
+    }
+    for (unsigned i = 0; i < num_args; i++)
+        asm_emit_load_call_arg(i, arg_offsets[i]);
+
+    u64 *calls = profile_get_counter(node, PROFILE_COUNTER_ENTRIES);
+    if (calls)
+        asm_emit_inc_counter(calls);
+    gen_host_call((void *)func->addr);
+}
+
 static void gen_variable_declaration(ast_node_t *node) {
-    unsigned num_bytes;
-    if (node->var_decl.type_info.is_array)
-        num_bytes = sizeof(darray_t);
-    else
-        num_bytes = node->var_decl.type_info.object_type.num_bytes;
+    if (node->var_decl.type_info.is_array) {
+        // The header was allocated on function entry.
+        asm_emit_array_clear(sframe_get_variable_offset(&node->var_decl.identifier_name));
+        return;
+    }
 
-    unsigned offset = sframe_add_variable(&node->var_decl.identifier_name, num_bytes);
-    asm_emit_zero_stack_range(offset, num_bytes);
+    // The slot already exists if this code is being generated a second time,
+    // eg by loop versioning.
+    unsigned num_bytes = node->var_decl.type_info.object_type.num_bytes;
+    unsigned offset;
+    if (!sframe_find_variable(&node->var_decl.identifier_name, &offset))
+        offset = sframe_add_variable(&node->var_decl.identifier_name, num_bytes);
+    if (!node->var_decl.skip_zero_init && !node->var_decl.zeroed_on_entry)
+        asm_emit_zero_stack_range(offset, num_bytes);
 }
 
-static void gen_while_loop(ast_node_t *node) {
+static void gen_loop_preheader(ast_node_t *node) {
+    darray_t invariants = { 0 };
+    licm_find_invariants(node, &invariants);
+
+    for (unsigned i = 0; i < invariants.size && g_num_hoisted < MAX_HOISTED; i++) {
+        ast_node_t *expr = invariants.data[i];
+        if (find_hoisted(expr))
+            continue; // Already hoisted by an enclosing loop.
+        if (get_vector_type(expr))
+            continue; // Temporaries only hold scalars.
+
+        g_in_preheader = true;
+        gen_node(expr);
+        g_in_preheader = false;
+        unsigned offset = sframe_add_temp(8);
+        asm_emit_mov_reg_to_stack(REG_RAX, offset);
+        g_hoisted[g_num_hoisted].node = expr;
+        g_hoisted[g_num_hoisted].offset = offset;
+        g_num_hoisted++;
+    }
+
+    darray_free(&invariants);
+}
+
+// Only emitted once the host has enabled safepoints, so that code that can't
+// be stopped doesn't pay for them.
+static void gen_safepoint_poll(void) {
+    if (safepoint_is_enabled())
+        asm_emit_safepoint_poll(g_safepoint_poll_word);
+}
+
+static void gen_loop(ast_node_t *node) {
+    // The padding is executed once, on the way in.
+    asm_emit_align(g_loop_alignment, g_loop_max_padding);
     unsigned start_of_condition = g_assembler.binary_size;
+    asm_set_source_pos(node->source_offset);
     
-    gen_node(node->while_loop.condition_expr);
-
-    unsigned jeq_end_offset = g_assembler.binary_size;
-    asm_emit_je(0);
+    // Leave the loop when the condition is false.
+    jump_list_t exits = { 0 };
+    gen_cond_jump(node->while_loop.condition_expr, false, &exits);
 
     gen_block(node->while_loop.block);
 
+    asm_set_source_pos(node->source_offset);
+    u64 *iterations = profile_get_counter(node, PROFILE_COUNTER_ITERATIONS);
+    if (iterations)
+        asm_emit_inc_counter(iterations);
+    gen_safepoint_poll();
     asm_emit_jmp_imm(start_of_condition);
 
-    asm_patch_je(jeq_end_offset, g_assembler.binary_size);
+    jump_list_patch(&exits, g_assembler.binary_size);
+}
+
+static bool contains_loop(ast_node_t *node) {
+    if (node->type == NODE_WHILE)
+        return true;
+    if (node->type == NODE_IF)
+        return contains_loop(node->if_stmt.then_block) ||
+               (node->if_stmt.else_block && contains_loop(node->if_stmt.else_block));
+    if (node->type != NODE_BLOCK)
+        return false;
+    for (unsigned i = 0; i < node->block.statements.size; i++) {
+        if (contains_loop(node->block.statements.data[i]))
+            return true;
+    }
+    return false;
+}
+
+static unsigned count_nodes(ast_node_t *node) {
+    unsigned n = 1;
+    switch (node->type) {
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            n += count_nodes(node->block.statements.data[i]);
+        break;
+    case NODE_WHILE:
+        n += count_nodes(node->while_loop.condition_expr);
+        n += count_nodes(node->while_loop.block);
+        break;
+    case NODE_IF:
+        n += count_nodes(node->if_stmt.condition_expr);
+        n += count_nodes(node->if_stmt.then_block);
+        if (node->if_stmt.else_block)
+            n += count_nodes(node->if_stmt.else_block);
+        break;
+    case NODE_FUNCTION_CALL:
+        for (unsigned i = 0; i < node->func_call.parameters.size; i++)
+            n += count_nodes(node->func_call.parameters.data[i]);
+        break;
+    case NODE_ASSIGNMENT:
+        n += count_nodes(node->assignment.left) + count_nodes(node->assignment.right);
+        break;
+    case NODE_BINARY_OP:
+        n += count_nodes(node->binary_op.left) + count_nodes(node->binary_op.right);
+        break;
+    case NODE_COMPARE:
+        n += count_nodes(node->compare_op.left) + count_nodes(node->compare_op.right);
+        break;
+    case NODE_UNARY_OP:
+        n += count_nodes(node->unary_op.operand);
+        break;
+    case NODE_INDEX:
+        n += count_nodes(node->index.array) + count_nodes(node->index.index);
+        break;
+    default:
+        break;
+    }
+    return n;
+}
+
+// Returns how many copies of the body to put in the unrolled loop, or 1 if it
+// shouldn't be unrolled.
+static unsigned choose_unroll_factor(ast_node_t *node) {
+    // Instrumented loops count each trip around the back edge.
+    if (g_unroll_factor <= 1 || profile_get_counter(node, PROFILE_COUNTER_ITERATIONS))
+        return 1;
+
+    unsigned factor = g_unroll_factor;
+    unsigned body_nodes = count_nodes(node->while_loop.block);
+    if (factor * body_nodes > g_unroll_max_nodes)
+        factor = g_unroll_max_nodes / body_nodes;
+
+    // If the profile says the loop usually runs fewer than 'factor' times,
+    // the unrolled copy would mostly be skipped.
+    u64 entries, iterations;
+    if (profile_get_loop_counts(node, &entries, &iterations) && iterations < factor * entries)
+        return 1;
+    return factor > 1 ? factor : 1;
+}
+
+// Returns true if 'prev_statement', which runs just before the loop, sets the
+// loop's variable to a constant, and the limit is a constant that it counts
+// up to without wrapping.
+static bool find_constant_trip_count(ast_node_t const *prev_statement, counted_loop_t const *loop,
+                                     unsigned *trip_count) {
+    if (!prev_statement || prev_statement->type != NODE_ASSIGNMENT)
+        return false;
+    ast_node_t const *var = prev_statement->assignment.left;
+    ast_node_t const *start = prev_statement->assignment.right;
+    if (var->type != NODE_IDENTIFIER || !strview_cmp(&var->identifier.name, loop->var_name) ||
+        start->type != NODE_NUMBER || loop->limit->type != NODE_NUMBER)
+        return false;
+
+    int start_val = start->number.int_value;
+    int limit_val = loop->limit->number.int_value;
+    derived_type_t *var_type = lscope_get((strview_t *)loop->var_name);
+    int max_val = var_type->object_type.num_bytes == 1 ? 255 : INT_MAX;
+    if (start_val < 0 || start_val > limit_val || limit_val > max_val)
+        return false;
+
+    *trip_count = (unsigned)(limit_val - start_val);
+    return true;
+}
+
+// If the loop has a small constant trip count, emits that many copies of the
+// body with no condition checks in between.
+static bool try_full_unroll(ast_node_t *node, ast_node_t const *prev_statement,
+                            counted_loop_t const *loop) {
+    unsigned trip_count;
+    if (!find_constant_trip_count(prev_statement, loop, &trip_count))
+        return false;
+    if (profile_get_counter(node, PROFILE_COUNTER_ITERATIONS))
+        return false;
+    if ((u64)trip_count * count_nodes(node->while_loop.block) > g_unroll_max_nodes)
+        return false;
+
+    for (unsigned i = 0; i < trip_count; i++)
+        gen_block(node->while_loop.block);
+    return true;
+}
+
+// Runs 'factor' copies of the body for as long as at least that many
+// iterations remain, then finishes with the ordinary loop. The condition
+// doesn't need checking between the copies, because each copy increments i
+// exactly once and the limit is invariant.
+static void gen_unrolled_loop(ast_node_t *node, counted_loop_t const *loop, unsigned factor) {
+    gen_node(loop->limit);
+    unsigned limit_offset = sframe_add_temp(8);
+    asm_emit_mov_reg_to_stack(REG_RAX, limit_offset);
+
+    derived_type_t *var_type = lscope_get((strview_t *)loop->var_name);
+    unsigned var_offset = sframe_get_variable_offset((strview_t *)loop->var_name);
+
+    // Enter the unrolled body if i + factor <= limit, and that didn't wrap.
+    asm_emit_align(g_loop_alignment, g_loop_max_padding);
+    unsigned start_of_check = g_assembler.binary_size;
+    asm_set_source_pos(node->source_offset);
+    asm_emit_mov_stack_to_reg(var_type->object_type.num_bytes == 1 ? REG_AL : REG_RAX, var_offset);
+    asm_emit_mov_imm_64(REG_RCX, factor);
+    asm_emit_arithmetic(REG_RAX, REG_RCX, TOKEN_PLUS);
+    asm_emit_cmp_imm(REG_RCX, REG_RAX);
+    unsigned jb_offset = g_assembler.binary_size;
+    asm_emit_jcc(COND_B, 0);
+    asm_emit_cmp_reg_stack(REG_RAX, limit_offset);
+    unsigned ja_offset = g_assembler.binary_size;
+    asm_emit_jcc(COND_A, 0);
+
+    for (unsigned i = 0; i < factor; i++)
+        gen_block(node->while_loop.block);
+    asm_set_source_pos(node->source_offset);
+    gen_safepoint_poll();
+    asm_emit_jmp_imm(start_of_check);
+
+    // The remainder runs fewer than 'factor' times, so isn't worth aligning.
+    asm_patch_jcc(jb_offset, g_assembler.binary_size);
+    asm_patch_jcc(ja_offset, g_assembler.binary_size);
+    unsigned loop_alignment = g_loop_alignment;
+    g_loop_alignment = 1;
+    gen_loop(node);
+    g_loop_alignment = loop_alignment;
+}
+
+// Emits two copies of the loop. The first has no bounds checks on 'indexes'
+// and is used if the checks in front of it prove that none can fail.
+static void gen_versioned_loop(ast_node_t *node, counted_loop_t const *loop,
+                               darray_t const *indexes, unsigned unroll_factor) {
+    unsigned *slow_path_jumps = malloc((indexes->size + 1) * sizeof(unsigned));
+    unsigned num_slow_path_jumps = 0;
+
+    gen_node(loop->limit);
+    unsigned limit_offset = sframe_add_temp(8);
+    asm_emit_mov_reg_to_stack(REG_RAX, limit_offset);
+
+    // i_start <= limit
+    derived_type_t *var_type = lscope_get((strview_t *)loop->var_name);
+    unsigned var_offset = sframe_get_variable_offset((strview_t *)loop->var_name);
+    asm_emit_mov_stack_to_reg(var_type->object_type.num_bytes == 1 ? REG_AL : REG_RAX, var_offset);
+    asm_emit_cmp_reg_stack(REG_RAX, limit_offset);
+    slow_path_jumps[num_slow_path_jumps++] = g_assembler.binary_size;
+    asm_emit_jcc(COND_A, 0);
+
+    // limit <= len(a), for each array
+    for (unsigned i = 0; i < indexes->size; i++) {
+        ast_node_t *arr = ((ast_node_t *)indexes->data[i])->index.array;
+        bool seen = false;
+        for (unsigned j = 0; j < i && !seen; j++) {
+            ast_node_t *other = ((ast_node_t *)indexes->data[j])->index.array;
+            seen = strview_cmp(&arr->identifier.name, &other->identifier.name);
+        }
+        if (seen)
+            continue;
+
+        unsigned elem_num_bytes;
+        asm_emit_array_len(get_array_offset(arr, &elem_num_bytes));
+        asm_emit_cmp_reg_stack(REG_RAX, limit_offset);
+        slow_path_jumps[num_slow_path_jumps++] = g_assembler.binary_size;
+        asm_emit_jcc(COND_B, 0);
+    }
+
+    darray_t const *unchecked_outside = g_unchecked_indexes;
+    g_unchecked_indexes = indexes;
+    if (unroll_factor > 1)
+        gen_unrolled_loop(node, loop, unroll_factor);
+    else
+        gen_loop(node);
+    g_unchecked_indexes = unchecked_outside;
+
+    unsigned jmp_end_offset = g_assembler.binary_size;
+    asm_emit_jmp_imm(0);
+
+    // The checked copy is the slow path, so don't spend padding on it.
+    for (unsigned i = 0; i < num_slow_path_jumps; i++)
+        asm_patch_jcc(slow_path_jumps[i], g_assembler.binary_size);
+    unsigned loop_alignment = g_loop_alignment;
+    g_loop_alignment = 1;
+    gen_loop(node);
+    g_loop_alignment = loop_alignment;
+
+    asm_patch_jmp(jmp_end_offset, g_assembler.binary_size);
+    free(slow_path_jumps);
+}
+
+// An if that only picks between two values with at most this many nodes
+// between them is compiled to a cmov.
+enum { MAX_SELECT_NODES = 8 };
+
+// True if 'node' can be evaluated when the program wouldn't have, because it
+// can't fault or change anything.
+static bool is_speculatable(ast_node_t *node) {
+    switch (node->type) {
+    case NODE_NUMBER:
+        return true;
+    case NODE_IDENTIFIER: {
+            derived_type_t *type = lscope_get(&node->identifier.name);
+            return type && !type->is_array && type->object_type.num_lanes == 1;
+        }
+    case NODE_BINARY_OP:
+        if (node->binary_op.op == TOKEN_DIVIDE || node->binary_op.op == TOKEN_MODULO) {
+            ast_node_t *divisor = node->binary_op.right;
+            if (divisor->type != NODE_NUMBER || divisor->number.int_value == 0)
+                return false;
+        }
+        return is_speculatable(node->binary_op.left) && is_speculatable(node->binary_op.right);
+    case NODE_UNARY_OP:
+        return is_speculatable(node->unary_op.operand);
+    case NODE_COMPARE:
+        return !is_logical_op(node) && !get_vector_type(node) &&
+               is_speculatable(node->compare_op.left) && is_speculatable(node->compare_op.right);
+    default:
+        return false;
+    }
+}
+
+// True if evaluating 'node' can change a variable, or has any other effect
+// besides faulting.
+static bool has_side_effects(ast_node_t *node) {
+    switch (node->type) {
+    case NODE_BINARY_OP:
+    case NODE_COMPARE:
+        return has_side_effects(node->binary_op.left) || has_side_effects(node->binary_op.right);
+    case NODE_UNARY_OP:
+        return has_side_effects(node->unary_op.operand);
+    case NODE_INDEX:
+        return has_side_effects(node->index.index);
+    case NODE_NUMBER:
+    case NODE_IDENTIFIER:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// True if part of 'node' loads a value that an earlier expression saved.
+static bool contains_reuse(ast_node_t *node) {
+    if (find_reuse(node))
+        return true;
+    if (node->type == NODE_BINARY_OP || node->type == NODE_COMPARE)
+        return contains_reuse(node->binary_op.left) || contains_reuse(node->binary_op.right);
+    return false;
+}
+
+// If 'block' is "{ x = value; }", for a scalar x, returns the assignment.
+static ast_node_t *get_single_assignment(ast_node_t *block) {
+    if (!block || block->block.statements.size != 1)
+        return NULL;
+    ast_node_t *assignment = block->block.statements.data[0];
+    if (assignment->type != NODE_ASSIGNMENT || !is_speculatable(assignment->assignment.left))
+        return NULL;
+    return assignment;
+}
+
+// Puts a value that only needs a move in rax, without touching the flags.
+static void gen_select_operand(ast_node_t *node, unsigned temp_offset) {
+    if (is_leaf(node))
+        gen_node(node);
+    else
+        asm_emit_mov_stack_to_reg(REG_RAX, temp_offset);
+}
+
+// Evaluates 'node' into a temporary, unless it's a leaf.
+static unsigned gen_select_temp(ast_node_t *node) {
+    if (is_leaf(node))
+        return 0;
+    gen_node(node);
+    unsigned offset = sframe_add_temp(8);
+    asm_emit_mov_reg_to_stack(REG_RAX, offset);
+    return offset;
+}
+
+// Turns "if (c) { x = a; } else { x = b; }", or the same without the else,
+// which keeps x, into a cmov. That's only done if a and b are cheap and safe
+// to evaluate whichever way the condition goes. A branch that is hard to
+// predict costs far more than evaluating both.
+static bool try_gen_select(ast_node_t *node) {
+    ast_node_t *then_assignment = get_single_assignment(node->if_stmt.then_block);
+    ast_node_t *condition = node->if_stmt.condition_expr;
+    if (!then_assignment || is_logical_op(condition) || has_side_effects(condition))
+        return false;
+    ast_node_t *x = then_assignment->assignment.left;
+    ast_node_t *then_value = then_assignment->assignment.right;
+    ast_node_t *else_value = x;
+    if (node->if_stmt.else_block) {
+        ast_node_t *else_assignment = get_single_assignment(node->if_stmt.else_block);
+        if (!else_assignment ||
+            !strview_cmp(&else_assignment->assignment.left->identifier.name, &x->identifier.name))
+            return false;
+        else_value = else_assignment->assignment.right;
+    }
+    if (!is_speculatable(then_value) || !is_speculatable(else_value) ||
+        count_nodes(then_value) + count_nodes(else_value) > MAX_SELECT_NODES)
+        return false;
+
+    // The values are evaluated before the condition, which might be where an
+    // equivalent expression saves the value they would reuse.
+    if (contains_reuse(then_value) || contains_reuse(else_value))
+        return false;
+
+    // The condition can't write anything, so the values can be computed
+    // before it. If it faults, computing them had no effect.
+    unsigned then_offset = gen_select_temp(then_value);
+    unsigned else_offset = gen_select_temp(else_value);
+    asm_cond_t cond = gen_flags(condition);
+    gen_select_operand(else_value, else_offset);
+    asm_emit_mov_reg_reg(REG_RCX, REG_RAX);
+    gen_select_operand(then_value, then_offset);
+    asm_emit_cmov(invert_cond(cond), REG_RAX, REG_RCX);
+
+    derived_type_t *type = lscope_get(&x->identifier.name);
+    unsigned x_offset = sframe_get_variable_offset(&x->identifier.name);
+    asm_emit_mov_reg_to_stack(type->object_type.num_bytes == 1 ? REG_AL : REG_RAX, x_offset);
+    return true;
+}
+
+static void gen_if(ast_node_t *node) {
+    if (try_gen_select(node))
+        return;
+
+    jump_list_t else_jumps = { 0 };
+    gen_cond_jump(node->if_stmt.condition_expr, false, &else_jumps);
+    gen_block(node->if_stmt.then_block);
+    if (!node->if_stmt.else_block) {
+        jump_list_patch(&else_jumps, g_assembler.binary_size);
+        return;
+    }
+
+    unsigned jmp_end_offset = g_assembler.binary_size;
+    asm_emit_jmp_imm(0);
+    jump_list_patch(&else_jumps, g_assembler.binary_size);
+    gen_block(node->if_stmt.else_block);
+    asm_patch_jmp(jmp_end_offset, g_assembler.binary_size);
+}
+
+// A loop is cold if the profile says its body runs less than once per entry,
+// on average. Then hoisting and versioning cost more on the way in than they
+// save, and aligning it wastes code size.
+static bool is_cold_loop(ast_node_t *node) {
+    u64 entries, iterations;
+    if (!profile_get_loop_counts(node, &entries, &iterations))
+        return false;
+    return iterations < entries || iterations == 0;
+}
+
+static void gen_while_loop(ast_node_t *node, ast_node_t *prev_statement) {
+    u64 *entries = profile_get_counter(node, PROFILE_COUNTER_ENTRIES);
+    if (entries)
+        asm_emit_inc_counter(entries);
+
+    unsigned num_hoisted_outside = g_num_hoisted;
+    unsigned loop_alignment = g_loop_alignment;
+    bool is_cold = is_cold_loop(node);
+    if (is_cold)
+        g_loop_alignment = 1;
+    else
+        gen_loop_preheader(node);
+
+    // Bounds check elimination and unrolling are only worth the code size in
+    // inner loops.
+    counted_loop_t loop;
+    bool is_counted = !is_cold && !contains_loop(node->while_loop.block) &&
+                      loop_info_find_counted_loop(node, &loop);
+    if (is_counted && try_full_unroll(node, prev_statement, &loop)) {
+        g_num_hoisted = num_hoisted_outside;
+        g_loop_alignment = loop_alignment;
+        return;
+    }
+
+    darray_t indexes = { 0 };
+    unsigned unroll_factor = 1;
+    if (is_counted) {
+        loop_info_find_induction_indexes(node, &loop, &indexes);
+        unroll_factor = choose_unroll_factor(node);
+    }
+
+    if (indexes.size > 0)
+        gen_versioned_loop(node, &loop, &indexes, unroll_factor);
+    else if (unroll_factor > 1)
+        gen_unrolled_loop(node, &loop, unroll_factor);
+    else
+        gen_loop(node);
+
+    darray_free(&indexes);
+    g_num_hoisted = num_hoisted_outside;
+    g_loop_alignment = loop_alignment;
 }
 
 static void gen_node(ast_node_t *node) {
+    listing_pos_t outer = listing_enter(node, false);
+
+    gvn_entry_t const *value = gvn_find(&g_gvn, node);
+    if (value && value->is_reuse && !g_in_preheader) {
+        assert(g_gvn_offsets[value->value] != UINT_MAX);
+        asm_emit_mov_stack_to_reg(REG_RAX, g_gvn_offsets[value->value]);
+        listing_leave(outer);
+        return;
+    }
+
+    // A hoisted expression saved its value when the preheader evaluated it.
+    hoisted_t *hoisted = find_hoisted(node);
+    if (hoisted) {
+        asm_emit_mov_stack_to_reg(REG_RAX, hoisted->offset);
+        listing_leave(outer);
+        return;
+    }
+
     switch (node->type) {
     case NODE_NUMBER:
         asm_emit_mov_imm_64(REG_RAX, node->number.int_value);
@@ -155,6 +1322,9 @@ static void gen_node(ast_node_t *node) {
     case NODE_BINARY_OP:
         gen_binary_op(node);
         break;
+    case NODE_UNARY_OP:
+        gen_unary_op(node);
+        break;
     case NODE_COMPARE:
         gen_compare(node);
         break;
@@ -171,21 +1341,265 @@ static void gen_node(ast_node_t *node) {
         gen_variable_declaration(node);
         break;
     case NODE_WHILE:
-        gen_while_loop(node);
+        gen_while_loop(node, NULL);
+        break;
+    case NODE_IF:
+        gen_if(node);
+        break;
+    case NODE_INDEX:
+        gen_index(node);
         break;
     default:
         printf("gen_node() unknown type\n");
         DBG_BREAK();
     }
+
+    if (value && !value->is_reuse) {
+        if (g_gvn_offsets[value->value] == UINT_MAX)
+            g_gvn_offsets[value->value] = sframe_add_temp(8);
+        asm_emit_mov_reg_to_stack(REG_RAX, g_gvn_offsets[value->value]);
+    }
+
+    listing_leave(outer);
+}
+
+static void find_array_decls(ast_node_t *node) {
+    switch (node->type) {
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_array_decls(node->block.statements.data[i]);
+        break;
+    case NODE_WHILE:
+        find_array_decls(node->while_loop.block);
+        break;
+    case NODE_IF:
+        find_array_decls(node->if_stmt.then_block);
+        if (node->if_stmt.else_block)
+            find_array_decls(node->if_stmt.else_block);
+        break;
+    case NODE_VARIABLE_DECLARATION:
+        if (node->var_decl.type_info.is_array) {
+            unsigned elem_num_bytes = node->var_decl.type_info.object_type.num_bytes;
+            if (elem_num_bytes != 1 && elem_num_bytes != 8)
+                FATAL_ERROR("Arrays of %u byte elements are not supported", elem_num_bytes);
+            darray_append(&g_array_decls, node);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// code_gen() leaves this to the frame layout, which also clears the headers.
+static void gen_array_headers(unsigned first_decl) {
+    for (unsigned i = first_decl; i < g_array_decls.size; i++) {
+        ast_node_t *decl = g_array_decls.data[i];
+        unsigned offset = sframe_add_variable(&decl->var_decl.identifier_name,
+                                              sizeof(runtime_array_t));
+        asm_emit_zero_stack_range(offset, sizeof(runtime_array_t));
+    }
+}
+
+static void gen_array_frees(void) {
+    if (g_array_decls.size == 0)
+        return;
+
+    // Preserve the return value.
+    unsigned result_offset = sframe_add_temp(8);
+    asm_emit_mov_reg_to_stack(REG_RAX, result_offset);
+
+    for (unsigned i = 0; i < g_array_decls.size; i++) {
+        ast_node_t *decl = g_array_decls.data[i];
+        unsigned offset = sframe_get_variable_offset(&decl->var_decl.identifier_name);
+        asm_emit_lea_stack(REG_RCX, offset, sizeof(runtime_array_t));
+        gen_host_call((void *)runtime_array_free);
+    }
+
+    asm_emit_mov_stack_to_reg(REG_RAX, result_offset);
+}
+
+static void gen_error_handlers(void) {
+    static void *const handlers[NUM_ERROR_KINDS] = {
+        (void *)runtime_index_error,
+        (void *)runtime_divide_by_zero_error
+    };
+
+    for (unsigned kind = 0; kind < NUM_ERROR_KINDS; kind++) {
+        bool used = false;
+        for (unsigned i = 0; i < g_num_error_jumps; i++) {
+            if (g_error_jumps[i].kind == kind) {
+                asm_patch_jcc(g_error_jumps[i].jcc_offset, g_assembler.binary_size);
+                used = true;
+            }
+        }
+        if (used)
+            gen_host_call(handlers[kind]);
+    }
 }
 
-void code_gen(ast_node_t *ast) {
+static void gen_literal_pool(void) {
+    if (g_num_literals == 0)
+        return;
+
+    listing_pos_t outer = listing_enter_data();
+    for (unsigned i = 0; i < g_num_literals; i++) {
+        g_literals[i].code_offset = g_assembler.binary_size;
+        asm_emit_data(g_literals[i].data, g_literals[i].num_bytes);
+        free(g_literals[i].data);
+    }
+    for (unsigned i = 0; i < g_num_literal_refs; i++) {
+        literal_ref_t const *ref = &g_literal_refs[i];
+        asm_patch_lea_rip(ref->lea_offset, g_literals[ref->literal].code_offset);
+    }
+    listing_leave(outer);
+
+    g_num_literals = 0;
+    g_num_literal_refs = 0;
+}
+
+// Emits everything that was kept out of the function body. Must come after
+// the function's exit.
+static void gen_cold_paths(void) {
+    for (unsigned i = 0; i < g_num_grow_paths; i++) {
+        grow_path_t const *path = &g_grow_paths[i];
+        asm_patch_jcc(path->jae_offset, g_assembler.binary_size);
+        asm_emit_lea_stack(REG_RCX, path->arr_offset, sizeof(runtime_array_t));
+        asm_emit_mov_imm_64(REG_RDX, path->elem_num_bytes);
+        gen_host_call((void *)runtime_array_grow);
+        asm_emit_jmp_imm(path->resume_offset);
+    }
+
+    gen_error_handlers();
+    gen_literal_pool();
+}
+
+static void reset_function_state(void) {
+    g_num_hoisted = 0;
+    g_unchecked_indexes = NULL;
+    g_num_error_jumps = 0;
+    g_num_grow_paths = 0;
+}
+
+// Returns the offset of the function's entry point.
+static unsigned begin_function(void) {
     asm_init();
     sframe_init();
+    darray_free(&g_array_decls);
+    reset_function_state();
+    listing_reset();
 
     unsigned start_of_code = g_assembler.binary_size;
     asm_emit_func_entry();
-    gen_node(ast);
-    asm_patch_func_entry(start_of_code, sframe_get_size());
+    gen_safepoint_poll();
+    return start_of_code;
+}
+
+static void end_function(unsigned start_of_code) {
+    // Keep rsp 16 byte aligned for calls to host functions.
+    asm_patch_func_entry(start_of_code, (sframe_get_size() + 15) & ~15u);
+    asm_set_source_pos(ASM_NO_SOURCE_POS);
     asm_emit_func_exit();
+    gen_cold_paths();
+}
+
+void code_gen_set_loop_alignment(unsigned alignment, unsigned max_padding) {
+    g_loop_alignment = alignment;
+    g_loop_max_padding = max_padding;
+}
+
+void code_gen_set_unrolling(unsigned factor, unsigned max_nodes) {
+    g_unroll_factor = factor;
+    g_unroll_max_nodes = max_nodes;
+}
+
+void *code_gen(ast_node_t *ast) {
+    ceval_run(ast);
+    dse_run(ast);
+    profile_begin(ast);
+    begin_value_numbering(ast);
+
+    unsigned start_of_code = begin_function();
+    unsigned zero_num_bytes = frame_layout_run(ast);
+    if (zero_num_bytes)
+        asm_emit_zero_stack_block(0, zero_num_bytes);
+    find_array_decls(ast);
+    gen_node(ast);
+    gen_array_frees();
+    end_function(start_of_code);
+    return asm_install(start_of_code, false);
+}
+
+osr_func_t code_gen_osr_loop(ast_node_t *while_node, osr_var_t const *vars, unsigned num_vars) {
+    assert(while_node->type == NODE_WHILE);
+
+    // The caller owns every variable, including the arrays, so there are no
+    // array headers to set up or free here.
+    begin_value_numbering(while_node);
+    unsigned start_of_code = begin_function();
+    unsigned state_offset = sframe_add_temp(8);
+    asm_emit_mov_reg_to_stack(REG_RCX, state_offset);
+    for (unsigned i = 0; i < num_vars; i++) {
+        unsigned offset = sframe_add_variable(vars[i].name, vars[i].num_bytes);
+        asm_emit_load_stack_from_rcx(offset, vars[i].num_bytes, vars[i].state_offset);
+    }
+
+    gen_node(while_node);
+
+    asm_emit_mov_stack_to_reg(REG_RCX, state_offset);
+    for (unsigned i = 0; i < num_vars; i++) {
+        unsigned offset = sframe_get_variable_offset(vars[i].name);
+        asm_emit_store_stack_to_rcx(offset, vars[i].num_bytes, vars[i].state_offset);
+    }
+    end_function(start_of_code);
+
+    // The loop has already proved to be hot.
+    return (osr_func_t)asm_install(start_of_code, true);
+}
+
+
+// Incremental compilation, for the REPL. Each line is compiled to a function
+// that is appended to the code buffer, and installed on its own. All the
+// functions share one frame, which the caller passes in, so variables keep
+// their stack slots and values from line to line.
+
+static unsigned g_repl_frame_num_bytes;
+
+void code_gen_repl_begin(unsigned frame_num_bytes) {
+    asm_init();
+    sframe_init();
+    darray_free(&g_array_decls);
+    listing_reset();
+    g_repl_frame_num_bytes = frame_num_bytes;
+}
+
+repl_func_t code_gen_repl_line(ast_node_t *ast) {
+    // Dead store elimination is not run, because later lines might read
+    // anything.
+    reset_function_state();
+    begin_value_numbering(ast);
+    unsigned start_of_code = g_assembler.binary_size;
+    asm_emit_repl_entry();
+
+    unsigned first_new_array = g_array_decls.size;
+    find_array_decls(ast);
+    gen_array_headers(first_new_array);
+    gen_node(ast);
+
+    asm_set_source_pos(ASM_NO_SOURCE_POS);
+    asm_emit_repl_exit();
+    gen_cold_paths();
+
+    if (sframe_get_size() > g_repl_frame_num_bytes)
+        FATAL_ERROR("Out of stack frame space. Limit is %u bytes", g_repl_frame_num_bytes);
+
+    return (repl_func_t)asm_install(start_of_code, false);
+}
+
+void code_gen_repl_end(u8 *frame_top) {
+    for (unsigned i = 0; i < g_array_decls.size; i++) {
+        ast_node_t *decl = g_array_decls.data[i];
+        unsigned offset = sframe_get_variable_offset(&decl->var_decl.identifier_name);
+        runtime_array_free((runtime_array_t *)(frame_top - offset - sizeof(runtime_array_t)));
+    }
+    darray_free(&g_array_decls);
 }
@@ -1,7 +1,51 @@
 #pragma once
 
+// This project's headers
+#include "common.h"
+
 
 typedef struct _ast_node_t ast_node_t;
+typedef struct _strview_t strview_t;
+
+// Where a variable lives in the interpreter's state block.
+typedef struct {
+    strview_t *name;
+    unsigned num_bytes;
+    unsigned state_offset;
+} osr_var_t;
+
+// A loop compiled for on-stack replacement. It copies the variables in from
+// 'state', runs the loop from its condition until it exits, then copies them
+// back.
+typedef void (JIT_CALLBACK *osr_func_t)(u8 *state);
+
+// One line of REPL input. Returns the value of its last statement.
+typedef u64 (JIT_CALLBACK *repl_func_t)(u8 *frame_top);
+
+
+// Loop heads are aligned to 'alignment' bytes (a power of two, or 1 for no
+// alignment), as long as that needs no more than 'max_padding' bytes of nops.
+// The default is 16 and 15.
+void code_gen_set_loop_alignment(unsigned alignment, unsigned max_padding);
+
+// Counted loops are unrolled 'factor' times (1 for no unrolling), and ones
+// with a small constant trip count completely, as long as the unrolled body
+// has no more than 'max_nodes' AST nodes. The default is 4 and 128.
+void code_gen_set_unrolling(unsigned factor, unsigned max_nodes);
+
+// The functions that compile code return it in the code heap. The caller
+// releases it with code_heap_free() once it won't be run again.
+
+// Returns the entry point of the program.
+void *code_gen(ast_node_t *ast);
 
+// Compiles a single while loop that the interpreter found to be hot. 'vars'
+// must include every variable that the loop uses.
+osr_func_t code_gen_osr_loop(ast_node_t *while_node, osr_var_t const *vars, unsigned num_vars);
 
-void code_gen(ast_node_t *ast);
+// The REPL's code is generated incrementally. The caller owns a frame of
+// 'frame_num_bytes' and passes a pointer to the end of it to every
+// repl_func_t. code_gen_repl_end() frees the arrays stored in the frame.
+void code_gen_repl_begin(unsigned frame_num_bytes);
+repl_func_t code_gen_repl_line(ast_node_t *ast);
+void code_gen_repl_end(u8 *frame_top);
@@ -0,0 +1,414 @@
+// Own header
+#include "code_heap.h"
+
+// Standard headers
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+enum {
+    CHUNK_SHIFT = 21,
+    CHUNK_NUM_BYTES = 1 << CHUNK_SHIFT,
+    MIN_REGION_SHIFT = 8,
+    NUM_CLASSES = CHUNK_SHIFT - MIN_REGION_SHIFT + 1, // The biggest class is a whole chunk
+    SLOTS_PER_CHUNK = CHUNK_NUM_BYTES >> MIN_REGION_SHIFT
+};
+
+// The free regions of each kind and size class are kept in a doubly linked
+// list that lives in the regions themselves.
+typedef struct _free_region_t {
+    struct _free_region_t *next;
+    struct _free_region_t *prev;
+} free_region_t;
+
+typedef struct {
+    u8 *base;
+    size_t num_bytes;
+    bool hot;
+    bool huge;
+    bool big;              // Holds a single region that is bigger than a chunk
+    size_t big_num_bytes;  // What a big chunk's region was asked for
+    unsigned num_regions;  // Allocated ones
+    bool writable;         // Otherwise it's executable
+
+    // Indexed by 256 byte slot, for the region that starts there, if any.
+    // Big chunks don't have these.
+    u32 *requested;        // An allocated region's requested size, or 0
+    u8 *free_class;        // A free region's size class plus one, or 0
+} chunk_t;
+
+static struct {
+    chunk_t *chunks;
+    unsigned num_chunks;
+    unsigned chunks_capacity;
+
+    free_region_t *free_lists[2][NUM_CLASSES]; // Indexed by hot, then by size class
+    bool huge_pages;
+} g_heap;
+
+
+#ifdef _MSC_VER
+
+__declspec(dllimport) void *__stdcall VirtualAlloc(void *address, size_t size,
+    unsigned allocationType, unsigned protect);
+__declspec(dllimport) int __stdcall VirtualFree(void *address, size_t size, unsigned freeType);
+__declspec(dllimport) size_t __stdcall GetLargePageMinimum(void);
+__declspec(dllimport) int __stdcall VirtualProtect(void *address, size_t size, unsigned newProtect,
+    unsigned *oldProtect);
+
+enum {
+    MEM_COMMIT = 0x1000,
+    MEM_RESERVE = 0x2000,
+    MEM_RELEASE = 0x8000,
+    MEM_LARGE_PAGES = 0x20000000,
+    PAGE_READWRITE = 0x04,
+    PAGE_EXECUTE_READ = 0x20
+};
+
+// 'alignment' is 0 or a power of two. Large pages need the "Lock pages in
+// memory" privilege, so asking for them often fails, and then *huge is
+// cleared and the memory gets normal pages.
+static u8 *map_memory(size_t num_bytes, size_t alignment, bool *huge) {
+    if (*huge) {
+        size_t large_page = GetLargePageMinimum();
+        u8 *p = NULL;
+        if (large_page && num_bytes % large_page == 0 && large_page % (alignment ? alignment : 1) == 0)
+            p = VirtualAlloc(NULL, num_bytes, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (p)
+            return p;
+        *huge = false;
+    }
+    if (alignment == 0)
+        return VirtualAlloc(NULL, num_bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+    // Find an aligned address by reserving more than needed, then release it
+    // and map just the aligned part. Another thread might take the address in
+    // between, so try a few times.
+    for (int attempt = 0; attempt < 8; attempt++) {
+        u8 *p = VirtualAlloc(NULL, num_bytes + alignment, MEM_RESERVE, PAGE_READWRITE);
+        if (!p)
+            return NULL;
+        VirtualFree(p, 0, MEM_RELEASE);
+        u8 *start = (u8 *)(((uintptr_t)p + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        p = VirtualAlloc(start, num_bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (p)
+            return p;
+    }
+
+    return NULL;
+}
+
+static void unmap_memory(u8 *p, size_t num_bytes) {
+    VirtualFree(p, 0, MEM_RELEASE);
+}
+
+static bool protect_memory(u8 *p, size_t num_bytes, bool writable) {
+    unsigned old_protect;
+    return VirtualProtect(p, num_bytes, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old_protect) != 0;
+}
+
+#else
+
+// POSIX headers
+#include <sys/mman.h>
+
+
+// 'alignment' is 0 or a power of two. *huge asks for transparent huge pages,
+// and is cleared if the kernel can't give them.
+static u8 *map_memory(size_t num_bytes, size_t alignment, bool *huge) {
+    // Map enough to find an aligned start, then unmap the ends.
+    u8 *p = mmap(NULL, num_bytes + alignment, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (alignment) {
+        u8 *start = (u8 *)(((uintptr_t)p + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        if (start > p)
+            munmap(p, start - p);
+        if (start + num_bytes < p + num_bytes + alignment)
+            munmap(start + num_bytes, p + alignment - start);
+        p = start;
+    }
+
+#ifdef MADV_HUGEPAGE
+    // Even then, the kernel may use normal pages if it's short of huge ones.
+    if (*huge && madvise(p, num_bytes, MADV_HUGEPAGE) != 0)
+        *huge = false;
+#else
+    *huge = false;
+#endif
+    return p;
+}
+
+static void unmap_memory(u8 *p, size_t num_bytes) {
+    munmap(p, num_bytes);
+}
+
+static bool protect_memory(u8 *p, size_t num_bytes, bool writable) {
+    return mprotect(p, num_bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+}
+
+#endif
+
+
+static size_t class_num_bytes(unsigned size_class) {
+    return (size_t)1 << (size_class + MIN_REGION_SHIFT);
+}
+
+static unsigned find_class(size_t num_bytes) {
+    unsigned size_class = 0;
+    while (class_num_bytes(size_class) < num_bytes)
+        size_class++;
+    return size_class;
+}
+
+// There are only ever a few chunks, so a linear search is fine.
+static chunk_t *find_chunk(void const *p) {
+    for (unsigned i = 0; i < g_heap.num_chunks; i++) {
+        chunk_t *chunk = &g_heap.chunks[i];
+        if ((u8 const *)p >= chunk->base && (u8 const *)p < chunk->base + chunk->num_bytes)
+            return chunk;
+    }
+
+    return NULL;
+}
+
+static unsigned get_slot(chunk_t const *chunk, void const *p) {
+    return (unsigned)(((u8 const *)p - chunk->base) >> MIN_REGION_SHIFT);
+}
+
+// Chunks are mapped writable, and stay that way until code_heap_seal(). The
+// protection is changed a whole chunk at a time, so that huge pages aren't
+// split.
+static void set_writable(chunk_t *chunk, bool writable) {
+    if (!protect_memory(chunk->base, chunk->num_bytes, writable))
+        FATAL_ERROR("Couldn't change the protection of the code heap");
+    chunk->writable = writable;
+}
+
+// The free list links live in the free regions, and a region's neighbours on
+// its list can be in other chunks, so those have to be made writable too.
+static void make_writable(void *p) {
+    chunk_t *chunk = find_chunk(p);
+    if (!chunk->writable)
+        set_writable(chunk, true);
+}
+
+static void push_free(chunk_t *chunk, u8 *p, unsigned size_class) {
+    free_region_t **list = &g_heap.free_lists[chunk->hot][size_class];
+    free_region_t *region = (free_region_t *)p;
+    make_writable(region);
+    if (*list)
+        make_writable(*list);
+    region->prev = NULL;
+    region->next = *list;
+    if (*list)
+        (*list)->prev = region;
+    *list = region;
+    chunk->free_class[get_slot(chunk, p)] = (u8)(size_class + 1);
+}
+
+static void remove_free(chunk_t *chunk, u8 *p, unsigned size_class) {
+    free_region_t *region = (free_region_t *)p;
+    make_writable(region);
+    if (region->prev) {
+        make_writable(region->prev);
+        region->prev->next = region->next;
+    } else {
+        g_heap.free_lists[chunk->hot][size_class] = region->next;
+    }
+    if (region->next) {
+        make_writable(region->next);
+        region->next->prev = region->prev;
+    }
+    chunk->free_class[get_slot(chunk, p)] = 0;
+}
+
+static chunk_t *add_chunk(u8 *base, size_t num_bytes, bool hot, bool huge, bool big) {
+    if (g_heap.num_chunks == g_heap.chunks_capacity) {
+        g_heap.chunks_capacity = g_heap.chunks_capacity ? g_heap.chunks_capacity * 2 : 16;
+        g_heap.chunks = realloc(g_heap.chunks, g_heap.chunks_capacity * sizeof(chunk_t));
+    }
+
+    chunk_t *chunk = &g_heap.chunks[g_heap.num_chunks++];
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->base = base;
+    chunk->num_bytes = num_bytes;
+    chunk->hot = hot;
+    chunk->huge = huge;
+    chunk->big = big;
+    chunk->writable = true;
+    if (!big) {
+        chunk->requested = calloc(SLOTS_PER_CHUNK, sizeof(u32));
+        chunk->free_class = calloc(SLOTS_PER_CHUNK, sizeof(u8));
+    }
+    return chunk;
+}
+
+// Any free regions in it must have been taken off the free lists already.
+static void remove_chunk(chunk_t *chunk) {
+    unmap_memory(chunk->base, chunk->num_bytes);
+    free(chunk->requested);
+    free(chunk->free_class);
+    *chunk = g_heap.chunks[--g_heap.num_chunks];
+}
+
+static unsigned count_chunks(bool hot) {
+    unsigned count = 0;
+    for (unsigned i = 0; i < g_heap.num_chunks; i++) {
+        if (g_heap.chunks[i].hot == hot && !g_heap.chunks[i].big)
+            count++;
+    }
+
+    return count;
+}
+
+void code_heap_set_huge_pages(bool enable) {
+    g_heap.huge_pages = enable;
+}
+
+void *code_heap_alloc(size_t num_bytes, bool hot) {
+    if (num_bytes == 0)
+        num_bytes = 1;
+
+    if (num_bytes > CHUNK_NUM_BYTES) {
+        size_t mapped_num_bytes = (num_bytes + CHUNK_NUM_BYTES - 1) & ~(size_t)(CHUNK_NUM_BYTES - 1);
+        bool huge = false;
+        u8 *p = map_memory(mapped_num_bytes, 0, &huge);
+        if (!p)
+            return NULL;
+        chunk_t *chunk = add_chunk(p, mapped_num_bytes, hot, false, true);
+        chunk->big_num_bytes = num_bytes;
+        chunk->num_regions = 1;
+        return p;
+    }
+
+    // Take the smallest free region that is big enough, mapping a new chunk
+    // if there isn't one, and split it down to size.
+    unsigned size_class = find_class(num_bytes);
+    unsigned c = size_class;
+    while (c < NUM_CLASSES && !g_heap.free_lists[hot][c])
+        c++;
+    if (c == NUM_CLASSES) {
+        bool huge = hot && g_heap.huge_pages;
+        u8 *p = map_memory(CHUNK_NUM_BYTES, CHUNK_NUM_BYTES, &huge);
+        if (!p)
+            return NULL;
+        c = NUM_CLASSES - 1;
+        push_free(add_chunk(p, CHUNK_NUM_BYTES, hot, huge, false), p, c);
+    }
+
+    u8 *p = (u8 *)g_heap.free_lists[hot][c];
+    chunk_t *chunk = find_chunk(p);
+    remove_free(chunk, p, c);
+    while (c > size_class) {
+        c--;
+        push_free(chunk, p + class_num_bytes(c), c);
+    }
+
+    chunk->requested[get_slot(chunk, p)] = (u32)num_bytes;
+    chunk->num_regions++;
+    return p;
+}
+
+void code_heap_seal(void) {
+    for (unsigned i = 0; i < g_heap.num_chunks; i++) {
+        if (g_heap.chunks[i].writable)
+            set_writable(&g_heap.chunks[i], false);
+    }
+}
+
+void code_heap_free(void *code) {
+    if (!code)
+        return;
+
+    chunk_t *chunk = find_chunk(code);
+    assert(chunk);
+    if (chunk->big) {
+        remove_chunk(chunk);
+        return;
+    }
+
+    u8 *p = code;
+    unsigned slot = get_slot(chunk, p);
+    assert(chunk->requested[slot]);
+    unsigned c = find_class(chunk->requested[slot]);
+    chunk->requested[slot] = 0;
+    chunk->num_regions--;
+
+    // Merge with the buddy for as long as it's free and the same size.
+    while (c < NUM_CLASSES - 1) {
+        u8 *buddy = chunk->base + ((size_t)(p - chunk->base) ^ class_num_bytes(c));
+        if (chunk->free_class[get_slot(chunk, buddy)] != c + 1)
+            break;
+        remove_free(chunk, buddy, c);
+        if (buddy < p)
+            p = buddy;
+        c++;
+    }
+
+    // One free chunk of each kind is kept, so that compiling and releasing a
+    // script over and over doesn't map and unmap memory every time.
+    if (c == NUM_CLASSES - 1 && count_chunks(chunk->hot) > 1)
+        remove_chunk(chunk);
+    else
+        push_free(chunk, p, c);
+    code_heap_seal();
+}
+
+void code_heap_get_stats(code_heap_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (unsigned i = 0; i < g_heap.num_chunks; i++) {
+        chunk_t const *chunk = &g_heap.chunks[i];
+        stats->num_chunks++;
+        stats->num_huge_chunks += chunk->huge;
+        stats->mapped_bytes += chunk->num_bytes;
+        if (chunk->big) {
+            stats->num_regions++;
+            stats->region_bytes += chunk->num_bytes;
+            stats->requested_bytes += chunk->big_num_bytes;
+            continue;
+        }
+
+        for (unsigned slot = 0; slot < SLOTS_PER_CHUNK; slot++) {
+            if (chunk->requested[slot]) {
+                stats->num_regions++;
+                stats->region_bytes += class_num_bytes(find_class(chunk->requested[slot]));
+                stats->requested_bytes += chunk->requested[slot];
+            }
+            if (chunk->free_class[slot]) {
+                size_t num_bytes = class_num_bytes(chunk->free_class[slot] - 1);
+                stats->num_free_regions++;
+                stats->free_bytes += num_bytes;
+                if (num_bytes > stats->largest_free_region)
+                    stats->largest_free_region = num_bytes;
+            }
+        }
+    }
+}
+
+// Internal fragmentation is the part of the allocated regions that is
+// rounding up to a size class. External fragmentation is the part of the
+// free memory that isn't in the largest free region.
+void code_heap_print_stats(void) {
+    code_heap_stats_t stats;
+    code_heap_get_stats(&stats);
+
+    double internal = stats.region_bytes ?
+        100.0 * (stats.region_bytes - stats.requested_bytes) / stats.region_bytes : 0.0;
+    double external = stats.free_bytes ?
+        100.0 * (stats.free_bytes - stats.largest_free_region) / stats.free_bytes : 0.0;
+
+    printf("--- Code heap ---\n");
+    printf("  Chunks        %u (%u with huge pages), %llu KB mapped\n",
+           stats.num_chunks, stats.num_huge_chunks, (unsigned long long)stats.mapped_bytes / 1024);
+    printf("  Regions       %u, %llu bytes for %llu requested (%.1f%% internal fragmentation)\n",
+           stats.num_regions, (unsigned long long)stats.region_bytes,
+           (unsigned long long)stats.requested_bytes, internal);
+    printf("  Free regions  %u, %llu bytes, largest %llu (%.1f%% external fragmentation)\n",
+           stats.num_free_regions, (unsigned long long)stats.free_bytes,
+           (unsigned long long)stats.largest_free_region, external);
+}
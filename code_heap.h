@@ -0,0 +1,52 @@
+// The code heap holds the generated code once it is finished. It maps
+// executable memory in 2 MB chunks and hands out regions of them in power of
+// two size classes, from 256 bytes up to a whole chunk. It's a buddy
+// allocator, so a freed region is merged with its neighbour whenever that is
+// free too, and a chunk that becomes completely free is unmapped, except for
+// the last one of its kind. Code that doesn't fit in a chunk gets a mapping
+// of its own.
+//
+// Memory in the heap is never writable and executable at the same time.
+// code_heap_alloc() leaves the new region, and whatever else the allocator
+// had to write to, writable, and code_heap_seal() makes it all executable
+// again once the code has been copied in. code_heap_free() does both itself.
+//
+// Hot code, eg loops compiled for on-stack replacement, goes in chunks of its
+// own, which can be backed by huge pages to cut iTLB misses.
+
+#pragma once
+
+// This project's headers
+#include "common.h"
+
+// Standard headers
+#include <stdbool.h>
+#include <stddef.h>
+
+
+typedef struct {
+    unsigned num_chunks;      // Including the mappings for single big regions
+    unsigned num_huge_chunks; // Ones that huge pages were asked for
+    size_t mapped_bytes;
+
+    unsigned num_regions;     // Allocated ones
+    size_t region_bytes;      // Allocated, rounded up to their size classes
+    size_t requested_bytes;   // What the allocated regions were asked for
+
+    unsigned num_free_regions;
+    size_t free_bytes;
+    size_t largest_free_region;
+} code_heap_stats_t;
+
+
+// Off by default. Only affects chunks that are mapped afterwards.
+void code_heap_set_huge_pages(bool enable);
+
+// Returns NULL if the memory couldn't be mapped. The region is writable
+// until code_heap_seal() is called.
+void *code_heap_alloc(size_t num_bytes, bool hot);
+void code_heap_seal(void);
+void code_heap_free(void *code);
+
+void code_heap_get_stats(code_heap_stats_t *stats);
+void code_heap_print_stats(void);
@@ -18,8 +18,18 @@
 #define DBG_BREAK() __asm__("int3")
 #endif
 
+// The generated code uses the Windows x64 calling convention. C functions that
+// it calls must be declared with this.
+#ifdef _MSC_VER
+#define JIT_CALLBACK
+#else
+#define JIT_CALLBACK __attribute__((ms_abi))
+#endif
+
 typedef uint8_t u8;
 typedef int8_t i8;
+typedef uint16_t u16;
 typedef uint32_t u32;
+typedef int32_t i32;
 typedef uint64_t u64;
 typedef int64_t i64;
@@ -0,0 +1,625 @@
+// Own header
+#include "const_eval.h"
+
+// This project's headers
+#include "common.h"
+#include "hash_table.h"
+#include "host_funcs.h"
+#include "loop_info.h"
+#include "parser.h"
+
+// Standard headers
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// The evaluator follows the interpreter's semantics: values are u64, a store
+// keeps the low bytes of the value, shift counts are taken mod 64, and while
+// and if statements have the value 0.
+//
+// The variables that a statement writes are known after it if it was run to
+// completion, and unknown otherwise. The ones it doesn't write keep their
+// state, so nothing needs to be undone when the evaluation gives up part way.
+//
+// A loop whose condition depends on something that can't be known, even
+// indirectly through the variables the body assigns, can never finish here.
+// That is checked before running it, so that it doesn't use up the fuel.
+
+
+enum { DEFAULT_FUEL = 10000 };
+
+typedef struct {
+    strview_t const *name;
+    u64 value;
+    unsigned num_bytes; // 0 if it isn't a scalar, ie an array or a vector.
+    bool is_known;
+} ceval_var_t;
+
+// The state of a variable that a statement writes, from before it ran.
+typedef struct {
+    strview_t name;
+    unsigned index; // Into the variables, or UINT_MAX if it wasn't declared yet.
+    u64 value;
+    bool is_known;
+} ceval_written_t;
+
+typedef struct {
+    hashtab_t var_indices; // Maps variable name to 1 + index into 'vars'.
+    ceval_var_t *vars;
+    unsigned num_vars;
+    unsigned vars_capacity;
+
+    unsigned fuel; // Number of nodes that can still be evaluated.
+
+    // For the statement being evaluated.
+    ceval_written_t *written;
+    unsigned num_written;
+    unsigned written_capacity;
+} ceval_t;
+
+static ceval_t g_ceval;
+static unsigned g_fuel_budget = DEFAULT_FUEL;
+
+
+void ceval_set_fuel(unsigned fuel) {
+    g_fuel_budget = fuel;
+}
+
+
+// ***************************************************************************
+// Variables
+// ***************************************************************************
+
+static ceval_var_t *find_var(strview_t const *name) {
+    void *val = hashtab_get(&g_ceval.var_indices, name);
+    return val ? &g_ceval.vars[(uintptr_t)val - 1] : NULL;
+}
+
+static ceval_var_t *add_var(ast_node_t *decl) {
+    ceval_var_t *var = find_var(&decl->var_decl.identifier_name);
+    if (var)
+        return var; // A declaration in a loop runs more than once.
+
+    if (g_ceval.num_vars == g_ceval.vars_capacity) {
+        g_ceval.vars_capacity = g_ceval.vars_capacity ? g_ceval.vars_capacity * 2 : 16;
+        g_ceval.vars = realloc(g_ceval.vars, g_ceval.vars_capacity * sizeof(ceval_var_t));
+    }
+
+    derived_type_t const *type = &decl->var_decl.type_info;
+    var = &g_ceval.vars[g_ceval.num_vars++];
+    var->name = &decl->var_decl.identifier_name;
+    var->value = 0;
+    var->num_bytes = type->is_array || type->object_type.num_lanes > 1 ?
+        0 : type->object_type.num_bytes;
+    var->is_known = false;
+    hashtab_put(&g_ceval.var_indices, &decl->var_decl.identifier_name,
+                (void *)(uintptr_t)g_ceval.num_vars);
+    return var;
+}
+
+static void store(ceval_var_t *var, u64 val) {
+    if (var->num_bytes < 8)
+        val &= (1ull << (var->num_bytes * 8)) - 1;
+    var->value = val;
+    var->is_known = true;
+}
+
+
+// ***************************************************************************
+// Loop conditions
+// ***************************************************************************
+
+// Variables that a loop body might leave unknown. Names map to (void *)1.
+typedef struct {
+    hashtab_t unknown;
+    hashtab_t declared; // In the body. They start out known.
+    bool changed;
+} loop_deps_t;
+
+static void find_body_decls(ast_node_t *node, hashtab_t *declared) {
+    if (g_ceval.fuel)
+        g_ceval.fuel--;
+
+    switch (node->type) {
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_body_decls(node->block.statements.data[i], declared);
+        break;
+    case NODE_VARIABLE_DECLARATION:
+        hashtab_put(declared, &node->var_decl.identifier_name, (void *)1);
+        break;
+    case NODE_WHILE:
+        find_body_decls(node->while_loop.block, declared);
+        break;
+    case NODE_IF:
+        find_body_decls(node->if_stmt.then_block, declared);
+        if (node->if_stmt.else_block)
+            find_body_decls(node->if_stmt.else_block, declared);
+        break;
+    default:
+        break;
+    }
+}
+
+// Whether an expression reads anything that isn't known, or does anything
+// that eval() can't.
+static bool depends_on_unknown(ast_node_t *node, loop_deps_t const *deps) {
+    if (g_ceval.fuel)
+        g_ceval.fuel--;
+
+    switch (node->type) {
+    case NODE_NUMBER:
+        return false;
+    case NODE_IDENTIFIER: {
+            strview_t const *name = &node->identifier.name;
+            if (hashtab_get(&deps->unknown, name))
+                return true;
+            if (hashtab_get(&deps->declared, name))
+                return false;
+            ceval_var_t const *var = find_var(name);
+            return !var || !var->num_bytes || !var->is_known;
+        }
+    case NODE_ASSIGNMENT:
+        return depends_on_unknown(node->assignment.right, deps);
+    case NODE_BINARY_OP:
+        return depends_on_unknown(node->binary_op.left, deps) ||
+               depends_on_unknown(node->binary_op.right, deps);
+    case NODE_UNARY_OP:
+        return depends_on_unknown(node->unary_op.operand, deps);
+    case NODE_COMPARE:
+        return depends_on_unknown(node->compare_op.left, deps) ||
+               depends_on_unknown(node->compare_op.right, deps);
+    case NODE_FUNCTION_CALL: {
+            host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+            if (!func || !func->is_pure)
+                return true;
+            for (unsigned i = 0; i < node->func_call.parameters.size; i++) {
+                if (depends_on_unknown(node->func_call.parameters.data[i], deps))
+                    return true;
+            }
+            return false;
+        }
+    default:
+        return true;
+    }
+}
+
+static void mark_assigned_unknown(ast_node_t *left, loop_deps_t *deps) {
+    if (left->type != NODE_IDENTIFIER || hashtab_get(&deps->unknown, &left->identifier.name))
+        return;
+    hashtab_put(&deps->unknown, &left->identifier.name, (void *)1);
+    deps->changed = true;
+}
+
+// Marks the variables that 'node' assigns from unknown values, or under a
+// condition that isn't known.
+static void find_unknown_assignments(ast_node_t *node, bool is_conditional, loop_deps_t *deps) {
+    switch (node->type) {
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_unknown_assignments(node->block.statements.data[i], is_conditional, deps);
+        break;
+    case NODE_ASSIGNMENT:
+        if (is_conditional || depends_on_unknown(node->assignment.right, deps))
+            mark_assigned_unknown(node->assignment.left, deps);
+        break;
+    case NODE_WHILE:
+        is_conditional = is_conditional || depends_on_unknown(node->while_loop.condition_expr, deps);
+        find_unknown_assignments(node->while_loop.block, is_conditional, deps);
+        break;
+    case NODE_IF:
+        is_conditional = is_conditional || depends_on_unknown(node->if_stmt.condition_expr, deps);
+        find_unknown_assignments(node->if_stmt.then_block, is_conditional, deps);
+        if (node->if_stmt.else_block)
+            find_unknown_assignments(node->if_stmt.else_block, is_conditional, deps);
+        break;
+    default:
+        break;
+    }
+}
+
+// The unknowns spread through the body's assignments until nothing changes.
+// The work counts against the fuel, as evaluating does.
+static bool can_finish_loop(ast_node_t *node) {
+    loop_deps_t deps;
+    deps.unknown = hashtab_create();
+    deps.declared = hashtab_create();
+    find_body_decls(node->while_loop.block, &deps.declared);
+    do {
+        deps.changed = false;
+        find_unknown_assignments(node->while_loop.block, false, &deps);
+    } while (deps.changed && g_ceval.fuel);
+
+    bool can_finish = g_ceval.fuel && !depends_on_unknown(node->while_loop.condition_expr, &deps);
+    hashtab_free(&deps.unknown);
+    hashtab_free(&deps.declared);
+    return can_finish;
+}
+
+
+// ***************************************************************************
+// Evaluation
+// ***************************************************************************
+
+// Each of these returns false if the node can't be evaluated at compile time.
+static bool eval(ast_node_t *node, u64 *result);
+
+static bool eval_intrinsic(ast_node_t *node, intrinsic_t intrinsic, u64 *result) {
+    if (node->func_call.parameters.size != 1)
+        return false;
+
+    u64 x;
+    if (!eval(node->func_call.parameters.data[0], &x))
+        return false;
+
+    u64 count = 0;
+    switch (intrinsic) {
+    case INTRINSIC_POPCOUNT:
+        for (; x; x &= x - 1)
+            count++;
+        break;
+    case INTRINSIC_CLZ:
+        while (count < 64 && !(x & (1ull << (63 - count))))
+            count++;
+        break;
+    case INTRINSIC_CTZ:
+        while (count < 64 && !(x & (1ull << count)))
+            count++;
+        break;
+    default:
+        return false;
+    }
+
+    *result = count;
+    return true;
+}
+
+static bool eval_binary_op(ast_node_t *node, u64 *result) {
+    u64 left, right;
+    if (!eval(node->binary_op.left, &left) || !eval(node->binary_op.right, &right))
+        return false;
+
+    switch (node->binary_op.op) {
+    case TOKEN_PLUS: *result = left + right; return true;
+    case TOKEN_MINUS: *result = left - right; return true;
+    case TOKEN_MULTIPLY: *result = left * right; return true;
+    case TOKEN_DIVIDE:
+        if (right == 0)
+            return false; // Leave the error to run time.
+        *result = left / right;
+        return true;
+    case TOKEN_MODULO:
+        if (right == 0)
+            return false;
+        *result = left % right;
+        return true;
+    case TOKEN_AND: *result = left & right; return true;
+    case TOKEN_OR: *result = left | right; return true;
+    case TOKEN_XOR: *result = left ^ right; return true;
+    case TOKEN_SHIFT_LEFT: *result = left << (right & 63); return true;
+    case TOKEN_SHIFT_RIGHT: *result = left >> (right & 63); return true;
+    default: return false;
+    }
+}
+
+static bool eval_compare(ast_node_t *node, u64 *result) {
+    u64 left, right;
+    if (!eval(node->compare_op.left, &left))
+        return false;
+
+    // The right operand of && and || is only evaluated if it is needed.
+    TokenType op = node->compare_op.op;
+    if (op == TOKEN_LOGICAL_AND || op == TOKEN_LOGICAL_OR) {
+        if ((left != 0) == (op == TOKEN_LOGICAL_OR)) {
+            *result = left != 0;
+            return true;
+        }
+        if (!eval(node->compare_op.right, &right))
+            return false;
+        *result = right != 0;
+        return true;
+    }
+
+    if (!eval(node->compare_op.right, &right))
+        return false;
+
+    switch (op) {
+    case TOKEN_EQUALS: *result = left == right; return true;
+    case TOKEN_NOT_EQUALS: *result = left != right; return true;
+    case TOKEN_LESS_THAN: *result = left < right; return true;
+    case TOKEN_LESS_EQUAL: *result = left <= right; return true;
+    case TOKEN_GREATER_THAN: *result = left > right; return true;
+    case TOKEN_GREATER_EQUAL: *result = left >= right; return true;
+    default: return false;
+    }
+}
+
+static bool eval(ast_node_t *node, u64 *result) {
+    if (g_ceval.fuel == 0)
+        return false;
+    g_ceval.fuel--;
+
+    *result = 0;
+    ceval_var_t *var;
+    u64 cond;
+
+    switch (node->type) {
+    case NODE_NUMBER:
+        *result = (u64)node->number.int_value;
+        return true;
+
+    case NODE_IDENTIFIER:
+        var = find_var(&node->identifier.name);
+        if (!var || !var->num_bytes || !var->is_known)
+            return false;
+        *result = var->value;
+        return true;
+
+    case NODE_ASSIGNMENT:
+        if (node->assignment.left->type != NODE_IDENTIFIER)
+            return false;
+        var = find_var(&node->assignment.left->identifier.name);
+        if (!var || !var->num_bytes || !eval(node->assignment.right, result))
+            return false;
+        store(var, *result);
+        return true;
+
+    case NODE_BINARY_OP:
+        return eval_binary_op(node, result);
+
+    case NODE_UNARY_OP:
+        if (!eval(node->unary_op.operand, result))
+            return false;
+        *result = node->unary_op.operator == TOKEN_MINUS ? 0 - *result : *result == 0;
+        return true;
+
+    case NODE_COMPARE:
+        return eval_compare(node, result);
+
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++) {
+            if (!eval(node->block.statements.data[i], result))
+                return false;
+        }
+        return true;
+
+    case NODE_FUNCTION_CALL: {
+            host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+            if (!func || !func->is_pure)
+                return false;
+            return eval_intrinsic(node, func->intrinsic, result);
+        }
+
+    case NODE_VARIABLE_DECLARATION:
+        var = add_var(node);
+        if (!var->num_bytes)
+            return false;
+        store(var, 0);
+        return true;
+
+    case NODE_WHILE:
+        if (!can_finish_loop(node))
+            return false;
+        while (true) {
+            if (!eval(node->while_loop.condition_expr, &cond))
+                return false;
+            if (!cond)
+                break;
+            if (!eval(node->while_loop.block, result))
+                return false;
+        }
+        *result = 0;
+        return true;
+
+    case NODE_IF:
+        if (!eval(node->if_stmt.condition_expr, &cond))
+            return false;
+        if (cond && !eval(node->if_stmt.then_block, result))
+            return false;
+        if (!cond && node->if_stmt.else_block && !eval(node->if_stmt.else_block, result))
+            return false;
+        *result = 0;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+
+// ***************************************************************************
+// Rewriting
+// ***************************************************************************
+
+static ast_node_t *create_node(ast_node_type_t type, ast_node_t const *pos) {
+    ast_node_t *node = calloc(1, sizeof(ast_node_t));
+    node->type = type;
+    node->source_offset = pos->source_offset;
+    return node;
+}
+
+// Number literals are ints, so bigger values are built 16 bits at a time.
+static ast_node_t *create_constant(u64 val, ast_node_t const *pos) {
+    if (val <= INT_MAX) {
+        ast_node_t *node = create_node(NODE_NUMBER, pos);
+        node->number.int_value = (int)val;
+        return node;
+    }
+
+    ast_node_t *shift = create_node(NODE_BINARY_OP, pos);
+    shift->binary_op.op = TOKEN_SHIFT_LEFT;
+    shift->binary_op.left = create_constant(val >> 16, pos);
+    shift->binary_op.right = create_constant(16, pos);
+
+    ast_node_t *node = create_node(NODE_BINARY_OP, pos);
+    node->binary_op.op = TOKEN_OR;
+    node->binary_op.left = shift;
+    node->binary_op.right = create_constant(val & 0xffff, pos);
+    return node;
+}
+
+static ast_node_t *create_store(strview_t const *name, u64 val, ast_node_t const *pos) {
+    ast_node_t *ident = create_node(NODE_IDENTIFIER, pos);
+    ident->identifier.name = *name;
+
+    ast_node_t *node = create_node(NODE_ASSIGNMENT, pos);
+    node->assignment.left = ident;
+    node->assignment.right = create_constant(val, pos);
+    return node;
+}
+
+// Moves the declarations nested in 'node' to 'decls', because the variables
+// they declare can be used after the statement.
+static void take_declarations(ast_node_t *node, darray_t *decls) {
+    if (node->type == NODE_BLOCK) {
+        for (unsigned i = 0; i < node->block.statements.size; i++) {
+            ast_node_t *stmt = node->block.statements.data[i];
+            if (stmt->type == NODE_VARIABLE_DECLARATION) {
+                darray_append(decls, stmt);
+                node->block.statements.data[i] = create_node(NODE_NUMBER, stmt);
+            }
+            else {
+                take_declarations(stmt, decls);
+            }
+        }
+    }
+    else if (node->type == NODE_WHILE) {
+        take_declarations(node->while_loop.block, decls);
+    }
+    else if (node->type == NODE_IF) {
+        take_declarations(node->if_stmt.then_block, decls);
+        if (node->if_stmt.else_block)
+            take_declarations(node->if_stmt.else_block, decls);
+    }
+}
+
+// A lone constant, or a store of one, can't get any simpler.
+static bool is_constant_statement(ast_node_t const *node) {
+    if (node->type == NODE_ASSIGNMENT) {
+        return node->assignment.left->type == NODE_IDENTIFIER &&
+               node->assignment.right->type == NODE_NUMBER;
+    }
+    return node->type == NODE_NUMBER || node->type == NODE_VARIABLE_DECLARATION;
+}
+
+// Records the state of the variables that 'stmt' writes, before it runs.
+// Only these are looked at afterwards, so the cost of a statement doesn't
+// depend on how many variables there are.
+static void find_written_vars(ast_node_t *stmt) {
+    hashtab_t written = hashtab_create();
+    loop_info_find_written_vars(stmt, &written);
+
+    g_ceval.num_written = 0;
+    for (unsigned i = 0; i < written.capacity; i++) {
+        if (!written.entries[i].key.len)
+            continue;
+        if (g_ceval.num_written == g_ceval.written_capacity) {
+            g_ceval.written_capacity = g_ceval.written_capacity ? g_ceval.written_capacity * 2 : 16;
+            g_ceval.written = realloc(g_ceval.written, g_ceval.written_capacity * sizeof(ceval_written_t));
+        }
+
+        ceval_written_t *w = &g_ceval.written[g_ceval.num_written++];
+        ceval_var_t const *var = find_var(&written.entries[i].key);
+        w->name = written.entries[i].key;
+        w->index = var ? (unsigned)(var - g_ceval.vars) : UINT_MAX;
+        w->value = var ? var->value : 0;
+        w->is_known = var && var->is_known;
+    }
+
+    hashtab_free(&written);
+}
+
+static int compare_written(void const *a, void const *b) {
+    unsigned ia = ((ceval_written_t const *)a)->index;
+    unsigned ib = ((ceval_written_t const *)b)->index;
+    return ia < ib ? -1 : ia > ib;
+}
+
+// Returns the statements that replace 'stmt', which was run to completion with
+// the value 'result'.
+static darray_t replace_statement(ast_node_t *stmt, u64 result, bool is_last) {
+    darray_t replacement = { 0 };
+    take_declarations(stmt, &replacement);
+
+    // Variables declared by the statement start as 0.
+    for (unsigned i = 0; i < g_ceval.num_written; i++) {
+        ceval_written_t *w = &g_ceval.written[i];
+        ceval_var_t const *var = w->index == UINT_MAX ? find_var(&w->name) : NULL;
+        if (var) {
+            w->index = (unsigned)(var - g_ceval.vars);
+            w->is_known = true;
+        }
+    }
+
+    // The stores are in the order that the variables were declared.
+    qsort(g_ceval.written, g_ceval.num_written, sizeof(ceval_written_t), compare_written);
+    for (unsigned i = 0; i < g_ceval.num_written; i++) {
+        ceval_written_t const *w = &g_ceval.written[i];
+        if (w->index == UINT_MAX)
+            continue; // Its declaration wasn't reached.
+        ceval_var_t const *var = &g_ceval.vars[w->index];
+        if (!var->is_known)
+            continue; // Not written on the path that was taken, and still unknown.
+
+        if (!w->is_known || w->value != var->value)
+            darray_append(&replacement, create_store(var->name, var->value, stmt));
+    }
+
+    // The last statement's value is the program's result.
+    if (is_last)
+        darray_append(&replacement, create_constant(result, stmt));
+
+    parser_free_ast(stmt);
+    return replacement;
+}
+
+static void mark_unknown(void) {
+    for (unsigned i = 0; i < g_ceval.num_written; i++) {
+        ceval_var_t *var = find_var(&g_ceval.written[i].name);
+        if (var)
+            var->is_known = false;
+    }
+}
+
+void ceval_run(ast_node_t *ast) {
+    if (g_fuel_budget == 0 || ast->type != NODE_BLOCK)
+        return;
+
+    memset(&g_ceval, 0, sizeof(g_ceval));
+    g_ceval.var_indices = hashtab_create();
+    g_ceval.fuel = g_fuel_budget;
+
+    darray_t old_stmts = ast->block.statements;
+    darray_t new_stmts = { 0 };
+    for (unsigned i = 0; i < old_stmts.size; i++) {
+        ast_node_t *stmt = old_stmts.data[i];
+        bool is_last = i + 1 == old_stmts.size;
+
+        find_written_vars(stmt);
+        u64 result;
+        if (!eval(stmt, &result)) {
+            mark_unknown();
+            darray_append(&new_stmts, stmt);
+            continue;
+        }
+
+        if (is_constant_statement(stmt)) {
+            darray_append(&new_stmts, stmt);
+            continue;
+        }
+
+        darray_t replacement = replace_statement(stmt, result, is_last);
+        for (unsigned j = 0; j < replacement.size; j++)
+            darray_append(&new_stmts, replacement.data[j]);
+        darray_free(&replacement);
+    }
+
+    ast->block.statements = new_stmts;
+    darray_free(&old_stmts);
+    free(g_ceval.written);
+    free(g_ceval.vars);
+    hashtab_free(&g_ceval.var_indices);
+    memset(&g_ceval, 0, sizeof(g_ceval));
+}
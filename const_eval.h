@@ -0,0 +1,22 @@
+// Compile-time evaluation.
+//
+// Runs the program's top level statements during compilation, for as long as
+// they only read values that are known then. A statement that can be run this
+// way is replaced by stores of the final values of the variables it changed,
+// so a loop over constants costs nothing at run time.
+//
+// Anything that depends on a host function, an array or a vector, or that
+// would fault, is left to run at run time, and the variables it writes are no
+// longer known. The number of nodes evaluated is limited by a fuel budget, so
+// that compile time stays bounded.
+
+#pragma once
+
+
+typedef struct _ast_node_t ast_node_t;
+
+
+// The default is 10000 nodes. 0 turns the evaluation off.
+void ceval_set_fuel(unsigned fuel);
+
+void ceval_run(ast_node_t *ast);
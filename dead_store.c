@@ -0,0 +1,434 @@
+// Own header
+#include "dead_store.h"
+
+// This project's headers
+#include "common.h"
+#include "hash_table.h"
+#include "host_funcs.h"
+#include "parser.h"
+
+// Standard headers
+#include <stdbool.h>
+#include <string.h>
+
+
+// The analysis is a backwards walk over each block, tracking the set of
+// variables whose current value may still be read. An assignment to a variable
+// that is not in the set is dead. The uses on the right of a dead assignment
+// are not added to the set, so chains of dead stores are removed in one pass.
+//
+// Loops are iterated to a fixed point before anything is rewritten. Because
+// the live sets only grow while iterating, starting from the empty set finds
+// the smallest (and still correct) answer.
+//
+// Each variable gets an index and a live set is a bit set of those indices.
+
+
+typedef struct {
+    hashtab_t var_indices; // Maps variable name to 1 + index.
+    unsigned num_vars;
+    unsigned num_words; // Number of u64s in each live set.
+} dse_t;
+
+static dse_t g_dse;
+
+
+// ***************************************************************************
+// Live sets
+// ***************************************************************************
+
+static u64 *liveset_create(void) {
+    return calloc(g_dse.num_words ? g_dse.num_words : 1, sizeof(u64));
+}
+
+static u64 *liveset_clone(u64 const *src) {
+    u64 *rv = liveset_create();
+    memcpy(rv, src, g_dse.num_words * sizeof(u64));
+    return rv;
+}
+
+// Returns true if 'dst' changed.
+static bool liveset_union(u64 *dst, u64 const *src) {
+    bool changed = false;
+    for (unsigned i = 0; i < g_dse.num_words; i++) {
+        u64 merged = dst[i] | src[i];
+        changed |= merged != dst[i];
+        dst[i] = merged;
+    }
+    return changed;
+}
+
+static int get_var_index(strview_t const *name) {
+    void *val = hashtab_get(&g_dse.var_indices, name);
+    return val ? (int)((uintptr_t)val - 1) : -1;
+}
+
+static bool is_live(u64 const *live, strview_t const *name) {
+    int idx = get_var_index(name);
+    if (idx < 0) return true;
+    return (live[idx / 64] >> (idx % 64)) & 1;
+}
+
+static void set_live(u64 *live, strview_t const *name) {
+    int idx = get_var_index(name);
+    if (idx >= 0) live[idx / 64] |= 1ull << (idx % 64);
+}
+
+static void set_dead(u64 *live, strview_t const *name) {
+    int idx = get_var_index(name);
+    if (idx >= 0) live[idx / 64] &= ~(1ull << (idx % 64));
+}
+
+
+// ***************************************************************************
+// Analysis
+// ***************************************************************************
+
+static void number_vars(ast_node_t *node) {
+    if (node->type == NODE_VARIABLE_DECLARATION) {
+        g_dse.num_vars++;
+        hashtab_put(&g_dse.var_indices, &node->var_decl.identifier_name,
+                    (void *)(uintptr_t)g_dse.num_vars);
+    }
+    else if (node->type == NODE_BLOCK) {
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            number_vars(node->block.statements.data[i]);
+    }
+    else if (node->type == NODE_WHILE) {
+        number_vars(node->while_loop.block);
+    }
+    else if (node->type == NODE_IF) {
+        number_vars(node->if_stmt.then_block);
+        if (node->if_stmt.else_block)
+            number_vars(node->if_stmt.else_block);
+    }
+}
+
+static bool has_side_effects(ast_node_t *node) {
+    switch (node->type) {
+    case NODE_ASSIGNMENT:
+        return true;
+    case NODE_BINARY_OP: {
+            // Dividing by zero is a runtime error.
+            TokenType op = node->binary_op.op;
+            ast_node_t *divisor = node->binary_op.right;
+            if ((op == TOKEN_DIVIDE || op == TOKEN_MODULO) &&
+                (divisor->type != NODE_NUMBER || divisor->number.int_value == 0))
+                return true;
+            return has_side_effects(node->binary_op.left) || has_side_effects(node->binary_op.right);
+        }
+    case NODE_COMPARE:
+        return has_side_effects(node->compare_op.left) || has_side_effects(node->compare_op.right);
+    case NODE_UNARY_OP:
+        return has_side_effects(node->unary_op.operand);
+    case NODE_INDEX:
+        return true; // It can fault.
+    case NODE_FUNCTION_CALL: {
+            host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+            if (!func || !func->is_pure)
+                return true;
+            for (unsigned i = 0; i < node->func_call.parameters.size; i++) {
+                if (has_side_effects(node->func_call.parameters.data[i]))
+                    return true;
+            }
+            return false;
+        }
+    default:
+        return false;
+    }
+}
+
+// Adds every variable read by an expression to the live set. Assignments
+// nested inside expressions are never removed and, to stay conservative, do
+// not kill the variable they write.
+static void add_uses(ast_node_t *node, u64 *live) {
+    switch (node->type) {
+    case NODE_IDENTIFIER:
+        set_live(live, &node->identifier.name);
+        break;
+    case NODE_ASSIGNMENT:
+        add_uses(node->assignment.right, live);
+        break;
+    case NODE_BINARY_OP:
+        add_uses(node->binary_op.left, live);
+        add_uses(node->binary_op.right, live);
+        break;
+    case NODE_COMPARE:
+        add_uses(node->compare_op.left, live);
+        add_uses(node->compare_op.right, live);
+        break;
+    case NODE_UNARY_OP:
+        add_uses(node->unary_op.operand, live);
+        break;
+    case NODE_FUNCTION_CALL:
+        for (unsigned i = 0; i < node->func_call.parameters.size; i++)
+            add_uses(node->func_call.parameters.data[i], live);
+        break;
+    case NODE_INDEX:
+        add_uses(node->index.array, live);
+        add_uses(node->index.index, live);
+        break;
+    default:
+        break;
+    }
+}
+
+// Transforms 'live' from the set of variables live after 'node' to the set
+// live before it. If 'rewrite' is true, the return value is what should
+// replace 'node' in its block. That is NULL if the statement can be deleted.
+static ast_node_t *process_statement(ast_node_t *node, u64 *live, bool rewrite);
+
+static void process_block(ast_node_t *node, u64 *live, bool rewrite) {
+    darray_t *stmts = &node->block.statements;
+    for (unsigned i = stmts->size; i-- > 0;)
+        stmts->data[i] = process_statement(stmts->data[i], live, rewrite);
+
+    if (!rewrite)
+        return;
+
+    unsigned num_kept = 0;
+    for (unsigned i = 0; i < stmts->size; i++) {
+        if (stmts->data[i])
+            stmts->data[num_kept++] = stmts->data[i];
+    }
+    stmts->size = num_kept;
+}
+
+static void process_while(ast_node_t *node, u64 *live, bool rewrite) {
+    // The variables live at the loop head are those read by the condition,
+    // plus those live after the loop, plus those live at the start of the body.
+    u64 *head = liveset_clone(live);
+    add_uses(node->while_loop.condition_expr, head);
+
+    while (true) {
+        u64 *body = liveset_clone(head);
+        process_block(node->while_loop.block, body, false);
+        bool changed = liveset_union(head, body);
+        free(body);
+        if (!changed)
+            break;
+    }
+
+    if (rewrite) {
+        u64 *body = liveset_clone(head);
+        process_block(node->while_loop.block, body, true);
+        free(body);
+    }
+
+    memcpy(live, head, g_dse.num_words * sizeof(u64));
+    free(head);
+}
+
+static void process_if(ast_node_t *node, u64 *live, bool rewrite) {
+    // A variable is live before the if if it is live at the start of either
+    // branch, or is read by the condition. Without an else, the other branch
+    // is empty, so everything live after the if stays live.
+    u64 *then_live = liveset_clone(live);
+    process_block(node->if_stmt.then_block, then_live, rewrite);
+    if (node->if_stmt.else_block)
+        process_block(node->if_stmt.else_block, live, rewrite);
+    liveset_union(live, then_live);
+    free(then_live);
+
+    add_uses(node->if_stmt.condition_expr, live);
+}
+
+static ast_node_t *process_statement(ast_node_t *node, u64 *live, bool rewrite) {
+    switch (node->type) {
+    case NODE_ASSIGNMENT: {
+            ast_node_t *left = node->assignment.left;
+            ast_node_t *right = node->assignment.right;
+            if (left->type != NODE_IDENTIFIER) {
+                // A store to an array element. The array is used, not killed.
+                add_uses(left, live);
+                add_uses(right, live);
+                return node;
+            }
+
+            if (is_live(live, &left->identifier.name)) {
+                set_dead(live, &left->identifier.name);
+                add_uses(right, live);
+                return node;
+            }
+
+            // Dead store. Keep the right hand side only if it does something.
+            bool keep_right = has_side_effects(right);
+            if (keep_right)
+                add_uses(right, live);
+
+            if (rewrite) {
+                if (keep_right)
+                    node->assignment.right = NULL;
+                parser_free_ast(node);
+                return keep_right ? right : NULL;
+            }
+            return node;
+        }
+
+    case NODE_VARIABLE_DECLARATION:
+        // The declaration zero-initializes the variable. That is a dead store
+        // if the variable is written before it is next read.
+        if (rewrite && !node->var_decl.type_info.is_array)
+            node->var_decl.skip_zero_init = !is_live(live, &node->var_decl.identifier_name);
+        set_dead(live, &node->var_decl.identifier_name);
+        return node;
+
+    case NODE_BLOCK:
+        process_block(node, live, rewrite);
+        return node;
+
+    case NODE_WHILE:
+        process_while(node, live, rewrite);
+        return node;
+
+    case NODE_IF:
+        process_if(node, live, rewrite);
+        return node;
+
+    default:
+        // An expression statement.
+        add_uses(node, live);
+        return node;
+    }
+}
+
+
+// The program's result is the value of its last statement, so a variable
+// assigned there is read after the end.
+static void add_result_uses(ast_node_t *node, u64 *live) {
+    while (node->type == NODE_BLOCK && node->block.statements.size)
+        node = node->block.statements.data[node->block.statements.size - 1];
+    if (node->type == NODE_ASSIGNMENT && node->assignment.left->type == NODE_IDENTIFIER)
+        set_live(live, &node->assignment.left->identifier.name);
+}
+
+
+// Scope is flat, so a variable declared in a branch or loop body that doesn't
+// run can still be read after it. Those reads see the zero that every variable
+// starts with, and are exactly the variables still live at the start.
+static void mark_reads_before_decls(ast_node_t *node, u64 const *live) {
+    if (node->type == NODE_VARIABLE_DECLARATION) {
+        node->var_decl.read_before_decl = is_live(live, &node->var_decl.identifier_name);
+    }
+    else if (node->type == NODE_BLOCK) {
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            mark_reads_before_decls(node->block.statements.data[i], live);
+    }
+    else if (node->type == NODE_WHILE) {
+        mark_reads_before_decls(node->while_loop.block, live);
+    }
+    else if (node->type == NODE_IF) {
+        mark_reads_before_decls(node->if_stmt.then_block, live);
+        if (node->if_stmt.else_block)
+            mark_reads_before_decls(node->if_stmt.else_block, live);
+    }
+}
+
+
+// ***************************************************************************
+// Unused variable removal
+// ***************************************************************************
+
+static void find_referenced_vars(ast_node_t *node, hashtab_t *referenced) {
+    switch (node->type) {
+    case NODE_IDENTIFIER:
+        hashtab_put(referenced, &node->identifier.name, node);
+        break;
+    case NODE_ASSIGNMENT:
+        find_referenced_vars(node->assignment.left, referenced);
+        find_referenced_vars(node->assignment.right, referenced);
+        break;
+    case NODE_BINARY_OP:
+        find_referenced_vars(node->binary_op.left, referenced);
+        find_referenced_vars(node->binary_op.right, referenced);
+        break;
+    case NODE_COMPARE:
+        find_referenced_vars(node->compare_op.left, referenced);
+        find_referenced_vars(node->compare_op.right, referenced);
+        break;
+    case NODE_UNARY_OP:
+        find_referenced_vars(node->unary_op.operand, referenced);
+        break;
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_referenced_vars(node->block.statements.data[i], referenced);
+        break;
+    case NODE_FUNCTION_CALL:
+        for (unsigned i = 0; i < node->func_call.parameters.size; i++)
+            find_referenced_vars(node->func_call.parameters.data[i], referenced);
+        break;
+    case NODE_WHILE:
+        find_referenced_vars(node->while_loop.condition_expr, referenced);
+        find_referenced_vars(node->while_loop.block, referenced);
+        break;
+    case NODE_IF:
+        find_referenced_vars(node->if_stmt.condition_expr, referenced);
+        find_referenced_vars(node->if_stmt.then_block, referenced);
+        if (node->if_stmt.else_block)
+            find_referenced_vars(node->if_stmt.else_block, referenced);
+        break;
+    case NODE_INDEX:
+        find_referenced_vars(node->index.array, referenced);
+        find_referenced_vars(node->index.index, referenced);
+        break;
+    default:
+        break;
+    }
+}
+
+static void remove_unused_decls(ast_node_t *node, hashtab_t const *referenced) {
+    if (node->type == NODE_WHILE) {
+        remove_unused_decls(node->while_loop.block, referenced);
+        return;
+    }
+    if (node->type == NODE_IF) {
+        remove_unused_decls(node->if_stmt.then_block, referenced);
+        if (node->if_stmt.else_block)
+            remove_unused_decls(node->if_stmt.else_block, referenced);
+        return;
+    }
+
+    if (node->type != NODE_BLOCK)
+        return;
+
+    darray_t *stmts = &node->block.statements;
+    unsigned num_kept = 0;
+    for (unsigned i = 0; i < stmts->size; i++) {
+        ast_node_t *stmt = stmts->data[i];
+        if (stmt->type == NODE_VARIABLE_DECLARATION &&
+            !hashtab_get(referenced, &stmt->var_decl.identifier_name)) {
+            parser_free_ast(stmt);
+            continue;
+        }
+
+        remove_unused_decls(stmt, referenced);
+        stmts->data[num_kept++] = stmt;
+    }
+    stmts->size = num_kept;
+}
+
+
+// ***************************************************************************
+// Public functions
+// ***************************************************************************
+
+void dse_run(ast_node_t *ast) {
+    g_dse.var_indices = hashtab_create();
+    g_dse.num_vars = 0;
+    number_vars(ast);
+    g_dse.num_words = (g_dse.num_vars + 63) / 64;
+
+    // Only the result is live when the program ends.
+    u64 *live = liveset_create();
+    add_result_uses(ast, live);
+    process_statement(ast, live, true);
+    mark_reads_before_decls(ast, live);
+    free(live);
+
+    hashtab_t referenced = hashtab_create();
+    find_referenced_vars(ast, &referenced);
+    remove_unused_decls(ast, &referenced);
+
+    hashtab_free(&referenced);
+    hashtab_free(&g_dse.var_indices);
+}
@@ -0,0 +1,15 @@
+// Dead Store Elimination.
+//
+// A liveness analysis over the AST that removes:
+// * Assignments whose value is never read.
+// * The implicit zero-initialization of variables that are always assigned
+//   before they are read.
+// * Declarations of variables that are never used, so they get no stack slot.
+
+#pragma once
+
+
+typedef struct _ast_node_t ast_node_t;
+
+
+void dse_run(ast_node_t *ast);
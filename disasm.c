@@ -0,0 +1,682 @@
+// Own header
+#include "disasm.h"
+
+// Standard headers
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+
+typedef struct {
+    u8 const *start;
+    u8 const *p;
+    u8 const *end;
+    unsigned code_offset;
+    disasm_instr_t *instr;
+    unsigned text_len;
+    bool bad;
+
+    // Prefixes
+    bool opsize; // 0x66
+    u8 rep;      // 0xf2 or 0xf3, or 0
+    bool has_rex;
+    bool rex_w, rex_r, rex_x, rex_b;
+    bool vex;
+    bool vex_l;
+    unsigned vex_vvvv;
+
+    // ModR/M. reg and rm include the REX extension bits.
+    unsigned mod, reg, rm;
+    int base, index; // -1 if absent
+    unsigned scale;
+    i32 disp;
+    bool rip_relative;
+} decoder_t;
+
+
+static char const *g_cond_names[16] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g"
+};
+
+static char const *g_alu_names[8] = { "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp" };
+static char const *g_shift_names[8] = { "rol", "ror", "rcl", "rcr", "shl", "shr", "sal", "sar" };
+static char const *g_unary_names[8] = { "test", "(bad)", "not", "neg", "mul", "imul", "div", "idiv" };
+
+static char const *g_reg64_names[16] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+static char const *g_reg32_names[16] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"
+};
+static char const *g_reg16_names[16] = {
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"
+};
+static char const *g_reg8_names[16] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+};
+static char const *g_reg8_legacy_names[4] = { "ah", "ch", "dh", "bh" };
+
+
+static void emit(decoder_t *d, char const *fmt, ...) {
+    if (d->text_len >= DISASM_MAX_TEXT - 1)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(d->instr->text + d->text_len, DISASM_MAX_TEXT - d->text_len, fmt, args);
+    va_end(args);
+    if (n > 0)
+        d->text_len += n;
+    if (d->text_len > DISASM_MAX_TEXT - 1)
+        d->text_len = DISASM_MAX_TEXT - 1;
+}
+
+static u8 next_byte(decoder_t *d) {
+    if (d->p == d->end) {
+        d->bad = true;
+        return 0;
+    }
+    return *d->p++;
+}
+
+static i32 read_i8(decoder_t *d) {
+    return (i8)next_byte(d);
+}
+
+static i32 read_i32(decoder_t *d) {
+    u32 v = 0;
+    for (unsigned i = 0; i < 4; i++)
+        v |= (u32)next_byte(d) << (i * 8);
+    return (i32)v;
+}
+
+static u64 read_u64(decoder_t *d) {
+    u64 v = 0;
+    for (unsigned i = 0; i < 8; i++)
+        v |= (u64)next_byte(d) << (i * 8);
+    return v;
+}
+
+
+// ***************************************************************************
+// Operands
+// ***************************************************************************
+
+// Size of a general purpose operand, from the prefixes.
+static unsigned gp_size(decoder_t const *d) {
+    return d->rex_w ? 8 : d->opsize ? 2 : 4;
+}
+
+static void emit_reg(decoder_t *d, unsigned reg, unsigned num_bytes) {
+    switch (num_bytes) {
+    case 1:
+        if (!d->has_rex && reg >= 4 && reg < 8)
+            emit(d, "%s", g_reg8_legacy_names[reg - 4]);
+        else
+            emit(d, "%s", g_reg8_names[reg]);
+        break;
+    case 2: emit(d, "%s", g_reg16_names[reg]); break;
+    case 4: emit(d, "%s", g_reg32_names[reg]); break;
+    case 8: emit(d, "%s", g_reg64_names[reg]); break;
+    case 16: emit(d, "xmm%u", reg); break;
+    case 32: emit(d, "ymm%u", reg); break;
+    }
+}
+
+static void emit_hex(decoder_t *d, i64 val) {
+    if (val < 0)
+        emit(d, "-0x%llx", (unsigned long long)-val);
+    else
+        emit(d, "0x%llx", (unsigned long long)val);
+}
+
+static void decode_modrm(decoder_t *d) {
+    u8 modrm = next_byte(d);
+    d->mod = modrm >> 6;
+    d->reg = ((modrm >> 3) & 7) | (d->rex_r ? 8 : 0);
+    d->rm = (modrm & 7) | (d->rex_b ? 8 : 0);
+    d->base = -1;
+    d->index = -1;
+    d->scale = 1;
+    d->disp = 0;
+    d->rip_relative = false;
+    if (d->mod == 3)
+        return;
+
+    if ((modrm & 7) == 4) {
+        u8 sib = next_byte(d);
+        d->scale = 1u << (sib >> 6);
+        unsigned index = ((sib >> 3) & 7) | (d->rex_x ? 8 : 0);
+        if (index != 4)
+            d->index = index;
+        if ((sib & 7) == 5 && d->mod == 0)
+            d->disp = read_i32(d); // No base
+        else
+            d->base = (sib & 7) | (d->rex_b ? 8 : 0);
+    }
+    else if ((modrm & 7) == 5 && d->mod == 0) {
+        d->rip_relative = true;
+        d->disp = read_i32(d);
+    }
+    else {
+        d->base = d->rm;
+    }
+
+    if (d->mod == 1)
+        d->disp = read_i8(d);
+    else if (d->mod == 2)
+        d->disp = read_i32(d);
+}
+
+// The r/m operand. 'num_bytes' is its size, which also picks the register
+// names when it is a register.
+static void emit_rm(decoder_t *d, unsigned num_bytes) {
+    if (d->mod == 3) {
+        emit_reg(d, d->rm, num_bytes);
+        return;
+    }
+
+    switch (num_bytes) {
+    case 1: emit(d, "byte ptr "); break;
+    case 2: emit(d, "word ptr "); break;
+    case 4: emit(d, "dword ptr "); break;
+    case 8: emit(d, "qword ptr "); break;
+    case 16: emit(d, "xmmword ptr "); break;
+    case 32: emit(d, "ymmword ptr "); break;
+    }
+
+    emit(d, "[");
+    bool empty = true;
+    if (d->rip_relative) {
+        emit(d, "rip");
+        empty = false;
+    }
+    if (d->base >= 0) {
+        emit(d, "%s", g_reg64_names[d->base]);
+        empty = false;
+    }
+    if (d->index >= 0) {
+        emit(d, "%s%s", empty ? "" : " + ", g_reg64_names[d->index]);
+        if (d->scale > 1)
+            emit(d, " * %u", d->scale);
+        empty = false;
+    }
+    if (empty)
+        emit_hex(d, d->disp);
+    else if (d->disp > 0)
+        emit(d, " + 0x%x", (unsigned)d->disp);
+    else if (d->disp < 0)
+        emit(d, " - 0x%x", (unsigned)-(i64)d->disp);
+    emit(d, "]");
+}
+
+static void emit_branch_target(decoder_t *d, i32 rel) {
+    unsigned next = d->code_offset + (unsigned)(d->p - d->start);
+    emit(d, "0x%x", next + rel);
+}
+
+// "name reg, r/m" or "name r/m, reg"
+static void emit_reg_rm(decoder_t *d, char const *name, unsigned num_bytes, bool rm_first) {
+    decode_modrm(d);
+    emit(d, "%s ", name);
+    if (rm_first) {
+        emit_rm(d, num_bytes);
+        emit(d, ", ");
+        emit_reg(d, d->reg, num_bytes);
+    }
+    else {
+        emit_reg(d, d->reg, num_bytes);
+        emit(d, ", ");
+        emit_rm(d, num_bytes);
+    }
+}
+
+
+// ***************************************************************************
+// Vector instructions
+// ***************************************************************************
+
+static unsigned vec_size(decoder_t const *d) {
+    return d->vex_l ? 32 : 16;
+}
+
+// "name xmm, xmm/m", or with VEX "vname xmm, xmm, xmm/m".
+static void emit_sse_binary(decoder_t *d, char const *name) {
+    decode_modrm(d);
+    unsigned n = vec_size(d);
+    emit(d, "%s%s ", d->vex ? "v" : "", name);
+    emit_reg(d, d->reg, n);
+    emit(d, ", ");
+    if (d->vex) {
+        emit_reg(d, d->vex_vvvv, n);
+        emit(d, ", ");
+    }
+    emit_rm(d, n);
+}
+
+// Two operand forms, that don't use VEX.vvvv.
+static void emit_sse_move(decoder_t *d, char const *name, unsigned reg_num_bytes,
+                          unsigned rm_num_bytes, bool rm_first) {
+    decode_modrm(d);
+    emit(d, "%s%s ", d->vex ? "v" : "", name);
+    if (rm_first) {
+        emit_rm(d, rm_num_bytes);
+        emit(d, ", ");
+        emit_reg(d, d->reg, reg_num_bytes);
+    }
+    else {
+        emit_reg(d, d->reg, reg_num_bytes);
+        emit(d, ", ");
+        emit_rm(d, rm_num_bytes);
+    }
+}
+
+// Opcodes in the 0x0f map that only exist with a 0x66 prefix (or VEX.pp = 1).
+static bool decode_0f_66(decoder_t *d, u8 op) {
+    unsigned n = vec_size(d);
+    switch (op) {
+    case 0x50: emit_sse_move(d, "movmskpd", 4, n, false); return true;
+    case 0x6c: emit_sse_binary(d, "punpcklqdq"); return true;
+    case 0x6e: emit_sse_move(d, d->rex_w ? "movq" : "movd", 16, d->rex_w ? 8 : 4, false); return true;
+    case 0x6f: emit_sse_move(d, "movdqa", n, n, false); return true;
+    case 0x70:
+        emit_sse_move(d, "pshufd", n, n, false);
+        emit(d, ", 0x%x", next_byte(d));
+        return true;
+    case 0x74: emit_sse_binary(d, "pcmpeqb"); return true;
+    case 0x75: emit_sse_binary(d, "pcmpeqw"); return true;
+    case 0x76: emit_sse_binary(d, "pcmpeqd"); return true;
+    case 0x7e: emit_sse_move(d, d->rex_w ? "movq" : "movd", 16, d->rex_w ? 8 : 4, true); return true;
+    case 0x7f: emit_sse_move(d, "movdqa", n, n, true); return true;
+    case 0xd4: emit_sse_binary(d, "paddq"); return true;
+    case 0xd7: emit_sse_move(d, "pmovmskb", 4, n, false); return true;
+    case 0xdb: emit_sse_binary(d, "pand"); return true;
+    case 0xdf: emit_sse_binary(d, "pandn"); return true;
+    case 0xeb: emit_sse_binary(d, "por"); return true;
+    case 0xef: emit_sse_binary(d, "pxor"); return true;
+    case 0xf6: emit_sse_binary(d, "psadbw"); return true;
+    case 0xf8: emit_sse_binary(d, "psubb"); return true;
+    case 0xfa: emit_sse_binary(d, "psubd"); return true;
+    case 0xfb: emit_sse_binary(d, "psubq"); return true;
+    case 0xfc: emit_sse_binary(d, "paddb"); return true;
+    case 0xfd: emit_sse_binary(d, "paddw"); return true;
+    case 0xfe: emit_sse_binary(d, "paddd"); return true;
+    }
+    return false;
+}
+
+static void decode_0f38(decoder_t *d) {
+    u8 op = next_byte(d);
+    if (d->opsize && op == 0x29) {
+        emit_sse_binary(d, "pcmpeqq");
+        return;
+    }
+    if (d->opsize && op == 0x17) {
+        emit_sse_move(d, "ptest", vec_size(d), vec_size(d), false);
+        return;
+    }
+
+    // BMI1 and BMI2. These are VEX encoded, and operate on general purpose
+    // registers.
+    if (d->vex && (op == 0xf2 || op == 0xf5 || op == 0xf6 || op == 0xf7)) {
+        // "r, r/m, vvvv" for the shifts and bzhi, otherwise "r, vvvv, r/m".
+        char const *name = NULL;
+        if (op == 0xf2 && !d->opsize && !d->rep)
+            name = "andn";
+        else if (op == 0xf5 && !d->opsize && !d->rep)
+            name = "bzhi";
+        else if (op == 0xf5 && d->rep == 0xf2)
+            name = "pdep";
+        else if (op == 0xf5 && d->rep == 0xf3)
+            name = "pext";
+        else if (op == 0xf6 && d->rep == 0xf2)
+            name = "mulx";
+        else if (op == 0xf7 && d->opsize)
+            name = "shlx";
+        else if (op == 0xf7 && d->rep == 0xf3)
+            name = "sarx";
+        else if (op == 0xf7 && d->rep == 0xf2)
+            name = "shrx";
+        bool vvvv_last = op == 0xf7 || (op == 0xf5 && !d->rep);
+        if (name) {
+            unsigned n = d->rex_w ? 8 : 4;
+            decode_modrm(d);
+            emit(d, "%s ", name);
+            emit_reg(d, d->reg, n);
+            emit(d, ", ");
+            if (vvvv_last) {
+                emit_rm(d, n);
+                emit(d, ", ");
+                emit_reg(d, d->vex_vvvv, n);
+            }
+            else {
+                emit_reg(d, d->vex_vvvv, n);
+                emit(d, ", ");
+                emit_rm(d, n);
+            }
+            return;
+        }
+    }
+
+    d->bad = true;
+}
+
+
+// ***************************************************************************
+// Opcode maps
+// ***************************************************************************
+
+static void decode_0f(decoder_t *d) {
+    u8 op = next_byte(d);
+    unsigned n = gp_size(d);
+
+    if (op == 0x38) {
+        decode_0f38(d);
+        return;
+    }
+    if (d->opsize && decode_0f_66(d, op))
+        return;
+
+    if (op >= 0x40 && op <= 0x4f) {
+        char name[8] = "cmov";
+        strcat(name, g_cond_names[op & 0xf]);
+        emit_reg_rm(d, name, n, false);
+        return;
+    }
+    if (op >= 0x80 && op <= 0x8f) {
+        i32 rel = read_i32(d);
+        emit(d, "j%s ", g_cond_names[op & 0xf]);
+        emit_branch_target(d, rel);
+        return;
+    }
+    if (op >= 0x90 && op <= 0x9f) {
+        decode_modrm(d);
+        emit(d, "set%s ", g_cond_names[op & 0xf]);
+        emit_rm(d, 1);
+        return;
+    }
+
+    switch (op) {
+    case 0x0b:
+        emit(d, "ud2");
+        return;
+    case 0x1f:
+        decode_modrm(d);
+        emit(d, "nop ");
+        emit_rm(d, n);
+        return;
+    case 0x6f:
+        if (d->rep == 0xf3) {
+            emit_sse_move(d, "movdqu", vec_size(d), vec_size(d), false);
+            return;
+        }
+        break;
+    case 0x7e:
+        if (d->rep == 0xf3) {
+            emit_sse_move(d, "movq", 16, 8, false);
+            return;
+        }
+        break;
+    case 0x7f:
+        if (d->rep == 0xf3) {
+            emit_sse_move(d, "movdqu", vec_size(d), vec_size(d), true);
+            return;
+        }
+        break;
+    case 0x77:
+        emit(d, d->vex ? "vzeroupper" : "emms");
+        return;
+    case 0xaf:
+        emit_reg_rm(d, "imul", n, false);
+        return;
+    case 0xb6:
+    case 0xb7:
+    case 0xbe:
+    case 0xbf:
+        decode_modrm(d);
+        emit(d, "%s ", op < 0xbe ? "movzx" : "movsx");
+        emit_reg(d, d->reg, n);
+        emit(d, ", ");
+        emit_rm(d, (op & 1) ? 2 : 1);
+        return;
+    case 0xb8:
+        if (d->rep == 0xf3) {
+            emit_reg_rm(d, "popcnt", n, false);
+            return;
+        }
+        break;
+    case 0xbc:
+        emit_reg_rm(d, d->rep == 0xf3 ? "tzcnt" : "bsf", n, false);
+        return;
+    case 0xbd:
+        emit_reg_rm(d, d->rep == 0xf3 ? "lzcnt" : "bsr", n, false);
+        return;
+    }
+
+    d->bad = true;
+}
+
+static void emit_imm(decoder_t *d, unsigned num_bytes) {
+    emit_hex(d, num_bytes == 1 ? read_i8(d) : read_i32(d));
+}
+
+static void decode_one_byte(decoder_t *d, u8 op) {
+    unsigned n = gp_size(d);
+
+    // add, or, adc, sbb, and, sub, xor, cmp
+    if (op < 0x40 && (op & 7) < 6) {
+        char const *name = g_alu_names[op >> 3];
+        switch (op & 7) {
+        case 0: emit_reg_rm(d, name, 1, true); break;
+        case 1: emit_reg_rm(d, name, n, true); break;
+        case 2: emit_reg_rm(d, name, 1, false); break;
+        case 3: emit_reg_rm(d, name, n, false); break;
+        case 4: emit(d, "%s al, ", name); emit_imm(d, 1); break;
+        case 5: emit(d, "%s ", name); emit_reg(d, 0, n); emit(d, ", "); emit_imm(d, 4); break;
+        }
+        return;
+    }
+
+    if (op >= 0x50 && op <= 0x5f) {
+        emit(d, "%s %s", op < 0x58 ? "push" : "pop", g_reg64_names[(op & 7) | (d->rex_b ? 8 : 0)]);
+        return;
+    }
+    if (op >= 0x91 && op <= 0x97) {
+        emit(d, "xchg ");
+        emit_reg(d, 0, n);
+        emit(d, ", ");
+        emit_reg(d, (op & 7) | (d->rex_b ? 8 : 0), n);
+        return;
+    }
+    if (op >= 0x70 && op <= 0x7f) {
+        i32 rel = read_i8(d);
+        emit(d, "j%s ", g_cond_names[op & 0xf]);
+        emit_branch_target(d, rel);
+        return;
+    }
+    if (op >= 0xb0 && op <= 0xb7) {
+        emit(d, "mov ");
+        emit_reg(d, (op & 7) | (d->rex_b ? 8 : 0), 1);
+        emit(d, ", 0x%x", next_byte(d));
+        return;
+    }
+    if (op >= 0xb8 && op <= 0xbf) {
+        unsigned reg = (op & 7) | (d->rex_b ? 8 : 0);
+        emit(d, "%s ", d->rex_w ? "movabs" : "mov");
+        emit_reg(d, reg, n);
+        if (d->rex_w)
+            emit(d, ", 0x%llx", (unsigned long long)read_u64(d));
+        else
+            emit(d, ", 0x%x", (unsigned)read_i32(d));
+        return;
+    }
+
+    switch (op) {
+    case 0x69:
+    case 0x6b:
+        emit_reg_rm(d, "imul", n, false);
+        emit(d, ", ");
+        emit_imm(d, op == 0x6b ? 1 : 4);
+        return;
+    case 0x80:
+    case 0x81:
+    case 0x83:
+        decode_modrm(d);
+        emit(d, "%s ", g_alu_names[d->reg & 7]);
+        emit_rm(d, op == 0x80 ? 1 : n);
+        emit(d, ", ");
+        emit_imm(d, op == 0x81 ? 4 : 1);
+        return;
+    case 0x84: emit_reg_rm(d, "test", 1, true); return;
+    case 0x85: emit_reg_rm(d, "test", n, true); return;
+    case 0x88: emit_reg_rm(d, "mov", 1, true); return;
+    case 0x89: emit_reg_rm(d, "mov", n, true); return;
+    case 0x8a: emit_reg_rm(d, "mov", 1, false); return;
+    case 0x8b: emit_reg_rm(d, "mov", n, false); return;
+    case 0x8d: emit_reg_rm(d, "lea", n, false); return;
+    case 0xa1:
+        // A 64-bit absolute address, eg a safepoint poll.
+        emit(d, "mov ");
+        emit_reg(d, 0, n);
+        emit(d, ", %s ptr [0x%llx]", n == 8 ? "qword" : n == 2 ? "word" : "dword",
+             (unsigned long long)read_u64(d));
+        return;
+    case 0x90: emit(d, "nop"); return;
+    case 0x99: emit(d, d->rex_w ? "cqo" : "cdq"); return;
+    case 0xc0:
+    case 0xc1:
+    case 0xd0:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+        decode_modrm(d);
+        emit(d, "%s ", g_shift_names[d->reg & 7]);
+        emit_rm(d, (op & 1) ? n : 1);
+        if (op <= 0xc1)
+            emit(d, ", 0x%x", next_byte(d));
+        else if (op <= 0xd1)
+            emit(d, ", 1");
+        else
+            emit(d, ", cl");
+        return;
+    case 0xc3: emit(d, "ret"); return;
+    case 0xc6:
+    case 0xc7:
+        decode_modrm(d);
+        emit(d, "mov ");
+        emit_rm(d, op == 0xc6 ? 1 : n);
+        emit(d, ", ");
+        emit_imm(d, op == 0xc6 ? 1 : 4);
+        return;
+    case 0xc9: emit(d, "leave"); return;
+    case 0xcc: emit(d, "int3"); return;
+    case 0xe8:
+    case 0xe9:
+    case 0xeb: {
+        i32 rel = op == 0xeb ? read_i8(d) : read_i32(d);
+        emit(d, "%s ", op == 0xe8 ? "call" : "jmp");
+        emit_branch_target(d, rel);
+        return;
+    }
+    case 0xf6:
+    case 0xf7: {
+        unsigned size = op == 0xf6 ? 1 : n;
+        decode_modrm(d);
+        emit(d, "%s ", g_unary_names[d->reg & 7]);
+        emit_rm(d, size);
+        if ((d->reg & 7) == 0) {
+            emit(d, ", ");
+            emit_imm(d, size == 1 ? 1 : 4);
+        }
+        return;
+    }
+    case 0xfe:
+    case 0xff:
+        decode_modrm(d);
+        switch (d->reg & 7) {
+        case 0: emit(d, "inc "); emit_rm(d, op == 0xfe ? 1 : n); return;
+        case 1: emit(d, "dec "); emit_rm(d, op == 0xfe ? 1 : n); return;
+        case 2: emit(d, "call "); emit_rm(d, 8); return;
+        case 4: emit(d, "jmp "); emit_rm(d, 8); return;
+        case 6: emit(d, "push "); emit_rm(d, 8); return;
+        }
+        break;
+    }
+
+    d->bad = true;
+}
+
+static void decode_vex(decoder_t *d, u8 first) {
+    unsigned map = 1;
+    u8 b1 = next_byte(d);
+    d->rex_r = !(b1 & 0x80);
+    if (first == 0xc4) {
+        d->rex_x = !(b1 & 0x40);
+        d->rex_b = !(b1 & 0x20);
+        map = b1 & 0x1f;
+        b1 = next_byte(d);
+        d->rex_w = (b1 & 0x80) != 0;
+    }
+    d->vex = true;
+    d->has_rex = true;
+    d->vex_vvvv = (~b1 >> 3) & 0xf;
+    d->vex_l = (b1 & 4) != 0;
+    switch (b1 & 3) {
+    case 1: d->opsize = true; break;
+    case 2: d->rep = 0xf3; break;
+    case 3: d->rep = 0xf2; break;
+    }
+
+    if (map == 1)
+        decode_0f(d);
+    else if (map == 2)
+        decode_0f38(d);
+    else
+        d->bad = true;
+}
+
+void disasm_one(u8 const *code, unsigned num_bytes, unsigned code_offset, disasm_instr_t *instr) {
+    decoder_t d;
+    memset(&d, 0, sizeof(d));
+    d.start = code;
+    d.p = code;
+    d.end = code + num_bytes;
+    d.code_offset = code_offset;
+    d.instr = instr;
+    instr->text[0] = '\0';
+
+    while (d.p < d.end && (*d.p == 0x66 || *d.p == 0xf2 || *d.p == 0xf3)) {
+        if (*d.p == 0x66)
+            d.opsize = true;
+        else
+            d.rep = *d.p;
+        d.p++;
+    }
+    if (d.p < d.end && (*d.p & 0xf0) == 0x40) {
+        u8 rex = *d.p++;
+        d.has_rex = true;
+        d.rex_w = (rex & 8) != 0;
+        d.rex_r = (rex & 4) != 0;
+        d.rex_x = (rex & 2) != 0;
+        d.rex_b = (rex & 1) != 0;
+    }
+
+    u8 op = next_byte(&d);
+    if (op == 0xc4 || op == 0xc5)
+        decode_vex(&d, op);
+    else if (op == 0x0f)
+        decode_0f(&d);
+    else
+        decode_one_byte(&d, op);
+
+    if (d.bad) {
+        strcpy(instr->text, "(bad)");
+        instr->num_bytes = 1;
+        return;
+    }
+    instr->num_bytes = (unsigned)(d.p - d.start);
+}
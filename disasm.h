@@ -0,0 +1,22 @@
+// A disassembler for the x86-64 instructions that the assembler emits. It
+// understands the general instruction format (prefixes, REX, VEX, ModR/M, SIB,
+// displacements and immediates), but only names the opcodes that Mortar
+// uses. Anything else is shown as "(bad)" and skipped one byte at a time.
+
+#pragma once
+
+// This project's headers
+#include "common.h"
+
+
+enum { DISASM_MAX_TEXT = 96 };
+
+typedef struct {
+    unsigned num_bytes;
+    char text[DISASM_MAX_TEXT]; // Intel syntax, eg "mov rax, qword ptr [rbp-0x18]"
+} disasm_instr_t;
+
+
+// 'code_offset' is where 'code' is in the code buffer, so that branch targets
+// can be shown as offsets too.
+void disasm_one(u8 const *code, unsigned num_bytes, unsigned code_offset, disasm_instr_t *instr);
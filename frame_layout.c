@@ -0,0 +1,343 @@
+// Own header
+#include "frame_layout.h"
+
+// This project's headers
+#include "common.h"
+#include "hash_table.h"
+#include "parser.h"
+#include "runtime.h"
+#include "stack_frame.h"
+
+// Standard headers
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// The nodes are numbered in the order they are evaluated, and a variable's
+// live range runs from its declaration to the last node that refers to it.
+// Mortar's lexical scope is flat, so a variable declared in a block can still
+// be used after the block, and the range is what matters, not the block.
+//
+// A loop runs its nodes more than once. If a variable is live on entry to the
+// loop, or after it, and is used inside, then it is live all the way round
+// the loop, so its range is extended to cover the whole loop. A variable that
+// is declared and used only inside the loop body is redefined by the
+// declaration on each iteration, so the range doesn't need to be extended.
+// Only the loops around one end of a range and not the other can change it,
+// so each range just walks out from the loops around its two ends.
+//
+// Slots are then handed out greedily: a variable reuses a slot of the same
+// size whose previous occupants all died before the variable was declared.
+// The variables are visited in order of size then declaration, and the slots
+// of the current size are kept in a heap ordered by when their occupants die,
+// so only the top of the heap needs checking.
+
+
+#define NO_LOOP UINT_MAX
+
+typedef struct {
+    ast_node_t *decl;
+    unsigned num_bytes;
+    unsigned start; // Node number of the declaration
+    unsigned end;   // Node number of the last use
+    unsigned start_loop; // Innermost loops around the declaration and the
+    unsigned end_loop;   // last use, or NO_LOOP
+} layout_var_t;
+
+typedef struct {
+    unsigned start;
+    unsigned end;
+    unsigned parent; // The loop around this one, or NO_LOOP
+} layout_loop_t;
+
+typedef struct {
+    unsigned offset;
+    unsigned num_bytes;
+    unsigned end; // Where the current occupant dies
+} layout_slot_t;
+
+typedef struct {
+    hashtab_t var_indices; // Maps variable name to 1 + index into 'vars'.
+    layout_var_t *vars;
+    unsigned num_vars;
+    unsigned vars_capacity;
+
+    layout_loop_t *loops; // Outer loops come before the loops inside them.
+    unsigned num_loops;
+    unsigned loops_capacity;
+
+    unsigned num_nodes;
+    unsigned current_loop;
+} layout_t;
+
+static layout_t g_layout;
+
+
+// ***************************************************************************
+// Live ranges
+// ***************************************************************************
+
+static void add_var(ast_node_t *decl) {
+    if (g_layout.num_vars == g_layout.vars_capacity) {
+        g_layout.vars_capacity = g_layout.vars_capacity ? g_layout.vars_capacity * 2 : 16;
+        g_layout.vars = realloc(g_layout.vars, g_layout.vars_capacity * sizeof(layout_var_t));
+    }
+
+    layout_var_t *var = &g_layout.vars[g_layout.num_vars++];
+    var->decl = decl;
+    var->num_bytes = decl->var_decl.type_info.is_array ?
+        sizeof(runtime_array_t) : decl->var_decl.type_info.object_type.num_bytes;
+    var->start = var->end = g_layout.num_nodes;
+    var->start_loop = var->end_loop = g_layout.current_loop;
+    hashtab_put(&g_layout.var_indices, &decl->var_decl.identifier_name,
+                (void *)(uintptr_t)g_layout.num_vars);
+}
+
+static void add_use(strview_t const *name) {
+    void *val = hashtab_get(&g_layout.var_indices, name);
+    if (val) {
+        layout_var_t *var = &g_layout.vars[(uintptr_t)val - 1];
+        var->end = g_layout.num_nodes;
+        var->end_loop = g_layout.current_loop;
+    }
+}
+
+// Returns the index of the new loop. Its end is filled in once its body has
+// been numbered.
+static unsigned add_loop(unsigned start) {
+    if (g_layout.num_loops == g_layout.loops_capacity) {
+        g_layout.loops_capacity = g_layout.loops_capacity ? g_layout.loops_capacity * 2 : 16;
+        g_layout.loops = realloc(g_layout.loops, g_layout.loops_capacity * sizeof(layout_loop_t));
+    }
+
+    layout_loop_t *loop = &g_layout.loops[g_layout.num_loops];
+    loop->start = loop->end = start;
+    loop->parent = g_layout.current_loop;
+    return g_layout.num_loops++;
+}
+
+static void find_ranges(ast_node_t *node) {
+    g_layout.num_nodes++;
+
+    switch (node->type) {
+    case NODE_IDENTIFIER:
+        add_use(&node->identifier.name);
+        break;
+    case NODE_ASSIGNMENT:
+        find_ranges(node->assignment.right);
+        find_ranges(node->assignment.left);
+        break;
+    case NODE_BINARY_OP:
+        find_ranges(node->binary_op.left);
+        find_ranges(node->binary_op.right);
+        break;
+    case NODE_COMPARE:
+        find_ranges(node->compare_op.left);
+        find_ranges(node->compare_op.right);
+        break;
+    case NODE_UNARY_OP:
+        find_ranges(node->unary_op.operand);
+        break;
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_ranges(node->block.statements.data[i]);
+        break;
+    case NODE_FUNCTION_CALL:
+        for (unsigned i = 0; i < node->func_call.parameters.size; i++)
+            find_ranges(node->func_call.parameters.data[i]);
+        break;
+    case NODE_VARIABLE_DECLARATION:
+        add_var(node);
+        break;
+    case NODE_WHILE: {
+            unsigned index = add_loop(g_layout.num_nodes);
+            g_layout.current_loop = index;
+            find_ranges(node->while_loop.condition_expr);
+            find_ranges(node->while_loop.block);
+            g_layout.loops[index].end = g_layout.num_nodes;
+            g_layout.current_loop = g_layout.loops[index].parent;
+            break;
+        }
+    case NODE_IF:
+        find_ranges(node->if_stmt.condition_expr);
+        find_ranges(node->if_stmt.then_block);
+        if (node->if_stmt.else_block)
+            find_ranges(node->if_stmt.else_block);
+        break;
+    case NODE_INDEX:
+        find_ranges(node->index.array);
+        find_ranges(node->index.index);
+        break;
+    default:
+        break;
+    }
+}
+
+static bool is_in_loop(unsigned node, unsigned loop) {
+    return g_layout.loops[loop].start <= node && node <= g_layout.loops[loop].end;
+}
+
+// A loop around the last use but not the declaration pushes the end of the
+// range out to the end of the loop, and one around the declaration but not
+// the last use pushes the start back. The loops around a node only get
+// bigger going outwards, so the outermost of each kind wins. The loops around
+// the new ends already contained both ends of the old range, or contain the
+// loop that moved it, so nothing more can change.
+static void extend_ranges_over_loops(void) {
+    for (unsigned i = 0; i < g_layout.num_vars; i++) {
+        layout_var_t *var = &g_layout.vars[i];
+        unsigned start = var->start;
+        unsigned end = var->end;
+
+        for (unsigned loop = var->end_loop; loop != NO_LOOP && !is_in_loop(start, loop);
+             loop = g_layout.loops[loop].parent)
+            var->end = g_layout.loops[loop].end;
+        for (unsigned loop = var->start_loop; loop != NO_LOOP && !is_in_loop(end, loop);
+             loop = g_layout.loops[loop].parent)
+            var->start = g_layout.loops[loop].start;
+    }
+}
+
+
+// ***************************************************************************
+// Slot assignment
+// ***************************************************************************
+
+static unsigned get_alignment(unsigned num_bytes) {
+    unsigned alignment = 1;
+    while (alignment < 16 && num_bytes % (alignment * 2) == 0)
+        alignment *= 2;
+    return alignment;
+}
+
+// Most aligned first, then biggest first, then in order of declaration.
+static int compare_vars(void const *a, void const *b) {
+    layout_var_t const *var_a = a;
+    layout_var_t const *var_b = b;
+    unsigned align_a = get_alignment(var_a->num_bytes);
+    unsigned align_b = get_alignment(var_b->num_bytes);
+    if (align_a != align_b)
+        return align_a > align_b ? -1 : 1;
+    if (var_a->num_bytes != var_b->num_bytes)
+        return var_a->num_bytes > var_b->num_bytes ? -1 : 1;
+    if (var_a->start != var_b->start)
+        return var_a->start < var_b->start ? -1 : 1;
+    return 0;
+}
+
+// The heap holds indices into 'slots', with the slot that frees up first at
+// the top.
+static void heap_sift_down(unsigned *heap, unsigned num_heap, layout_slot_t const *slots, unsigned i) {
+    while (true) {
+        unsigned smallest = i;
+        unsigned left = 2 * i + 1;
+        unsigned right = left + 1;
+        if (left < num_heap && slots[heap[left]].end < slots[heap[smallest]].end)
+            smallest = left;
+        if (right < num_heap && slots[heap[right]].end < slots[heap[smallest]].end)
+            smallest = right;
+        if (smallest == i)
+            return;
+        unsigned tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void heap_push(unsigned *heap, unsigned *num_heap, layout_slot_t const *slots, unsigned slot) {
+    unsigned i = (*num_heap)++;
+    heap[i] = slot;
+    while (i > 0 && slots[heap[(i - 1) / 2]].end > slots[heap[i]].end) {
+        unsigned parent = (i - 1) / 2;
+        heap[i] = heap[parent];
+        heap[parent] = slot;
+        i = parent;
+    }
+}
+
+// Arrays own a buffer that is freed on exit, so their headers are cleared
+// once on entry and are never shared. So are the scalars that are zeroed, as
+// long as their declaration can't run more than once, and the ones that can be
+// read without their declaration having run, which must read 0.
+static bool is_zeroed_on_entry(layout_var_t const *var) {
+    ast_node_t const *decl = var->decl;
+    return decl->var_decl.type_info.is_array || decl->var_decl.read_before_decl ||
+           (!decl->var_decl.skip_zero_init && var->start_loop == NO_LOOP);
+}
+
+unsigned frame_layout_run(ast_node_t *root) {
+    g_layout.var_indices = hashtab_create();
+    g_layout.current_loop = NO_LOOP;
+    find_ranges(root);
+    extend_ranges_over_loops();
+
+    // Partition the variables so that the ones that are zeroed on entry come
+    // first, then sort each part.
+    unsigned num_zeroed = 0;
+    for (unsigned i = 0; i < g_layout.num_vars; i++) {
+        if (is_zeroed_on_entry(&g_layout.vars[i])) {
+            layout_var_t tmp = g_layout.vars[num_zeroed];
+            g_layout.vars[num_zeroed++] = g_layout.vars[i];
+            g_layout.vars[i] = tmp;
+        }
+    }
+    qsort(g_layout.vars, num_zeroed, sizeof(layout_var_t), compare_vars);
+    qsort(g_layout.vars + num_zeroed, g_layout.num_vars - num_zeroed, sizeof(layout_var_t),
+          compare_vars);
+
+    for (unsigned i = 0; i < num_zeroed; i++) {
+        ast_node_t *decl = g_layout.vars[i].decl;
+        sframe_add_variable(&decl->var_decl.identifier_name, g_layout.vars[i].num_bytes);
+        // A declaration in a loop still has to clear the variable each time.
+        decl->var_decl.zeroed_on_entry = decl->var_decl.type_info.is_array ||
+                                         g_layout.vars[i].start_loop == NO_LOOP;
+    }
+
+    // The clear is rounded up to whole vector stores. That spills into the
+    // first shared slots, which is harmless because nothing has used them yet.
+    unsigned zero_num_bytes = (sframe_get_size() + 15) & ~15u;
+
+    layout_slot_t *slots = NULL;
+    unsigned *heap = NULL; // Only the slots of the current size
+    unsigned num_slots = 0;
+    unsigned num_heap = 0;
+    unsigned slots_capacity = 0;
+    for (unsigned i = num_zeroed; i < g_layout.num_vars; i++) {
+        layout_var_t const *var = &g_layout.vars[i];
+        if (num_heap && slots[heap[0]].num_bytes != var->num_bytes)
+            num_heap = 0;
+
+        if (num_heap && slots[heap[0]].end < var->start) {
+            layout_slot_t *slot = &slots[heap[0]];
+            slot->end = var->end;
+            heap_sift_down(heap, num_heap, slots, 0);
+            sframe_place_variable(&var->decl->var_decl.identifier_name, slot->offset);
+        }
+        else {
+            if (num_slots == slots_capacity) {
+                slots_capacity = slots_capacity ? slots_capacity * 2 : 16;
+                slots = realloc(slots, slots_capacity * sizeof(layout_slot_t));
+                heap = realloc(heap, slots_capacity * sizeof(unsigned));
+            }
+            layout_slot_t *slot = &slots[num_slots];
+            slot->offset = sframe_add_temp(var->num_bytes);
+            slot->num_bytes = var->num_bytes;
+            slot->end = var->end;
+            heap_push(heap, &num_heap, slots, num_slots++);
+            sframe_place_variable(&var->decl->var_decl.identifier_name, slot->offset);
+        }
+        var->decl->var_decl.zeroed_on_entry = false;
+    }
+
+    free(slots);
+    free(heap);
+    free(g_layout.vars);
+    free(g_layout.loops);
+    hashtab_free(&g_layout.var_indices);
+    memset(&g_layout, 0, sizeof(g_layout));
+
+    return zero_num_bytes;
+}
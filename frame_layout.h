@@ -0,0 +1,20 @@
+// Stack frame layout.
+//
+// Gives each variable of a function its stack slot before the code is
+// generated. Variables whose live ranges do not overlap share a slot, and the
+// slots are sorted by alignment so that little padding is needed.
+//
+// The variables that only need zeroing once, rather than each time their
+// declaration runs, are packed together at the top of the frame, so that the
+// function's entry can clear them all with one block of vector stores. Their
+// declarations are marked with 'zeroed_on_entry'.
+
+#pragma once
+
+
+typedef struct _ast_node_t ast_node_t;
+
+
+// Must be called straight after sframe_init(). Returns the number of bytes
+// to clear at offset 0, which is a multiple of 16.
+unsigned frame_layout_run(ast_node_t *root);
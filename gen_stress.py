@@ -0,0 +1,127 @@
+# Generates a synthetic Mortar program, for measuring how the compiler scales
+# with the size of its input. Every variable is assigned before it's used,
+# divisors are never zero and loops run a few times at most, so the program is
+# valid and terminates, but it's meant to be compiled rather than run.
+#
+# Usage: python3 gen_stress.py [--tokens N | --statements N] [--vars N]
+#            [--depth N] [--loop-depth N] [--seed N] [-o path]
+
+import argparse
+import random
+import sys
+
+ARITH_OPS = ['+', '-', '*', '&', '|', '^', '<<', '>>']
+COMPARE_OPS = ['<', '<=', '>', '>=', '==', '!=']
+
+
+class Generator:
+    def __init__(self, num_vars, depth, loop_depth, rng):
+        self.vars = ['v%d' % i for i in range(num_vars)]
+        self.depth = depth
+        self.loop_depth = loop_depth
+        self.rng = rng
+        self.num_loops = 0
+        self.num_tokens = 0
+
+    # Each piece of text is a list of tokens, so that they can be counted as
+    # they're generated.
+    def expr(self, depth):
+        rng = self.rng
+        if depth == 0 or rng.random() < 0.2:
+            if rng.random() < 0.7:
+                return [rng.choice(self.vars)]
+            return [str(rng.randint(0, 1000))]
+
+        left = self.expr(depth - 1)
+        right = self.expr(depth - 1)
+        x = rng.random()
+        if x < 0.1:
+            # Never divide by zero.
+            op = rng.choice(['/', '%'])
+            right = ['('] + right + ['|', '1', ')']
+        elif x < 0.25:
+            op = rng.choice(COMPARE_OPS)
+        else:
+            op = rng.choice(ARITH_OPS)
+        return ['('] + left + [op] + right + [')']
+
+    def assignment(self):
+        return [self.rng.choice(self.vars), '='] + self.expr(self.depth) + [';']
+
+    # Loop counters get their own names, and loops never assign them except
+    # to count up, so every loop terminates.
+    def loop(self, nesting):
+        counter = 'i%d' % self.num_loops
+        self.num_loops += 1
+        trips = str(self.rng.randint(1, 3))
+        body = []
+        for _ in range(self.rng.randint(1, 4)):
+            body += self.statement(nesting + 1)
+        return (['u64', counter, ';', counter, '=', '0', ';',
+                 'while', '(', counter, '<', trips, ')', '{'] + body +
+                [counter, '=', counter, '+', '1', ';', '}'])
+
+    def if_statement(self, nesting):
+        then_body = self.assignment()
+        tokens = ['if', '('] + self.expr(self.depth) + [')', '{'] + then_body + ['}']
+        if self.rng.random() < 0.5:
+            tokens += ['else', '{'] + self.assignment() + ['}']
+        return tokens
+
+    def statement(self, nesting=0):
+        x = self.rng.random()
+        if x < 0.1 and nesting < self.loop_depth:
+            return self.loop(nesting)
+        if x < 0.25:
+            return self.if_statement(nesting)
+        return self.assignment()
+
+    def program(self, out, max_tokens, max_statements):
+        def write(tokens):
+            out.write(' '.join(tokens))
+            out.write('\n')
+            self.num_tokens += len(tokens)
+
+        write(['{'])
+        for v in self.vars:
+            write(['u64', v, ';', v, '=', str(self.rng.randint(0, 1000)), ';'])
+
+        num_statements = 0
+        while True:
+            if max_statements is not None and num_statements >= max_statements:
+                break
+            if max_tokens is not None and self.num_tokens >= max_tokens:
+                break
+            write(self.statement())
+            num_statements += 1
+
+        write([self.vars[0], ';', '}'])
+        return num_statements
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate a synthetic Mortar program.')
+    size = parser.add_mutually_exclusive_group()
+    size.add_argument('--tokens', type=int, help='stop once the program has this many tokens')
+    size.add_argument('--statements', type=int, help='number of top level statements')
+    parser.add_argument('--vars', type=int, default=16, help='number of variables (default 16)')
+    parser.add_argument('--depth', type=int, default=3, help='expression depth (default 3)')
+    parser.add_argument('--loop-depth', type=int, default=2, help='loop nesting (default 2)')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('-o', dest='out_path', help='output file (default stdout)')
+    args = parser.parse_args()
+    if args.tokens is None and args.statements is None:
+        args.statements = 100
+    if args.vars < 1:
+        parser.error('--vars must be at least 1')
+
+    gen = Generator(args.vars, args.depth, args.loop_depth, random.Random(args.seed))
+    out = open(args.out_path, 'w') if args.out_path else sys.stdout
+    num_statements = gen.program(out, args.tokens, args.statements)
+    if args.out_path:
+        out.close()
+    print('%d statements, %d tokens' % (num_statements, gen.num_tokens), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,548 @@
+// Own header
+#include "gvn.h"
+
+// This project's headers
+#include "common.h"
+#include "hash_table.h"
+#include "host_funcs.h"
+#include "lexical_scope.h"
+#include "parser.h"
+#include "types.h"
+
+// Standard headers
+#include <stdlib.h>
+#include <string.h>
+
+
+// The AST is walked in the order the code generator evaluates it. Each
+// expression gets a value number (VN), and each variable has the VN of its
+// current value. Operators, array loads and calls to pure host functions are
+// looked up in a table keyed by the operator and the VNs of the operands. A hit
+// means the node computes a value that is already in a temporary.
+//
+// The table is scoped like the dominator tree. Entries added inside an if
+// branch, a loop, or the right operand of && or ||, are removed on the way out,
+// because that code might not have run. So are the VNs of the variables it
+// assigned, which get fresh VNs after the if. On entry to a loop, every
+// variable written anywhere in it gets a fresh VN, because the body sees the
+// values from the previous iteration.
+//
+// Storing to an element of an array, or resizing it, gives the array variable
+// a fresh VN, so that loads from it don't match loads from before the store.
+// Vectors and strings aren't numbered, so each read of one gets a fresh VN.
+
+
+// Literals get VNs that can't collide with the counter, so that the same
+// literal has the same VN in every scope.
+#define VN_LITERAL_BIT (1ull << 63)
+
+typedef struct {
+    u64 op;   // Node type, plus the operator or host function
+    u64 lhs;  // VNs of the operands
+    u64 rhs;
+} gvn_key_t;
+
+typedef struct {
+    gvn_key_t key;
+    u64 vn;
+    ast_node_t *node; // The first node with this key
+} gvn_expr_t;
+
+typedef struct {
+    unsigned var;
+    u64 old_vn;
+} gvn_undo_t;
+
+typedef struct {
+    ast_node_t *reuse;
+    ast_node_t *original;
+} gvn_match_t;
+
+// A point to return to on the way out of a scope.
+typedef struct {
+    unsigned num_exprs;
+    unsigned num_undos;
+} gvn_mark_t;
+
+typedef struct {
+    u64 next_vn;
+
+    hashtab_t var_indices; // Maps variable name to 1 + index.
+    u64 *var_vns;
+    unsigned num_vars, vars_capacity;
+
+    // A stack of the expressions, in the order they were added, and an open
+    // addressing hash table of 1 + their indices. Entries are only removed
+    // from the top of the stack, which keeps the probe sequences intact.
+    gvn_expr_t *exprs;
+    unsigned num_exprs, exprs_capacity;
+    unsigned *slots;
+    unsigned slots_mask;
+
+    // The old VN of each variable assignment in the current scopes.
+    gvn_undo_t *undos;
+    unsigned num_undos, undos_capacity;
+
+    gvn_match_t *matches;
+    unsigned num_matches, matches_capacity;
+} gvn_t;
+
+static gvn_t g_gvn;
+
+
+// ***************************************************************************
+// Variables
+// ***************************************************************************
+
+static u64 fresh_vn(void) {
+    return g_gvn.next_vn++;
+}
+
+static unsigned get_var(strview_t *name) {
+    void *index = hashtab_get(&g_gvn.var_indices, name);
+    if (index)
+        return (unsigned)((uintptr_t)index - 1);
+
+    if (g_gvn.num_vars == g_gvn.vars_capacity) {
+        g_gvn.vars_capacity = g_gvn.vars_capacity ? g_gvn.vars_capacity * 2 : 16;
+        g_gvn.var_vns = realloc(g_gvn.var_vns, g_gvn.vars_capacity * sizeof(u64));
+    }
+    unsigned var = g_gvn.num_vars++;
+    g_gvn.var_vns[var] = fresh_vn(); // A value from before the code being numbered.
+    hashtab_put(&g_gvn.var_indices, name, (void *)(uintptr_t)(var + 1));
+    return var;
+}
+
+static void set_var_vn(strview_t *name, u64 vn) {
+    unsigned var = get_var(name);
+    if (g_gvn.num_undos == g_gvn.undos_capacity) {
+        g_gvn.undos_capacity = g_gvn.undos_capacity ? g_gvn.undos_capacity * 2 : 16;
+        g_gvn.undos = realloc(g_gvn.undos, g_gvn.undos_capacity * sizeof(gvn_undo_t));
+    }
+    g_gvn.undos[g_gvn.num_undos].var = var;
+    g_gvn.undos[g_gvn.num_undos].old_vn = g_gvn.var_vns[var];
+    g_gvn.num_undos++;
+    g_gvn.var_vns[var] = vn;
+}
+
+// Only u64 scalars hold exactly the value of the expression assigned to them.
+static bool is_u64_scalar(strview_t *name) {
+    derived_type_t *type = lscope_get(name);
+    return type && !type->is_array && type->object_type.num_lanes == 1 &&
+           type->object_type.num_bytes == 8;
+}
+
+static bool is_vector(strview_t *name) {
+    derived_type_t *type = lscope_get(name);
+    return type && !type->is_array && type->object_type.num_lanes > 1;
+}
+
+
+// ***************************************************************************
+// Expression table
+// ***************************************************************************
+
+static unsigned hash_key(gvn_key_t const *key) {
+    u64 h = key->op * 0x9e3779b97f4a7c15ull;
+    h = (h ^ key->lhs) * 0xff51afd7ed558ccdull;
+    h = (h ^ key->rhs) * 0xc4ceb9fe1a85ec53ull;
+    return (unsigned)(h ^ (h >> 32));
+}
+
+static bool keys_equal(gvn_key_t const *a, gvn_key_t const *b) {
+    return a->op == b->op && a->lhs == b->lhs && a->rhs == b->rhs;
+}
+
+static void insert_slot(unsigned expr_index) {
+    unsigned i = hash_key(&g_gvn.exprs[expr_index].key) & g_gvn.slots_mask;
+    while (g_gvn.slots[i])
+        i = (i + 1) & g_gvn.slots_mask;
+    g_gvn.slots[i] = expr_index + 1;
+}
+
+static gvn_expr_t *find_expr(gvn_key_t const *key, unsigned *slot) {
+    unsigned i = hash_key(key) & g_gvn.slots_mask;
+    for (; g_gvn.slots[i]; i = (i + 1) & g_gvn.slots_mask) {
+        gvn_expr_t *expr = &g_gvn.exprs[g_gvn.slots[i] - 1];
+        if (keys_equal(&expr->key, key)) {
+            *slot = i;
+            return expr;
+        }
+    }
+    return NULL;
+}
+
+static void add_expr(gvn_key_t const *key, u64 vn, ast_node_t *node) {
+    if (g_gvn.num_exprs == g_gvn.exprs_capacity) {
+        g_gvn.exprs_capacity = g_gvn.exprs_capacity ? g_gvn.exprs_capacity * 2 : 256;
+        g_gvn.exprs = realloc(g_gvn.exprs, g_gvn.exprs_capacity * sizeof(gvn_expr_t));
+
+        // Keep the load factor at or below a half. Re-inserting in stack
+        // order leaves the table as if it had always been this size.
+        unsigned num_slots = g_gvn.exprs_capacity * 2;
+        free(g_gvn.slots);
+        g_gvn.slots = calloc(num_slots, sizeof(unsigned));
+        g_gvn.slots_mask = num_slots - 1;
+        for (unsigned i = 0; i < g_gvn.num_exprs; i++)
+            insert_slot(i);
+    }
+
+    gvn_expr_t *expr = &g_gvn.exprs[g_gvn.num_exprs];
+    expr->key = *key;
+    expr->vn = vn;
+    expr->node = node;
+    insert_slot(g_gvn.num_exprs++);
+}
+
+static void add_match(ast_node_t *reuse, ast_node_t *original) {
+    if (g_gvn.num_matches == g_gvn.matches_capacity) {
+        g_gvn.matches_capacity = g_gvn.matches_capacity ? g_gvn.matches_capacity * 2 : 16;
+        g_gvn.matches = realloc(g_gvn.matches, g_gvn.matches_capacity * sizeof(gvn_match_t));
+    }
+    g_gvn.matches[g_gvn.num_matches].reuse = reuse;
+    g_gvn.matches[g_gvn.num_matches].original = original;
+    g_gvn.num_matches++;
+}
+
+// Returns the VN of 'node', which computes 'key'.
+static u64 lookup_or_add(ast_node_t *node, gvn_key_t const *key) {
+    unsigned slot;
+    gvn_expr_t *expr = g_gvn.num_exprs ? find_expr(key, &slot) : NULL;
+    if (expr) {
+        add_match(node, expr->node);
+        return expr->vn;
+    }
+
+    u64 vn = fresh_vn();
+    add_expr(key, vn, node);
+    return vn;
+}
+
+
+// ***************************************************************************
+// Scopes
+// ***************************************************************************
+
+static gvn_mark_t enter_scope(void) {
+    gvn_mark_t mark = { g_gvn.num_exprs, g_gvn.num_undos };
+    return mark;
+}
+
+// Forgets the expressions and variable values since 'mark'.
+static void leave_scope(gvn_mark_t mark) {
+    while (g_gvn.num_exprs > mark.num_exprs) {
+        unsigned slot;
+        g_gvn.num_exprs--;
+        find_expr(&g_gvn.exprs[g_gvn.num_exprs].key, &slot);
+        g_gvn.slots[slot] = 0;
+    }
+
+    while (g_gvn.num_undos > mark.num_undos) {
+        gvn_undo_t const *undo = &g_gvn.undos[--g_gvn.num_undos];
+        g_gvn.var_vns[undo->var] = undo->old_vn;
+    }
+}
+
+
+// ***************************************************************************
+// The walk
+// ***************************************************************************
+
+static u64 number_node(ast_node_t *node);
+
+static bool is_commutative(TokenType op) {
+    return op == TOKEN_PLUS || op == TOKEN_MULTIPLY ||
+           op == TOKEN_AND || op == TOKEN_OR || op == TOKEN_XOR;
+}
+
+// Gives every variable that 'node' might write a fresh VN.
+static void clobber_written_vars(ast_node_t *node) {
+    switch (node->type) {
+    case NODE_ASSIGNMENT: {
+            ast_node_t *left = node->assignment.left;
+            if (left->type == NODE_INDEX) {
+                set_var_vn(&left->index.array->identifier.name, fresh_vn());
+                clobber_written_vars(left->index.index);
+            }
+            else {
+                set_var_vn(&left->identifier.name, fresh_vn());
+            }
+            clobber_written_vars(node->assignment.right);
+            break;
+        }
+    case NODE_VARIABLE_DECLARATION:
+        set_var_vn(&node->var_decl.identifier_name, fresh_vn());
+        break;
+    case NODE_FUNCTION_CALL: {
+            host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+            darray_t *params = &node->func_call.parameters;
+            if (func && func->intrinsic == INTRINSIC_APPEND && params->size > 0 &&
+                params->data[0]->type == NODE_IDENTIFIER)
+                set_var_vn(&params->data[0]->identifier.name, fresh_vn());
+            for (unsigned i = 0; i < params->size; i++)
+                clobber_written_vars(params->data[i]);
+            break;
+        }
+    case NODE_BINARY_OP:
+    case NODE_COMPARE:
+        clobber_written_vars(node->binary_op.left);
+        clobber_written_vars(node->binary_op.right);
+        break;
+    case NODE_UNARY_OP:
+        clobber_written_vars(node->unary_op.operand);
+        break;
+    case NODE_INDEX:
+        clobber_written_vars(node->index.index);
+        break;
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            clobber_written_vars(node->block.statements.data[i]);
+        break;
+    case NODE_WHILE:
+        clobber_written_vars(node->while_loop.condition_expr);
+        clobber_written_vars(node->while_loop.block);
+        break;
+    case NODE_IF:
+        clobber_written_vars(node->if_stmt.condition_expr);
+        clobber_written_vars(node->if_stmt.then_block);
+        if (node->if_stmt.else_block)
+            clobber_written_vars(node->if_stmt.else_block);
+        break;
+    default:
+        break;
+    }
+}
+
+static u64 number_assignment(ast_node_t *node) {
+    ast_node_t *left = node->assignment.left;
+    u64 vn = number_node(node->assignment.right);
+
+    // The code generator evaluates the value before the index.
+    if (left->type == NODE_INDEX) {
+        number_node(left->index.index);
+        set_var_vn(&left->index.array->identifier.name, fresh_vn());
+        return vn;
+    }
+
+    // The value of the assignment is the value before any truncation.
+    strview_t *name = &left->identifier.name;
+    set_var_vn(name, is_u64_scalar(name) ? vn : fresh_vn());
+    return vn;
+}
+
+static u64 number_function_call(ast_node_t *node) {
+    host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+    darray_t *params = &node->func_call.parameters;
+    u64 param_vns[2] = { 0, 0 };
+    for (unsigned i = 0; i < params->size; i++) {
+        u64 vn = number_node(params->data[i]);
+        if (i < 2)
+            param_vns[i] = vn;
+    }
+
+    if (func && func->intrinsic == INTRINSIC_APPEND && params->size > 0 &&
+        params->data[0]->type == NODE_IDENTIFIER)
+        set_var_vn(&params->data[0]->identifier.name, fresh_vn());
+
+    if (!func || !func->is_pure || params->size == 0 || params->size > 2)
+        return fresh_vn();
+    gvn_key_t key = { ((u64)(uintptr_t)func << 8) | NODE_FUNCTION_CALL, param_vns[0], param_vns[1] };
+    return lookup_or_add(node, &key);
+}
+
+static u64 number_compare(ast_node_t *node) {
+    TokenType op = node->compare_op.op;
+    number_node(node->compare_op.left);
+    if (op == TOKEN_LOGICAL_AND || op == TOKEN_LOGICAL_OR) {
+        // The right operand doesn't always run.
+        gvn_mark_t mark = enter_scope();
+        number_node(node->compare_op.right);
+        leave_scope(mark);
+        clobber_written_vars(node->compare_op.right);
+    }
+    else {
+        number_node(node->compare_op.right);
+    }
+
+    // Comparisons usually only set the flags, so they aren't worth saving.
+    return fresh_vn();
+}
+
+static void number_if(ast_node_t *node) {
+    number_node(node->if_stmt.condition_expr);
+
+    gvn_mark_t mark = enter_scope();
+    number_node(node->if_stmt.then_block);
+    leave_scope(mark);
+
+    if (node->if_stmt.else_block) {
+        mark = enter_scope();
+        number_node(node->if_stmt.else_block);
+        leave_scope(mark);
+    }
+
+    // Where the branches join, a variable either of them assigned could have
+    // either value.
+    clobber_written_vars(node->if_stmt.then_block);
+    if (node->if_stmt.else_block)
+        clobber_written_vars(node->if_stmt.else_block);
+}
+
+static void number_while(ast_node_t *node) {
+    clobber_written_vars(node);
+
+    gvn_mark_t mark = enter_scope();
+    number_node(node->while_loop.condition_expr);
+    number_node(node->while_loop.block);
+    leave_scope(mark);
+}
+
+static u64 number_node(ast_node_t *node) {
+    gvn_key_t key;
+    u64 lhs, rhs;
+
+    switch (node->type) {
+    case NODE_NUMBER:
+        return VN_LITERAL_BIT | (u32)node->number.int_value;
+
+    case NODE_IDENTIFIER: {
+            if (is_vector(&node->identifier.name))
+                return fresh_vn();
+            unsigned var = get_var(&node->identifier.name); // May grow var_vns
+            return g_gvn.var_vns[var];
+        }
+
+    case NODE_ASSIGNMENT:
+        return number_assignment(node);
+
+    case NODE_BINARY_OP:
+        lhs = number_node(node->binary_op.left);
+        rhs = number_node(node->binary_op.right);
+        if (is_commutative(node->binary_op.op) && lhs > rhs) {
+            u64 tmp = lhs;
+            lhs = rhs;
+            rhs = tmp;
+        }
+        key.op = ((u64)node->binary_op.op << 8) | NODE_BINARY_OP;
+        key.lhs = lhs;
+        key.rhs = rhs;
+        return lookup_or_add(node, &key);
+
+    case NODE_COMPARE:
+        return number_compare(node);
+
+    case NODE_INDEX:
+        key.op = NODE_INDEX;
+        key.lhs = number_node(node->index.array);
+        key.rhs = number_node(node->index.index);
+        return lookup_or_add(node, &key);
+
+    case NODE_FUNCTION_CALL:
+        return number_function_call(node);
+
+    case NODE_UNARY_OP:
+        number_node(node->unary_op.operand);
+        return fresh_vn();
+
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            number_node(node->block.statements.data[i]);
+        return fresh_vn();
+
+    case NODE_VARIABLE_DECLARATION: {
+            strview_t *name = &node->var_decl.identifier_name;
+            bool is_zero = is_u64_scalar(name) && !node->var_decl.skip_zero_init;
+            set_var_vn(name, is_zero ? VN_LITERAL_BIT : fresh_vn());
+            return fresh_vn();
+        }
+
+    case NODE_WHILE:
+        number_while(node);
+        return fresh_vn();
+
+    case NODE_IF:
+        number_if(node);
+        return fresh_vn();
+
+    default:
+        return fresh_vn();
+    }
+}
+
+
+// ***************************************************************************
+// Results
+// ***************************************************************************
+
+static int compare_matches_by_original(void const *a, void const *b) {
+    uintptr_t x = (uintptr_t)((gvn_match_t const *)a)->original;
+    uintptr_t y = (uintptr_t)((gvn_match_t const *)b)->original;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_entries(void const *a, void const *b) {
+    uintptr_t x = (uintptr_t)((gvn_entry_t const *)a)->node;
+    uintptr_t y = (uintptr_t)((gvn_entry_t const *)b)->node;
+    return x < y ? -1 : x > y;
+}
+
+// Each original gets a value index, and an entry along with its reuses.
+static void build_result(gvn_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    if (g_gvn.num_matches == 0)
+        return;
+
+    qsort(g_gvn.matches, g_gvn.num_matches, sizeof(gvn_match_t), compare_matches_by_original);
+    result->entries = malloc(2 * g_gvn.num_matches * sizeof(gvn_entry_t));
+    for (unsigned i = 0; i < g_gvn.num_matches; i++) {
+        gvn_match_t const *match = &g_gvn.matches[i];
+        if (i == 0 || match->original != match[-1].original) {
+            gvn_entry_t *original = &result->entries[result->num_entries++];
+            original->node = match->original;
+            original->value = result->num_values++;
+            original->is_reuse = false;
+        }
+        gvn_entry_t *reuse = &result->entries[result->num_entries++];
+        reuse->node = match->reuse;
+        reuse->value = result->num_values - 1;
+        reuse->is_reuse = true;
+    }
+    qsort(result->entries, result->num_entries, sizeof(gvn_entry_t), compare_entries);
+}
+
+void gvn_run(ast_node_t *root, gvn_result_t *result) {
+    memset(&g_gvn, 0, sizeof(g_gvn));
+    g_gvn.next_vn = 1;
+    g_gvn.var_indices = hashtab_create();
+
+    number_node(root);
+    build_result(result);
+
+    hashtab_free(&g_gvn.var_indices);
+    free(g_gvn.var_vns);
+    free(g_gvn.exprs);
+    free(g_gvn.slots);
+    free(g_gvn.undos);
+    free(g_gvn.matches);
+    memset(&g_gvn, 0, sizeof(g_gvn));
+}
+
+gvn_entry_t const *gvn_find(gvn_result_t const *result, ast_node_t const *node) {
+    unsigned lo = 0, hi = result->num_entries;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        gvn_entry_t const *entry = &result->entries[mid];
+        if (entry->node == node)
+            return entry;
+        if ((uintptr_t)entry->node < (uintptr_t)node)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+void gvn_free(gvn_result_t *result) {
+    free(result->entries);
+    memset(result, 0, sizeof(*result));
+}
@@ -0,0 +1,36 @@
+// Global Value Numbering.
+//
+// Finds expressions that compute the same value as an expression that was
+// evaluated earlier on every path to them, eg the second "a + b" in
+// "x = a + b; y = (a + b) * 2;". The code generator saves the result of the
+// first one in a stack temporary and reuses it instead of evaluating the others.
+//
+// Two expressions are equivalent if they apply the same operator to equivalent
+// operands. A variable is equivalent to the last value assigned to it, so an
+// assignment to an operand stops later occurrences from matching earlier ones.
+
+#pragma once
+
+// Standard headers
+#include <stdbool.h>
+
+
+typedef struct _ast_node_t ast_node_t;
+
+typedef struct {
+    ast_node_t const *node;
+    unsigned value;  // Index of the computation. Nodes with the same value are equivalent.
+    bool is_reuse;   // If false, this is the first evaluation, which the others reuse.
+} gvn_entry_t;
+
+// Only the nodes that share a value with another node have an entry.
+typedef struct {
+    gvn_entry_t *entries; // Sorted by node address
+    unsigned num_entries;
+    unsigned num_values;
+} gvn_result_t;
+
+
+void gvn_run(ast_node_t *root, gvn_result_t *result);
+gvn_entry_t const *gvn_find(gvn_result_t const *result, ast_node_t const *node); // Returns NULL if not found.
+void gvn_free(gvn_result_t *result);
@@ -33,6 +33,7 @@ static void resize_table(hashtab_t* ht) {
 
     // Calculate new capacity and allocate a new, larger array
     ht->capacity *= 2;
+    ht->mask = ht->capacity - 1;
     ht->entries = calloc(ht->capacity, sizeof(hashtab_entry_t));
 
     // Reset count before re-inserting
@@ -62,6 +63,12 @@ hashtab_t hashtab_create(void) {
     return ht;
 }
 
+void hashtab_free(hashtab_t *ht) {
+    free(ht->entries);
+    ht->entries = NULL;
+    ht->capacity = ht->mask = ht->count = 0;
+}
+
 void hashtab_put(hashtab_t* ht, strview_t const *key, void *value) {
     if (ht->count >= ht->capacity * 0.7)
         resize_table(ht);
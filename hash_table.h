@@ -17,5 +17,6 @@ typedef struct hashtab_t {
 
 
 hashtab_t hashtab_create(void);
+void hashtab_free(hashtab_t *ht);
 void hashtab_put(hashtab_t *ht, strview_t const *key, void *val);
 void *hashtab_get(hashtab_t const *ht, strview_t const *key);
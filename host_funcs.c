@@ -0,0 +1,42 @@
+// Own header
+#include "host_funcs.h"
+
+// This project's headers
+#include "strview.h"
+
+// Standard headers
+#include <stdio.h>
+
+
+// The C library uses the platform's own calling convention, which on Linux
+// isn't the one the host functions are called with, so each is wrapped.
+static u64 JIT_CALLBACK host_puts(u64 s, u64 unused1, u64 unused2, u64 unused3) {
+    (void)unused1;
+    (void)unused2;
+    (void)unused3;
+    return (u64)puts((char const *)(uintptr_t)s);
+}
+
+
+static host_func_t const g_host_funcs[] = {
+    { "puts", host_puts, false, INTRINSIC_NONE },
+
+    { "lane", NULL, true, INTRINSIC_LANE },
+    { "hsum", NULL, true, INTRINSIC_HSUM },
+    { "movemask", NULL, true, INTRINSIC_MOVEMASK },
+    { "len", NULL, true, INTRINSIC_LEN },
+    { "append", NULL, false, INTRINSIC_APPEND },
+    { "popcount", NULL, true, INTRINSIC_POPCOUNT },
+    { "clz", NULL, true, INTRINSIC_CLZ },
+    { "ctz", NULL, true, INTRINSIC_CTZ },
+};
+
+
+host_func_t const *host_funcs_get(strview_t const *name) {
+    for (unsigned i = 0; i < sizeof(g_host_funcs) / sizeof(g_host_funcs[0]); i++) {
+        if (strview_cmp_cstr(name, g_host_funcs[i].name))
+            return &g_host_funcs[i];
+    }
+
+    return NULL;
+}
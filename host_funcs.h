@@ -0,0 +1,46 @@
+// The table of host (C) functions and compiler intrinsics that Mortar code is
+// allowed to call.
+
+#pragma once
+
+// This project's headers
+#include "common.h"
+
+// Standard headers
+#include <stdbool.h>
+
+
+typedef struct _strview_t strview_t;
+
+typedef enum {
+    INTRINSIC_NONE = 0, // A real C function, called through 'addr'.
+
+    // Intrinsics are implemented inline by the code generator.
+    INTRINSIC_LANE,     // lane(vector, constant_index) - Extract one element
+    INTRINSIC_HSUM,     // hsum(vector) - Sum of all the elements
+    INTRINSIC_MOVEMASK, // movemask(vector) - Top bit of each element, packed into an integer
+    INTRINSIC_LEN,      // len(array) - Number of elements
+    INTRINSIC_APPEND,   // append(array, value) - Add an element to the end. Gives 0
+    INTRINSIC_POPCOUNT, // popcount(x) - Number of set bits
+    INTRINSIC_CLZ,      // clz(x) - Number of leading zero bits
+    INTRINSIC_CTZ,      // ctz(x) - Number of trailing zero bits
+} intrinsic_t;
+
+// Every tier calls host functions through this, with the Windows x64 calling
+// convention that the generated code uses. Only as many arguments as the call
+// passes are meaningful.
+typedef u64 (JIT_CALLBACK *host_func_ptr_t)(u64, u64, u64, u64);
+
+typedef struct {
+    char const *name;
+    host_func_ptr_t addr; // NULL for intrinsics
+
+    // A pure function's result depends only on its arguments and calling it
+    // has no side effects. Optimizers may move, merge or remove calls to it.
+    bool is_pure;
+
+    intrinsic_t intrinsic;
+} host_func_t;
+
+
+host_func_t const *host_funcs_get(strview_t const *name); // Returns NULL if not found.
@@ -0,0 +1,456 @@
+// Own header
+#include "interp.h"
+
+// This project's headers
+#include "code_gen.h"
+#include "code_heap.h"
+#include "const_eval.h"
+#include "dead_store.h"
+#include "hash_table.h"
+#include "host_funcs.h"
+#include "parser.h"
+#include "runtime.h"
+#include "safepoint.h"
+
+// Standard headers
+#include <assert.h>
+#include <string.h>
+
+
+// Every variable lives in a single state block for the whole run. That means
+// a loop compiled for OSR can be handed all of them at once, whichever ones it
+// uses, and the state block is always up to date between statements.
+
+enum { OSR_THRESHOLD = 1000 }; // Loop iterations before a loop is compiled
+
+typedef struct {
+    ast_node_t *node;
+    unsigned num_iterations; // Across all the times the loop has been run
+    osr_func_t compiled;     // NULL until the loop is hot
+} loop_counter_t;
+
+
+static struct {
+    hashtab_t var_indices; // Maps name to index + 1 in 'vars'
+    osr_var_t *vars;
+    derived_type_t const **var_types;
+    unsigned num_vars;
+    u8 *state;
+
+    loop_counter_t *loops;
+    unsigned num_loops;
+    bool allow_osr;
+
+    hashtab_t strings; // Maps a string literal's text to its decoded, nul terminated copy
+} g_interp;
+
+
+static u64 eval(ast_node_t *node);
+
+static void find_vars(ast_node_t *node, darray_t *decls) {
+    switch (node->type) {
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_vars(node->block.statements.data[i], decls);
+        break;
+    case NODE_WHILE:
+        find_vars(node->while_loop.block, decls);
+        break;
+    case NODE_IF:
+        find_vars(node->if_stmt.then_block, decls);
+        if (node->if_stmt.else_block)
+            find_vars(node->if_stmt.else_block, decls);
+        break;
+    case NODE_VARIABLE_DECLARATION:
+        darray_append(decls, node);
+        break;
+    default:
+        break;
+    }
+}
+
+static void find_loops(ast_node_t *node, unsigned *num_loops) {
+    if (node->type == NODE_WHILE) {
+        (*num_loops)++;
+        find_loops(node->while_loop.block, num_loops);
+    }
+    else if (node->type == NODE_BLOCK) {
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_loops(node->block.statements.data[i], num_loops);
+    }
+    else if (node->type == NODE_IF) {
+        find_loops(node->if_stmt.then_block, num_loops);
+        if (node->if_stmt.else_block)
+            find_loops(node->if_stmt.else_block, num_loops);
+    }
+}
+
+bool interp_can_run(ast_node_t *ast) {
+    darray_t decls = { 0 };
+    find_vars(ast, &decls);
+
+    bool rv = true;
+    for (unsigned i = 0; i < decls.size; i++) {
+        derived_type_t const *type = &decls.data[i]->var_decl.type_info;
+        if (type->object_type.num_lanes > 1)
+            rv = false;
+    }
+
+    darray_free(&decls);
+    return rv;
+}
+
+static void init_state(ast_node_t *ast) {
+    darray_t decls = { 0 };
+    find_vars(ast, &decls);
+
+    g_interp.var_indices = hashtab_create();
+    g_interp.strings = hashtab_create();
+    g_interp.num_vars = decls.size;
+    g_interp.vars = calloc(decls.size, sizeof(osr_var_t));
+    g_interp.var_types = calloc(decls.size, sizeof(derived_type_t *));
+
+    unsigned state_size = 0;
+    for (unsigned i = 0; i < decls.size; i++) {
+        ast_node_t *decl = decls.data[i];
+        derived_type_t const *type = &decl->var_decl.type_info;
+        if (type->is_array && type->object_type.num_bytes != 1 && type->object_type.num_bytes != 8)
+            FATAL_ERROR("Arrays of %u byte elements are not supported", type->object_type.num_bytes);
+
+        osr_var_t *var = &g_interp.vars[i];
+        var->name = &decl->var_decl.identifier_name;
+        var->num_bytes = type->is_array ? sizeof(runtime_array_t) : type->object_type.num_bytes;
+        var->state_offset = state_size;
+        state_size += (var->num_bytes + 7) & ~7u;
+        g_interp.var_types[i] = type;
+        hashtab_put(&g_interp.var_indices, var->name, (void *)(uintptr_t)(i + 1));
+    }
+    g_interp.state = calloc(1, state_size ? state_size : 1);
+
+    unsigned num_loops = 0;
+    find_loops(ast, &num_loops);
+    g_interp.loops = calloc(num_loops ? num_loops : 1, sizeof(loop_counter_t));
+    g_interp.num_loops = 0;
+
+    darray_free(&decls);
+}
+
+static void free_state(void) {
+    for (unsigned i = 0; i < g_interp.num_loops; i++)
+        code_heap_free((void *)g_interp.loops[i].compiled);
+    for (unsigned i = 0; i < g_interp.num_vars; i++) {
+        if (g_interp.var_types[i]->is_array)
+            runtime_array_free((runtime_array_t *)(g_interp.state + g_interp.vars[i].state_offset));
+    }
+
+    for (unsigned i = 0; i < g_interp.strings.capacity; i++)
+        free(g_interp.strings.entries[i].value);
+
+    hashtab_free(&g_interp.var_indices);
+    hashtab_free(&g_interp.strings);
+    free(g_interp.vars);
+    free(g_interp.var_types);
+    free(g_interp.state);
+    free(g_interp.loops);
+    memset(&g_interp, 0, sizeof(g_interp));
+}
+
+static unsigned get_var_index(strview_t const *name) {
+    void *val = hashtab_get(&g_interp.var_indices, name);
+    if (!val)
+        FATAL_ERROR("Couldn't find storage for variable '%.*s'", (int)name->len, name->data);
+    return (unsigned)((uintptr_t)val - 1);
+}
+
+// A literal is decoded the first time it's evaluated, and literals with the
+// same text share the copy, as they share an entry in the bytecode's string
+// table.
+static char const *get_string(strview_t const *literal) {
+    char *str = hashtab_get(&g_interp.strings, literal);
+    if (!str) {
+        str = malloc(literal->len + 1);
+        str[strview_unescape(literal, str)] = '\0';
+        hashtab_put(&g_interp.strings, literal, str);
+    }
+
+    return str;
+}
+
+static runtime_array_t *get_array(ast_node_t *ident, unsigned *elem_num_bytes) {
+    assert(ident->type == NODE_IDENTIFIER);
+    unsigned idx = get_var_index(&ident->identifier.name);
+    derived_type_t const *type = g_interp.var_types[idx];
+    if (!type->is_array)
+        FATAL_ERROR("'%.*s' is not an array",
+                    (int)ident->identifier.name.len, ident->identifier.name.data);
+    *elem_num_bytes = type->object_type.num_bytes;
+    return (runtime_array_t *)(g_interp.state + g_interp.vars[idx].state_offset);
+}
+
+static u64 read_var(ast_node_t *ident) {
+    unsigned idx = get_var_index(&ident->identifier.name);
+    if (g_interp.var_types[idx]->is_array)
+        FATAL_ERROR("Array '%.*s' used where a scalar is expected",
+                    (int)ident->identifier.name.len, ident->identifier.name.data);
+
+    u64 val = 0;
+    memcpy(&val, g_interp.state + g_interp.vars[idx].state_offset, g_interp.vars[idx].num_bytes);
+    return val;
+}
+
+static u64 eval_index(ast_node_t *node) {
+    unsigned elem_num_bytes;
+    runtime_array_t *arr = get_array(node->index.array, &elem_num_bytes);
+    u64 i = eval(node->index.index);
+    if (i >= arr->size)
+        runtime_index_error();
+
+    if (elem_num_bytes == 1)
+        return arr->data[i];
+    return ((u64 *)arr->data)[i];
+}
+
+static u64 eval_assignment(ast_node_t *node) {
+    ast_node_t *left = node->assignment.left;
+    u64 val = eval(node->assignment.right);
+
+    if (left->type == NODE_INDEX) {
+        unsigned elem_num_bytes;
+        runtime_array_t *arr = get_array(left->index.array, &elem_num_bytes);
+        u64 i = eval(left->index.index);
+        if (i >= arr->size)
+            runtime_index_error();
+
+        if (elem_num_bytes == 1)
+            arr->data[i] = (u8)val;
+        else
+            ((u64 *)arr->data)[i] = val;
+        return val;
+    }
+
+    assert(left->type == NODE_IDENTIFIER);
+    unsigned idx = get_var_index(&left->identifier.name);
+    if (g_interp.var_types[idx]->is_array)
+        FATAL_ERROR("Cannot assign to the whole of array '%.*s'",
+                    (int)left->identifier.name.len, left->identifier.name.data);
+
+    // Little endian, so this stores the low bytes of a u64.
+    memcpy(g_interp.state + g_interp.vars[idx].state_offset, &val, g_interp.vars[idx].num_bytes);
+    return val;
+}
+
+static u64 eval_intrinsic(ast_node_t *node, intrinsic_t intrinsic) {
+    strview_t const *name = &node->func_call.func_name;
+    darray_t const *params = &node->func_call.parameters;
+    unsigned expected_num_params = intrinsic == INTRINSIC_APPEND ? 2 : 1;
+    if (params->size != expected_num_params)
+        FATAL_ERROR("%.*s() expects %u parameters", (int)name->len, name->data, expected_num_params);
+
+    unsigned elem_num_bytes;
+    runtime_array_t *arr;
+    u64 x;
+    switch (intrinsic) {
+    case INTRINSIC_LEN:
+        return get_array(params->data[0], &elem_num_bytes)->size;
+    case INTRINSIC_APPEND:
+        arr = get_array(params->data[0], &elem_num_bytes);
+        x = eval(params->data[1]);
+        if (arr->size == arr->capacity)
+            runtime_array_grow(arr, elem_num_bytes);
+        if (elem_num_bytes == 1)
+            arr->data[arr->size] = (u8)x;
+        else
+            ((u64 *)arr->data)[arr->size] = x;
+        arr->size++;
+        return 0;
+    case INTRINSIC_POPCOUNT:
+        x = eval(params->data[0]);
+        for (u64 count = 0; ; count++) {
+            if (!x)
+                return count;
+            x &= x - 1;
+        }
+    case INTRINSIC_CLZ:
+        x = eval(params->data[0]);
+        for (u64 count = 0; count < 64; count++) {
+            if (x & (1ull << (63 - count)))
+                return count;
+        }
+        return 64;
+    case INTRINSIC_CTZ:
+        x = eval(params->data[0]);
+        for (u64 count = 0; count < 64; count++) {
+            if (x & (1ull << count))
+                return count;
+        }
+        return 64;
+    default:
+        FATAL_ERROR("%.*s() is not supported by the interpreter", (int)name->len, name->data);
+    }
+}
+
+static u64 eval_function_call(ast_node_t *node) {
+    host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+    assert(func);
+    if (func->intrinsic != INTRINSIC_NONE)
+        return eval_intrinsic(node, func->intrinsic);
+
+    // Host functions use the same calling convention as from the generated code.
+    u64 args[4] = { 0 };
+    assert(node->func_call.parameters.size <= 4);
+    for (unsigned i = 0; i < node->func_call.parameters.size; i++)
+        args[i] = eval(node->func_call.parameters.data[i]);
+    return func->addr(args[0], args[1], args[2], args[3]);
+}
+
+static u64 eval_unary_op(ast_node_t *node) {
+    u64 operand = eval(node->unary_op.operand);
+    return node->unary_op.operator == TOKEN_MINUS ? 0 - operand : operand == 0;
+}
+
+// Shift counts are taken mod 64, as the x86 shift instructions do.
+static u64 eval_binary_op(ast_node_t *node) {
+    u64 left = eval(node->binary_op.left);
+    u64 right = eval(node->binary_op.right);
+
+    switch (node->binary_op.op) {
+    case TOKEN_PLUS: return left + right;
+    case TOKEN_MINUS: return left - right;
+    case TOKEN_MULTIPLY: return left * right;
+    case TOKEN_DIVIDE:
+        if (right == 0)
+            runtime_divide_by_zero_error();
+        return left / right;
+    case TOKEN_MODULO:
+        if (right == 0)
+            runtime_divide_by_zero_error();
+        return left % right;
+    case TOKEN_AND: return left & right;
+    case TOKEN_OR: return left | right;
+    case TOKEN_XOR: return left ^ right;
+    case TOKEN_SHIFT_LEFT: return left << (right & 63);
+    case TOKEN_SHIFT_RIGHT: return left >> (right & 63);
+    default: FATAL_ERROR("Unknown binary op");
+    }
+}
+
+static bool eval_condition(ast_node_t *node) {
+    if (node->type != NODE_COMPARE)
+        return eval(node) != 0;
+
+    // The right operand of && and || is only evaluated if it is needed.
+    if (node->compare_op.op == TOKEN_LOGICAL_AND)
+        return eval_condition(node->compare_op.left) && eval_condition(node->compare_op.right);
+    if (node->compare_op.op == TOKEN_LOGICAL_OR)
+        return eval_condition(node->compare_op.left) || eval_condition(node->compare_op.right);
+
+    u64 left = eval(node->compare_op.left);
+    u64 right = eval(node->compare_op.right);
+    switch (node->compare_op.op) {
+    case TOKEN_EQUALS: return left == right;
+    case TOKEN_NOT_EQUALS: return left != right;
+    case TOKEN_LESS_THAN: return left < right;
+    case TOKEN_LESS_EQUAL: return left <= right;
+    case TOKEN_GREATER_THAN: return left > right;
+    case TOKEN_GREATER_EQUAL: return left >= right;
+    default: FATAL_ERROR("Unknown comparison");
+    }
+}
+
+static void eval_if(ast_node_t *node) {
+    if (eval_condition(node->if_stmt.condition_expr))
+        eval(node->if_stmt.then_block);
+    else if (node->if_stmt.else_block)
+        eval(node->if_stmt.else_block);
+}
+
+static loop_counter_t *get_loop_counter(ast_node_t *node) {
+    for (unsigned i = 0; i < g_interp.num_loops; i++) {
+        if (g_interp.loops[i].node == node)
+            return &g_interp.loops[i];
+    }
+
+    loop_counter_t *loop = &g_interp.loops[g_interp.num_loops++];
+    loop->node = node;
+    return loop;
+}
+
+static void eval_while(ast_node_t *node) {
+    loop_counter_t *loop = get_loop_counter(node);
+
+    while (true) {
+        // The state block is up to date at the top of the loop, so this is
+        // where we can switch to the compiled code.
+        if (loop->compiled) {
+            loop->compiled(g_interp.state);
+            return;
+        }
+
+        if (!eval_condition(node->while_loop.condition_expr))
+            return;
+        eval(node->while_loop.block);
+        SAFEPOINT_POLL();
+
+        loop->num_iterations++;
+        if (g_interp.allow_osr && loop->num_iterations == OSR_THRESHOLD)
+            loop->compiled = code_gen_osr_loop(node, g_interp.vars, g_interp.num_vars);
+    }
+}
+
+static u64 eval(ast_node_t *node) {
+    u64 rv = 0;
+
+    switch (node->type) {
+    case NODE_NUMBER:
+        return (u64)node->number.int_value;
+    case NODE_IDENTIFIER:
+        return read_var(node);
+    case NODE_ASSIGNMENT:
+        return eval_assignment(node);
+    case NODE_BINARY_OP:
+        return eval_binary_op(node);
+    case NODE_UNARY_OP:
+        return eval_unary_op(node);
+    case NODE_COMPARE:
+        return eval_condition(node);
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            rv = eval(node->block.statements.data[i]);
+        return rv;
+    case NODE_STRING_LITERAL:
+        return (u64)(uintptr_t)get_string(&node->string_literal.val);
+    case NODE_FUNCTION_CALL:
+        return eval_function_call(node);
+    case NODE_VARIABLE_DECLARATION: {
+            unsigned idx = get_var_index(&node->var_decl.identifier_name);
+            osr_var_t const *var = &g_interp.vars[idx];
+            if (g_interp.var_types[idx]->is_array)
+                ((runtime_array_t *)(g_interp.state + var->state_offset))->size = 0;
+            else if (!node->var_decl.skip_zero_init)
+                memset(g_interp.state + var->state_offset, 0, var->num_bytes);
+            return 0;
+        }
+    case NODE_WHILE:
+        eval_while(node);
+        return 0;
+    case NODE_IF:
+        eval_if(node);
+        return 0;
+    case NODE_INDEX:
+        return eval_index(node);
+    default:
+        FATAL_ERROR("The interpreter does not support node type %d", node->type);
+    }
+}
+
+u64 interp_run(ast_node_t *ast, bool allow_osr) {
+    ceval_run(ast);
+    dse_run(ast);
+
+    init_state(ast);
+    g_interp.allow_osr = allow_osr;
+    u64 rv = eval(ast);
+    free_state();
+
+    return rv;
+}
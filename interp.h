@@ -0,0 +1,24 @@
+// A tree walking interpreter, the first execution tier. It starts running a
+// program straight after parsing. Each while loop counts the number of times
+// it goes round and, when that passes a threshold, the loop is compiled to
+// machine code and entered part way through by on-stack replacement.
+
+#pragma once
+
+// This project's headers
+#include "common.h"
+
+// Standard headers
+#include <stdbool.h>
+
+
+typedef struct _ast_node_t ast_node_t;
+
+
+// False if the program uses features that only the code generator supports,
+// ie SIMD vectors.
+bool interp_can_run(ast_node_t *ast);
+
+// Returns the value of the last statement of the program. If 'allow_osr' is
+// false, hot loops are not compiled.
+u64 interp_run(ast_node_t *ast, bool allow_osr);
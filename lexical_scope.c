@@ -5,18 +5,57 @@
 #include "hash_table.h"
 #include "types.h"
 
+// Standard headers
+#include <stdlib.h>
+
+
+typedef struct {
+    strview_t *identifier;
+    derived_type_t *type;
+} lscope_entry_t;
+
 
 static hashtab_t g_lscope;
 
+// Every identifier added, in order, so that lscope_rollback() can rebuild the
+// hash table without the most recent ones.
+static lscope_entry_t *g_entries;
+static unsigned g_num_entries;
+static unsigned g_entries_capacity;
+
 
 void lscope_init(void) {
     g_lscope = hashtab_create();
+    g_num_entries = 0;
 }
 
 void lscope_add(strview_t *identifier, derived_type_t *type) {
     hashtab_put(&g_lscope, identifier, type);
+
+    if (g_num_entries == g_entries_capacity) {
+        g_entries_capacity = g_entries_capacity ? g_entries_capacity * 2 : 32;
+        g_entries = realloc(g_entries, g_entries_capacity * sizeof(lscope_entry_t));
+    }
+    g_entries[g_num_entries].identifier = identifier;
+    g_entries[g_num_entries].type = type;
+    g_num_entries++;
 }
 
 derived_type_t *lscope_get(strview_t *identifier) {
     return hashtab_get(&g_lscope, identifier);
 }
+
+unsigned lscope_mark(void) {
+    return g_num_entries;
+}
+
+void lscope_rollback(unsigned mark) {
+    if (mark == g_num_entries)
+        return;
+
+    hashtab_free(&g_lscope);
+    g_lscope = hashtab_create();
+    for (unsigned i = 0; i < mark; i++)
+        hashtab_put(&g_lscope, g_entries[i].identifier, g_entries[i].type);
+    g_num_entries = mark;
+}
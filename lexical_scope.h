@@ -9,3 +9,8 @@ void lscope_init(void);
 void lscope_add(strview_t *identifier, derived_type_t *type);
 
 derived_type_t *lscope_get(strview_t *identifier);
+
+// lscope_rollback() forgets every identifier added since the lscope_mark()
+// call that returned 'mark'. Used to undo a partly parsed line of REPL input.
+unsigned lscope_mark(void);
+void lscope_rollback(unsigned mark);
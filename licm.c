@@ -0,0 +1,140 @@
+// Own header
+#include "licm.h"
+
+// This project's headers
+#include "hash_table.h"
+#include "host_funcs.h"
+#include "loop_info.h"
+#include "parser.h"
+
+// Standard headers
+#include <stdbool.h>
+
+
+// An expression is invariant if it is built only from literals, variables that
+// are not written anywhere in the loop, and calls to pure host functions. Since
+// Mortar has no pointers, a variable can only be written by an assignment, a
+// declaration or a call that names it directly.
+//
+// Hoisting evaluates an expression even if the loop body never runs. That is
+// only safe because none of the invariant expressions can fault or have side
+// effects. Division is the one operator that can fault, so it is only
+// invariant when the divisor is a constant other than 0.
+
+
+static bool is_worth_hoisting(ast_node_t *node) {
+    return node->type == NODE_BINARY_OP || node->type == NODE_FUNCTION_CALL;
+}
+
+static bool can_fault(ast_node_t *node) {
+    TokenType op = node->binary_op.op;
+    ast_node_t *divisor = node->binary_op.right;
+    if (op != TOKEN_DIVIDE && op != TOKEN_MODULO)
+        return false;
+    return divisor->type != NODE_NUMBER || divisor->number.int_value == 0;
+}
+
+static bool find_invariants(ast_node_t *node, hashtab_t const *written, darray_t *invariants);
+
+// Used when the parent of 'node' is not invariant. If 'node' is, it is as big
+// an invariant expression as we are going to get, so record it.
+static void find_maximal_invariants(ast_node_t *node, hashtab_t const *written, darray_t *invariants) {
+    if (find_invariants(node, written, invariants) && is_worth_hoisting(node))
+        darray_append(invariants, node);
+}
+
+// Returns true if 'node' is invariant. Any maximal invariant sub-expressions
+// of a node that is not itself invariant are appended to 'invariants'.
+static bool find_invariants(ast_node_t *node, hashtab_t const *written, darray_t *invariants) {
+    switch (node->type) {
+    case NODE_NUMBER:
+    case NODE_STRING_LITERAL:
+        return true;
+
+    case NODE_IDENTIFIER:
+        return hashtab_get(written, &node->identifier.name) == NULL;
+
+    case NODE_BINARY_OP: {
+            bool left = find_invariants(node->binary_op.left, written, invariants);
+            bool right = find_invariants(node->binary_op.right, written, invariants);
+            if (left && right && !can_fault(node))
+                return true;
+            if (left && is_worth_hoisting(node->binary_op.left))
+                darray_append(invariants, node->binary_op.left);
+            if (right && is_worth_hoisting(node->binary_op.right))
+                darray_append(invariants, node->binary_op.right);
+            return false;
+        }
+
+    case NODE_FUNCTION_CALL: {
+            host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+            unsigned num_params = node->func_call.parameters.size;
+            bool all_invariant = true;
+            for (unsigned i = 0; i < num_params; i++) {
+                if (!find_invariants(node->func_call.parameters.data[i], written, invariants))
+                    all_invariant = false;
+            }
+
+            if (func && func->is_pure && all_invariant)
+                return true;
+
+            for (unsigned i = 0; i < num_params; i++) {
+                ast_node_t *param = node->func_call.parameters.data[i];
+                // Re-walking an invariant parameter is cheap because it cannot
+                // contain anything that was appended already.
+                if (is_worth_hoisting(param) && find_invariants(param, written, invariants))
+                    darray_append(invariants, param);
+            }
+            return false;
+        }
+
+    // Comparisons are usually only needed in the flags, so at most their
+    // operands are hoisted. That includes the right operand of && and ||,
+    // which is only sometimes evaluated, because invariants can't fault.
+    case NODE_COMPARE:
+        find_maximal_invariants(node->compare_op.left, written, invariants);
+        find_maximal_invariants(node->compare_op.right, written, invariants);
+        return false;
+
+    case NODE_ASSIGNMENT:
+        find_maximal_invariants(node->assignment.right, written, invariants);
+        return false;
+
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_maximal_invariants(node->block.statements.data[i], written, invariants);
+        return false;
+
+    case NODE_WHILE:
+        find_maximal_invariants(node->while_loop.condition_expr, written, invariants);
+        find_invariants(node->while_loop.block, written, invariants);
+        return false;
+
+    case NODE_IF:
+        find_maximal_invariants(node->if_stmt.condition_expr, written, invariants);
+        find_invariants(node->if_stmt.then_block, written, invariants);
+        if (node->if_stmt.else_block)
+            find_invariants(node->if_stmt.else_block, written, invariants);
+        return false;
+
+    // Indexing can fault, so it is never hoisted.
+    case NODE_INDEX:
+        find_maximal_invariants(node->index.index, written, invariants);
+        return false;
+
+    default:
+        return false;
+    }
+}
+
+
+// ***************************************************************************
+// Public functions
+// ***************************************************************************
+
+void licm_find_invariants(ast_node_t *while_node, darray_t *invariants) {
+    hashtab_t written = hashtab_create();
+    loop_info_find_written_vars(while_node, &written);
+    find_invariants(while_node, &written, invariants);
+    hashtab_free(&written);
+}
@@ -0,0 +1,15 @@
+// Loop Invariant Code Motion.
+//
+// Finds expressions inside a while loop whose value cannot change from one
+// iteration to the next. The code generator evaluates them once, in the loop
+// preheader, and reads the saved result inside the loop.
+
+#pragma once
+
+#include "darray.h"
+
+
+// Appends the maximal invariant sub-expressions of the loop's condition and
+// body to 'invariants'. Only expressions worth hoisting are reported, ie not
+// lone identifiers or literals.
+void licm_find_invariants(ast_node_t *while_node, darray_t *invariants);
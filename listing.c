@@ -0,0 +1,259 @@
+// Own header
+#include "listing.h"
+
+// This project's headers
+#include "assembler.h"
+#include "disasm.h"
+#include "parser.h"
+#include "source_pos.h"
+
+// Standard headers
+#include <stdio.h>
+#include <stdlib.h>
+
+
+// The code buffer is split into regions, each starting where the node or
+// statement changed. A region covers the code up to the start of the next.
+
+enum { MAX_SUMMARY_STATEMENTS = 20 };
+
+typedef struct {
+    unsigned code_offset;
+    listing_pos_t pos;
+} region_t;
+
+static bool g_enabled;
+static listing_pos_t g_pos;
+static region_t *g_regions;
+static unsigned g_num_regions;
+static unsigned g_regions_capacity;
+
+static char const *g_node_type_names[] = {
+    "NUMBER", "IDENTIFIER", "ASSIGNMENT", "BINARY_OP", "COMPARE", "UNARY_OP",
+    "BLOCK", "STRING_LITERAL", "FUNCTION_CALL", "VARIABLE_DECLARATION", "WHILE", "INDEX",
+    "IF"
+};
+enum { NUM_NODE_TYPES = sizeof(g_node_type_names) / sizeof(g_node_type_names[0]) };
+
+
+void listing_enable(void) {
+    g_enabled = true;
+}
+
+void listing_reset(void) {
+    g_num_regions = 0;
+    g_pos.node = NULL;
+    g_pos.statement = NULL;
+    g_pos.is_data = false;
+}
+
+static void start_region(void) {
+    if (!g_enabled)
+        return;
+
+    region_t *last = g_num_regions ? &g_regions[g_num_regions - 1] : NULL;
+    if (last && last->pos.node == g_pos.node && last->pos.statement == g_pos.statement &&
+        last->pos.is_data == g_pos.is_data)
+        return;
+    if (!last || last->code_offset != g_assembler.binary_size) {
+        if (g_num_regions == g_regions_capacity) {
+            g_regions_capacity = g_regions_capacity ? g_regions_capacity * 2 : 256;
+            g_regions = realloc(g_regions, g_regions_capacity * sizeof(region_t));
+        }
+        last = &g_regions[g_num_regions++];
+    }
+    last->code_offset = g_assembler.binary_size;
+    last->pos = g_pos;
+}
+
+listing_pos_t listing_enter(ast_node_t *node, bool is_statement) {
+    listing_pos_t outer = g_pos;
+    g_pos.node = node;
+    g_pos.is_data = false;
+    if (is_statement)
+        g_pos.statement = node;
+    start_region();
+    return outer;
+}
+
+listing_pos_t listing_enter_data(void) {
+    listing_pos_t outer = g_pos;
+    g_pos.node = NULL;
+    g_pos.statement = NULL;
+    g_pos.is_data = true;
+    start_region();
+    return outer;
+}
+
+void listing_leave(listing_pos_t outer) {
+    g_pos = outer;
+    start_region();
+}
+
+static char const *get_type_name(ast_node_t const *node) {
+    if (!node)
+        return "(none)";
+    if ((unsigned)node->type < NUM_NODE_TYPES)
+        return g_node_type_names[node->type];
+    return "UNKNOWN";
+}
+
+static unsigned get_region_end(unsigned i) {
+    return i + 1 < g_num_regions ? g_regions[i + 1].code_offset : g_assembler.binary_size;
+}
+
+// Shows data as hex and as text, 8 bytes to a line.
+static void print_data(unsigned start, unsigned end) {
+    printf("; (data)\n");
+    for (unsigned offset = start; offset < end; offset += 8) {
+        unsigned num_bytes = end - offset < 8 ? end - offset : 8;
+        printf("  %06x  ", offset);
+        for (unsigned i = 0; i < 11; i++) {
+            if (i < num_bytes)
+                printf("%02x ", g_assembler.binary[offset + i]);
+            else
+                printf("   ");
+        }
+        printf(" \"");
+        for (unsigned i = 0; i < num_bytes; i++) {
+            u8 c = g_assembler.binary[offset + i];
+            putchar(c >= 0x20 && c < 0x7f ? c : '.');
+        }
+        printf("\"\n");
+    }
+}
+
+static void print_code(unsigned start, unsigned end, ast_node_t const *node) {
+    if (start == end)
+        return;
+
+    if (!node) {
+        printf("; (no node)\n");
+    }
+    else {
+        printf("; %s", get_type_name(node));
+        switch (node->type) {
+        case NODE_NUMBER:
+            printf(" %d", node->number.int_value);
+            break;
+        case NODE_BINARY_OP:
+            printf(" %s", tokenizer_get_name_from_type(node->binary_op.op));
+            break;
+        case NODE_COMPARE:
+            printf(" %s", tokenizer_get_name_from_type(node->compare_op.op));
+            break;
+        case NODE_IDENTIFIER:
+            printf(" %.*s", (int)node->identifier.name.len, node->identifier.name.data);
+            break;
+        case NODE_FUNCTION_CALL:
+            printf(" %.*s", (int)node->func_call.func_name.len, node->func_call.func_name.data);
+            break;
+        case NODE_VARIABLE_DECLARATION:
+            printf(" %.*s", (int)node->var_decl.identifier_name.len, node->var_decl.identifier_name.data);
+            break;
+        default:
+            break;
+        }
+        unsigned line, column;
+        source_pos_get(node->source_offset, &line, &column);
+        printf(" at %u:%u\n", line, column);
+    }
+
+    unsigned offset = start;
+    while (offset < end) {
+        disasm_instr_t instr;
+        disasm_one(g_assembler.binary + offset, end - offset, offset, &instr);
+        printf("  %06x  ", offset);
+        for (unsigned i = 0; i < 11; i++) {
+            if (i < instr.num_bytes)
+                printf("%02x ", g_assembler.binary[offset + i]);
+            else
+                printf("   ");
+        }
+        printf(" %s\n", instr.text);
+        offset += instr.num_bytes;
+    }
+}
+
+static void print_instructions(void) {
+    printf("--- Listing ---\n");
+
+    // Code before the first region doesn't belong to any node.
+    unsigned first = g_num_regions ? g_regions[0].code_offset : g_assembler.binary_size;
+    print_code(0, first, NULL);
+    for (unsigned i = 0; i < g_num_regions; i++) {
+        if (g_regions[i].pos.is_data)
+            print_data(g_regions[i].code_offset, get_region_end(i));
+        else
+            print_code(g_regions[i].code_offset, get_region_end(i), g_regions[i].pos.node);
+    }
+}
+
+typedef struct {
+    ast_node_t *statement;
+    unsigned num_bytes;
+} statement_bytes_t;
+
+static int compare_statement_bytes(void const *a, void const *b) {
+    statement_bytes_t const *x = a;
+    statement_bytes_t const *y = b;
+    return x->num_bytes < y->num_bytes ? 1 : x->num_bytes > y->num_bytes ? -1 : 0;
+}
+
+static void print_summary(void) {
+    unsigned type_bytes[NUM_NODE_TYPES] = { 0 };
+    unsigned unattributed = g_num_regions ? g_regions[0].code_offset : g_assembler.binary_size;
+    unsigned data_bytes = 0;
+    statement_bytes_t *statements = NULL;
+    unsigned num_statements = 0;
+
+    for (unsigned i = 0; i < g_num_regions; i++) {
+        region_t const *region = &g_regions[i];
+        unsigned num_bytes = get_region_end(i) - region->code_offset;
+        if (region->pos.is_data)
+            data_bytes += num_bytes;
+        else if (region->pos.node && (unsigned)region->pos.node->type < NUM_NODE_TYPES)
+            type_bytes[region->pos.node->type] += num_bytes;
+        else
+            unattributed += num_bytes;
+
+        if (!region->pos.statement)
+            continue;
+        unsigned j = 0;
+        while (j < num_statements && statements[j].statement != region->pos.statement)
+            j++;
+        if (j == num_statements) {
+            statements = realloc(statements, (num_statements + 1) * sizeof(statement_bytes_t));
+            statements[j].statement = region->pos.statement;
+            statements[j].num_bytes = 0;
+            num_statements++;
+        }
+        statements[j].num_bytes += num_bytes;
+    }
+
+    printf("--- Bytes per node type ---\n");
+    for (unsigned i = 0; i < NUM_NODE_TYPES; i++) {
+        if (type_bytes[i])
+            printf("  %-22s %7u\n", g_node_type_names[i], type_bytes[i]);
+    }
+    printf("  %-22s %7u\n", "(no node)", unattributed);
+    if (data_bytes)
+        printf("  %-22s %7u\n", "(data)", data_bytes);
+    printf("  %-22s %7u\n", "Total", g_assembler.binary_size);
+
+    // Each statement's own code, not counting the statements nested in it.
+    qsort(statements, num_statements, sizeof(statement_bytes_t), compare_statement_bytes);
+    printf("--- Largest statements ---\n");
+    for (unsigned i = 0; i < num_statements && i < MAX_SUMMARY_STATEMENTS; i++) {
+        ast_node_t const *s = statements[i].statement;
+        unsigned line, column;
+        source_pos_get(s->source_offset, &line, &column);
+        printf("  %5u:%-4u %-22s %7u\n", line, column, get_type_name(s), statements[i].num_bytes);
+    }
+    free(statements);
+}
+
+void listing_print(void) {
+    print_instructions();
+    print_summary();
+}
@@ -0,0 +1,35 @@
+// Annotated listings of generated code. While the code generator runs, it
+// tells the listing which AST node and which statement it is generating code
+// for. listing_print() then disassembles the code buffer, groups the
+// instructions under the nodes that produced them, and ends with how many
+// bytes each node type and each statement took.
+//
+// Nothing is recorded unless listing_enable() has been called.
+
+#pragma once
+
+// Standard headers
+#include <stdbool.h>
+
+
+typedef struct _ast_node_t ast_node_t;
+
+// What the code generator is working on. Code emitted outside of any node,
+// like the function entry and exit, has a NULL node and statement.
+typedef struct {
+    ast_node_t *node;
+    ast_node_t *statement;
+    bool is_data; // Bytes that aren't instructions, eg a literal pool
+} listing_pos_t;
+
+
+void listing_enable(void);
+void listing_reset(void); // Call when the code buffer is reset
+
+// The code emitted until the matching listing_leave() belongs to 'node'. Pass
+// the return value to listing_leave().
+listing_pos_t listing_enter(ast_node_t *node, bool is_statement);
+void listing_leave(listing_pos_t outer);
+listing_pos_t listing_enter_data(void); // Like listing_enter(), for data that isn't disassembled
+
+void listing_print(void);
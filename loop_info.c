@@ -0,0 +1,224 @@
+// Own header
+#include "loop_info.h"
+
+// This project's headers
+#include "host_funcs.h"
+#include "lexical_scope.h"
+#include "parser.h"
+#include "types.h"
+
+
+// Stands in for the writer of a variable that is written in more than one place.
+static ast_node_t g_many_writers;
+
+
+static void record_write(hashtab_t *written, strview_t const *name, ast_node_t *writer) {
+    ast_node_t *prev = hashtab_get(written, name);
+    hashtab_put(written, name, prev && prev != writer ? &g_many_writers : writer);
+}
+
+static bool is_pure_call(ast_node_t *node) {
+    host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+    return func && func->is_pure;
+}
+
+void loop_info_find_written_vars(ast_node_t *node, hashtab_t *written) {
+    switch (node->type) {
+    case NODE_ASSIGNMENT:
+        if (node->assignment.left->type == NODE_IDENTIFIER)
+            record_write(written, &node->assignment.left->identifier.name, node);
+        loop_info_find_written_vars(node->assignment.left, written);
+        loop_info_find_written_vars(node->assignment.right, written);
+        break;
+    case NODE_BINARY_OP:
+        loop_info_find_written_vars(node->binary_op.left, written);
+        loop_info_find_written_vars(node->binary_op.right, written);
+        break;
+    case NODE_COMPARE:
+        loop_info_find_written_vars(node->compare_op.left, written);
+        loop_info_find_written_vars(node->compare_op.right, written);
+        break;
+    case NODE_UNARY_OP:
+        loop_info_find_written_vars(node->unary_op.operand, written);
+        break;
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            loop_info_find_written_vars(node->block.statements.data[i], written);
+        break;
+    case NODE_FUNCTION_CALL:
+        for (unsigned i = 0; i < node->func_call.parameters.size; i++) {
+            ast_node_t *param = node->func_call.parameters.data[i];
+
+            // An impure call may modify any variable passed to it, eg append(a, x).
+            if (param->type == NODE_IDENTIFIER && !is_pure_call(node))
+                record_write(written, &param->identifier.name, node);
+            loop_info_find_written_vars(param, written);
+        }
+        break;
+    case NODE_VARIABLE_DECLARATION:
+        // The declaration zeroes the variable on every iteration.
+        record_write(written, &node->var_decl.identifier_name, node);
+        break;
+    case NODE_WHILE:
+        loop_info_find_written_vars(node->while_loop.condition_expr, written);
+        loop_info_find_written_vars(node->while_loop.block, written);
+        break;
+    case NODE_IF:
+        loop_info_find_written_vars(node->if_stmt.condition_expr, written);
+        loop_info_find_written_vars(node->if_stmt.then_block, written);
+        if (node->if_stmt.else_block)
+            loop_info_find_written_vars(node->if_stmt.else_block, written);
+        break;
+    case NODE_INDEX:
+        loop_info_find_written_vars(node->index.index, written);
+        break;
+    default:
+        break;
+    }
+}
+
+bool loop_info_is_invariant(ast_node_t *expr, hashtab_t const *written) {
+    switch (expr->type) {
+    case NODE_NUMBER:
+    case NODE_STRING_LITERAL:
+        return true;
+    case NODE_IDENTIFIER:
+        return hashtab_get(written, &expr->identifier.name) == NULL;
+    case NODE_BINARY_OP:
+        return loop_info_is_invariant(expr->binary_op.left, written) &&
+               loop_info_is_invariant(expr->binary_op.right, written);
+    case NODE_FUNCTION_CALL:
+        if (!is_pure_call(expr))
+            return false;
+        for (unsigned i = 0; i < expr->func_call.parameters.size; i++) {
+            if (!loop_info_is_invariant(expr->func_call.parameters.data[i], written))
+                return false;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_identifier(ast_node_t *node, strview_t const *name) {
+    return node->type == NODE_IDENTIFIER && strview_cmp(&node->identifier.name, name);
+}
+
+// Returns true if 'node' is "name = name + 1" or "name = 1 + name".
+static bool is_increment_of(ast_node_t *node, strview_t const *name) {
+    if (node->type != NODE_ASSIGNMENT || !is_identifier(node->assignment.left, name))
+        return false;
+
+    ast_node_t *add = node->assignment.right;
+    if (add->type != NODE_BINARY_OP || add->binary_op.op != TOKEN_PLUS)
+        return false;
+
+    ast_node_t *l = add->binary_op.left;
+    ast_node_t *r = add->binary_op.right;
+    return (is_identifier(l, name) && r->type == NODE_NUMBER && r->number.int_value == 1) ||
+           (is_identifier(r, name) && l->type == NODE_NUMBER && l->number.int_value == 1);
+}
+
+bool loop_info_find_counted_loop(ast_node_t *while_node, counted_loop_t *loop) {
+    ast_node_t *cond = while_node->while_loop.condition_expr;
+    if (cond->type != NODE_COMPARE)
+        return false;
+
+    // i != limit, limit != i, i < limit or limit > i.
+    TokenType op = cond->compare_op.op;
+    ast_node_t *var = cond->compare_op.left;
+    ast_node_t *limit = cond->compare_op.right;
+    if (op == TOKEN_GREATER_THAN || (op == TOKEN_NOT_EQUALS && var->type != NODE_IDENTIFIER)) {
+        var = cond->compare_op.right;
+        limit = cond->compare_op.left;
+    }
+    else if (op != TOKEN_NOT_EQUALS && op != TOKEN_LESS_THAN) {
+        return false;
+    }
+    if (var->type != NODE_IDENTIFIER)
+        return false;
+
+    derived_type_t *type = lscope_get(&var->identifier.name);
+    if (!type || type->is_array || type->object_type.num_lanes != 1)
+        return false;
+
+    hashtab_t written = hashtab_create();
+    loop_info_find_written_vars(while_node, &written);
+
+    bool found = false;
+    if (loop_info_is_invariant(limit, &written)) {
+        ast_node_t *writer = hashtab_get(&written, &var->identifier.name);
+        darray_t *stmts = &while_node->while_loop.block->block.statements;
+        for (unsigned i = 0; i < stmts->size; i++) {
+            if (stmts->data[i] == writer && is_increment_of(writer, &var->identifier.name)) {
+                loop->var_name = &var->identifier.name;
+                loop->limit = limit;
+                loop->increment_idx = i;
+                found = true;
+                break;
+            }
+        }
+    }
+
+    hashtab_free(&written);
+    return found;
+}
+
+static void find_induction_indexes(ast_node_t *node, counted_loop_t const *loop,
+                                   hashtab_t const *written, darray_t *indexes) {
+    switch (node->type) {
+    case NODE_INDEX:
+        if (is_identifier(node->index.index, loop->var_name) &&
+            !hashtab_get(written, &node->index.array->identifier.name))
+            darray_append(indexes, node);
+        find_induction_indexes(node->index.index, loop, written, indexes);
+        break;
+    case NODE_ASSIGNMENT:
+        find_induction_indexes(node->assignment.left, loop, written, indexes);
+        find_induction_indexes(node->assignment.right, loop, written, indexes);
+        break;
+    case NODE_BINARY_OP:
+        find_induction_indexes(node->binary_op.left, loop, written, indexes);
+        find_induction_indexes(node->binary_op.right, loop, written, indexes);
+        break;
+    case NODE_COMPARE:
+        find_induction_indexes(node->compare_op.left, loop, written, indexes);
+        find_induction_indexes(node->compare_op.right, loop, written, indexes);
+        break;
+    case NODE_UNARY_OP:
+        find_induction_indexes(node->unary_op.operand, loop, written, indexes);
+        break;
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            find_induction_indexes(node->block.statements.data[i], loop, written, indexes);
+        break;
+    case NODE_FUNCTION_CALL:
+        for (unsigned i = 0; i < node->func_call.parameters.size; i++)
+            find_induction_indexes(node->func_call.parameters.data[i], loop, written, indexes);
+        break;
+    case NODE_WHILE:
+        find_induction_indexes(node->while_loop.condition_expr, loop, written, indexes);
+        find_induction_indexes(node->while_loop.block, loop, written, indexes);
+        break;
+    case NODE_IF:
+        find_induction_indexes(node->if_stmt.condition_expr, loop, written, indexes);
+        find_induction_indexes(node->if_stmt.then_block, loop, written, indexes);
+        if (node->if_stmt.else_block)
+            find_induction_indexes(node->if_stmt.else_block, loop, written, indexes);
+        break;
+    default:
+        break;
+    }
+}
+
+void loop_info_find_induction_indexes(ast_node_t *while_node, counted_loop_t const *loop,
+                                      darray_t *indexes) {
+    hashtab_t written = hashtab_create();
+    loop_info_find_written_vars(while_node, &written);
+
+    darray_t *stmts = &while_node->while_loop.block->block.statements;
+    for (unsigned i = 0; i < loop->increment_idx; i++)
+        find_induction_indexes(stmts->data[i], loop, &written, indexes);
+
+    hashtab_free(&written);
+}
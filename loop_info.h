@@ -0,0 +1,48 @@
+// Analyses of while loops that are shared by the loop optimizations.
+
+#pragma once
+
+// This project's headers
+#include "darray.h"
+#include "hash_table.h"
+
+// Standard headers
+#include <stdbool.h>
+
+
+// A loop of the form:
+//
+//     while (i != limit) { ... i = i + 1; ... }
+//
+// or the same with i < limit. Both stop at the same point when i starts at or
+// below the limit, which the optimizations check before relying on it.
+//
+// where 'limit' is loop invariant and the increment, which must be a statement
+// directly in the loop body, is the only write to 'i' anywhere in the loop.
+typedef struct {
+    strview_t const *var_name; // The induction variable, 'i'.
+    ast_node_t *limit;
+    unsigned increment_idx;    // Index of the increment in the body's statements.
+} counted_loop_t;
+
+
+// Builds the set of variables whose value may change while 'node' runs. Each
+// entry maps the variable name to the node that writes it, or to a dummy
+// node if there is more than one.
+//
+// Storing to an element of an array does not count as writing the array
+// variable. Resizing it does.
+void loop_info_find_written_vars(ast_node_t *node, hashtab_t *written);
+
+// True if the expression only reads literals, variables that are not in
+// 'written', and calls to pure host functions with invariant arguments.
+bool loop_info_is_invariant(ast_node_t *expr, hashtab_t const *written);
+
+bool loop_info_find_counted_loop(ast_node_t *while_node, counted_loop_t *loop);
+
+// Finds the "a[i]" expressions in the part of a counted loop's body that runs
+// before the increment, where 'a' is not resized anywhere in the loop. Each
+// time they run, i is in [i_start, limit). So if i_start <= limit <= len(a)
+// when the loop is entered, none of them can be out of bounds.
+void loop_info_find_induction_indexes(ast_node_t *while_node, counted_loop_t const *loop,
+                                      darray_t *indexes);
@@ -1,16 +1,114 @@
 // This project's headers
 #include "assembler.h"
+#include "bc_gen.h"
+#include "bytecode.h"
 #include "code_gen.h"
+#include "code_heap.h"
+#include "const_eval.h"
+#include "interp.h"
+#include "listing.h"
+#include "mem_usage.h"
 #include "parser.h"
+#include "profile.h"
+#include "repl.h"
+#include "safepoint.h"
+#include "sampler.h"
+#include "source_file.h"
+#include "target.h"
 #include "time.h"
+#include "tokenizer.h"
+#include "vm.h"
 
 // Standard headers
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 typedef int(*two_in_one_out)(int, int);
 
+typedef enum {
+    TIER_MODE_TIERED, // Interpret, and compile hot loops
+    TIER_MODE_INTERP, // Only interpret
+    TIER_MODE_JIT,    // Compile the whole program before running it
+    TIER_MODE_VM,     // Compile to bytecode and run that
+} tier_mode_t;
 
+static tier_mode_t g_tier_mode = TIER_MODE_TIERED;
+static char const *g_bytecode_out_path; // Where to save the bytecode, in TIER_MODE_VM
+static char const *g_source_path;       // Run this file instead of the built in tests
+static char const *g_profile_out_path;  // Where to save the profile, when instrumenting
+static unsigned g_sample_interval_us;   // 0 means don't run the sampling profiler
+static bool g_print_listing;            // Print the generated code before running it
+static bool g_print_code_heap_stats;    // Print the code heap's occupancy after running
+static unsigned g_timeout_ms;           // 0 means no timeout
+static bool g_compile_only;             // Time the compiler's phases instead of running
+
+
+
+typedef struct {
+    ast_node_t *ast;
+    int result;
+    void *code; // The JIT tier's code
+} run_t;
+
+// Programs that the interpreter can't run are compiled up front.
+static void run_tier(void *arg) {
+    run_t *run = arg;
+    if (g_tier_mode == TIER_MODE_VM) {
+        bc_module_t module;
+        bc_gen(run->ast, &module);
+        if (g_bytecode_out_path) {
+            FILE *f = fopen(g_bytecode_out_path, "wb");
+            if (!f || !bc_write(&module, f))
+                FATAL_ERROR("Couldn't write bytecode to '%s'", g_bytecode_out_path);
+            fclose(f);
+        }
+        run->result = (int)vm_run(&module);
+        bc_free(&module);
+    }
+    else if (g_tier_mode != TIER_MODE_JIT && interp_can_run(run->ast)) {
+        run->result = (int)interp_run(run->ast, g_tier_mode == TIER_MODE_TIERED);
+    }
+    else {
+        run->code = code_gen(run->ast);
+        if (g_print_listing)
+            listing_print();
+        two_in_one_out funcPtr = (two_in_one_out)run->code;
+        run->result = funcPtr(1, 2);
+        if (g_profile_out_path) {
+            FILE *f = fopen(g_profile_out_path, "w");
+            if (!f || !profile_write(f))
+                FATAL_ERROR("Couldn't write profile to '%s'", g_profile_out_path);
+            fclose(f);
+        }
+    }
+}
+
+// 'source' is only used for the sampling profiler's report.
+static void run_ast(ast_node_t *ast, char const *source, size_t source_num_bytes) {
+    if (g_sample_interval_us && !sampler_start(g_sample_interval_us))
+        g_sample_interval_us = 0;
+    double start = get_time();
+    run_t run = { ast, 0, NULL };
+    bool finished = safepoint_run(run_tier, &run, g_timeout_ms);
+    double duration = get_time() - start;
+    if (finished)
+        printf("%d %.3f\n", run.result, duration * 1e3);
+    else
+        printf("Timed out after %.3f ms\n", duration * 1e3);
+
+    if (g_sample_interval_us) {
+        sampler_stop();
+        sampler_report(source, source_num_bytes);
+    }
+
+    // The interpreter has already released the loops that it compiled,
+    // unless it was stopped.
+    if (g_print_code_heap_stats)
+        code_heap_print_stats();
+    code_heap_free(run.code);
+}
 
 static void run_test(char const *source_code) {
     printf("--- Parsing Code: \"%s\" ---\n", source_code);
@@ -20,20 +118,248 @@ static void run_test(char const *source_code) {
     printf("--- Abstract Syntax Tree ---\n");
     parser_print_ast_node(ast, 0);
 
-    code_gen(ast);
+    run_ast(ast, source_code, strlen(source_code));
+    parser_free_ast(ast);
+    printf("\n");
+}
 
-    two_in_one_out funcPtr = (two_in_one_out)g_assembler.binary;
+typedef struct {
+    char const *name;
+    double duration;
+    size_t peak_mem;   // For the whole process so far
+} phase_time_t;
 
+static void end_phase(phase_time_t *phase, char const *name, double start) {
+    phase->name = name;
+    phase->duration = get_time() - start;
+    phase->peak_mem = mem_usage_get_peak();
+}
+
+// The parser pulls tokens as it goes, so the tokenizer is timed on its own by
+// running it over the whole file first.
+static unsigned count_tokens(char const *source, size_t num_bytes) {
+    unsigned num_tokens = 0;
+    tokenizer_init_range(source, num_bytes);
+    while (current_token.type != TOKEN_EOF) {
+        num_tokens++;
+        if (!tokenizer_next_token())
+            break;
+    }
+
+    return num_tokens;
+}
+
+// The format is read by bench_scaling.py.
+static void print_phase_times(unsigned num_tokens, size_t num_bytes, phase_time_t const *phases,
+                              unsigned num_phases) {
+    printf("--- Compile times: %u tokens, %u bytes ---\n", num_tokens, (unsigned)num_bytes);
+    printf("  %-10s %12s %14s\n", "Phase", "ms", "peak KB");
+    for (unsigned i = 0; i < num_phases; i++) {
+        printf("  %-10s %12.3f %14llu\n", phases[i].name, phases[i].duration * 1e3,
+               (unsigned long long)phases[i].peak_mem / 1024);
+    }
+}
+
+// The file is parsed straight out of its mapping. Its source and AST aren't
+// printed because files are expected to be big.
+static void run_file(char const *path) {
+    printf("--- Parsing File: \"%s\" ---\n", path);
+    source_file_t sf;
+    if (!source_file_map(&sf, path))
+        FATAL_ERROR("Couldn't map source file '%s'", path);
+
+    phase_time_t phases[3];
+    unsigned num_phases = 0;
+    unsigned num_tokens = 0;
     double start = get_time();
-    int result = funcPtr(1, 2);
+    if (g_compile_only) {
+        num_tokens = count_tokens(sf.data, sf.num_bytes);
+        end_phase(&phases[num_phases++], "tokenize", start);
+        start = get_time();
+    }
+
+    ast_node_t *ast = parser_parse_range(sf.data, sf.num_bytes);
+    double duration = get_time() - start;
+    printf("Parsed %u bytes in %.3f ms\n", (unsigned)sf.num_bytes, duration * 1e3);
+
+    if (ast && g_compile_only) {
+        end_phase(&phases[num_phases++], "parse", start);
+        start = get_time();
+        void *code = code_gen(ast);
+        end_phase(&phases[num_phases++], "codegen", start);
+        printf("Generated %u bytes of code\n", g_assembler.binary_size);
+        print_phase_times(num_tokens, sf.num_bytes, phases, num_phases);
+        code_heap_free(code);
+        parser_free_ast(ast);
+    }
+    else if (ast) {
+        run_ast(ast, sf.data, sf.num_bytes);
+        parser_free_ast(ast);
+    }
+
+    // The AST's identifiers point into the mapping, so it goes last.
+    source_file_unmap(&sf);
+}
+
+static void run_bytecode_file(char const *path) {
+    printf("--- Loading Bytecode: \"%s\" ---\n", path);
+    bc_module_t module;
+    FILE *f = fopen(path, "rb");
+    if (!f || !bc_read(&module, f))
+        FATAL_ERROR("Couldn't read valid bytecode from '%s'", path);
+    fclose(f);
+    bc_print(&module);
+
+    double start = get_time();
+    int result = (int)vm_run(&module);
     double duration = get_time() - start;
     printf("%d %.3f\n", result, duration * 1e3);
 
-    parser_free_ast(ast);
-    printf("\n");
+    bc_free(&module);
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    target_init();
+
+    // "-target baseline" pins the code generator to plain x86-64, so that
+    // timings are comparable across machines.
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-target") == 0 && i + 1 < argc) {
+            i++;
+            if (!target_select(argv[i]))
+                FATAL_ERROR("Unknown target '%s'. Expected 'native' or 'baseline'", argv[i]);
+        }
+        else if (strcmp(argv[i], "-tier") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "tiered") == 0)
+                g_tier_mode = TIER_MODE_TIERED;
+            else if (strcmp(argv[i], "interp") == 0)
+                g_tier_mode = TIER_MODE_INTERP;
+            else if (strcmp(argv[i], "jit") == 0)
+                g_tier_mode = TIER_MODE_JIT;
+            else if (strcmp(argv[i], "vm") == 0)
+                g_tier_mode = TIER_MODE_VM;
+            else
+                FATAL_ERROR("Unknown tier mode '%s'. Expected 'tiered', 'interp', 'jit' or 'vm'", argv[i]);
+        }
+        else if (strcmp(argv[i], "-save-bytecode") == 0 && i + 1 < argc) {
+            g_tier_mode = TIER_MODE_VM;
+            g_bytecode_out_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-run-bytecode") == 0 && i + 1 < argc) {
+            run_bytecode_file(argv[++i]);
+            return 0;
+        }
+        else if (strcmp(argv[i], "-repl") == 0) {
+            repl_run(stdin);
+            return 0;
+        }
+        else if (strcmp(argv[i], "-align-loops") == 0 && i + 1 < argc) {
+            // "<alignment>" or "<alignment>:<max padding>". Smaller values
+            // trade loop alignment for code size.
+            i++;
+            char *end;
+            unsigned alignment = strtoul(argv[i], &end, 10);
+            unsigned max_padding = alignment ? alignment - 1 : 0;
+            if (*end == ':')
+                max_padding = strtoul(end + 1, &end, 10);
+            if (*end != '\0' || alignment == 0 || alignment > 64 || (alignment & (alignment - 1)))
+                FATAL_ERROR("Bad loop alignment '%s'. Expected a power of two up to 64, optionally followed by :<max padding>", argv[i]);
+            code_gen_set_loop_alignment(alignment, max_padding);
+        }
+        else if (strcmp(argv[i], "-unroll") == 0 && i + 1 < argc) {
+            // "<factor>" or "<factor>:<max nodes>", where max nodes is the
+            // code size budget for an unrolled loop body.
+            i++;
+            char *end;
+            unsigned factor = strtoul(argv[i], &end, 10);
+            unsigned max_nodes = 128;
+            if (*end == ':')
+                max_nodes = strtoul(end + 1, &end, 10);
+            if (*end != '\0' || factor == 0)
+                FATAL_ERROR("Bad unroll setting '%s'. Expected <factor>[:<max nodes>]", argv[i]);
+            code_gen_set_unrolling(factor, max_nodes);
+        }
+        else if (strcmp(argv[i], "-const-eval") == 0 && i + 1 < argc) {
+            // The number of AST nodes that may be evaluated at compile time.
+            // 0 turns compile-time evaluation off.
+            i++;
+            char *end;
+            unsigned fuel = strtoul(argv[i], &end, 10);
+            if (*end != '\0')
+                FATAL_ERROR("Bad compile-time evaluation fuel '%s'. Expected a number of nodes", argv[i]);
+            ceval_set_fuel(fuel);
+        }
+        else if (strcmp(argv[i], "-profile-gen") == 0 && i + 1 < argc) {
+            // Only the JIT tier is instrumented.
+            g_tier_mode = TIER_MODE_JIT;
+            g_profile_out_path = argv[++i];
+            profile_enable_instrumentation();
+        }
+        else if (strcmp(argv[i], "-profile-use") == 0 && i + 1 < argc) {
+            i++;
+            g_tier_mode = TIER_MODE_JIT;
+            FILE *f = fopen(argv[i], "r");
+            if (!f || !profile_read(f))
+                FATAL_ERROR("Couldn't read a valid profile from '%s'", argv[i]);
+            fclose(f);
+        }
+        else if (strcmp(argv[i], "-sample") == 0 && i + 1 < argc) {
+            // Sampling interval, in microseconds of CPU time.
+            i++;
+            char *end;
+            g_sample_interval_us = strtoul(argv[i], &end, 10);
+            if (*end != '\0' || g_sample_interval_us == 0)
+                FATAL_ERROR("Bad sampling interval '%s'. Expected microseconds", argv[i]);
+        }
+        else if (strcmp(argv[i], "-listing") == 0) {
+            // Only the JIT tier compiles the whole program.
+            g_tier_mode = TIER_MODE_JIT;
+            g_print_listing = true;
+            listing_enable();
+        }
+        else if (strcmp(argv[i], "-huge-pages") == 0) {
+            // Back the code of hot loops with huge pages, where the OS allows.
+            code_heap_set_huge_pages(true);
+        }
+        else if (strcmp(argv[i], "-code-heap-stats") == 0) {
+            g_print_code_heap_stats = true;
+        }
+        else if (strcmp(argv[i], "-timeout") == 0 && i + 1 < argc) {
+            // Milliseconds, after which the script is stopped at its next
+            // safepoint.
+            i++;
+            char *end;
+            g_timeout_ms = strtoul(argv[i], &end, 10);
+            if (*end != '\0' || g_timeout_ms == 0)
+                FATAL_ERROR("Bad timeout '%s'. Expected milliseconds", argv[i]);
+            if (!safepoint_enable())
+                g_timeout_ms = 0;
+        }
+        else if (strcmp(argv[i], "-compile-only") == 0) {
+            // Only applies to -file.
+            g_compile_only = true;
+        }
+        else if (strcmp(argv[i], "-file") == 0 && i + 1 < argc) {
+            g_source_path = argv[++i];
+        }
+        else {
+            FATAL_ERROR("Usage: %s [-target native|baseline] [-tier tiered|interp|jit|vm]\n"
+                        "       [-save-bytecode <path>] [-run-bytecode <path>] [-repl] [-file <path>]\n"
+                        "       [-align-loops <n>[:<max padding>]] [-unroll <factor>[:<max nodes>]]\n"
+                        "       [-const-eval <fuel>]\n"
+                        "       [-profile-gen <path>] [-profile-use <path>] [-sample <interval us>]\n"
+                        "       [-listing] [-huge-pages] [-code-heap-stats] [-timeout <ms>]\n"
+                        "       [-compile-only]", argv[0]);
+        }
+    }
+    target_print();
+
+    if (g_source_path) {
+        run_file(g_source_path);
+        return 0;
+    }
+
 //    run_test("{ u8 x; x = 3; u64 y; y = 7; }");
 
 //    run_test("{ u8[] a; }");
@@ -47,6 +373,7 @@ int main() {
         "       a = b;"
         "       b = c;"
         "   }"
+        "   a;"
         "}");
 
 //     run_test(
@@ -0,0 +1,9 @@
+#pragma once
+
+// Standard headers
+#include <stddef.h>
+
+
+// The most memory that the process has had resident so far, in bytes. 0 if
+// it isn't known.
+size_t mem_usage_get_peak(void);
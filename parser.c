@@ -3,7 +3,9 @@
 
 // This project's headers
 #include "hash_table.h"
+#include "host_funcs.h"
 #include "lexical_scope.h"
+#include "source_pos.h"
 #include "tokenizer.h"
 #include "types.h"
 
@@ -46,19 +48,26 @@ static ast_node_t *parse_compound_statement(void);
 // ***************************************************************************
 
 static void *report_error(char const *msg, Token const *bad_token) {
+    unsigned line, column;
+    source_pos_get(bad_token->offset, &line, &column);
     fwrite(msg, strlen(msg), 1, stdout);
-    printf("'%.*s'. line=%d column=%d'\n", 
+    printf("'%.*s'. line=%u column=%u'\n", 
         (int)bad_token->lexeme.len, bad_token->lexeme.data, 
-        bad_token->line, bad_token->column);
+        line, column);
     return NULL;
 }
 
 static ast_node_t *create_ast_node(ast_node_type_t type) {
     ast_node_t *node = calloc(1, sizeof(ast_node_t));
     node->type = type;
+    node->source_offset = current_token.offset;
     return node;
 }
 
+static void set_pos_from_token(ast_node_t *node, Token const *token) {
+    node->source_offset = token->offset;
+}
+
 
 // ***************************************************************************
 // Parser functions that correspond to a grammar rule and AstNodeType
@@ -67,10 +76,11 @@ static ast_node_t *create_ast_node(ast_node_type_t type) {
 static ast_node_t *parse_func_call(Token const *name) {
     ast_node_t *rv = NULL;
 
-    if (strview_cmp_cstr(&name->lexeme, "puts")) {
+    if (host_funcs_get(&name->lexeme)) {
         if (!tokenizer_next_token()) goto error;
 
         rv = create_ast_node(NODE_FUNCTION_CALL);
+        set_pos_from_token(rv, name);
         rv->func_call.func_name = name->lexeme;
         while (current_token.type != TOKEN_RPAREN) {
             ast_node_t *expr = parse_expression();
@@ -116,10 +126,35 @@ static ast_node_t *parse_primary(void) {
             rv = parse_func_call(&ident_token);
         }
         else {
-            if (!lscope_get(&ident_token.lexeme))
+            derived_type_t *type = lscope_get(&ident_token.lexeme);
+            if (!type)
                 return report_error("Unknown identifier ", &ident_token);
             rv = create_ast_node(NODE_IDENTIFIER);
+            set_pos_from_token(rv, &ident_token);
             rv->identifier.name = ident_token.lexeme;
+
+            if (current_token.type == TOKEN_LBRACKET) {
+                ast_node_t *index; // VS2013 insists I have to put this up here.
+
+                if (!type->is_array) {
+                    report_error("Indexing something that is not an array ", &ident_token);
+                    goto error;
+                }
+                if (!tokenizer_next_token()) goto error;
+
+                index = create_ast_node(NODE_INDEX);
+                set_pos_from_token(index, &ident_token);
+                index->index.array = rv;
+                rv = index;
+                rv->index.index = parse_expression();
+                if (!rv->index.index) goto error;
+
+                if (current_token.type != TOKEN_RBRACKET) {
+                    report_error("Expected ]. Got ", &current_token);
+                    goto error;
+                }
+                if (!tokenizer_next_token()) goto error;
+            }
         }
 //         if (!lookup_identifier()) {
 //             report_error("Expected 
@@ -169,52 +204,76 @@ error:
     return NULL;
 }
 
-static ast_node_t *parse_add_expression(void) {
-    ast_node_t *right = NULL;
-    ast_node_t *left = parse_unary_expression();
-    if (!left) goto error;
-
-    if (current_token.type == TOKEN_PLUS || current_token.type == TOKEN_MINUS) {
-        ast_node_t *equals; // VS2013 insists I have to put this up here.
-
-        equals = create_ast_node(NODE_BINARY_OP);
-        equals->binary_op.op = current_token.type;
-        equals->binary_op.left = left;
-
-        if (!tokenizer_next_token()) goto error;
-        right = parse_add_expression();
-        if (!right) goto error;
-
-        equals->binary_op.right = right;
-        return equals;
+// Binary operators, all left associative. Higher precedence binds tighter.
+// The order is the same as C's.
+typedef struct {
+    TokenType token;
+    ast_node_type_t node_type;
+    int precedence;
+} binary_op_info_t;
+
+static binary_op_info_t const g_binary_ops[] = {
+    { TOKEN_LOGICAL_OR, NODE_COMPARE, 1 },
+    { TOKEN_LOGICAL_AND, NODE_COMPARE, 2 },
+    { TOKEN_OR, NODE_BINARY_OP, 3 },
+    { TOKEN_XOR, NODE_BINARY_OP, 4 },
+    { TOKEN_AND, NODE_BINARY_OP, 5 },
+    { TOKEN_EQUALS, NODE_COMPARE, 6 },
+    { TOKEN_NOT_EQUALS, NODE_COMPARE, 6 },
+    { TOKEN_LESS_THAN, NODE_COMPARE, 7 },
+    { TOKEN_LESS_EQUAL, NODE_COMPARE, 7 },
+    { TOKEN_GREATER_THAN, NODE_COMPARE, 7 },
+    { TOKEN_GREATER_EQUAL, NODE_COMPARE, 7 },
+    { TOKEN_SHIFT_LEFT, NODE_BINARY_OP, 8 },
+    { TOKEN_SHIFT_RIGHT, NODE_BINARY_OP, 8 },
+    { TOKEN_PLUS, NODE_BINARY_OP, 9 },
+    { TOKEN_MINUS, NODE_BINARY_OP, 9 },
+    { TOKEN_MULTIPLY, NODE_BINARY_OP, 10 },
+    { TOKEN_DIVIDE, NODE_BINARY_OP, 10 },
+    { TOKEN_MODULO, NODE_BINARY_OP, 10 },
+};
+
+static binary_op_info_t const *get_binary_op(TokenType type) {
+    for (unsigned i = 0; i < sizeof(g_binary_ops) / sizeof(g_binary_ops[0]); i++) {
+        if (g_binary_ops[i].token == type)
+            return &g_binary_ops[i];
     }
-
-    return left;
-
-error:
-    parser_free_ast(left);
-    parser_free_ast(right);
     return NULL;
 }
 
-static ast_node_t *parse_compare_expression(void) {
+// Precedence climbing. Parses unary expressions separated by binary operators
+// with a precedence of at least min_precedence. A run of operators of the same
+// precedence is handled by the loop rather than by recursion, so a flat chain
+// like a + b + c + ... builds a left leaning tree without using more stack.
+static ast_node_t *parse_binary_expression(int min_precedence) {
     ast_node_t *right = NULL;
-    ast_node_t *left = parse_add_expression();
+    ast_node_t *left = parse_unary_expression();
     if (!left) goto error;
 
-    if (current_token.type == TOKEN_EQUALS || current_token.type == TOKEN_NOT_EQUALS) {
-        ast_node_t *equals; // VS2013 insists I have to put this up here.
-
-        equals = create_ast_node(NODE_COMPARE);
-        equals->compare_op.op = current_token.type;
-        equals->compare_op.left = left;
+    for (;;) {
+        ast_node_t *node; // VS2013 insists I have to put this up here.
+        binary_op_info_t const *op = get_binary_op(current_token.type);
+        if (!op || op->precedence < min_precedence)
+            break;
 
         if (!tokenizer_next_token()) goto error;
-        right = parse_compare_expression();
+        right = parse_binary_expression(op->precedence + 1);
         if (!right) goto error;
 
-        equals->compare_op.right = right;
-        return equals;
+        node = create_ast_node(op->node_type);
+        node->source_offset = left->source_offset;
+        if (op->node_type == NODE_COMPARE) {
+            node->compare_op.op = op->token;
+            node->compare_op.left = left;
+            node->compare_op.right = right;
+        }
+        else {
+            node->binary_op.op = op->token;
+            node->binary_op.left = left;
+            node->binary_op.right = right;
+        }
+        left = node;
+        right = NULL;
     }
 
     return left;
@@ -228,7 +287,7 @@ error:
 static ast_node_t *parse_assignment(void) {
     ast_node_t *right = NULL;
 
-    ast_node_t *left = parse_compare_expression();
+    ast_node_t *left = parse_binary_expression(1);
     if (!left) goto error;
 
     if (current_token.type == TOKEN_ASSIGN) {
@@ -238,6 +297,7 @@ static ast_node_t *parse_assignment(void) {
         if (!right) goto error;
 
         assignment = create_ast_node(NODE_ASSIGNMENT);
+        assignment->source_offset = left->source_offset;
         assignment->assignment.left = left;
         assignment->assignment.right = right;
         return assignment;
@@ -342,6 +402,54 @@ static ast_node_t *parse_while_stmt(void) {
 
     if (!tokenizer_next_token()) goto error;
     node->while_loop.block = parse_compound_statement();
+    if (!node->while_loop.block) goto error;
+    return node;
+
+error:
+    parser_free_ast(node);
+    return NULL;
+}
+
+static ast_node_t *parse_if_stmt(void) {
+    assert(current_token.type == TOKEN_IF);
+
+    ast_node_t *node = create_ast_node(NODE_IF);
+    if (!tokenizer_next_token()) goto error;
+
+    if (current_token.type != TOKEN_LPAREN) {
+        report_error("Expected ( Got ", &current_token);
+        goto error;
+    }
+    if (!tokenizer_next_token()) goto error;
+
+    node->if_stmt.condition_expr = parse_expression();
+    if (!node->if_stmt.condition_expr) goto error;
+
+    if (current_token.type != TOKEN_RPAREN) {
+        report_error("Expected ) Got ", &current_token);
+        goto error;
+    }
+
+    if (!tokenizer_next_token()) goto error;
+    node->if_stmt.then_block = parse_compound_statement();
+    if (!node->if_stmt.then_block) goto error;
+
+    if (current_token.type != TOKEN_ELSE)
+        return node;
+    if (!tokenizer_next_token()) goto error;
+
+    if (current_token.type == TOKEN_IF) {
+        // Wrap the chained if in a block, so both branches are always blocks.
+        ast_node_t *else_if;
+        node->if_stmt.else_block = create_ast_node(NODE_BLOCK);
+        else_if = parse_if_stmt();
+        if (!else_if) goto error;
+        darray_append(&node->if_stmt.else_block->block.statements, else_if);
+    }
+    else {
+        node->if_stmt.else_block = parse_compound_statement();
+        if (!node->if_stmt.else_block) goto error;
+    }
     return node;
 
 error:
@@ -352,11 +460,33 @@ error:
 static ast_node_t *parse_statement(void) {
     if (current_token.type == TOKEN_WHILE)
         return parse_while_stmt();
-    else if (current_token.type == TOKEN_LPAREN)
+    else if (current_token.type == TOKEN_IF)
+        return parse_if_stmt();
+    else if (current_token.type == TOKEN_LBRACE)
         return parse_compound_statement();
     return parse_expr_statement();
 }
 
+static ast_node_t *parse_block_item(void) {
+    unsigned source_offset = current_token.offset;
+
+    ast_node_t *node;
+    object_type_t *this_type = types_get_obj_type(&current_token.lexeme);
+    if (this_type) {
+        // We've found a variable declaration.
+        node = parse_variable_declaration(this_type);
+    }
+    else {
+        // We must have a statement.
+        node = parse_statement();
+    }
+
+    if (node) {
+        node->source_offset = source_offset;
+    }
+    return node;
+}
+
 static ast_node_t *parse_compound_statement(void) {
     ast_node_t *compound_stmt = NULL;
 
@@ -367,18 +497,7 @@ static ast_node_t *parse_compound_statement(void) {
 
     compound_stmt = create_ast_node(NODE_BLOCK);
     while (current_token.type != TOKEN_RBRACE) {
-        ast_node_t *node = NULL;
-
-        object_type_t *this_type = types_get_obj_type(&current_token.lexeme);
-        if (this_type) {
-            // We've found a variable declaration.
-            node = parse_variable_declaration(this_type);
-        }
-        else {
-            // We must have a statement.
-            node = parse_statement();
-        }
-        
+        ast_node_t *node = parse_block_item();
         if (!node) goto error;
 
         darray_append(&compound_stmt->block.statements, node);
@@ -399,12 +518,42 @@ error:
 // ***************************************************************************
 
 ast_node_t *parser_parse(char const *source_code) {
+    return parser_parse_range(source_code, strlen(source_code));
+}
+
+ast_node_t *parser_parse_range(char const *source_code, size_t num_bytes) {
     lscope_init();
     types_init();
-    tokenizer_init(source_code);
+    tokenizer_init_range(source_code, num_bytes);
     return parse_compound_statement();
 }
 
+void parser_begin_session(void) {
+    lscope_init();
+    types_init();
+}
+
+ast_node_t *parser_parse_line(char const *source_code) {
+    unsigned scope_mark = lscope_mark();
+    ast_node_t *block = create_ast_node(NODE_BLOCK);
+
+    tokenizer_init(source_code);
+    while (current_token.type != TOKEN_EOF) {
+        ast_node_t *node = parse_block_item();
+        if (!node) goto error;
+
+        darray_append(&block->block.statements, node);
+    }
+
+    return block;
+
+error:
+    // The declarations on this line refer to nodes that are being freed.
+    lscope_rollback(scope_mark);
+    parser_free_ast(block);
+    return NULL;
+}
+
 void parser_free_ast(ast_node_t *node) {
     if (!node) return;
 
@@ -438,6 +587,15 @@ void parser_free_ast(ast_node_t *node) {
     case NODE_FUNCTION_CALL:
         darray_free(&node->func_call.parameters);
         break;
+    case NODE_INDEX:
+        parser_free_ast(node->index.array);
+        parser_free_ast(node->index.index);
+        break;
+    case NODE_IF:
+        parser_free_ast(node->if_stmt.condition_expr);
+        parser_free_ast(node->if_stmt.then_block);
+        parser_free_ast(node->if_stmt.else_block);
+        break;
     }
 
     free(node);
@@ -478,6 +636,12 @@ void parser_print_ast_node(ast_node_t *node, int indent_level) {
         case TOKEN_MINUS: printf("-\n"); break;
         case TOKEN_MULTIPLY: printf("*\n"); break;
         case TOKEN_DIVIDE: printf("/\n"); break;
+        case TOKEN_MODULO: printf("%%\n"); break;
+        case TOKEN_AND: printf("&\n"); break;
+        case TOKEN_OR: printf("|\n"); break;
+        case TOKEN_XOR: printf("^\n"); break;
+        case TOKEN_SHIFT_LEFT: printf("<<\n"); break;
+        case TOKEN_SHIFT_RIGHT: printf(">>\n"); break;
         default: printf("UNKNOWN_OP\n"); break;
         }
         print_ast_indent(indent_level + 1);
@@ -492,6 +656,12 @@ void parser_print_ast_node(ast_node_t *node, int indent_level) {
         switch (node->compare_op.op) {
         case TOKEN_EQUALS: printf("==\n"); break;
         case TOKEN_NOT_EQUALS: printf("!=\n"); break;
+        case TOKEN_LESS_THAN: printf("<\n"); break;
+        case TOKEN_LESS_EQUAL: printf("<=\n"); break;
+        case TOKEN_GREATER_THAN: printf(">\n"); break;
+        case TOKEN_GREATER_EQUAL: printf(">=\n"); break;
+        case TOKEN_LOGICAL_AND: printf("&&\n"); break;
+        case TOKEN_LOGICAL_OR: printf("||\n"); break;
         default: printf("UNKNOWN_OP\n"); break;
         }
         print_ast_indent(indent_level + 1);
@@ -537,6 +707,17 @@ void parser_print_ast_node(ast_node_t *node, int indent_level) {
         parser_print_ast_node(node->while_loop.condition_expr, indent_level + 2);
         parser_print_ast_node(node->while_loop.block, indent_level + 2);
         break;
+    case NODE_INDEX:
+        printf("INDEX:\n");
+        parser_print_ast_node(node->index.array, indent_level + 2);
+        parser_print_ast_node(node->index.index, indent_level + 2);
+        break;
+    case NODE_IF:
+        printf("IF:\n");
+        parser_print_ast_node(node->if_stmt.condition_expr, indent_level + 2);
+        parser_print_ast_node(node->if_stmt.then_block, indent_level + 2);
+        parser_print_ast_node(node->if_stmt.else_block, indent_level + 2);
+        break;
 
     default:
         printf("Don't know how to print node type %d\n", node->type);
@@ -19,7 +19,9 @@ typedef enum {
     NODE_STRING_LITERAL,
     NODE_FUNCTION_CALL = 8,
     NODE_VARIABLE_DECLARATION,
-    NODE_WHILE = 10
+    NODE_WHILE = 10,
+    NODE_INDEX,
+    NODE_IF = 12
 } ast_node_type_t;
 
 typedef struct _ast_node_t {
@@ -45,6 +47,8 @@ typedef struct _ast_node_t {
             struct _ast_node_t *right;
         } binary_op;
 
+        // Comparisons, and the && and || operators, whose right operand is
+        // only evaluated if it is needed. All produce 0 or 1.
         struct {
             TokenType op;
             struct _ast_node_t *left;
@@ -72,18 +76,44 @@ typedef struct _ast_node_t {
         struct {
             derived_type_t type_info;
             strview_t identifier_name;
+            bool skip_zero_init; // Set by dead store elimination.
+            bool read_before_decl; // Set by dead store elimination too.
+            bool zeroed_on_entry; // Set by the frame layout.
         } var_decl;
 
         struct {
             struct _ast_node_t *condition_expr;
             struct _ast_node_t *block;
         } while_loop;
+
+        struct {
+            struct _ast_node_t *condition_expr;
+            struct _ast_node_t *then_block;
+            struct _ast_node_t *else_block; // NULL if there is no else. "else if" is a block holding the if.
+        } if_stmt;
+
+        struct {
+            struct _ast_node_t *array; // Always a NODE_IDENTIFIER
+            struct _ast_node_t *index;
+        } index;
     };
 
-    // You could add line/column info here for error reporting
+    // Where the node starts in the source. See source_pos.h
+    unsigned source_offset;
 } ast_node_t;
 
 
 void parser_free_ast(ast_node_t *node);
 ast_node_t *parser_parse(char const *source_code);
+
+// Like parser_parse() but the source need not be nul terminated. The AST's
+// identifiers point into source_code, so it must outlive the AST.
+ast_node_t *parser_parse_range(char const *source_code, size_t num_bytes);
+
+// For interactive use. parser_begin_session() starts with an empty scope. Then
+// each call to parser_parse_line() parses a sequence of declarations and
+// statements, not wrapped in braces, that can use the variables declared by
+// earlier lines. The source code must outlive the session.
+void parser_begin_session(void);
+ast_node_t *parser_parse_line(char const *source_code);
 void parser_print_ast_node(ast_node_t *node, int indent_level);
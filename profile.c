@@ -0,0 +1,202 @@
+// Own header
+#include "profile.h"
+
+// This project's headers
+#include "host_funcs.h"
+#include "parser.h"
+
+// Standard headers
+#include <string.h>
+
+
+// The file format is text. A header line, then one line per site:
+//
+//     MPROF 1 <num sites>
+//     loop <entries> <iterations>
+//     call <calls>
+
+enum { MAX_PROFILE_SITES = 1024 };
+
+typedef enum {
+    SITE_LOOP,
+    SITE_CALL,
+} site_kind_t;
+
+typedef struct {
+    site_kind_t kind;
+    u64 counts[2]; // Indexed by profile_counter_t
+} site_t;
+
+static bool g_instrumenting;
+
+// The sites of the program being compiled. Their counts are the ones the
+// generated code increments, or the ones read from the profile.
+static ast_node_t const *g_site_nodes[MAX_PROFILE_SITES];
+static site_t g_sites[MAX_PROFILE_SITES];
+static unsigned g_num_sites;
+static bool g_have_counts;
+
+// What profile_read() loaded, waiting for profile_begin() to match it up
+// with the program.
+static site_t g_loaded_sites[MAX_PROFILE_SITES];
+static unsigned g_num_loaded_sites;
+static bool g_have_loaded;
+
+
+void profile_enable_instrumentation(void) {
+    g_instrumenting = true;
+}
+
+bool profile_read(FILE *f) {
+    unsigned version, num_sites;
+    if (fscanf(f, "MPROF %u %u", &version, &num_sites) != 2 || version != 1 ||
+        num_sites > MAX_PROFILE_SITES)
+        return false;
+
+    for (unsigned i = 0; i < num_sites; i++) {
+        char kind[8];
+        unsigned long long a, b = 0;
+        site_t *site = &g_loaded_sites[i];
+        if (fscanf(f, "%7s %llu", kind, &a) != 2)
+            return false;
+        if (strcmp(kind, "loop") == 0) {
+            if (fscanf(f, "%llu", &b) != 1)
+                return false;
+            site->kind = SITE_LOOP;
+        }
+        else if (strcmp(kind, "call") == 0) {
+            site->kind = SITE_CALL;
+        }
+        else {
+            return false;
+        }
+        site->counts[PROFILE_COUNTER_ENTRIES] = a;
+        site->counts[PROFILE_COUNTER_ITERATIONS] = b;
+    }
+
+    g_num_loaded_sites = num_sites;
+    g_have_loaded = true;
+    return true;
+}
+
+bool profile_write(FILE *f) {
+    fprintf(f, "MPROF 1 %u\n", g_num_sites);
+    for (unsigned i = 0; i < g_num_sites; i++) {
+        site_t const *site = &g_sites[i];
+        if (site->kind == SITE_LOOP)
+            fprintf(f, "loop %llu %llu\n",
+                    (unsigned long long)site->counts[PROFILE_COUNTER_ENTRIES],
+                    (unsigned long long)site->counts[PROFILE_COUNTER_ITERATIONS]);
+        else
+            fprintf(f, "call %llu\n", (unsigned long long)site->counts[PROFILE_COUNTER_ENTRIES]);
+    }
+    return !ferror(f);
+}
+
+static void add_site(ast_node_t const *node, site_kind_t kind) {
+    if (g_num_sites == MAX_PROFILE_SITES)
+        return; // The rest of the program isn't profiled.
+
+    g_site_nodes[g_num_sites] = node;
+    g_sites[g_num_sites].kind = kind;
+    g_sites[g_num_sites].counts[0] = 0;
+    g_sites[g_num_sites].counts[1] = 0;
+    g_num_sites++;
+}
+
+static void number_sites(ast_node_t *node) {
+    switch (node->type) {
+    case NODE_BLOCK:
+        for (unsigned i = 0; i < node->block.statements.size; i++)
+            number_sites(node->block.statements.data[i]);
+        break;
+    case NODE_WHILE:
+        add_site(node, SITE_LOOP);
+        number_sites(node->while_loop.condition_expr);
+        number_sites(node->while_loop.block);
+        break;
+    case NODE_FUNCTION_CALL: {
+        host_func_t const *func = host_funcs_get(&node->func_call.func_name);
+        if (func && func->intrinsic == INTRINSIC_NONE)
+            add_site(node, SITE_CALL);
+        for (unsigned i = 0; i < node->func_call.parameters.size; i++)
+            number_sites(node->func_call.parameters.data[i]);
+        break;
+    }
+    case NODE_ASSIGNMENT:
+        number_sites(node->assignment.left);
+        number_sites(node->assignment.right);
+        break;
+    case NODE_BINARY_OP:
+        number_sites(node->binary_op.left);
+        number_sites(node->binary_op.right);
+        break;
+    case NODE_COMPARE:
+        number_sites(node->compare_op.left);
+        number_sites(node->compare_op.right);
+        break;
+    case NODE_UNARY_OP:
+        number_sites(node->unary_op.operand);
+        break;
+    case NODE_INDEX:
+        number_sites(node->index.array);
+        number_sites(node->index.index);
+        break;
+    case NODE_IF:
+        number_sites(node->if_stmt.condition_expr);
+        number_sites(node->if_stmt.then_block);
+        if (node->if_stmt.else_block)
+            number_sites(node->if_stmt.else_block);
+        break;
+    default:
+        break;
+    }
+}
+
+void profile_begin(ast_node_t *ast) {
+    g_num_sites = 0;
+    g_have_counts = false;
+    if (!g_instrumenting && !g_have_loaded)
+        return;
+
+    number_sites(ast);
+    if (g_instrumenting || !g_have_loaded)
+        return;
+
+    bool matches = g_num_loaded_sites == g_num_sites;
+    for (unsigned i = 0; i < g_num_sites && matches; i++)
+        matches = g_loaded_sites[i].kind == g_sites[i].kind;
+    if (!matches) {
+        printf("Warning: The profile doesn't match the program. Ignoring it.\n");
+        return;
+    }
+
+    memcpy(g_sites, g_loaded_sites, g_num_sites * sizeof(site_t));
+    g_have_counts = true;
+}
+
+static site_t *find_site(ast_node_t const *node) {
+    for (unsigned i = 0; i < g_num_sites; i++) {
+        if (g_site_nodes[i] == node)
+            return &g_sites[i];
+    }
+    return NULL;
+}
+
+u64 *profile_get_counter(ast_node_t const *site_node, profile_counter_t counter) {
+    if (!g_instrumenting)
+        return NULL;
+    site_t *site = find_site(site_node);
+    return site ? &site->counts[counter] : NULL;
+}
+
+bool profile_get_loop_counts(ast_node_t const *while_node, u64 *entries, u64 *iterations) {
+    if (!g_have_counts)
+        return false;
+    site_t const *site = find_site(while_node);
+    if (!site || site->kind != SITE_LOOP)
+        return false;
+    *entries = site->counts[PROFILE_COUNTER_ENTRIES];
+    *iterations = site->counts[PROFILE_COUNTER_ITERATIONS];
+    return true;
+}
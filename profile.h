@@ -0,0 +1,44 @@
+// Profile guided optimization.
+//
+// When instrumenting, code_gen() gives each loop and each call to a host
+// function (a "site") its own counters, which the generated code increments
+// as it runs. After the run, profile_write() saves the counts to a file. A
+// later compile of the same source loads them with profile_read(), and the
+// code generator uses them to decide which loops are worth optimizing.
+//
+// Sites are numbered in the order they appear in the AST, so a profile only
+// applies to the program it was recorded from. profile_begin() checks that the
+// sites match and ignores the profile if they don't.
+
+#pragma once
+
+// This project's headers
+#include "common.h"
+
+// Standard headers
+#include <stdbool.h>
+#include <stdio.h>
+
+
+typedef struct _ast_node_t ast_node_t;
+
+typedef enum {
+    PROFILE_COUNTER_ENTRIES,    // Loop: times it was reached. Call: times it was made
+    PROFILE_COUNTER_ITERATIONS, // Loop: times its back edge was taken
+} profile_counter_t;
+
+
+void profile_enable_instrumentation(void);
+bool profile_read(FILE *f);
+bool profile_write(FILE *f);
+
+// Numbers the sites in the program about to be compiled, after any AST
+// transforms. Zeroes the counters if instrumenting.
+void profile_begin(ast_node_t *ast);
+
+// The counter for the generated code to increment, or NULL if the site should
+// not be instrumented.
+u64 *profile_get_counter(ast_node_t const *site, profile_counter_t counter);
+
+// False if there is no profile for the loop.
+bool profile_get_loop_counts(ast_node_t const *while_node, u64 *entries, u64 *iterations);
@@ -0,0 +1,75 @@
+// Own header
+#include "repl.h"
+
+// This project's headers
+#include "code_gen.h"
+#include "code_heap.h"
+#include "darray.h"
+#include "parser.h"
+
+// Standard headers
+#include <stdlib.h>
+#include <string.h>
+
+
+enum {
+    MAX_LINE_LEN = 1024,
+    FRAME_NUM_BYTES = 1024 * 1024
+};
+
+
+void repl_run(FILE *in) {
+    // The ASTs and source text have to be kept until the end of the session,
+    // because the scope and stack frame refer to the names in them.
+    darray_t asts = { 0 };
+    char **lines = NULL;
+    unsigned num_lines = 0;
+
+    u8 *frame = calloc(1, FRAME_NUM_BYTES);
+    u8 *frame_top = frame + FRAME_NUM_BYTES;
+
+    parser_begin_session();
+    code_gen_repl_begin(FRAME_NUM_BYTES);
+
+    char buf[MAX_LINE_LEN];
+    while (printf("> "), fflush(stdout), fgets(buf, sizeof(buf), in)) {
+        if (strcmp(buf, "quit\n") == 0)
+            break;
+
+        char *line = malloc(strlen(buf) + 1);
+        strcpy(line, buf);
+        ast_node_t *ast = parser_parse_line(line);
+        if (!ast) {
+            free(line);
+            continue;
+        }
+        if (ast->block.statements.size == 0) {
+            parser_free_ast(ast);
+            free(line);
+            continue;
+        }
+
+        lines = realloc(lines, (num_lines + 1) * sizeof(char *));
+        lines[num_lines++] = line;
+        darray_append(&asts, ast);
+
+        repl_func_t func = code_gen_repl_line(ast);
+        u64 result = func(frame_top);
+        code_heap_free((void *)func);
+
+        // Only show the value of expressions.
+        ast_node_t *last = ast->block.statements.data[ast->block.statements.size - 1];
+        if (last->type != NODE_VARIABLE_DECLARATION && last->type != NODE_WHILE &&
+            last->type != NODE_IF)
+            printf("%llu\n", (unsigned long long)result);
+    }
+
+    code_gen_repl_end(frame_top);
+    free(frame);
+    for (unsigned i = 0; i < asts.size; i++)
+        parser_free_ast(asts.data[i]);
+    darray_free(&asts);
+    for (unsigned i = 0; i < num_lines; i++)
+        free(lines[i]);
+    free(lines);
+}
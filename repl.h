@@ -0,0 +1,10 @@
+// An interactive mode. Each line of input is compiled and run as soon as it
+// is entered. Only the new line is compiled. Its code is appended to that of
+// the previous lines, and it can use the variables they declared.
+
+#pragma once
+
+#include <stdio.h>
+
+
+void repl_run(FILE *in);
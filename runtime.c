@@ -0,0 +1,30 @@
+// Own header
+#include "runtime.h"
+
+// Standard headers
+#include <stdlib.h>
+
+
+void JIT_CALLBACK runtime_array_grow(runtime_array_t *arr, unsigned elem_num_bytes) {
+    if (arr->capacity == 0)
+        arr->capacity = 8;
+    else
+        arr->capacity *= 2;
+    arr->data = realloc(arr->data, (size_t)arr->capacity * elem_num_bytes);
+    if (!arr->data)
+        FATAL_ERROR("Out of memory growing array to %u elements", arr->capacity);
+}
+
+void JIT_CALLBACK runtime_array_free(runtime_array_t *arr) {
+    free(arr->data);
+    arr->data = NULL;
+    arr->size = arr->capacity = 0;
+}
+
+void JIT_CALLBACK runtime_index_error(void) {
+    FATAL_ERROR("Array index out of bounds");
+}
+
+void JIT_CALLBACK runtime_divide_by_zero_error(void) {
+    FATAL_ERROR("Division by zero");
+}
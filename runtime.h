@@ -0,0 +1,26 @@
+// Support routines that the generated code calls.
+
+#pragma once
+
+// This project's headers
+#include "common.h"
+
+
+// The in-memory form of a Mortar dynamic array, eg a u8[]. The generated code
+// reads and writes these fields directly. It only calls out to this module
+// when the array needs to grow.
+typedef struct {
+    u8 *data;      // NULL if capacity is 0.
+    u32 size;      // Number of elements currently stored
+    u32 capacity;  // Max number of elements that can be stored
+} runtime_array_t;
+
+
+void JIT_CALLBACK runtime_array_grow(runtime_array_t *arr, unsigned elem_num_bytes);
+void JIT_CALLBACK runtime_array_free(runtime_array_t *arr);
+
+// Called when an array index is out of bounds. Does not return.
+void JIT_CALLBACK runtime_index_error(void);
+
+// Called when the divisor of a '/' or '%' is zero. Does not return.
+void JIT_CALLBACK runtime_divide_by_zero_error(void);
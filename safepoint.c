@@ -0,0 +1,127 @@
+// Own header
+#include "safepoint.h"
+
+// Standard headers
+#include <stdio.h>
+
+
+static u32 const g_unarmed_word;
+static u8 *g_poll_page; // NULL until safepoints are enabled
+
+u32 const volatile *g_safepoint_poll_word = &g_unarmed_word;
+
+
+bool safepoint_is_enabled(void) {
+    return g_poll_page != NULL;
+}
+
+
+#ifdef _MSC_VER
+
+bool safepoint_enable(void) {
+    printf("Timeouts aren't supported on this platform\n");
+    return false;
+}
+
+bool safepoint_run(void (*func)(void *), void *arg, unsigned timeout_ms) {
+    func(arg);
+    return true;
+}
+
+#else
+
+// POSIX headers
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+
+// The timer arms the poll page from a SIGALRM handler. The poll that then
+// traps raises SIGSEGV (SIGBUS on macOS), and that handler jumps back to
+// safepoint_run().
+
+static sigjmp_buf g_stop_jump;
+static size_t g_page_num_bytes;
+static struct sigaction g_old_segv;
+static struct sigaction g_old_bus;
+
+bool safepoint_enable(void) {
+    if (g_poll_page)
+        return true;
+
+    g_page_num_bytes = (size_t)sysconf(_SC_PAGESIZE);
+    void *p = mmap(NULL, g_page_num_bytes, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return false;
+
+    g_poll_page = p;
+    g_safepoint_poll_word = (u32 const volatile *)g_poll_page;
+    return true;
+}
+
+// mprotect() isn't on the list of async-signal-safe functions, but it's a
+// plain system call everywhere that matters.
+static void on_sigalrm(int sig) {
+    (void)sig;
+    mprotect(g_poll_page, g_page_num_bytes, PROT_NONE);
+}
+
+static void on_fault(int sig, siginfo_t *info, void *context) {
+    (void)context;
+    u8 const *addr = info->si_addr;
+    if (addr >= g_poll_page && addr < g_poll_page + g_page_num_bytes)
+        siglongjmp(g_stop_jump, 1);
+
+    // A real crash. Put the old handler back, and let the instruction fault
+    // again when this returns.
+    sigaction(sig, sig == SIGSEGV ? &g_old_segv : &g_old_bus, NULL);
+}
+
+static void set_timer(unsigned timeout_ms) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = timeout_ms / 1000;
+    timer.it_value.tv_usec = (timeout_ms % 1000) * 1000;
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+bool safepoint_run(void (*func)(void *), void *arg, unsigned timeout_ms) {
+    if (timeout_ms == 0 || !g_poll_page) {
+        func(arg);
+        return true;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &g_old_segv);
+    sigaction(SIGBUS, &sa, &g_old_bus);
+
+    struct sigaction alarm_sa, old_alarm;
+    memset(&alarm_sa, 0, sizeof(alarm_sa));
+    alarm_sa.sa_handler = on_sigalrm;
+    alarm_sa.sa_flags = SA_RESTART;
+    sigemptyset(&alarm_sa.sa_mask);
+    sigaction(SIGALRM, &alarm_sa, &old_alarm);
+
+    bool finished = false;
+    if (sigsetjmp(g_stop_jump, 1) == 0) {
+        set_timer(timeout_ms);
+        func(arg);
+        finished = true;
+    }
+
+    set_timer(0);
+    mprotect(g_poll_page, g_page_num_bytes, PROT_READ);
+    sigaction(SIGALRM, &old_alarm, NULL);
+    sigaction(SIGSEGV, &g_old_segv, NULL);
+    sigaction(SIGBUS, &g_old_bus, NULL);
+    return finished;
+}
+
+#endif
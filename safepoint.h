@@ -0,0 +1,31 @@
+// Safepoints let the host stop a script that runs for too long. The
+// generated code polls at function entry and on loop back edges, and the
+// interpreter and VM poll on their loops' back edges. A poll is a single load
+// from the poll page, which normally does nothing. To stop the script, the
+// host makes the page unreadable, so that the next poll traps.
+
+#pragma once
+
+// This project's headers
+#include "common.h"
+
+// Standard headers
+#include <stdbool.h>
+
+
+// Polls read this. Until safepoint_enable() is called, it points to an
+// ordinary variable, so polls can never trap.
+extern u32 const volatile *g_safepoint_poll_word;
+
+#define SAFEPOINT_POLL() ((void)*g_safepoint_poll_word)
+
+
+// Maps the poll page. Returns false if timeouts aren't supported here. Only
+// code generated afterwards has polls.
+bool safepoint_enable(void);
+bool safepoint_is_enabled(void);
+
+// Runs func(arg). Returns false if it hadn't returned after 'timeout_ms', in
+// which case it was stopped at its next safepoint. Whatever the script had
+// allocated is left behind. 0 means no timeout.
+bool safepoint_run(void (*func)(void *), void *arg, unsigned timeout_ms);
@@ -0,0 +1,166 @@
+// Own header
+#include "sampler.h"
+
+// This project's headers
+#include "assembler.h"
+#include "common.h"
+#include "source_pos.h"
+
+// Standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// The signal handler just appends the code offset to g_samples. Everything
+// else happens in sampler_report(), after the timer has been stopped.
+
+enum { MAX_SAMPLES = 1 << 16 };
+enum { MAX_REPORTED_LINES = 20 };
+
+static unsigned g_samples[MAX_SAMPLES];
+static unsigned volatile g_num_samples;
+static unsigned volatile g_num_outside; // Samples in the runtime, host functions, etc
+static unsigned volatile g_num_dropped; // Samples that didn't fit in g_samples
+
+static void record_sample(u8 const *pc) {
+    // Only the code that was installed last is sampled.
+    u8 const *code = g_assembler.installed;
+    if (!code || pc < code || pc >= code + g_assembler.binary_size - g_assembler.installed_offset) {
+        g_num_outside++;
+        return;
+    }
+    if (g_num_samples == MAX_SAMPLES) {
+        g_num_dropped++;
+        return;
+    }
+    g_samples[g_num_samples] = g_assembler.installed_offset + (unsigned)(pc - code);
+    g_num_samples++;
+}
+
+
+#ifdef _MSC_VER
+
+bool sampler_start(unsigned interval_us) {
+    printf("Sampling isn't supported on this platform\n");
+    return false;
+}
+
+void sampler_stop(void) {
+}
+
+#else
+
+// POSIX headers
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+
+static u8 const *get_pc(ucontext_t const *uc) {
+#if defined(__APPLE__)
+    return (u8 const *)uc->uc_mcontext->__ss.__rip;
+#else
+    // gregs[REG_RIP]. The REG_ names need _GNU_SOURCE, and clash with asm_reg_t.
+    return (u8 const *)uc->uc_mcontext.gregs[16];
+#endif
+}
+
+static void on_sigprof(int sig, siginfo_t *info, void *context) {
+    (void)sig;
+    (void)info;
+    record_sample(get_pc(context));
+}
+
+bool sampler_start(unsigned interval_us) {
+    g_num_samples = 0;
+    g_num_outside = 0;
+    g_num_dropped = 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0)
+        return false;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+void sampler_stop(void) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_DFL);
+}
+
+#endif
+
+
+typedef struct {
+    unsigned line;
+    unsigned num_samples;
+} line_count_t;
+
+static int compare_line_counts(void const *a, void const *b) {
+    line_count_t const *x = a;
+    line_count_t const *y = b;
+    if (x->num_samples != y->num_samples)
+        return x->num_samples < y->num_samples ? 1 : -1;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+void sampler_report(char const *source, size_t num_bytes) {
+    unsigned num_in_code = g_num_samples;
+    unsigned total = num_in_code + g_num_outside + g_num_dropped;
+    printf("--- Samples: %u total, %u in generated code, %u elsewhere ---\n",
+           total, num_in_code + g_num_dropped, g_num_outside);
+    if (num_in_code == 0)
+        return;
+
+    // One count per source line, plus one for code that isn't from any line.
+    source_pos_set_source(source, num_bytes);
+    line_count_t *counts = NULL;
+    unsigned num_counts = 0;
+    unsigned num_unattributed = 0;
+    for (unsigned i = 0; i < num_in_code; i++) {
+        unsigned source_offset, line, column;
+        if (!asm_find_source_pos(g_samples[i], &source_offset)) {
+            num_unattributed++;
+            continue;
+        }
+        source_pos_get(source_offset, &line, &column);
+        unsigned j = 0;
+        while (j < num_counts && counts[j].line != line)
+            j++;
+        if (j == num_counts) {
+            counts = realloc(counts, (num_counts + 1) * sizeof(line_count_t));
+            counts[num_counts].line = line;
+            counts[num_counts].num_samples = 0;
+            num_counts++;
+        }
+        counts[j].num_samples++;
+    }
+
+    qsort(counts, num_counts, sizeof(line_count_t), compare_line_counts);
+    printf("  line  samples      %%\n");
+    for (unsigned i = 0; i < num_counts && i < MAX_REPORTED_LINES; i++) {
+        char const *text;
+        int len;
+        source_pos_get_line_text(counts[i].line, &text, &len);
+        printf("%6u  %7u  %5.1f  %.*s\n", counts[i].line, counts[i].num_samples,
+               100.0 * counts[i].num_samples / total, len, text);
+    }
+    if (num_unattributed)
+        printf("     -  %7u  %5.1f  (function entry/exit and error handling)\n",
+               num_unattributed, 100.0 * num_unattributed / total);
+    if (g_num_dropped)
+        printf("%u samples were dropped because the buffer was full\n", g_num_dropped);
+
+    free(counts);
+}
@@ -0,0 +1,21 @@
+// A sampling profiler for generated code. While it runs, a timer interrupts
+// the program at a fixed interval of CPU time and records where it was. At
+// the end, sampler_report() uses the assembler's line table to map the samples
+// that landed in the code buffer back to source lines, and prints the lines
+// that took the most time.
+//
+// Only POSIX systems are supported, because it is driven by SIGPROF.
+
+#pragma once
+
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+bool sampler_start(unsigned interval_us);
+void sampler_stop(void);
+
+// 'source' is what the code was compiled from. It is used to print the hot
+// lines and need not be nul terminated.
+void sampler_report(char const *source, size_t num_bytes);
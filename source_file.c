@@ -0,0 +1,135 @@
+// Own header
+#include "source_file.h"
+
+// Standard headers
+#include <stdint.h>
+
+
+#ifdef _MSC_VER
+
+typedef void *HANDLE;
+
+__declspec(dllimport) HANDLE __stdcall CreateFileA(char const *fileName, unsigned desiredAccess,
+    unsigned shareMode, void *securityAttributes, unsigned creationDisposition,
+    unsigned flagsAndAttributes, HANDLE templateFile);
+__declspec(dllimport) int __stdcall GetFileSizeEx(HANDLE file, long long *fileSize);
+__declspec(dllimport) HANDLE __stdcall CreateFileMappingA(HANDLE file, void *attributes,
+    unsigned protect, unsigned maxSizeHigh, unsigned maxSizeLow, char const *name);
+__declspec(dllimport) void *__stdcall MapViewOfFile(HANDLE mapping, unsigned desiredAccess,
+    unsigned offsetHigh, unsigned offsetLow, size_t numBytes);
+__declspec(dllimport) int __stdcall UnmapViewOfFile(void const *baseAddress);
+__declspec(dllimport) int __stdcall CloseHandle(HANDLE object);
+
+enum {
+    GENERIC_READ = 0x80000000,
+    FILE_SHARE_READ = 0x1,
+    OPEN_EXISTING = 3,
+    FILE_FLAG_SEQUENTIAL_SCAN = 0x08000000,
+    PAGE_READONLY = 0x2,
+    FILE_MAP_READ = 0x4
+};
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+
+
+bool source_file_map(source_file_t *sf, char const *path) {
+    sf->data = "";
+    sf->num_bytes = 0;
+    sf->mapping = NULL;
+
+    // The sequential scan flag is Windows' equivalent of MADV_SEQUENTIAL.
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    long long size;
+    if (!GetFileSizeEx(file, &size) || (unsigned long long)size > SIZE_MAX) {
+        CloseHandle(file);
+        return false;
+    }
+
+    // CreateFileMapping fails on an empty file, so leave that as "".
+    if (size > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (!view) {
+            if (mapping) CloseHandle(mapping);
+            CloseHandle(file);
+            return false;
+        }
+        sf->data = view;
+        sf->num_bytes = (size_t)size;
+        sf->mapping = mapping;
+    }
+
+    // The view keeps the file open.
+    CloseHandle(file);
+    return true;
+}
+
+void source_file_unmap(source_file_t *sf) {
+    if (sf->mapping) {
+        UnmapViewOfFile(sf->data);
+        CloseHandle(sf->mapping);
+    }
+    sf->data = "";
+    sf->num_bytes = 0;
+    sf->mapping = NULL;
+}
+
+#else
+
+// POSIX headers
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+bool source_file_map(source_file_t *sf, char const *path) {
+    sf->data = "";
+    sf->num_bytes = 0;
+    sf->mapping = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (unsigned long long)st.st_size > SIZE_MAX) {
+        close(fd);
+        return false;
+    }
+
+    // mmap rejects a zero length, so leave an empty file as "".
+    if (st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+
+        // The tokenizer reads the file once, front to back, so ask for
+        // aggressive read-ahead and early reclaim of pages behind it.
+        madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+        sf->data = p;
+        sf->num_bytes = (size_t)st.st_size;
+        sf->mapping = p;
+    }
+
+    // The mapping keeps the file open.
+    close(fd);
+    return true;
+}
+
+void source_file_unmap(source_file_t *sf) {
+    if (sf->mapping)
+        munmap(sf->mapping, sf->num_bytes);
+    sf->data = "";
+    sf->num_bytes = 0;
+    sf->mapping = NULL;
+}
+
+#endif
@@ -0,0 +1,21 @@
+// Maps a source file into memory read-only, so that the tokenizer can work
+// directly on the file's pages and the AST's strviews can point into them,
+// without copying the file into a heap buffer first. The mapping is not nul
+// terminated, so use parser_parse_range() with it.
+
+#pragma once
+
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+typedef struct _source_file_t {
+    char const *data;
+    size_t num_bytes;
+    void *mapping; // Platform handle. NULL for an empty file, which isn't mapped
+} source_file_t;
+
+
+bool source_file_map(source_file_t *sf, char const *path);
+void source_file_unmap(source_file_t *sf);
@@ -0,0 +1,121 @@
+// Own header
+#include "source_pos.h"
+
+// This project's headers
+#include "common.h"
+
+// Platform headers
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
+
+// Standard headers
+#include <stdbool.h>
+#include <stdlib.h>
+
+
+static char const *g_source;
+static size_t g_num_bytes;
+
+static unsigned *g_line_starts; // Offset of the first character of each line
+static unsigned g_num_lines;
+static unsigned g_line_starts_capacity;
+static bool g_is_indexed;
+
+
+void source_pos_set_source(char const *source, size_t num_bytes) {
+    g_source = source;
+    g_num_bytes = num_bytes;
+    g_is_indexed = false;
+}
+
+
+// ***************************************************************************
+// Line index
+// ***************************************************************************
+
+static unsigned count_trailing_zeros(unsigned x) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, x);
+    return idx;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+static void add_line_start(size_t offset) {
+    if (g_num_lines == g_line_starts_capacity) {
+        g_line_starts_capacity = g_line_starts_capacity ? g_line_starts_capacity * 2 : 256;
+        g_line_starts = realloc(g_line_starts, g_line_starts_capacity * sizeof(unsigned));
+    }
+    g_line_starts[g_num_lines++] = (unsigned)offset;
+}
+
+// Compares 16 bytes at a time against '\n'. Most blocks have no newline, and
+// those that do have a bit set in the mask for each one.
+static void build_index(void) {
+    g_num_lines = 0;
+    add_line_start(0);
+
+    __m128i const newlines = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= g_num_bytes; i += 16) {
+        __m128i block = _mm_loadu_si128((__m128i const *)(g_source + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newlines));
+        while (mask) {
+            add_line_start(i + count_trailing_zeros(mask) + 1);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < g_num_bytes; i++) {
+        if (g_source[i] == '\n')
+            add_line_start(i + 1);
+    }
+
+    g_is_indexed = true;
+}
+
+
+// ***************************************************************************
+// Lookups
+// ***************************************************************************
+
+void source_pos_get(unsigned offset, unsigned *line, unsigned *column) {
+    if (!g_is_indexed)
+        build_index();
+
+    // Find the last line that starts at or before offset. The first line
+    // starts at 0, so there always is one.
+    unsigned lo = 1, hi = g_num_lines;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (g_line_starts[mid] <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *line = lo;
+    *column = offset - g_line_starts[lo - 1] + 1;
+}
+
+void source_pos_get_line_text(unsigned line, char const **text, int *len) {
+    if (!g_is_indexed)
+        build_index();
+
+    if (line == 0 || line > g_num_lines) {
+        *text = "";
+        *len = 0;
+        return;
+    }
+
+    char const *start = g_source + g_line_starts[line - 1];
+    char const *end = g_source + g_num_bytes;
+    char const *line_end = start;
+    while (line_end < end && *line_end != '\n' && *line_end != '\r')
+        line_end++;
+    *text = start;
+    *len = (int)(line_end - start);
+}
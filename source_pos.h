@@ -0,0 +1,22 @@
+// Tokens and AST nodes only record the byte offset where they start. Line and
+// column numbers are worked out from the offset when something is reported,
+// using an index of where each line starts. The index is built the first time
+// a position is looked up, so a compile that reports nothing never builds it.
+//
+// Offsets refer to the source last passed to source_pos_set_source(), which
+// the tokenizer does for each source it is given.
+
+#pragma once
+
+
+#include <stddef.h>
+
+
+// 'source' need not be nul terminated. It must outlive any lookups.
+void source_pos_set_source(char const *source, size_t num_bytes);
+
+// Both are 1 based.
+void source_pos_get(unsigned offset, unsigned *line, unsigned *column);
+
+// Finds the text of a line, without its newline. Empty if there is no such line.
+void source_pos_get_line_text(unsigned line, char const **text, int *len);
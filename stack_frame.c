@@ -7,17 +7,8 @@
 #include "strview.h"
 
 
-enum { MAX_SFRAME_ITEMS = 100 };
-
-
-typedef struct {
-    strview_t *name;
-    unsigned offset;
-} sframe_item_t;
-
 typedef struct {
-    sframe_item_t items[MAX_SFRAME_ITEMS];
-    unsigned num_items;
+    hashtab_t offsets; // Maps variable name to 1 + offset.
     unsigned current_offset;
 } sframe_t;
 
@@ -25,30 +16,51 @@ typedef struct {
 static sframe_t g_sframe;
 
 
+static unsigned get_alignment(unsigned num_bytes) {
+    unsigned alignment = 1;
+    while (alignment < 16 && num_bytes % (alignment * 2) == 0)
+        alignment *= 2;
+    return alignment;
+}
+
 void sframe_init(void) {
-    g_sframe.num_items = 0;
+    hashtab_free(&g_sframe.offsets);
+    g_sframe.offsets = hashtab_create();
     g_sframe.current_offset = 0;
 }
 
 unsigned sframe_add_variable(strview_t *name, unsigned num_bytes) {
-    if (g_sframe.num_items >= MAX_SFRAME_ITEMS)
-        FATAL_ERROR("Too many items in current stack frame. Limit is %d\n", MAX_SFRAME_ITEMS);
-
-    unsigned rv = g_sframe.current_offset;
-    g_sframe.items[g_sframe.num_items].name = name;
-    g_sframe.items[g_sframe.num_items].offset = g_sframe.current_offset;
-    g_sframe.num_items++;
-    g_sframe.current_offset += num_bytes;
+    unsigned rv = sframe_add_temp(num_bytes);
+    sframe_place_variable(name, rv);
+    return rv;
+}
 
+unsigned sframe_add_temp(unsigned num_bytes) {
+    // The slot's lowest address is rbp - offset - num_bytes, so it is aligned
+    // if the offset is.
+    unsigned alignment = get_alignment(num_bytes);
+    unsigned rv = (g_sframe.current_offset + alignment - 1) & ~(alignment - 1);
+    g_sframe.current_offset = rv + num_bytes;
     return rv;
 }
 
+void sframe_place_variable(strview_t *name, unsigned offset) {
+    hashtab_put(&g_sframe.offsets, name, (void *)(uintptr_t)(offset + 1));
+}
+
+bool sframe_find_variable(strview_t *name, unsigned *offset) {
+    void *val = hashtab_get(&g_sframe.offsets, name);
+    if (!val)
+        return false;
+
+    *offset = (unsigned)((uintptr_t)val - 1);
+    return true;
+}
+
 unsigned sframe_get_variable_offset(strview_t *name) {
-    for (unsigned i = 0; i < g_sframe.num_items; i++) {
-        if (strview_cmp(g_sframe.items[i].name, name)) {
-            return g_sframe.items[i].offset;
-        }
-    }
+    unsigned offset;
+    if (sframe_find_variable(name, &offset))
+        return offset;
 
     FATAL_ERROR("Couldn't find storage offset for variable '%.*s'", name->len, name->data);
     return 0;
@@ -1,10 +1,17 @@
 #pragma once
 
+#include <stdbool.h>
+
 
 typedef struct _strview_t strview_t;
 
 
+// Slots are aligned to their size, up to 16 bytes. The frame's top (rbp) is
+// 16 byte aligned, so the addresses are too.
 void sframe_init(void);
 unsigned sframe_add_variable(strview_t *name, unsigned num_bytes); // Returns offset
+unsigned sframe_add_temp(unsigned num_bytes); // Anonymous slot for compiler temporaries. Returns offset
+void sframe_place_variable(strview_t *name, unsigned offset); // Gives a variable a slot that was allocated with sframe_add_temp()
+bool sframe_find_variable(strview_t *name, unsigned *offset); // Returns false if not found
 unsigned sframe_get_variable_offset(strview_t *name);
 unsigned sframe_get_size(void);
@@ -46,3 +46,22 @@ bool strview_to_int(strview_t *sv, int *out_value) {
     *out_value = neg ? -(int32_t)value : (int32_t)value;
     return true;
 }
+
+size_t strview_unescape(strview_t const *sv, char *out) {
+    size_t len = 0;
+    for (size_t i = 0; i < sv->len; i++) {
+        char c = sv->data[i];
+        if (c == '\\' && i + 1 < sv->len) {
+            c = sv->data[++i];
+            switch (c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case '0': c = '\0'; break;
+            default: break;
+            }
+        }
+        out[len++] = c;
+    }
+    return len;
+}
@@ -41,3 +41,8 @@ INLINE bool strview_cmp(strview_t const *a, strview_t const *b) {
 
 bool strview_cmp_cstr(strview_t const *a, char const *b);
 bool strview_to_int(strview_t *sv, int *out_value);
+
+// Decodes the escape sequences of a string literal's contents, ie \n \t \r \0
+// \\ and \". Any other character after a backslash stands for itself. 'out'
+// needs room for sv->len bytes. Returns the number of bytes written.
+size_t strview_unescape(strview_t const *sv, char *out);
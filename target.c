@@ -0,0 +1,101 @@
+// Own header
+#include "target.h"
+
+// This project's headers
+#include "common.h"
+
+// Platform headers
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// Standard headers
+#include <stdio.h>
+#include <string.h>
+
+
+target_t g_target;
+
+
+static void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4]) {
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, leaf, subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static u64 xgetbv(unsigned xcr) {
+#ifdef _MSC_VER
+    return _xgetbv(xcr);
+#else
+    unsigned lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(xcr));
+    return ((u64)hi << 32) | lo;
+#endif
+}
+
+static bool bit(unsigned reg, unsigned idx) {
+    return (reg >> idx) & 1;
+}
+
+void target_init(void) {
+    unsigned regs[4]; // eax, ebx, ecx, edx
+    target_set_baseline();
+
+    cpuid(0, 0, regs);
+    unsigned max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    g_target.has_sse41 = bit(regs[2], 19);
+    g_target.has_sse42 = bit(regs[2], 20);
+    g_target.has_popcnt = bit(regs[2], 23);
+
+    // The OS must have enabled saving of the YMM registers.
+    bool osxsave = bit(regs[2], 27);
+    bool avx = bit(regs[2], 28);
+    bool ymm_enabled = osxsave && avx && (xgetbv(0) & 6) == 6;
+
+    if (max_leaf >= 7) {
+        cpuid(7, 0, regs);
+        g_target.has_bmi1 = bit(regs[1], 3);
+        g_target.has_avx2 = ymm_enabled && bit(regs[1], 5);
+        g_target.has_bmi2 = bit(regs[1], 8);
+        g_target.has_fsrm = bit(regs[3], 4);
+    }
+
+    cpuid(0x80000000, 0, regs);
+    if (regs[0] >= 0x80000001) {
+        cpuid(0x80000001, 0, regs);
+        g_target.has_lzcnt = bit(regs[2], 5);
+    }
+}
+
+void target_set_baseline(void) {
+    memset(&g_target, 0, sizeof(g_target));
+}
+
+bool target_select(char const *name) {
+    if (strcmp(name, "native") == 0)
+        target_init();
+    else if (strcmp(name, "baseline") == 0)
+        target_set_baseline();
+    else
+        return false;
+
+    return true;
+}
+
+void target_print(void) {
+    printf("Target: x86-64 sse2%s%s%s%s%s%s%s%s\n",
+           g_target.has_sse41 ? " sse4.1" : "",
+           g_target.has_sse42 ? " sse4.2" : "",
+           g_target.has_popcnt ? " popcnt" : "",
+           g_target.has_lzcnt ? " lzcnt" : "",
+           g_target.has_bmi1 ? " bmi1" : "",
+           g_target.has_bmi2 ? " bmi2" : "",
+           g_target.has_avx2 ? " avx2" : "",
+           g_target.has_fsrm ? " fsrm" : "");
+}
@@ -0,0 +1,35 @@
+// A description of the CPU that the generated code will run on. The assembler
+// consults it to choose between instruction forms.
+
+#pragma once
+
+#include <stdbool.h>
+
+
+typedef struct {
+    bool has_sse41;   // pcmpeqq, ptest
+    bool has_sse42;
+    bool has_popcnt;
+    bool has_lzcnt;
+    bool has_bmi1;    // tzcnt, andn
+    bool has_bmi2;    // shlx, shrx, bzhi
+    bool has_avx2;    // 256 bit integer vectors
+    bool has_fsrm;    // Fast short rep movsb
+} target_t;
+
+
+extern target_t g_target;
+
+// Fills in g_target from CPUID. Until this is called, g_target describes the
+// baseline target.
+void target_init(void);
+
+// Forgets the features detected by target_init(), leaving only the baseline
+// x86-64 instruction set (SSE2). Useful for reproducible benchmarks.
+void target_set_baseline(void);
+
+// Selects a target by name: "native" or "baseline". Returns false if the name
+// is not recognised.
+bool target_select(char const *name);
+
+void target_print(void);
@@ -0,0 +1,129 @@
+# Runs some programs on every tier and checks that they all print the same
+# thing and give the same result. The first passes string literals with
+# escapes to puts(), so it covers decoding the literals, the JIT's literal pool
+# and host function calls. In the tiered mode its loop gets hot, so its puts()
+# runs from the compiled loop.
+#
+# Usage: python3 test_tiers.py [--mortar path]
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+TIERS = ['interp', 'vm', 'jit', 'tiered']
+
+# Each case is a name, a program, what it prints, and its result.
+CASES = [
+    ('strings', r'''{
+    puts("tab\there, quote \"q\", backslash \\ end");
+    puts("two\nlines");
+    u64 i;
+    i = 0;
+    while (i < 2000) {
+        if (i == 1999) {
+            puts("tab\there, quote \"q\", backslash \\ end");
+        }
+        i = i + 1;
+    }
+    i;
+}
+''', [
+        'tab\there, quote "q", backslash \\ end',
+        'two',
+        'lines',
+        'tab\there, quote "q", backslash \\ end',
+    ], '2000'),
+
+    # The last statement's value is the result, so its store isn't dead.
+    ('ends in assignment', '''{
+    u64 x;
+    x = 5;
+}
+''', [], '5'),
+
+    # append() gives 0 wherever its value is used.
+    ('append value', '''{
+    u64[] a;
+    u64 y;
+    y = append(a, 7) + 1;
+    y = y + append(a, 9) + len(a) * 10;
+    y;
+}
+''', [], '21'),
+
+    # Variables declared in a branch or loop body that doesn't run can still
+    # be read afterwards, and are 0. puts() stops the conditions being
+    # worked out at compile time, and w is there to leave garbage in the
+    # stack slots.
+    ('skipped declarations', '''{
+    u64 w;
+    w = puts("start") + 77;
+    w = w * 3;
+    u64 c;
+    c = puts("end") * 0;
+    if (c == 1) {
+        u64 y;
+        y = 4;
+    }
+    while (c == 1) {
+        u64 z;
+        z = 5;
+        c = 0;
+    }
+    u64 i;
+    u64 s;
+    while (i < 3) {
+        if (i != 1) {
+            u64 v;
+        }
+        s = s + v;
+        v = v + 1;
+        i = i + 1;
+    }
+    y + z + s;
+}
+''', ['start', 'end'], '1'),
+]
+
+
+# Returns what the program printed, and its result.
+def run(mortar, path, tier):
+    p = subprocess.run([mortar, '-tier', tier, '-file', path], capture_output=True, text=True,
+                       errors='replace')
+    if p.returncode != 0:
+        return None, 'exit code %d' % p.returncode
+    lines = p.stdout.splitlines()
+    start = next((i + 1 for i, line in enumerate(lines) if line.startswith('Parsed ')), None)
+    if start is None or start >= len(lines):
+        return None, 'unexpected output'
+    return lines[start:-1], lines[-1].split()[0]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Check that every tier runs some programs the same way.')
+    parser.add_argument('--mortar', default='./mortar', help='path of the mortar binary (default ./mortar)')
+    args = parser.parse_args()
+
+    failed = False
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, 'tiers.mtr')
+        for name, program, expected_output, expected_result in CASES:
+            with open(path, 'w') as out:
+                out.write(program)
+
+            for tier in TIERS:
+                output, result = run(args.mortar, path, tier)
+                if output == expected_output and result == expected_result:
+                    print('%-20s %-8s ok' % (name, tier))
+                    continue
+                failed = True
+                print('%-20s %-8s FAILED: %s' % (name, tier,
+                      result if output is None else 'got %r, result %s' % (output, result)))
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,6 +1,9 @@
 // Own header
 #include "tokenizer.h"
 
+// This project's headers
+#include "source_pos.h"
+
 // Standard headers
 #include <assert.h>
 #include <stdio.h>
@@ -15,35 +18,44 @@ bool is_alpha(char x) { x |= 32; return (x >= 'a' && x <= 'z'); }
 bool is_alnum(char x) { return is_alpha(x) || is_digit(x); }
 
 
+// The input does not need to be nul terminated. Instead, 'end' points just
+// past the last character, and peek() returns '\0' for anything beyond it.
 static char const *input_code;
 static char const *c;
-static unsigned line, column;
+static char const *end;
 Token current_token;
 
 
+static char peek(size_t offset) {
+    return (size_t)(end - c) > offset ? c[offset] : '\0';
+}
+
 static void next_char(void) {
-    assert (*c != '\0');
+    assert (c < end);
     c++;
-    if (*c == '\n') {
-        line++;
-        column = 1;
-    }
-    column++;
+}
+
+static unsigned get_offset(void) {
+    return (unsigned)(c - input_code);
 }
 
 static void skip_whitespace(void) {
-    while (is_space(*c)) {
+    while (is_space(peek(0))) {
         next_char();
     }
 }
 
 void tokenizer_init(char const *source_code) {
+    tokenizer_init_range(source_code, strlen(source_code));
+}
+
+void tokenizer_init_range(char const *source_code, size_t num_bytes) {
     input_code = source_code;
     c = source_code;
+    end = source_code + num_bytes;
     current_token.type = TOKEN_EOF; // Or some initial invalid state
     current_token.lexeme = strview_empty();
-    line = 1;
-    column = 1;
+    source_pos_set_source(source_code, num_bytes);
 
     tokenizer_next_token(); // Get the first token
 }
@@ -51,12 +63,14 @@ void tokenizer_init(char const *source_code) {
 static bool get_string(void) {
     next_char();
     char const *start_c = c;
-    while (*c != '"') {
-        if (*c == '\\') {
+    while (peek(0) != '"') {
+        if (peek(0) == '\\' && c + 1 < end) {
             next_char();
         }
-        if (*c == '\n' || *c == '\0') {
-            printf("Unterminated string at line %d, column %d\n",
+        if (peek(0) == '\n' || c == end) {
+            unsigned line, column;
+            source_pos_get(get_offset(), &line, &column);
+            printf("Unterminated string at line %u, column %u\n",
                 line, column);
             return false;
         }
@@ -74,18 +88,17 @@ bool tokenizer_next_token(void) {
     skip_whitespace();
 
     current_token.lexeme = strview_empty();
-    current_token.line = line;
-    current_token.column = column;
+    current_token.offset = get_offset();
 
-    if (*c == '\0') {
+    if (c == end) {
         current_token.type = TOKEN_EOF;
         return true;
     }
 
-    if (is_digit(*c)) {
+    if (is_digit(peek(0))) {
         char const *start_c = c;
         next_char();
-        while (is_digit(*c)) {
+        while (is_digit(peek(0))) {
             next_char();
         }
         int length = (int)(c - start_c);
@@ -94,10 +107,10 @@ bool tokenizer_next_token(void) {
         return true;
     }
 
-    if (is_alpha(*c) || *c == '_') {
+    if (is_alpha(peek(0)) || peek(0) == '_') {
         char const *start_c = c;
         next_char();
-        while (is_alnum(*c) || *c == '_') {
+        while (is_alnum(peek(0)) || peek(0) == '_') {
             next_char();
         }
         int length = (int)(c - start_c);
@@ -105,29 +118,35 @@ bool tokenizer_next_token(void) {
         
         if (strview_cmp_cstr(&current_token.lexeme, "while"))
             current_token.type = TOKEN_WHILE;
+        else if (strview_cmp_cstr(&current_token.lexeme, "if"))
+            current_token.type = TOKEN_IF;
+        else if (strview_cmp_cstr(&current_token.lexeme, "else"))
+            current_token.type = TOKEN_ELSE;
         else
             current_token.type = TOKEN_IDENTIFIER;
         return true;
     }
 
-    if (*c == '"')
+    if (peek(0) == '"')
         return get_string();
 
-    if (*c == '!') {
+    if (peek(0) == '!') {
         next_char();
-        if (*c == '=') {
+        if (peek(0) == '=') {
             next_char();
             current_token.type = TOKEN_NOT_EQUALS;
             return true;
         }
 
         current_token.type = TOKEN_EXCLAMATION;
+        current_token.lexeme = strview_create(c - 1, 1);
+        return true;
     }
 
-    switch (*c) {
+    switch (peek(0)) {
     case ';': current_token.type = TOKEN_SEMICOLON; next_char(); break;
     case '=':
-        if (c[1] == '=') {
+        if (peek(1) == '=') {
             current_token.type = TOKEN_EQUALS;
             next_char();
         }
@@ -136,27 +155,50 @@ bool tokenizer_next_token(void) {
         }
         next_char();
         break;
+    case '<':
+    case '>':
+    case '&':
+    case '|':
+        // Two character operators: << >> <= >= && ||
+        if (peek(1) == peek(0) || (peek(1) == '=' && (peek(0) == '<' || peek(0) == '>'))) {
+            switch (peek(0)) {
+            case '<': current_token.type = peek(1) == '=' ? TOKEN_LESS_EQUAL : TOKEN_SHIFT_LEFT; break;
+            case '>': current_token.type = peek(1) == '=' ? TOKEN_GREATER_EQUAL : TOKEN_SHIFT_RIGHT; break;
+            case '&': current_token.type = TOKEN_LOGICAL_AND; break;
+            case '|': current_token.type = TOKEN_LOGICAL_OR; break;
+            }
+            next_char();
+            next_char();
+            current_token.lexeme = strview_create(c - 2, 2);
+            return true;
+        }
+        current_token.type = peek(0);
+        next_char();
+        break;
     case '+':
     case '-':
     case '*':
     case '/':
+    case '%':
+    case '^':
     case '(':
     case ')':
     case '{':
     case '}':
     case '[':
     case ']':
-    case '<':
-    case '>':
     case ',': 
     case '.': 
-        current_token.type = *c;
+        current_token.type = peek(0);
         next_char();
         break;
-    default:
-        printf("Unexpected character '%c' at line %d, column %d\n", 
-            *c, line, column);
-        return false;
+    default: {
+            unsigned line, column;
+            source_pos_get(get_offset(), &line, &column);
+            printf("Unexpected character '%c' at line %u, column %u\n",
+                peek(0), line, column);
+            return false;
+        }
     }
 
     current_token.lexeme = strview_create(c - 1, 1); // For single-char tokens
@@ -170,7 +212,9 @@ bool tokenizer_consume(TokenType expected_type) {
 
     char const *expected = tokenizer_get_name_from_type(expected_type);
     char const *got = tokenizer_get_name_from_type(current_token.type);
-    printf("Expected %s, but got %s ('%.*s') at line %d column %d\n",
+    unsigned line, column;
+    source_pos_get(get_offset(), &line, &column);
+    printf("Expected %s, but got %s ('%.*s') at line %u column %u\n",
         expected, got,
         (int)current_token.lexeme.len, current_token.lexeme.data,
         line, column);
@@ -184,12 +228,27 @@ char const *tokenizer_get_name_from_type(TokenType t) {
     case TOKEN_NUMBER: return "Number";
     case TOKEN_STRING: return "String";
     case TOKEN_EQUALS: return "==";
+    case TOKEN_NOT_EQUALS: return "!=";
     case TOKEN_SEMICOLON: return ";";
     case TOKEN_ASSIGN: return "Assignment";
     case TOKEN_PLUS: return "+";
     case TOKEN_MINUS: return "-";
     case TOKEN_MULTIPLY: return "*";
     case TOKEN_DIVIDE: return "/";
+    case TOKEN_MODULO: return "%";
+    case TOKEN_AND: return "&";
+    case TOKEN_OR: return "|";
+    case TOKEN_XOR: return "^";
+    case TOKEN_SHIFT_LEFT: return "<<";
+    case TOKEN_SHIFT_RIGHT: return ">>";
+    case TOKEN_LESS_THAN: return "<";
+    case TOKEN_GREATER_THAN: return ">";
+    case TOKEN_LESS_EQUAL: return "<=";
+    case TOKEN_GREATER_EQUAL: return ">=";
+    case TOKEN_LOGICAL_AND: return "&&";
+    case TOKEN_LOGICAL_OR: return "||";
+    case TOKEN_IF: return "if";
+    case TOKEN_ELSE: return "else";
     case TOKEN_EXCLAMATION: return "!";
     case TOKEN_LPAREN: return "(";
     case TOKEN_RPAREN: return ")";
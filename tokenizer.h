@@ -12,12 +12,24 @@ typedef enum {
     TOKEN_EQUALS, // ==
     TOKEN_NOT_EQUALS, // !=
     TOKEN_WHILE,
+    TOKEN_IF,
+    TOKEN_ELSE,
+    TOKEN_SHIFT_LEFT, // <<
+    TOKEN_SHIFT_RIGHT, // >>
+    TOKEN_LESS_EQUAL, // <=
+    TOKEN_GREATER_EQUAL, // >=
+    TOKEN_LOGICAL_AND, // &&
+    TOKEN_LOGICAL_OR, // ||
     TOKEN_SEMICOLON = ';',
     TOKEN_ASSIGN = '=',
     TOKEN_PLUS = '+',
     TOKEN_MINUS = '-',
     TOKEN_MULTIPLY = '*',
     TOKEN_DIVIDE = '/',
+    TOKEN_MODULO = '%',
+    TOKEN_AND = '&',
+    TOKEN_OR = '|',
+    TOKEN_XOR = '^',
     TOKEN_EXCLAMATION = '!',
     TOKEN_LPAREN = '(',
     TOKEN_RPAREN = ')',
@@ -34,14 +46,14 @@ typedef enum {
 typedef struct {
     TokenType type;
     strview_t lexeme;
-    int line;
-    int column;
+    unsigned offset; // From the start of the source. See source_pos.h
 } Token;
 
 
 extern Token current_token;
 
 void tokenizer_init(char const *source_code);
+void tokenizer_init_range(char const *source_code, size_t num_bytes); // Need not be nul terminated
 bool tokenizer_next_token(void); // Returns false on error.
 
 // Consumes the current token if its type matches, otherwise returns false.
@@ -10,13 +10,26 @@ void types_init(void) {
 
     static strview_t sv;
 
-    static object_type_t u8 = { 1 };
+    static object_type_t u8 = { 1, 1 };
     sv = strview_create_from_cstring("u8");
     hashtab_put(&g_types, &sv, &u8);
 
-    static object_type_t u64 = { 8 };
+    static object_type_t u64 = { 8, 1 };
     sv = strview_create_from_cstring("u64");
     hashtab_put(&g_types, &sv, &u64);
+
+    // SIMD vectors
+    static object_type_t u8x16 = { 16, 16 };
+    sv = strview_create_from_cstring("u8x16");
+    hashtab_put(&g_types, &sv, &u8x16);
+
+    static object_type_t u64x2 = { 16, 2 };
+    sv = strview_create_from_cstring("u64x2");
+    hashtab_put(&g_types, &sv, &u64x2);
+
+    static object_type_t u64x4 = { 32, 4 };
+    sv = strview_create_from_cstring("u64x4");
+    hashtab_put(&g_types, &sv, &u64x4);
 }
 
 object_type_t *types_get_obj_type(strview_t *type_name) {
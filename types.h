@@ -5,6 +5,7 @@
 // A type that is NOT derived from another type. eg u8, or (todo) a user defined struct.
 typedef struct _type_info_t {
     unsigned num_bytes;
+    unsigned num_lanes; // 1 for scalars. More for SIMD vectors, eg 16 for u8x16.
 } object_type_t;
 
 typedef struct _derived_type_t {
@@ -0,0 +1,230 @@
+// Own header
+#include "vm.h"
+
+// This project's headers
+#include "bytecode.h"
+#include "host_funcs.h"
+#include "runtime.h"
+#include "safepoint.h"
+#include "strview.h"
+
+// Standard headers
+#include <string.h>
+
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+
+static u64 popcount64(u64 x) {
+    u64 count = 0;
+    for (; x; x &= x - 1)
+        count++;
+    return count;
+}
+
+static u64 clz64(u64 x) {
+    u64 count = 0;
+    for (u64 bit = 1ull << 63; bit && !(x & bit); bit >>= 1)
+        count++;
+    return count;
+}
+
+static u64 ctz64(u64 x) {
+    u64 count = 0;
+    for (u64 bit = 1; bit && !(x & bit); bit <<= 1)
+        count++;
+    return count;
+}
+
+// Host functions are named in the module's string table. Look them all up
+// before starting, so BC_CALL doesn't have to.
+static host_func_ptr_t *resolve_host_funcs(bc_module_t const *m) {
+    host_func_ptr_t *funcs = calloc(m->num_strings ? m->num_strings : 1, sizeof(host_func_ptr_t));
+    for (unsigned i = 0; i < m->num_instrs; i++) {
+        bc_instr_t const *in = &m->instrs[i];
+        if (in->op != BC_CALL)
+            continue;
+
+        strview_t name = strview_create_from_cstring(m->strings[in->b]);
+        host_func_t const *func = host_funcs_get(&name);
+        if (!func || func->intrinsic != INTRINSIC_NONE)
+            FATAL_ERROR("Unknown host function '%s'", m->strings[in->b]);
+        funcs[in->b] = func->addr;
+    }
+
+    return funcs;
+}
+
+u64 vm_run(bc_module_t const *m) {
+    u64 *r = calloc(m->num_regs, sizeof(u64));
+    runtime_array_t *arrays = calloc(m->num_arrays ? m->num_arrays : 1, sizeof(runtime_array_t));
+    host_func_ptr_t *funcs = resolve_host_funcs(m);
+    bc_instr_t const *code = m->instrs;
+    bc_instr_t const *ip = code;
+    bc_instr_t const *in;
+    runtime_array_t *arr;
+    u64 rv;
+
+#if VM_COMPUTED_GOTO
+    static void *const dispatch_table[BC_NUM_OPS] = {
+        &&op_BC_LOADK, &&op_BC_LOADS, &&op_BC_MOV, &&op_BC_TRUNC8, &&op_BC_ADD,
+        &&op_BC_SUB, &&op_BC_MUL, &&op_BC_DIV, &&op_BC_MOD, &&op_BC_AND, &&op_BC_OR,
+        &&op_BC_XOR, &&op_BC_SHL, &&op_BC_SHR, &&op_BC_EQ, &&op_BC_NE, &&op_BC_LT, &&op_BC_LE, &&op_BC_POPCOUNT, &&op_BC_CLZ, &&op_BC_CTZ,
+        &&op_BC_JMP, &&op_BC_JZ, &&op_BC_JNZ, &&op_BC_ARR_CLEAR, &&op_BC_ARR_LEN, &&op_BC_ARR_LOAD,
+        &&op_BC_ARR_STORE, &&op_BC_ARR_APPEND, &&op_BC_CALL, &&op_BC_RET
+    };
+#define CASE(op) op_##op
+#define NEXT() do { in = ip++; goto *dispatch_table[in->op]; } while (0)
+    NEXT();
+#else
+#define CASE(op) case op
+#define NEXT() continue
+    for (;;) {
+    in = ip++;
+    switch (in->op) {
+#endif
+
+    CASE(BC_LOADK):
+        r[in->a] = m->consts[in->b];
+        NEXT();
+    CASE(BC_LOADS):
+        r[in->a] = (u64)m->strings[in->b];
+        NEXT();
+    CASE(BC_MOV):
+        r[in->a] = r[in->b];
+        NEXT();
+    CASE(BC_TRUNC8):
+        r[in->a] = r[in->b] & 0xff;
+        NEXT();
+    CASE(BC_ADD):
+        r[in->a] = r[in->b] + r[in->c];
+        NEXT();
+    CASE(BC_SUB):
+        r[in->a] = r[in->b] - r[in->c];
+        NEXT();
+    CASE(BC_MUL):
+        r[in->a] = r[in->b] * r[in->c];
+        NEXT();
+    CASE(BC_DIV):
+        if (r[in->c] == 0)
+            runtime_divide_by_zero_error();
+        r[in->a] = r[in->b] / r[in->c];
+        NEXT();
+    CASE(BC_MOD):
+        if (r[in->c] == 0)
+            runtime_divide_by_zero_error();
+        r[in->a] = r[in->b] % r[in->c];
+        NEXT();
+    CASE(BC_AND):
+        r[in->a] = r[in->b] & r[in->c];
+        NEXT();
+    CASE(BC_OR):
+        r[in->a] = r[in->b] | r[in->c];
+        NEXT();
+    CASE(BC_XOR):
+        r[in->a] = r[in->b] ^ r[in->c];
+        NEXT();
+    CASE(BC_SHL):
+        r[in->a] = r[in->b] << (r[in->c] & 63);
+        NEXT();
+    CASE(BC_SHR):
+        r[in->a] = r[in->b] >> (r[in->c] & 63);
+        NEXT();
+    CASE(BC_EQ):
+        r[in->a] = r[in->b] == r[in->c];
+        NEXT();
+    CASE(BC_NE):
+        r[in->a] = r[in->b] != r[in->c];
+        NEXT();
+    CASE(BC_LT):
+        r[in->a] = r[in->b] < r[in->c];
+        NEXT();
+    CASE(BC_LE):
+        r[in->a] = r[in->b] <= r[in->c];
+        NEXT();
+    CASE(BC_POPCOUNT):
+        r[in->a] = popcount64(r[in->b]);
+        NEXT();
+    CASE(BC_CLZ):
+        r[in->a] = clz64(r[in->b]);
+        NEXT();
+    CASE(BC_CTZ):
+        r[in->a] = ctz64(r[in->b]);
+        NEXT();
+    CASE(BC_JMP):
+        // Every loop jumps back with BC_JMP. Polling on the forward jumps of
+        // if/else too is cheaper than telling them apart.
+        SAFEPOINT_POLL();
+        ip = code + BC_GET_TARGET(in);
+        NEXT();
+    CASE(BC_JZ):
+        if (r[in->a] == 0)
+            ip = code + BC_GET_TARGET(in);
+        NEXT();
+    CASE(BC_JNZ):
+        if (r[in->a] != 0)
+            ip = code + BC_GET_TARGET(in);
+        NEXT();
+    CASE(BC_ARR_CLEAR):
+        arrays[in->a].size = 0;
+        NEXT();
+    CASE(BC_ARR_LEN):
+        r[in->a] = arrays[in->b].size;
+        NEXT();
+    CASE(BC_ARR_LOAD):
+        arr = &arrays[in->b];
+        if (r[in->c] >= arr->size)
+            runtime_index_error();
+        if (m->array_elem_num_bytes[in->b] == 1)
+            r[in->a] = arr->data[r[in->c]];
+        else
+            r[in->a] = ((u64 *)arr->data)[r[in->c]];
+        NEXT();
+    CASE(BC_ARR_STORE):
+        arr = &arrays[in->a];
+        if (r[in->b] >= arr->size)
+            runtime_index_error();
+        if (m->array_elem_num_bytes[in->a] == 1)
+            arr->data[r[in->b]] = (u8)r[in->c];
+        else
+            ((u64 *)arr->data)[r[in->b]] = r[in->c];
+        NEXT();
+    CASE(BC_ARR_APPEND):
+        arr = &arrays[in->a];
+        if (arr->size == arr->capacity)
+            runtime_array_grow(arr, m->array_elem_num_bytes[in->a]);
+        if (m->array_elem_num_bytes[in->a] == 1)
+            arr->data[arr->size] = (u8)r[in->b];
+        else
+            ((u64 *)arr->data)[arr->size] = r[in->b];
+        arr->size++;
+        NEXT();
+    CASE(BC_CALL): {
+            u64 args[4] = { 0 };
+            memcpy(args, &r[in->c], in->n * sizeof(u64));
+            r[in->a] = funcs[in->b](args[0], args[1], args[2], args[3]);
+            NEXT();
+        }
+    CASE(BC_RET):
+        rv = r[in->a];
+        goto done;
+
+#if !VM_COMPUTED_GOTO
+    }
+    }
+#endif
+#undef CASE
+#undef NEXT
+
+done:
+    for (unsigned i = 0; i < m->num_arrays; i++)
+        runtime_array_free(&arrays[i]);
+    free(arrays);
+    free(funcs);
+    free(r);
+    return rv;
+}
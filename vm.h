@@ -0,0 +1,15 @@
+// Runs bytecode produced by bc_gen, or loaded by bc_read. The interpreter
+// loop uses computed goto where the compiler supports it, so that each
+// instruction dispatches directly to the next.
+
+#pragma once
+
+// This project's headers
+#include "common.h"
+
+
+typedef struct _bc_module_t bc_module_t;
+
+
+// The module must have passed bc_validate(). Returns the value of the RET.
+u64 vm_run(bc_module_t const *module);